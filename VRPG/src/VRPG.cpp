@@ -2,6 +2,8 @@
 #include "world.h"
 #include "blocks.h"
 #include "logger.h"
+#include "regionfile.h"
+#include "chunkprovider.h"
 
 #define USE_SPOT_LIGHT 0
 
@@ -20,7 +22,7 @@ static bool FLY_MODE = false;
 VRPG game;
 
 VRPG::VRPG()
-    : _scene(NULL), _wireframe(false)
+    : _scene(NULL), _wireframe(false), _world(NULL), _regionStore(NULL), _chunkWriter(NULL), _chunkProvider(NULL), _chunkCompactor(NULL), _journalPosition(0), _visitedDir(NORTH)
 {
 	runWorldUnitTests();
 }
@@ -48,7 +50,7 @@ public:
 		//fprintf(log, "Cam position : %d,%d,%d \t dir=%d\n", camPosition.pos.x, camPosition.pos.y, camPosition.pos.z, camPosition.direction.dir);
 	}
 	virtual void visit(World * world, Position & camPosition, Vector3d pos, cell_t cell, int visibleFaces) {
-		BlockDef * def = BLOCK_DEFS[cell];
+		BlockDef * def = world->getBlockDef(pos, cell);
 		def->createFaces(world, camPosition, pos, visibleFaces, vertices, indexes);
 	}
 
@@ -189,16 +191,18 @@ static short TERRAIN_SCALE_DATA[] = {
 	//                                      ^
 };
 
-void VRPG::initWorld() {
+const int TERRAIN_SIZE_BITS = 10;
+
+/// generate terrain and test buildings, returns ground level at 0, 0
+static int generateWorld(World * world) {
 
-	World * world = new World();
 	int y0 = 3;
 
 #if 1
 	lUInt64 start = GetCurrentTimeMillis();
 	CRLog::trace("Generating terrain");
 
-	int terrSizeBits = 10;
+	int terrSizeBits = TERRAIN_SIZE_BITS;
 	int terrSize = 1 << terrSizeBits;
 	TerrainGen scaleterr(terrSizeBits, terrSizeBits); // 512x512
 	scaleterr.generate(4321, TERRAIN_SCALE_DATA, terrSizeBits - 4); // init grid is 16x16 (1 << (9-7))
@@ -210,6 +214,7 @@ void VRPG::initWorld() {
 	terr.filter(1);
 	terr.limit(5, CHUNK_DY * 3 / 4);
 	terr.filter(1);
+	WorldEditBuilder builder(world);
 	for (int x = 0; x < terrSize; x++) {
 		for (int z = 0; z < terrSize; z++) {
 			int h = terr.get(x, z);
@@ -226,19 +231,16 @@ void VRPG::initWorld() {
 				cell = 104;
 			else
 				cell = 105;
-			for (int y = 0; y < h; y++) {
-				world->setCell(x - terrSize / 2, y, z - terrSize / 2, cell);
-			}
+			builder.setColumn(x - terrSize / 2, z - terrSize / 2, 0, h, cell);
 		}
 	}
+	builder.flush();
 	y0 = terr.get(terrSize / 2, terrSize / 2) + 8;
 	CRLog::trace("terrain generation took %lld ms", GetCurrentTimeMillis() - start);
+	logChunkPoolStats();
 
 #endif
 
-	world->getCamPosition().pos = Vector3d(0, y0, 0);
-	world->getCamPosition().direction.set(NORTH);
-
 	world->setCell(-5, 3, 5, 1);
 	world->setCell(-2, 1, -7, 8);
 	world->setCell(-2, 2, -7, 8);
@@ -254,11 +256,7 @@ void VRPG::initWorld() {
 	world->setCell(-5, 7, -5, 1);
 	world->setCell(-5, 7, 5, 1);
 #else
-	for (int x = -100; x <= 100; x++) {
-		for (int z = -100; z <= 100; z++) {
-			world->setCell(x, 0, z, 3);
-		}
-	}
+	world->fillBox(Vector3d(-100, 0, -100), Vector3d(101, 1, 101), 3);
 	for (int x = -10; x <= 10; x++) {
 		for (int z = -10; z <= 10; z++) {
 			if (z < -2 || z > 2 || x < -2 || x > 2) {
@@ -305,6 +303,43 @@ void VRPG::initWorld() {
 
 	world->setCell(2, 2, 0, 8);
 
+	return y0;
+}
+
+void VRPG::initWorld() {
+
+	World * world = new World();
+	int y0;
+
+	// load saved world if any, otherwise generate new one; changes are saved to region files
+	_regionStore = new RegionStore("world");
+	int terrChunks = (1 << TERRAIN_SIZE_BITS) >> CHUNK_DX_SHIFT;
+	lUInt64 start = GetCurrentTimeMillis();
+	int loadedChunks = _regionStore->loadChunks(world, -terrChunks / 2, -terrChunks / 2, terrChunks / 2, terrChunks / 2);
+	if (loadedChunks) {
+		CRLog::trace("%d chunks loaded from region files in %lld ms", loadedChunks, GetCurrentTimeMillis() - start);
+		logChunkPoolStats();
+		WorldColumn column = WorldReader(world).getColumn(0, 0);
+		int bottom = world->getChunks().bottom();
+		for (y0 = world->getChunks().maxY() * CHUNK_DY; y0 > bottom && column.get(y0 - 1) == NO_CELL; y0--)
+			;
+		y0 += 8;
+	} else {
+		y0 = generateWorld(world);
+	}
+	// evicted chunks are written to region files on background thread
+	_chunkWriter = new ChunkWriter(_regionStore, _regionStore);
+	world->setPersistence(_chunkWriter);
+	// generated terrain takes ~8 MB of chunk memory; least recently used chunks out of view range are saved and freed over 64 MB
+	world->setMemoryBudget(64 * 1024 * 1024);
+	// chunks evicted from memory are loaded back in background when camera comes close; ones not written yet are copied from writer
+	_chunkProvider = new ChunkProvider(_chunkWriter, NULL, 2);
+	// chunks which were not accessed for 10 seconds (at 60 fps) are kept compressed in memory
+	_chunkCompactor = new ChunkCompactor(1, 600, 64);
+
+	world->getCamPosition().pos = Vector3d(0, y0, 0);
+	world->getCamPosition().direction.set(NORTH);
+
 	_world = world;
 }
 
@@ -437,6 +472,7 @@ void VRPG::initialize()
 
 	MeshVisitor * meshVisitor = new MeshVisitor();
 	//world->visitVisibleCells(world->getCamPosition(), meshVisitor);
+	worldViewChanged();
 	_world->visitVisibleCellsAllDirectionsFast(_world->getCamPosition(), meshVisitor);
 	Mesh * worldMesh = meshVisitor->createMesh();
 	_worldMesh = worldMesh;
@@ -452,13 +488,23 @@ void VRPG::finalize()
 {
     SAFE_RELEASE(_scene);
 	SAFE_RELEASE(_material);
+	delete _chunkCompactor;
+	delete _chunkProvider;
+	// dirty chunks are passed to writer on world destruction, writer saves all of them to region store before stopping
 	delete _world;
+	delete _chunkWriter;
+	delete _regionStore;
 }
 
 static bool animation = false;
 
 void VRPG::update(float elapsedTime)
 {
+	_world->tick();
+	_chunkProvider->update(_world);
+	_chunkCompactor->update(_world);
+	_world->evictChunks();
+
     // Rotate model
     //_scene->findNode("box")
 	//_group1->rotateY(MATH_DEG_TO_RAD((float)elapsedTime / 1000.0f * 180.0f));
@@ -522,29 +568,26 @@ void VRPG::render(float elapsedTime)
 
 	//_cameraNode->rotateX(MATH_DEG_TO_RAD(-10));
 
-#define REVISIT_EACH_RENDER 1
+// 1 to rebuild world mesh on each frame, 0 to rebuild it only when camera moves or visible cells change
+#define REVISIT_EACH_RENDER 0
 
-	MeshVisitor * meshVisitor = new MeshVisitor();
-	_world->visitVisibleCellsAllDirectionsFast(_world->getCamPosition(), meshVisitor);
-#if REVISIT_EACH_RENDER==1
-	Mesh * oldMesh = _worldMesh;
-	Mesh * worldMesh = meshVisitor->createMesh();
-	_worldMesh = worldMesh;
-	//delete oldMesh;
-#endif
+	if (worldViewChanged() || REVISIT_EACH_RENDER == 1) {
+		MeshVisitor * meshVisitor = new MeshVisitor();
+		_world->visitVisibleCellsAllDirectionsFast(_world->getCamPosition(), meshVisitor);
+		Mesh * worldMesh = meshVisitor->createMesh();
+		_worldMesh = worldMesh;
 
-	Node * worldNode = createWorldNode(_worldMesh);
+		Node * worldNode = createWorldNode(_worldMesh);
 
-#if REVISIT_EACH_RENDER==1
-	SAFE_RELEASE(worldMesh);
-#endif
-	delete meshVisitor;
+		SAFE_RELEASE(worldMesh);
+		delete meshVisitor;
 
-	_group2->removeAllChildren();
+		_group2->removeAllChildren();
 
-	_group2->addChild(worldNode);
+		_group2->addChild(worldNode);
 
-	SAFE_RELEASE(worldNode);
+		SAFE_RELEASE(worldNode);
+	}
 
     // Visit all the nodes in the scene for drawing
     _scene->visit(this, &VRPG::drawScene);
@@ -555,6 +598,23 @@ void VRPG::render(float elapsedTime)
 	drawFrameRate(_font, Vector4(0, 0.5f, 1, 1), 5, 5, getFrameRate());
 }
 
+/// returns true if camera has moved or visible part of world has changed since the last visit
+bool VRPG::worldViewChanged() {
+	Position & camPos = _world->getCamPosition();
+	bool changed = !(camPos.pos == _visitedPos) || camPos.direction.dir != _visitedDir;
+	_visitedPos = camPos.pos;
+	_visitedDir = camPos.direction.dir;
+	Array<DirtyBox> boxes;
+	if (!_world->getJournal().drain(_journalPosition, boxes))
+		return true; // missed some changes
+	int range = _world->getMaxVisibleRange();
+	Vector3d visibleMin = camPos.pos - Vector3d(range, range, range);
+	Vector3d visibleMax = camPos.pos + Vector3d(range + 1, range + 1, range + 1);
+	for (int i = 0; i < boxes.length() && !changed; i++)
+		changed = boxes[i].intersects(visibleMin, visibleMax);
+	return changed;
+}
+
 bool VRPG::drawScene(Node* node)
 {
     // If the node visited contains a drawable object, draw it
@@ -567,7 +627,19 @@ bool VRPG::drawScene(Node* node)
 
 void VRPG::correctY() {
 	Vector3d & pos = _world->getCamPosition().pos;
-	if (_world->canPass(pos - Vector3d(2, 3, 2), Vector3d(5, 4, 5))) {
+	// ground level under camera footprint from heightmap
+	WorldReader reader(_world);
+	int ground = _world->getChunks().bottom();
+	for (int x = -2; x <= 3; x++)
+		for (int z = -2; z <= 3; z++) {
+			int h = reader.getHeight(pos.x + x, pos.z + z);
+			if (ground < h)
+				ground = h;
+		}
+	if (pos.y - 3 >= ground) {
+		// above everything opaque: fall right to the ground
+		pos.y = ground + 3;
+	} else if (_world->canPass(pos - Vector3d(2, 3, 2), Vector3d(5, 4, 5))) {
 		// down
 		while (_world->canPass(pos - Vector3d(2, 4, 2), Vector3d(5, 4, 5)))
 			pos.y--;
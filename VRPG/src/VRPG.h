@@ -3,6 +3,8 @@
 
 #include "gameplay.h"
 #include "world.h"
+#include "regionfile.h"
+#include "chunkprovider.h"
 
 using namespace gameplay;
 
@@ -62,6 +64,8 @@ private:
     bool drawScene(Node* node);
 
 	Node * createWorldNode(Mesh * mesh);
+	/// returns true if camera has moved or visible part of world has changed since the last visit
+	bool worldViewChanged();
 
     Scene* _scene;
     Node * _group2;
@@ -78,6 +82,14 @@ private:
 	bool _wireframe;
 
 	World * _world;
+	RegionStore * _regionStore;
+	ChunkWriter * _chunkWriter;
+	ChunkProvider * _chunkProvider;
+	ChunkCompactor * _chunkCompactor;
+	// state of world at the last visit of visible cells
+	lUInt64 _journalPosition;
+	Vector3d _visitedPos;
+	Dir _visitedDir;
 	Font * _font;
 	Camera* _camera;
 
@@ -1,38 +1,172 @@
 #include "blocks.h"
 #include <stdio.h>
+#include <mutex>
 #include "world.h"
+#include "logger.h"
 
 
 BlockDef * BLOCK_DEFS[256];
+BlockDef * BLOCK_DEFS_BY_ID[BLOCK_ID_COUNT];
+block_id_t BLOCK_CELL_IDS[256];
+bool BLOCK_CELL_ALIAS[256];
+int BLOCK_ALIAS_CELLS = 0;
 bool BLOCK_TYPE_CAN_PASS[256];
 bool BLOCK_TYPE_OPAQUE[256];
 bool BLOCK_TYPE_VISIBLE[256];
 bool BLOCK_TERRAIN_SMOOTHING[256];
 
+/// cell values with undefined block types added by initBlockTypes(); they are given to alias cells
+static bool BLOCK_CELL_UNDEFINED[256];
+static bool blockTypesInitialized = false;
+static char BLOCK_UNDEFINED_NAMES[256][12];
+/// property class of alias cell, see blockPropertyClass()
+static int BLOCK_ALIAS_CLASSES[256];
+/// alias cells are assigned by chunk loader threads too
+static std::mutex BLOCK_ALIAS_MUTEX;
+
+/// canPass, isOpaque, isVisible and terrainSmoothing bits: block types of the same class may share alias cell
+static int blockPropertyClass(BlockDef * def) {
+	return (def->canPass() ? 1 : 0) | (def->isOpaque() ? 2 : 0) | (def->isVisible() ? 4 : 0) | (def->terrainSmoothing() ? 8 : 0);
+}
+
+/// placeholder type of alias cell, with properties of its class
+class AliasBlockDef : public BlockDef {
+	int propertyClass;
+public:
+	AliasBlockDef(const char * name, BlockDef * def) : BlockDef(BLOCK_ID_NONE, name, def->visibility, def->txIndex), propertyClass(blockPropertyClass(def)) {
+	}
+	virtual bool canPass() { return (propertyClass & 1) != 0; }
+	virtual bool isOpaque() { return (propertyClass & 2) != 0; }
+	virtual bool isVisible() { return (propertyClass & 4) != 0; }
+	virtual bool terrainSmoothing() { return (propertyClass & 8) != 0; }
+};
+
+/// put block type to cell value, init property shortcuts
+static void setBlockCell(BlockDef * def, cell_t cell) {
+	BLOCK_DEFS[cell] = def;
+	BLOCK_CELL_IDS[cell] = def->id;
+	BLOCK_CELL_UNDEFINED[cell] = false;
+	BLOCK_CELL_ALIAS[cell] = false;
+	BLOCK_TYPE_CAN_PASS[cell] = def->canPass();
+	BLOCK_TYPE_OPAQUE[cell] = def->isOpaque();
+	BLOCK_TYPE_VISIBLE[cell] = def->isVisible();
+	BLOCK_TERRAIN_SMOOTHING[cell] = def->terrainSmoothing();
+}
+
+/// put undefined block type to cell value
+static void setUndefinedCell(int cell) {
+	sprintf(BLOCK_UNDEFINED_NAMES[cell], "undef%d", cell);
+	BlockDef * def = new BlockDef(cell, BLOCK_UNDEFINED_NAMES[cell], INVISIBLE, 0);
+	// reserved cell values have no block id
+	if (cell < BLOCK_ID_DIRECT)
+		BLOCK_DEFS_BY_ID[cell] = def;
+	setBlockCell(def, (cell_t)cell);
+	BLOCK_CELL_UNDEFINED[cell] = cell < BLOCK_ID_DIRECT;
+}
+
+/// cell value w/o block type: undefined type after initBlockTypes(), empty before
+static void clearBlockCell(int cell) {
+	if (blockTypesInitialized) {
+		setUndefinedCell(cell);
+		return;
+	}
+	BLOCK_DEFS[cell] = NULL;
+	BLOCK_CELL_IDS[cell] = cell;
+	BLOCK_CELL_ALIAS[cell] = false;
+	BLOCK_TYPE_CAN_PASS[cell] = true;
+	BLOCK_TYPE_OPAQUE[cell] = false;
+	BLOCK_TYPE_VISIBLE[cell] = false;
+	BLOCK_TERRAIN_SMOOTHING[cell] = false;
+}
+
+/// free cell value for new alias cell, not excluded; -1 if all cell values are used
+static int freeBlockCell(const bool * excluded) {
+	// from the top: low ids are usually taken by block types stored as is
+	for (int i = BLOCK_ID_DIRECT - 1; i > 0; i--) {
+		if (excluded[i])
+			continue;
+		if (!BLOCK_DEFS[i])
+			return i;
+		if (BLOCK_CELL_UNDEFINED[i]) {
+			delete BLOCK_DEFS[i];
+			BLOCK_DEFS[i] = NULL;
+			BLOCK_DEFS_BY_ID[i] = NULL;
+			BLOCK_CELL_UNDEFINED[i] = false;
+			return i;
+		}
+	}
+	return -1;
+}
+
+/// alias cell for block type with id >= BLOCK_ID_DIRECT: cell of the same property class for which excluded[cell] is false
+cell_t blockAliasCell(BlockDef * def, const bool * excluded) {
+	int propertyClass = blockPropertyClass(def);
+	std::lock_guard<std::mutex> lock(BLOCK_ALIAS_MUTEX);
+	for (int i = BLOCK_ID_DIRECT - 1; i > 0; i--)
+		if (BLOCK_CELL_ALIAS[i] && BLOCK_ALIAS_CLASSES[i] == propertyClass && !excluded[i])
+			return (cell_t)i;
+	int cell = freeBlockCell(excluded);
+	if (cell < 0)
+		return NO_CELL;
+	sprintf(BLOCK_UNDEFINED_NAMES[cell], "alias%d", cell);
+	setBlockCell(new AliasBlockDef(BLOCK_UNDEFINED_NAMES[cell], def), (cell_t)cell);
+	BLOCK_CELL_ALIAS[cell] = true;
+	BLOCK_ALIAS_CLASSES[cell] = propertyClass;
+	BLOCK_ALIAS_CELLS++;
+	return (cell_t)cell;
+}
+
+/// turn all alias cells back to free cell values; cells of chunks which use them lose their block types
+void resetBlockAliases() {
+	std::lock_guard<std::mutex> lock(BLOCK_ALIAS_MUTEX);
+	for (int i = 0; i < BLOCK_ID_DIRECT; i++) {
+		if (BLOCK_CELL_ALIAS[i]) {
+			delete BLOCK_DEFS[i];
+			clearBlockCell(i);
+		}
+	}
+	BLOCK_ALIAS_CELLS = 0;
+}
+
 /// registers new block type
-void registerBlockType(BlockDef * def) {
-	if (BLOCK_DEFS[def->id]) {
-		if (BLOCK_DEFS[def->id] == def)
-			return;
+bool registerBlockType(BlockDef * def) {
+	BlockDef * old = BLOCK_DEFS_BY_ID[def->id];
+	if (old == def)
+		return true;
+	if (def->id == BLOCK_ID_NONE || (def->id < BLOCK_ID_DIRECT && BLOCK_CELL_ALIAS[def->id])) {
+		CRLog::error("Cannot register block type %d %s: cell value is used as alias", def->id, def->name);
+		delete def;
+		return false;
+	}
+	BLOCK_DEFS_BY_ID[def->id] = def;
+	if (def->id < BLOCK_ID_DIRECT) {
+		// previous type or undefined placeholder
 		delete BLOCK_DEFS[def->id];
+		setBlockCell(def, (cell_t)def->id);
+	} else {
+		// cells of large ids are assigned by chunks
+		delete old;
 	}
-	BLOCK_DEFS[def->id] = def;
-	// init property shortcuts
-	BLOCK_TYPE_CAN_PASS[def->id] = def->canPass();
-	BLOCK_TYPE_OPAQUE[def->id] = def->isOpaque();
-	BLOCK_TYPE_VISIBLE[def->id] = def->isVisible();
-	BLOCK_TERRAIN_SMOOTHING[def->id] = def->terrainSmoothing();
+	return true;
+}
+
+/// removes block type with global id
+void unregisterBlockType(block_id_t id) {
+	BlockDef * def = BLOCK_DEFS_BY_ID[id];
+	if (!def)
+		return;
+	BLOCK_DEFS_BY_ID[id] = NULL;
+	delete def;
+	if (id < BLOCK_ID_DIRECT)
+		clearBlockCell(id);
 }
 
 void initBlockTypes() {
 	// fill non-registered entries
-	for (int i = 0; i < 256; i++) {
-		if (!BLOCK_DEFS[i]) {
-			char buf[32];
-			sprintf(buf, "undef%d", i);
-			registerBlockType(new BlockDef(i, strdup(buf), INVISIBLE, 0));
-		}
-	}
+	for (int i = 0; i < 256; i++)
+		if (!BLOCK_DEFS[i])
+			setUndefinedCell(i);
+	blockTypesInitialized = true;
 	BLOCK_TYPE_CAN_PASS[BOUND_SKY] = false;
 	BLOCK_TYPE_VISIBLE[BOUND_SKY] = false;
 	BLOCK_TYPE_CAN_PASS[BOUND_BOTTOM] = false;
@@ -177,28 +311,28 @@ void BlockDef::createFaces(World * world, Position & camPosition, Vector3d pos,
 			createFace(world, camPosition, pos, (Dir)i, vertices, indexes);
 }
 
-static VolumeData nearVolume(1);
-
 class TerrainBlock : public BlockDef {
 public:
-	TerrainBlock(cell_t blockId, const char * blockName, int tx) : BlockDef(blockId, blockName, OPAQUE, tx) {
+	TerrainBlock(block_id_t blockId, const char * blockName, int tx) : BlockDef(blockId, blockName, OPAQUE, tx) {
 
 	}
 	virtual bool terrainSmoothing() {
 		return true;
 	}
 	virtual void createFaces(World * world, Position & camPosition, Vector3d pos, int visibleFaces, FloatArray & vertices, IntArray & indexes) {
-		world->getCellsNear(pos, nearVolume);
-		bool emptyAbove = BLOCK_TYPE_CAN_PASS[nearVolume.get(Vector3d(0, 1, 0))];
-		bool sameBlockBelow = nearVolume.get(Vector3d(0, -1, 0)) == id;
-		bool sameBlockNorth = nearVolume.get(Vector3d(0, 0, -1)) == id;
-		bool sameBlockSouth = nearVolume.get(Vector3d(0, 0, 1)) == id;
-		bool sameBlockWest = nearVolume.get(Vector3d(-1, 0, 0)) == id;
-		bool sameBlockEast = nearVolume.get(Vector3d(1, 0, 0)) == id;
-		bool emptyBlockNorth = BLOCK_TYPE_CAN_PASS[nearVolume.get(Vector3d(0, 0, -1))];
-		bool emptyBlockSouth = BLOCK_TYPE_CAN_PASS[nearVolume.get(Vector3d(0, 0, 1))];
-		bool emptyBlockWest = BLOCK_TYPE_CAN_PASS[nearVolume.get(Vector3d(-1, 0, 0))];
-		bool emptyBlockEast = BLOCK_TYPE_CAN_PASS[nearVolume.get(Vector3d(1, 0, 0))];
+		// own reader: mesh builders may run concurrently
+		WorldReader reader(world);
+		cell_t cell = reader.getCell(pos);
+		bool emptyAbove = BLOCK_TYPE_CAN_PASS[reader.getCell(pos + Vector3d(0, 1, 0))];
+		bool sameBlockBelow = reader.getCell(pos + Vector3d(0, -1, 0)) == cell;
+		bool sameBlockNorth = reader.getCell(pos + Vector3d(0, 0, -1)) == cell;
+		bool sameBlockSouth = reader.getCell(pos + Vector3d(0, 0, 1)) == cell;
+		bool sameBlockWest = reader.getCell(pos + Vector3d(-1, 0, 0)) == cell;
+		bool sameBlockEast = reader.getCell(pos + Vector3d(1, 0, 0)) == cell;
+		bool emptyBlockNorth = BLOCK_TYPE_CAN_PASS[reader.getCell(pos + Vector3d(0, 0, -1))];
+		bool emptyBlockSouth = BLOCK_TYPE_CAN_PASS[reader.getCell(pos + Vector3d(0, 0, 1))];
+		bool emptyBlockWest = BLOCK_TYPE_CAN_PASS[reader.getCell(pos + Vector3d(-1, 0, 0))];
+		bool emptyBlockEast = BLOCK_TYPE_CAN_PASS[reader.getCell(pos + Vector3d(1, 0, 0))];
 		BlockDef::createFaces(world, camPosition, pos, visibleFaces, vertices, indexes);
 	}
 };
@@ -208,6 +342,7 @@ struct BlockTypeInitializer {
 	BlockTypeInitializer() {
 		for (int i = 0; i < 256; i++) {
 			BLOCK_DEFS[i] = NULL;
+			BLOCK_CELL_IDS[i] = (block_id_t)i;
 			BLOCK_TYPE_CAN_PASS[i] = true;
 		}
 		// empty cell
@@ -20,15 +20,25 @@ enum BlockVisibility {
 	HALF_TRANSPARENT, // should be rendered last (semi transparent texture)
 };
 
+/// global block type id; saved chunks store ids through per-chunk palette (ChunkCodec)
+typedef unsigned short block_id_t;
+/// size of global block id space
+#define BLOCK_ID_COUNT 65536
+/// block ids below this value are stored in cells as is (cell values BOUND_SKY and above are reserved)
+#define BLOCK_ID_DIRECT 252
+/// block id of alias cell placeholder types (see BLOCK_CELL_ALIAS), cannot be registered
+#define BLOCK_ID_NONE 0xFFFF
+
 class BlockDef {
 public:
-	cell_t id;
+	/// global block id: cell value for ids below BLOCK_ID_DIRECT, larger ids are stored through alias cells of chunk
+	block_id_t id;
 	const char * name;
 	BlockVisibility visibility;
 	int txIndex;
 	BlockDef() : id(0), name(""), visibility(INVISIBLE), txIndex(0) {
 	}
-	BlockDef(cell_t blockId, const char * blockName, BlockVisibility v, int tx) : id(blockId), name(blockName), visibility(v), txIndex(tx) {
+	BlockDef(block_id_t blockId, const char * blockName, BlockVisibility v, int tx) : id(blockId), name(blockName), visibility(v), txIndex(tx) {
 	}
 	virtual ~BlockDef() {}
 	// blocks behind this block can be visible
@@ -59,8 +69,17 @@ public:
 };
 
 
-// block type definitions
+// block type definitions by cell value; placeholder with properties of block types it stands for, for alias cells
 extern BlockDef * BLOCK_DEFS[256];
+// block type definitions by global block id
+extern BlockDef * BLOCK_DEFS_BY_ID[BLOCK_ID_COUNT];
+// global block id of cell value; BLOCK_ID_NONE for alias cells, their block ids are kept by chunk (Chunk::cellBlockId())
+extern block_id_t BLOCK_CELL_IDS[256];
+// cell value stands for block types with ids >= BLOCK_ID_DIRECT which have the same canPass, isOpaque, isVisible and terrainSmoothing,
+// so that property tables below are valid for it; each chunk maps alias cell to its own block id
+extern bool BLOCK_CELL_ALIAS[256];
+// number of alias cell values
+extern int BLOCK_ALIAS_CELLS;
 // faster check for block->canPass()
 extern bool BLOCK_TYPE_CAN_PASS[256];
 // faster check for block->isOpaque()
@@ -70,8 +89,22 @@ extern bool BLOCK_TYPE_VISIBLE[256];
 // faster check for block->isVisible()
 extern bool BLOCK_TERRAIN_SMOOTHING[256];
 
-/// registers new block type
-void registerBlockType(BlockDef * def);
+/// cell value for block id below BLOCK_ID_DIRECT, NO_CELL if it has no cell value; cells of larger ids are per chunk (Chunk::blockCell())
+inline cell_t blockCell(block_id_t id) {
+	return id < BLOCK_ID_DIRECT && BLOCK_CELL_IDS[id] == id ? (cell_t)id : NO_CELL;
+}
+
+/// alias cell for block type with id >= BLOCK_ID_DIRECT: cell of the same property class for which excluded[cell] is false
+/// new alias is taken from cell values w/o registered block type when needed; NO_CELL if there are none; thread safe
+cell_t blockAliasCell(BlockDef * def, const bool * excluded);
+/// turn all alias cells back to free cell values; cells of chunks which use them lose their block types
+void resetBlockAliases();
+/// registers new block type; returns false (and deletes def) if it cannot be registered
+/// Any number of block types with ids >= BLOCK_ID_DIRECT may be registered: chunks store them through alias cells.
+/// Block type with id below BLOCK_ID_DIRECT fails if its cell value is already used as alias, so register types before loading chunks.
+bool registerBlockType(BlockDef * def);
+/// removes block type with global id; cell value of small id becomes free, cells of large id get placeholder type of alias cell
+void unregisterBlockType(block_id_t id);
 /// init block types array
 void initBlockTypes();
 
@@ -0,0 +1,416 @@
+#include "chunkprovider.h"
+
+int myAbs(int d);
+
+ChunkProvider::ChunkProvider(ChunkSource * chunkLoader, ChunkSource * chunkGenerator, int threadCount)
+	: loader(chunkLoader), generator(chunkGenerator), stopping(false) {
+	for (int i = 0; i < threadCount; i++)
+		workers.append(new std::thread(&ChunkProvider::workerLoop, this));
+}
+
+/// stops worker threads; chunks which are not installed yet are deleted
+ChunkProvider::~ChunkProvider() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	wakeup.notify_all();
+	for (int i = 0; i < workers.length(); i++) {
+		workers[i]->join();
+		delete workers[i];
+	}
+	for (int i = 0; i < done.length(); i++)
+		delete done[i].chunk;
+}
+
+/// loader first, then generator; empty chunk if nobody has data, so that position is not requested again
+Chunk * ChunkProvider::createChunk(int x, int y, int z) {
+	Chunk * chunk = NULL;
+	if (loader)
+		chunk = loader->loadChunk(x, y, z);
+	if (!chunk && generator)
+		chunk = generator->loadChunk(x, y, z);
+	if (!chunk)
+		chunk = new Chunk();
+	return chunk;
+}
+
+void ChunkProvider::workerLoop() {
+	std::unique_lock<std::mutex> lock(mutex);
+	for (;;) {
+		while (!stopping && !queue.length())
+			wakeup.wait(lock);
+		if (stopping)
+			return;
+		ChunkRequest request = queue.removeLast();
+		inProgress.append(request);
+		lock.unlock();
+		Result result;
+		result.x = request.x;
+		result.y = request.y;
+		result.z = request.z;
+		result.chunk = createChunk(request.x, request.y, request.z);
+		lock.lock();
+		for (int i = 0; i < inProgress.length(); i++) {
+			if (inProgress[i].x == request.x && inProgress[i].y == request.y && inProgress[i].z == request.z) {
+				inProgress[i] = inProgress[inProgress.length() - 1];
+				inProgress.removeLast();
+				break;
+			}
+		}
+		done.append(result);
+	}
+}
+
+/// request priority for chunk at offset dx, dz (in chunks) from camera chunk
+int ChunkProvider::chunkPriority(int dx, int dz, Vector3d forward) {
+	int dist2 = dx * dx + dz * dz;
+	int dot = dx * forward.x + dz * forward.z;
+	if (dot > 0)
+		return dist2; // in front of camera
+	if (dot == 0)
+		return dist2 * 2; // on the sides
+	return dist2 * 4; // behind camera
+}
+
+static int compareChunkRequests(const void * p1, const void * p2) {
+	int priority1 = ((const ChunkRequest*)p1)->priority;
+	int priority2 = ((const ChunkRequest*)p2)->priority;
+	// descending
+	return priority1 > priority2 ? -1 : (priority1 < priority2 ? 1 : 0);
+}
+
+/// install finished chunks to world, then request chunks missing in view range (+1 chunk, as protected from eviction)
+int ChunkProvider::update(World * world) {
+	ChunkMatrix & chunks = world->getChunks();
+	Position & camera = world->getCamPosition();
+	int range = (world->getMaxVisibleRange() >> CHUNK_DX_SHIFT) + 1;
+	int rangeY = (world->getMaxVisibleRange() >> CHUNK_DY_SHIFT) + 1;
+	int camx = camera.pos.x >> CHUNK_DX_SHIFT;
+	int camy = camera.pos.y >> CHUNK_DY_SHIFT;
+	int camz = camera.pos.z >> CHUNK_DX_SHIFT;
+	// levels which may have data: loaded ones, and ones sources know about
+	int minY = chunks.minY();
+	int maxY = chunks.maxY();
+	ChunkSource * sources[2] = { loader, generator };
+	for (int i = 0; i < 2; i++) {
+		int sourceMinY, sourceMaxY;
+		if (!sources[i])
+			continue;
+		sources[i]->getLevels(sourceMinY, sourceMaxY);
+		if (minY > sourceMinY)
+			minY = sourceMinY;
+		if (maxY < sourceMaxY)
+			maxY = sourceMaxY;
+	}
+	// nothing is visible below world bottom
+	if (minY < chunks.bottomLevel())
+		minY = chunks.bottomLevel();
+	if (minY < camy - rangeY)
+		minY = camy - rangeY;
+	if (maxY > camy + rangeY + 1)
+		maxY = camy + rangeY + 1;
+	Array<Result> finished;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		finished.swap(done);
+	}
+	int installed = 0;
+	for (int i = 0; i < finished.length(); i++) {
+		Result & r = finished[i];
+		if (myAbs(r.x - camx) <= range && myAbs(r.y - camy) <= rangeY && myAbs(r.z - camz) <= range && !chunks.find(r.x, r.y, r.z)) {
+			world->installChunk(r.x, r.y, r.z, r.chunk);
+			installed++;
+		} else {
+			// went out of range while loading
+			delete r.chunk;
+		}
+	}
+	Array<ChunkRequest> requests;
+	for (int y = minY; y < maxY; y++) {
+		for (int dz = -range; dz <= range; dz++) {
+			for (int dx = -range; dx <= range; dx++) {
+				if (chunks.find(camx + dx, y, camz + dz))
+					continue;
+				ChunkRequest request;
+				request.x = camx + dx;
+				request.y = y;
+				request.z = camz + dz;
+				// level of camera first
+				request.priority = chunkPriority(dx, dz, camera.direction.forward) + (y - camy) * (y - camy);
+				requests.append(request);
+			}
+		}
+	}
+	if (requests.length())
+		qsort(requests.ptr(), requests.length(), sizeof(ChunkRequest), compareChunkRequests);
+	bool hasRequests;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		// replace queue: requests out of range are dropped, ones being loaded or just loaded are not repeated
+		queue.clear();
+		for (int i = 0; i < requests.length(); i++) {
+			ChunkRequest & request = requests[i];
+			bool loading = false;
+			for (int j = 0; j < inProgress.length() && !loading; j++)
+				loading = inProgress[j].x == request.x && inProgress[j].y == request.y && inProgress[j].z == request.z;
+			for (int j = 0; j < done.length() && !loading; j++)
+				loading = done[j].x == request.x && done[j].y == request.y && done[j].z == request.z;
+			if (!loading)
+				queue.append(request);
+		}
+		hasRequests = queue.length() > 0;
+	}
+	if (hasRequests)
+		wakeup.notify_all();
+	return installed;
+}
+
+/// number of requests which are not finished yet
+int ChunkProvider::pendingCount() {
+	std::lock_guard<std::mutex> lock(mutex);
+	return queue.length() + inProgress.length();
+}
+
+ChunkCompactor::ChunkCompactor(int threadCount, unsigned int coldTicks, int budget)
+	: stopping(false), jobCount(0), coldTicks(coldTicks), budget(budget), nextSlot(0) {
+	for (int i = 0; i < threadCount; i++)
+		workers.append(new std::thread(&ChunkCompactor::workerLoop, this));
+}
+
+/// stops worker threads; encoded data which is not used yet is dropped
+ChunkCompactor::~ChunkCompactor() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	wakeup.notify_all();
+	for (int i = 0; i < workers.length(); i++) {
+		workers[i]->join();
+		delete workers[i];
+	}
+	for (int i = 0; i < queue.length(); i++)
+		queue[i].chunk->release();
+	for (int i = 0; i < done.length(); i++) {
+		free(done[i].data);
+		done[i].chunk->release();
+	}
+}
+
+void ChunkCompactor::workerLoop() {
+	Array<unsigned char> buf;
+	std::unique_lock<std::mutex> lock(mutex);
+	for (;;) {
+		while (!stopping && !queue.length())
+			wakeup.wait(lock);
+		if (stopping)
+			return;
+		Job job = queue.removeLast();
+		lock.unlock();
+		// chunk is shared, so it's not changed while being read
+		buf.clear();
+		// entities are not compressed: they stay in chunk
+		ChunkCodec::encodeCells(job.chunk, buf);
+		job.size = buf.length();
+		job.data = (unsigned char *)malloc(job.size);
+		memcpy(job.data, buf.ptr(), job.size);
+		lock.lock();
+		done.append(job);
+	}
+}
+
+/// compress chunks encoded since the last call and queue more cold chunks
+int ChunkCompactor::update(World * world) {
+	ChunkMatrix & chunks = world->getChunks();
+	unsigned int clock = world->getAccessClock();
+	Array<Job> finished;
+	int queued;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		finished.swap(done);
+		jobCount -= finished.length();
+		queued = jobCount;
+	}
+	int compressed = 0;
+	for (int i = 0; i < finished.length(); i++) {
+		Job & job = finished[i];
+		Chunk * chunk = job.chunk;
+		bool inWorld = chunks.find(job.x, job.y, job.z) == chunk;
+		// world keeps reference if chunk is still there
+		chunk->release();
+		if (inWorld && chunk->getVersion() == job.version && !chunk->isShared() && !chunk->isCompressed()
+				&& clock - chunk->getLastAccess() >= coldTicks && job.size < chunk->memoryUsage() - (int)sizeof(Chunk)) {
+			chunk->compress(job.data, job.size);
+			compressed++;
+		} else {
+			free(job.data);
+		}
+	}
+	if (compressed)
+		world->resetChunkCache();
+	// look for cold chunks, continuing from the place where previous search stopped
+	Array<Job> jobs;
+	int slots = chunks.slots();
+	for (int n = 0; n < slots && queued + jobs.length() < budget; n++) {
+		if (nextSlot >= slots)
+			nextSlot = 0; // table is resized
+		int slot = nextSlot++;
+		Job job;
+		job.chunk = chunks.getAt(slot, job.x, job.y, job.z);
+		if (!job.chunk || job.chunk->isCompressed() || job.chunk->isShared() || clock - job.chunk->getLastAccess() < coldTicks)
+			continue;
+		if (job.chunk->getStorage() == CHUNK_STORAGE_LAYERS && !job.chunk->layerCount())
+			continue; // uniform layers only: nothing to compress
+		job.chunk->retain();
+		job.version = job.chunk->getVersion();
+		job.data = NULL;
+		job.size = 0;
+		jobs.append(job);
+	}
+	if (jobs.length()) {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			for (int i = 0; i < jobs.length(); i++)
+				queue.append(jobs[i]);
+			jobCount += jobs.length();
+		}
+		wakeup.notify_all();
+	}
+	return compressed;
+}
+
+/// number of chunks which are queued or being encoded
+int ChunkCompactor::pendingCount() {
+	std::lock_guard<std::mutex> lock(mutex);
+	return jobCount - done.length();
+}
+
+ChunkWriter::ChunkWriter(ChunkPersistence * target, ChunkSource * source)
+	: target(target), source(source), stopping(false) {
+	worker = new std::thread(&ChunkWriter::workerLoop, this);
+}
+
+/// writes all queued chunks, then stops worker thread
+ChunkWriter::~ChunkWriter() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	wakeup.notify_all();
+	worker->join();
+	delete worker;
+}
+
+void ChunkWriter::workerLoop() {
+	std::unique_lock<std::mutex> lock(mutex);
+	for (;;) {
+		while (!stopping && !queue.length())
+			wakeup.wait(lock);
+		// queue is written before stopping, so that nothing saved is lost
+		if (!queue.length())
+			return;
+		inProgress.swap(queue);
+		lock.unlock();
+		// chunks are shared, so they are not changed while being written
+		for (int i = 0; i < inProgress.length(); i++)
+			target->saveChunk(inProgress[i].x, inProgress[i].y, inProgress[i].z, inProgress[i].chunk);
+		lock.lock();
+		for (int i = 0; i < inProgress.length(); i++)
+			inProgress[i].chunk->release();
+		inProgress.clear();
+		if (!queue.length())
+			written.notify_all();
+	}
+}
+
+/// the latest queued or being written chunk for position, NULL if none; call under lock
+Chunk * ChunkWriter::findPending(int x, int y, int z) {
+	for (int i = 0; i < queue.length(); i++)
+		if (queue[i].x == x && queue[i].y == y && queue[i].z == z)
+			return queue[i].chunk;
+	for (int i = inProgress.length() - 1; i >= 0; i--)
+		if (inProgress[i].x == x && inProgress[i].y == y && inProgress[i].z == z)
+			return inProgress[i].chunk;
+	return NULL;
+}
+
+/// queue chunk for writing; call on thread which owns world
+void ChunkWriter::saveChunk(int chunkx, int chunky, int chunkz, Chunk * chunk) {
+	// world may delete or change its chunk right after this call: keep reference, so that changes go to a copy
+	chunk->retain();
+	Chunk * replaced = NULL;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		for (int i = 0; i < queue.length(); i++) {
+			if (queue[i].x == chunkx && queue[i].y == chunky && queue[i].z == chunkz) {
+				replaced = queue[i].chunk;
+				queue[i].chunk = chunk;
+				break;
+			}
+		}
+		if (!replaced) {
+			Job job;
+			job.x = chunkx;
+			job.y = chunky;
+			job.z = chunkz;
+			job.chunk = chunk;
+			queue.append(job);
+		}
+	}
+	if (replaced)
+		replaced->release();
+	else
+		wakeup.notify_all();
+}
+
+/// copy of pending chunk, or chunk read from source; returns NULL if chunk is not saved
+Chunk * ChunkWriter::loadChunk(int chunkx, int chunky, int chunkz) {
+	Chunk * pending;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		pending = findPending(chunkx, chunky, chunkz);
+		if (pending)
+			pending->retain();
+	}
+	if (!pending)
+		return source ? source->loadChunk(chunkx, chunky, chunkz) : NULL;
+	Chunk * chunk = new Chunk(*pending);
+	pending->release();
+	// the same data is being written
+	chunk->setDirty(false);
+	return chunk;
+}
+
+/// levels of source extended with levels of pending chunks
+void ChunkWriter::getLevels(int & minY, int & maxY) {
+	if (source) {
+		source->getLevels(minY, maxY);
+	} else {
+		minY = 0;
+		maxY = 1;
+	}
+	std::lock_guard<std::mutex> lock(mutex);
+	Array<Job> * pending[2] = { &queue, &inProgress };
+	for (int n = 0; n < 2; n++) {
+		for (int i = 0; i < pending[n]->length(); i++) {
+			int y = (*pending[n])[i].y;
+			if (minY > y)
+				minY = y;
+			if (maxY <= y)
+				maxY = y + 1;
+		}
+	}
+}
+
+/// wait until all queued chunks are written
+void ChunkWriter::flush() {
+	std::unique_lock<std::mutex> lock(mutex);
+	while (queue.length() || inProgress.length())
+		written.wait(lock);
+}
+
+/// number of chunks which are queued or being written
+int ChunkWriter::pendingCount() {
+	std::lock_guard<std::mutex> lock(mutex);
+	return queue.length() + inProgress.length();
+}
@@ -0,0 +1,153 @@
+#ifndef CHUNKPROVIDER_H_INCLUDED
+#define CHUNKPROVIDER_H_INCLUDED
+
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include "world.h"
+#include "regionfile.h"
+
+/// Chunk position requested from ChunkProvider
+struct ChunkRequest {
+	int x;
+	int y;
+	int z;
+	int priority; // lower value is loaded first
+	ChunkRequest() : x(0), y(0), z(0), priority(0) {}
+};
+
+/// Loads or generates chunks missing around camera on background threads
+/// Requests are ordered by distance from camera, chunks in front of camera go first.
+/// Queue is rebuilt on each update(), so requests for chunks which went out of range are cancelled;
+/// chunks which are already being loaded are discarded on arrival if not needed anymore.
+/// World is accessed only from update(): finished chunks are installed on the calling (main) thread,
+/// which never waits for loading or generation.
+/// Chunk levels (chunk y) are requested for the range loaded in world extended with ranges of sources,
+/// limited by view range around camera level.
+class ChunkProvider {
+	struct Result {
+		int x;
+		int y;
+		int z;
+		Chunk * chunk;
+	};
+	ChunkSource * loader;
+	ChunkSource * generator;
+	std::mutex mutex;
+	std::condition_variable wakeup;
+	Array<std::thread *> workers;
+	bool stopping;
+	/// pending requests, sorted by priority descending: next one to process is the last
+	Array<ChunkRequest> queue;
+	/// requests taken by workers
+	Array<ChunkRequest> inProgress;
+	/// finished chunks waiting for update()
+	Array<Result> done;
+	void workerLoop();
+	/// loader first, then generator; empty chunk if nobody has data, so that position is not requested again
+	Chunk * createChunk(int x, int y, int z);
+public:
+	/// loader and generator may be NULL
+	ChunkProvider(ChunkSource * chunkLoader, ChunkSource * chunkGenerator, int threadCount);
+	/// stops worker threads; chunks which are not installed yet are deleted
+	~ChunkProvider();
+	/// request priority for chunk at offset dx, dz (in chunks) from camera chunk
+	static int chunkPriority(int dx, int dz, Vector3d forward);
+	/// install finished chunks to world, then request chunks missing in view range (+1 chunk, as protected from eviction)
+	/// returns number of installed chunks
+	int update(World * world);
+	/// number of requests which are not finished yet
+	int pendingCount();
+};
+
+/// Compresses cold chunks (not accessed for a number of world clock ticks) on background threads
+/// Cells are encoded with ChunkCodec (palette + PackBits RLE); compressed chunk is decompressed on first access
+/// through ChunkMatrix::get(), i.e. from World::getCell(), getCellsNear(), WorldReader, edits.
+/// Chunk is retained while being encoded, so that edits on main thread replace it with a copy, as for snapshots;
+/// update() stores encoded data in chunk only if it's still in world, unchanged, cold, not shared, and data is smaller than layers.
+class ChunkCompactor {
+	struct Job {
+		int x;
+		int y;
+		int z;
+		Chunk * chunk;
+		unsigned int version;
+		unsigned char * data;
+		int size;
+	};
+	std::mutex mutex;
+	std::condition_variable wakeup;
+	Array<std::thread *> workers;
+	bool stopping;
+	/// chunks waiting for encoding
+	Array<Job> queue;
+	/// encoded chunks waiting for update()
+	Array<Job> done;
+	/// jobs which are queued, being encoded or done
+	int jobCount;
+	unsigned int coldTicks;
+	int budget;
+	/// hash table slot to continue search of cold chunks from
+	int nextSlot;
+	void workerLoop();
+public:
+	/// chunks which were not accessed for coldTicks are compressed, up to budget chunks are in work at once
+	ChunkCompactor(int threadCount, unsigned int coldTicks, int budget);
+	/// stops worker threads; encoded data which is not used yet is dropped
+	~ChunkCompactor();
+	void setColdTicks(unsigned int ticks) { coldTicks = ticks; }
+	unsigned int getColdTicks() { return coldTicks; }
+	void setBudget(int chunks) { budget = chunks; }
+	int getBudget() { return budget; }
+	/// compress chunks encoded since the last call and queue more cold chunks; call on main thread, e.g. after World::tick()
+	/// returns number of compressed chunks; readers created before this call must not be used after it
+	int update(World * world);
+	/// number of chunks which are queued or being encoded
+	int pendingCount();
+};
+
+/// Saves chunks to target persistence on a background thread, so that World::evictChunks() doesn't wait for encoding and file i/o
+/// Saved chunk is retained until it's written: world releases evicted chunk, and edits of chunk which is still in world copy it first,
+/// as for snapshots. Chunks are written in order of saving; a newer save of the same position replaces one which is still queued.
+/// loadChunk() returns copy of the latest chunk saved for position while it's not written yet, otherwise reads it from source,
+/// so ChunkProvider never gets data older than the last save.
+class ChunkWriter : public ChunkPersistence, public ChunkSource {
+	struct Job {
+		int x;
+		int y;
+		int z;
+		Chunk * chunk;
+	};
+	ChunkPersistence * target;
+	ChunkSource * source;
+	std::mutex mutex;
+	std::condition_variable wakeup;
+	/// notified when queue becomes empty and nothing is being written
+	std::condition_variable written;
+	std::thread * worker;
+	bool stopping;
+	/// chunks waiting for writing, oldest first
+	Array<Job> queue;
+	/// chunks taken by worker, being written
+	Array<Job> inProgress;
+	void workerLoop();
+	/// the latest queued or being written chunk for position, NULL if none; call under lock
+	Chunk * findPending(int x, int y, int z);
+public:
+	/// target writes chunks on worker thread, source reads chunks which are not pending; usually both are the same RegionStore
+	ChunkWriter(ChunkPersistence * target, ChunkSource * source);
+	/// writes all queued chunks, then stops worker thread
+	~ChunkWriter();
+	/// queue chunk for writing; call on thread which owns world
+	virtual void saveChunk(int chunkx, int chunky, int chunkz, Chunk * chunk);
+	/// copy of pending chunk, or chunk read from source; returns NULL if chunk is not saved
+	virtual Chunk * loadChunk(int chunkx, int chunky, int chunkz);
+	/// levels of source extended with levels of pending chunks
+	virtual void getLevels(int & minY, int & maxY);
+	/// wait until all queued chunks are written
+	void flush();
+	/// number of chunks which are queued or being written
+	int pendingCount();
+};
+
+#endif// CHUNKPROVIDER_H_INCLUDED
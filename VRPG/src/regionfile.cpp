@@ -0,0 +1,809 @@
+#include "regionfile.h"
+#include "logger.h"
+#ifdef _WIN32
+#include <windows.h>
+#include <direct.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+static const char REGION_MAGIC[8] = { 'V', 'R', 'P', 'G', 'R', 'E', 'G', 0 };
+static const int REGION_FORMAT_VERSION = 1;
+
+enum {
+	LAYER_UNIFORM = 0,
+	LAYER_PALETTE = 1,
+	LAYER_RAW = 2,
+	/// flag for LAYER_PALETTE and LAYER_RAW: indexes are XORed with indexes of previous layer, which has the same bits
+	LAYER_DELTA = 0x80,
+	/// palette of global block ids, first record of chunk
+	CHUNK_BLOCK_IDS = 3,
+	/// block entities, last record of chunk
+	CHUNK_ENTITIES = 4,
+};
+
+static char * copyString(const char * s) {
+	size_t len = strlen(s);
+	char * res = (char*)malloc(len + 1);
+	memcpy(res, s, len + 1);
+	return res;
+}
+
+static void putUInt32(unsigned char * p, unsigned int value) {
+	p[0] = (unsigned char)value;
+	p[1] = (unsigned char)(value >> 8);
+	p[2] = (unsigned char)(value >> 16);
+	p[3] = (unsigned char)(value >> 24);
+}
+
+static unsigned int getUInt32(const unsigned char * p) {
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+/// PackBits: header n < 128 is followed by n + 1 literal bytes, n > 128 is followed by byte repeated 257 - n times
+static void packBits(const unsigned char * src, int len, Array<unsigned char> & dst) {
+	int i = 0;
+	while (i < len) {
+		int run = 1;
+		while (i + run < len && run < 128 && src[i + run] == src[i])
+			run++;
+		if (run >= 3) {
+			dst.append((unsigned char)(257 - run));
+			dst.append(src[i]);
+			i += run;
+			continue;
+		}
+		// literals until next run of 3 or more equal bytes
+		int start = i;
+		while (i < len && i - start < 128) {
+			if (i + 2 < len && src[i] == src[i + 1] && src[i] == src[i + 2])
+				break;
+			i++;
+		}
+		dst.append((unsigned char)(i - start - 1));
+		for (int j = start; j < i; j++)
+			dst.append(src[j]);
+	}
+}
+
+/// decodes exactly len bytes to dst, returns pointer to byte after packed data or NULL on error
+static const unsigned char * unpackBits(const unsigned char * src, const unsigned char * end, unsigned char * dst, int len) {
+	int pos = 0;
+	while (pos < len) {
+		if (src >= end)
+			return NULL;
+		int n = *src++;
+		if (n < 128) {
+			n++;
+			if (pos + n > len || src + n > end)
+				return NULL;
+			memcpy(dst + pos, src, n);
+			src += n;
+			pos += n;
+		} else if (n > 128) {
+			n = 257 - n;
+			if (pos + n > len || src >= end)
+				return NULL;
+			memset(dst + pos, *src++, n);
+			pos += n;
+		}
+	}
+	return src;
+}
+
+/// append palette of global block ids of alias cells of chunk
+void ChunkCodec::encodeBlockIds(Chunk * chunk, Array<unsigned char> & buf) {
+	int count = 0;
+	for (int i = 0; i < BLOCK_ID_DIRECT; i++)
+		if (chunk->blockIds[i])
+			count++;
+	if (!count)
+		return;
+	buf.append(CHUNK_BLOCK_IDS);
+	buf.append((unsigned char)count);
+	for (int i = 0; i < BLOCK_ID_DIRECT; i++) {
+		if (chunk->blockIds[i]) {
+			buf.append((unsigned char)i);
+			buf.append((unsigned char)(chunk->blockIds[i] & 0xFF));
+			buf.append((unsigned char)(chunk->blockIds[i] >> 8));
+		}
+	}
+}
+
+/// replace saved cell values of decoded chunk with cell values of this session; large block ids get alias cells of chunk
+bool ChunkCodec::mapBlockIds(Chunk * chunk, const unsigned char * ids, int count) {
+	// cell values w/o entry in palette are block ids below BLOCK_ID_DIRECT
+	cell_t map[256];
+	for (int i = 0; i < 256; i++)
+		map[i] = i < BLOCK_ID_DIRECT ? blockCell((block_id_t)i) : (cell_t)i;
+	block_id_t largeIds[256];
+	memset(largeIds, 0, sizeof(largeIds));
+	for (int i = 0; i < count; i++, ids += 3) {
+		if (ids[0] >= BLOCK_ID_DIRECT)
+			return false;
+		block_id_t id = ids[1] | (ids[2] << 8);
+		if (id < BLOCK_ID_DIRECT) {
+			map[ids[0]] = blockCell(id);
+		} else {
+			largeIds[ids[0]] = id;
+			// unknown block types become empty cells
+			map[ids[0]] = NO_CELL;
+		}
+	}
+	bool saved[256];
+	memset(saved, 0, sizeof(saved));
+	chunk->getUsedCells(saved);
+	// alias cells must differ from other cell values of chunk
+	bool used[256];
+	memset(used, 0, sizeof(used));
+	for (int i = 0; i < 256; i++)
+		if (saved[i])
+			used[map[i]] = true;
+	for (int i = 0; i < BLOCK_ID_DIRECT; i++) {
+		BlockDef * def = BLOCK_DEFS_BY_ID[largeIds[i]];
+		if (!largeIds[i] || !saved[i] || !def)
+			continue;
+		cell_t cell = blockAliasCell(def, used);
+		if (cell == NO_CELL) {
+			CRLog::error("No free cell value for block type %d %s", def->id, def->name);
+			continue;
+		}
+		used[cell] = true;
+		if (!chunk->blockIds)
+			chunk->allocBlockIds();
+		chunk->blockIds[cell] = largeIds[i];
+		map[i] = cell;
+	}
+	remapCells(chunk, map);
+	return true;
+}
+
+/// replace cell values of decoded chunk using map
+void ChunkCodec::remapCells(Chunk * chunk, const cell_t * map) {
+	cell_t cells[CHUNK_DX * CHUNK_DX];
+	for (int y = 0; y < CHUNK_DY; y++) {
+		ChunkLayer * layer = chunk->layers[y];
+		if (!layer) {
+			chunk->uniform[y] = map[chunk->uniform[y]];
+			continue;
+		}
+		layer->getCells(0, 0, CHUNK_DX, CHUNK_DX, cells, CHUNK_DX);
+		bool changed = false;
+		for (int i = 0; i < CHUNK_DX * CHUNK_DX; i++) {
+			if (map[cells[i]] != cells[i]) {
+				cells[i] = map[cells[i]];
+				changed = true;
+			}
+		}
+		if (changed)
+			chunk->storeLayerCells(y, cells);
+	}
+}
+
+/// append block entities record
+void ChunkCodec::encodeEntities(ChunkEntities * entities, Array<unsigned char> & buf) {
+	int count = entities->length();
+	buf.append(CHUNK_ENTITIES);
+	buf.append((unsigned char)(count & 0xFF));
+	buf.append((unsigned char)(count >> 8));
+	for (int i = 0; i < count; i++) {
+		const ChunkEntities::Entity & e = (*entities)[i];
+		unsigned char * p = buf.append(0, 6 + e.size);
+		p[0] = (unsigned char)(e.index & 0xFF);
+		p[1] = (unsigned char)(e.index >> 8);
+		p[2] = (unsigned char)(e.type & 0xFF);
+		p[3] = (unsigned char)(e.type >> 8);
+		p[4] = (unsigned char)(e.size & 0xFF);
+		p[5] = (unsigned char)(e.size >> 8);
+		if (e.size)
+			memcpy(p + 6, e.data, e.size);
+	}
+}
+
+/// decode block entities record into chunk; returns pointer to data after record, or NULL if data is corrupted
+const unsigned char * ChunkCodec::decodeEntities(const unsigned char * data, const unsigned char * end, Chunk * chunk) {
+	if (end - data < 3)
+		return NULL;
+	int count = data[1] | (data[2] << 8);
+	data += 3;
+	for (int i = 0; i < count; i++) {
+		if (end - data < 6)
+			return NULL;
+		int index = data[0] | (data[1] << 8);
+		int type = data[2] | (data[3] << 8);
+		int size = data[4] | (data[5] << 8);
+		data += 6;
+		if (index >= CHUNK_DX * CHUNK_DX * CHUNK_DY || end - data < size)
+			return NULL;
+		// loaded chunk is not dirty
+		if (!chunk->entities)
+			chunk->entities = new ChunkEntities();
+		chunk->entities->set(index, type, data, size);
+		data += size;
+	}
+	return data;
+}
+
+/// append block ids of alias cells, encoded cells and block entities of chunk to buf
+void ChunkCodec::encode(Chunk * chunk, Array<unsigned char> & buf) {
+	if (chunk->blockIds)
+		encodeBlockIds(chunk, buf);
+	encodeCells(chunk, buf);
+	if (chunk->entities)
+		encodeEntities(chunk->entities, buf);
+}
+
+/// append encoded cells of chunk to buf, w/o block ids and block entities
+void ChunkCodec::encodeCells(Chunk * chunk, Array<unsigned char> & buf) {
+	// compressed chunk already has encoded data
+	if (chunk->getCompressedData(buf))
+		return;
+	if (chunk->getStorage() != CHUNK_STORAGE_LAYERS) {
+		// format is layer based: encode layered copy
+		Chunk copy(*chunk);
+		copy.setStorage(CHUNK_STORAGE_LAYERS);
+		encodeCells(&copy, buf);
+		return;
+	}
+	Array<unsigned char> packed;
+	Array<unsigned char> deltaPacked;
+	for (int y = 0; y < CHUNK_DY; ) {
+		ChunkLayer * layer = chunk->layers[y];
+		if (!layer) {
+			cell_t cell = chunk->uniform[y];
+			int count = 1;
+			while (y + count < CHUNK_DY && !chunk->layers[y + count] && chunk->uniform[y + count] == cell)
+				count++;
+			buf.append(LAYER_UNIFORM);
+			buf.append((unsigned char)count);
+			buf.append(cell);
+			y += count;
+			continue;
+		}
+		int size = (CHUNK_DX * CHUNK_DX * layer->bits) >> 3;
+		packed.clear();
+		packBits(layer->indexes(), size, packed);
+		// neighbour layers are often alike: delta from previous layer has longer runs
+		ChunkLayer * prev = y > 0 ? chunk->layers[y - 1] : NULL;
+		bool delta = false;
+		if (prev && prev->bits == layer->bits) {
+			unsigned char diff[CHUNK_DX * CHUNK_DX];
+			for (int i = 0; i < size; i++)
+				diff[i] = layer->indexes()[i] ^ prev->indexes()[i];
+			deltaPacked.clear();
+			packBits(diff, size, deltaPacked);
+			delta = deltaPacked.length() < packed.length();
+		}
+		int flags = delta ? LAYER_DELTA : 0;
+		if (layer->bits == 8) {
+			buf.append(LAYER_RAW | flags);
+		} else {
+			buf.append(LAYER_PALETTE | flags);
+			buf.append(layer->bits);
+			buf.append((unsigned char)layer->paletteSize);
+			for (int i = 0; i < layer->paletteSize; i++)
+				buf.append(layer->palette()[i]);
+		}
+		Array<unsigned char> & data = delta ? deltaPacked : packed;
+		memcpy(buf.append(0, data.length()), data.ptr(), data.length());
+		y++;
+	}
+}
+
+/// decode chunk directly into layer buffers; returns NULL if data is corrupted
+Chunk * ChunkCodec::decode(const unsigned char * data, int size) {
+	const unsigned char * end = data + size;
+	// palette of block ids: saved cell value, block id low byte, block id high byte
+	const unsigned char * ids = NULL;
+	int idCount = 0;
+	if (data < end && *data == CHUNK_BLOCK_IDS) {
+		if (end - data < 2 || end - data < 2 + data[1] * 3)
+			return NULL;
+		idCount = data[1];
+		ids = data + 2;
+		data += 2 + idCount * 3;
+	}
+	Chunk * chunk = new Chunk();
+	// saved cell values are the same in this session unless some of them are used as alias cells
+	if (!decodeLayers(data, (int)(end - data), chunk) || ((ids || BLOCK_ALIAS_CELLS) && !mapBlockIds(chunk, ids, idCount))) {
+		delete chunk;
+		return NULL;
+	}
+	// heightmap is not stored
+	chunk->updateHeights();
+	return chunk;
+}
+
+/// decode layers (and block entities, if any) into chunk which has no layers and columns; cell values are not remapped
+bool ChunkCodec::decodeLayers(const unsigned char * data, int size, Chunk * chunk) {
+	const unsigned char * end = data + size;
+	int y = 0;
+	while (y < CHUNK_DY && data && data < end) {
+		int tag = *data++;
+		if (tag == LAYER_UNIFORM) {
+			if (end - data < 2)
+				break;
+			int count = data[0];
+			if (count == 0 || y + count > CHUNK_DY)
+				break;
+			cell_t cell = data[1];
+			data += 2;
+			for (int i = 0; i < count; i++, y++) {
+				chunk->uniform[y] = cell;
+				if (cell != NO_CELL)
+					chunk->updateLayerBounds(y);
+			}
+			continue;
+		}
+		bool delta = (tag & LAYER_DELTA) != 0;
+		tag &= ~LAYER_DELTA;
+		int bits = 8;
+		int shift = 3;
+		int distinct = 256;
+		if (tag == LAYER_PALETTE) {
+			if (end - data < 2)
+				break;
+			bits = data[0];
+			distinct = data[1];
+			data += 2;
+			for (shift = 0; shift < 3 && (1 << shift) != bits; shift++)
+				;
+			if ((1 << shift) != bits || distinct == 0 || distinct > (1 << bits) || end - data < distinct)
+				break;
+		} else if (tag != LAYER_RAW) {
+			break;
+		}
+		ChunkLayer * prev = y > 0 ? chunk->layers[y - 1] : NULL;
+		if (delta && (!prev || prev->bits != bits))
+			break;
+		ChunkLayer * layer = new ChunkLayer(bits, shift, distinct);
+		chunk->layers[y] = layer;
+		chunk->updateLayerBounds(y);
+		y++;
+		cell_t * palette = layer->palette();
+		if (bits == 8) {
+			for (int i = 0; i < 256; i++)
+				palette[i] = (cell_t)i;
+		} else {
+			memcpy(palette, data, distinct);
+			data += distinct;
+		}
+		int size = (CHUNK_DX * CHUNK_DX * bits) >> 3;
+		data = unpackBits(data, end, layer->indexes(), size);
+		if (data && delta) {
+			for (int i = 0; i < size; i++)
+				layer->indexes()[i] ^= prev->indexes()[i];
+		}
+		if (data && !layer->updateCounts())
+			data = NULL;
+	}
+	if (y == CHUNK_DY && data && data < end && *data == CHUNK_ENTITIES)
+		data = decodeEntities(data, end, chunk);
+	return y == CHUNK_DY && data == end;
+}
+
+MappedFile::MappedFile() : ptr(NULL), len(0)
+#ifdef _WIN32
+	, fileHandle(INVALID_HANDLE_VALUE), mappingHandle(NULL)
+#endif
+{
+}
+
+/// map file, returns false on failure
+bool MappedFile::map(const char * path) {
+	unmap();
+#ifdef _WIN32
+	fileHandle = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (fileHandle == INVALID_HANDLE_VALUE)
+		return false;
+	len = (int)GetFileSize(fileHandle, NULL);
+	mappingHandle = CreateFileMappingA(fileHandle, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (mappingHandle)
+		ptr = (unsigned char *)MapViewOfFile(mappingHandle, FILE_MAP_READ, 0, 0, 0);
+	if (!ptr) {
+		unmap();
+		return false;
+	}
+#else
+	int fd = ::open(path, O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	if (fstat(fd, &st) == 0 && st.st_size > 0) {
+		void * p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (p != MAP_FAILED) {
+			ptr = (unsigned char *)p;
+			len = (int)st.st_size;
+		}
+	}
+	::close(fd);
+	if (!ptr)
+		return false;
+#endif
+	return true;
+}
+
+void MappedFile::unmap() {
+#ifdef _WIN32
+	if (ptr)
+		UnmapViewOfFile(ptr);
+	if (mappingHandle)
+		CloseHandle(mappingHandle);
+	if (fileHandle != INVALID_HANDLE_VALUE)
+		CloseHandle(fileHandle);
+	mappingHandle = NULL;
+	fileHandle = INVALID_HANDLE_VALUE;
+#else
+	if (ptr)
+		munmap(ptr, len);
+#endif
+	ptr = NULL;
+	len = 0;
+}
+
+RegionFile::RegionFile() : path(NULL), f(NULL), fileSize(0), liveBytes(0) {
+	memset(offsets, 0, sizeof(offsets));
+	memset(sizes, 0, sizeof(sizes));
+}
+
+bool RegionFile::writeHeader(FILE * file, unsigned int * offs, unsigned int * szs) {
+	unsigned char * header = (unsigned char *)malloc(HEADER_SIZE);
+	memcpy(header, REGION_MAGIC, 8);
+	putUInt32(header + 8, REGION_FORMAT_VERSION);
+	putUInt32(header + 12, CHUNK_DY);
+	for (int i = 0; i < REGION_CHUNKS; i++) {
+		putUInt32(header + 16 + i * 8, offs[i]);
+		putUInt32(header + 16 + i * 8 + 4, szs[i]);
+	}
+	bool res = fseek(file, 0, SEEK_SET) == 0 && fwrite(header, 1, HEADER_SIZE, file) == (size_t)HEADER_SIZE;
+	free(header);
+	return res;
+}
+
+bool RegionFile::writeTableEntry(int index) {
+	unsigned char entry[8];
+	putUInt32(entry, offsets[index]);
+	putUInt32(entry + 4, sizes[index]);
+	return fseek(f, 16 + index * 8, SEEK_SET) == 0 && fwrite(entry, 1, 8, f) == 8;
+}
+
+/// open existing region file or create new one
+bool RegionFile::open(const char * filename) {
+	std::lock_guard<std::mutex> lock(mutex);
+	reset();
+	path = copyString(filename);
+	f = fopen(path, "r+b");
+	if (!f) {
+		FILE * existing = fopen(path, "rb");
+		if (existing) {
+			// don't overwrite file which cannot be opened for writing
+			fclose(existing);
+			CRLog::error("cannot open region file %s for writing", path);
+			reset();
+			return false;
+		}
+		f = fopen(path, "w+b");
+		if (!f || !writeHeader(f, offsets, sizes) || fflush(f)) {
+			CRLog::error("cannot create region file %s", path);
+			reset();
+			return false;
+		}
+		fileSize = HEADER_SIZE;
+		return true;
+	}
+	unsigned char * header = (unsigned char *)malloc(HEADER_SIZE);
+	bool valid = fread(header, 1, HEADER_SIZE, f) == (size_t)HEADER_SIZE
+		&& !memcmp(header, REGION_MAGIC, 8)
+		&& getUInt32(header + 8) == REGION_FORMAT_VERSION
+		&& getUInt32(header + 12) == CHUNK_DY;
+	fseek(f, 0, SEEK_END);
+	fileSize = (int)ftell(f);
+	for (int i = 0; valid && i < REGION_CHUNKS; i++) {
+		offsets[i] = getUInt32(header + 16 + i * 8);
+		sizes[i] = getUInt32(header + 16 + i * 8 + 4);
+		if (offsets[i] ? (offsets[i] < (unsigned int)HEADER_SIZE || offsets[i] + sizes[i] > (unsigned int)fileSize) : sizes[i] != 0)
+			valid = false;
+		liveBytes += sizes[i];
+	}
+	free(header);
+	if (!valid) {
+		CRLog::error("invalid region file %s", path);
+		reset();
+		return false;
+	}
+	return true;
+}
+
+void RegionFile::close() {
+	std::lock_guard<std::mutex> lock(mutex);
+	reset();
+}
+
+/// close() under lock
+void RegionFile::reset() {
+	mapping.unmap();
+	if (f)
+		fclose(f);
+	f = NULL;
+	if (path)
+		free(path);
+	path = NULL;
+	memset(offsets, 0, sizeof(offsets));
+	memset(sizes, 0, sizeof(sizes));
+	fileSize = 0;
+	liveBytes = 0;
+}
+
+/// ensure that mapping covers whole file
+bool RegionFile::remap() {
+	if (mapping.isMapped() && mapping.size() >= fileSize)
+		return true;
+	return mapping.map(path);
+}
+
+bool RegionFile::hasChunk(int x, int z) {
+	std::lock_guard<std::mutex> lock(mutex);
+	return offsets[(z << REGION_SHIFT) + x] != 0;
+}
+
+int RegionFile::getFileSize() {
+	std::lock_guard<std::mutex> lock(mutex);
+	return fileSize;
+}
+
+/// size of stale payloads
+int RegionFile::garbageBytes() {
+	std::lock_guard<std::mutex> lock(mutex);
+	return fileSize - HEADER_SIZE - liveBytes;
+}
+
+/// append copy of saved payload of chunk to buf; returns false if chunk is not saved or file cannot be mapped
+bool RegionFile::readPayload(int x, int z, Array<unsigned char> & buf) {
+	std::lock_guard<std::mutex> lock(mutex);
+	int index = (z << REGION_SHIFT) + x;
+	if (!offsets[index] || !remap())
+		return false;
+	// mapping is replaced by compaction, so payload is copied rather than decoded in place
+	memcpy(buf.append(0, sizes[index]), mapping.data() + offsets[index], sizes[index]);
+	return true;
+}
+
+/// returns NULL if chunk is not saved or cannot be read
+Chunk * RegionFile::loadChunk(int x, int z) {
+	Array<unsigned char> payload;
+	if (!readPayload(x, z, payload))
+		return NULL;
+	Chunk * chunk = ChunkCodec::decode(payload.ptr(), payload.length());
+	if (!chunk)
+		CRLog::error("corrupted chunk %d,%d in region file %s", x, z, path);
+	return chunk;
+}
+
+/// replace payload of chunk with size bytes of data encoded by ChunkCodec::encode()
+bool RegionFile::savePayload(int x, int z, const unsigned char * data, int size) {
+	std::lock_guard<std::mutex> lock(mutex);
+	if (!f)
+		return false;
+	int index = (z << REGION_SHIFT) + x;
+	// append payload first: table still points to old payload if writing is interrupted
+	if (fseek(f, fileSize, SEEK_SET) || fwrite(data, 1, size, f) != (size_t)size)
+		return false;
+	liveBytes += size - sizes[index];
+	offsets[index] = fileSize;
+	sizes[index] = size;
+	fileSize += size;
+	if (!writeTableEntry(index) || fflush(f))
+		return false;
+	int garbage = fileSize - HEADER_SIZE - liveBytes;
+	if (garbage > MIN_COMPACT_GARBAGE && garbage > liveBytes)
+		return rewrite();
+	return true;
+}
+
+bool RegionFile::saveChunk(int x, int z, Chunk * chunk) {
+	Array<unsigned char> payload;
+	ChunkCodec::encode(chunk, payload);
+	return savePayload(x, z, payload.ptr(), payload.length());
+}
+
+/// rewrite file with current payloads only
+bool RegionFile::compact() {
+	std::lock_guard<std::mutex> lock(mutex);
+	return rewrite();
+}
+
+/// compact() under lock
+bool RegionFile::rewrite() {
+	if (!f || !remap())
+		return false;
+	int oldSize = fileSize;
+	size_t pathLen = strlen(path);
+	char * tmpPath = (char*)malloc(pathLen + 5);
+	memcpy(tmpPath, path, pathLen);
+	memcpy(tmpPath + pathLen, ".tmp", 5);
+	FILE * out = fopen(tmpPath, "wb");
+	unsigned int newOffsets[REGION_CHUNKS];
+	unsigned int pos = HEADER_SIZE;
+	for (int i = 0; i < REGION_CHUNKS; i++) {
+		newOffsets[i] = sizes[i] ? pos : 0;
+		pos += sizes[i];
+	}
+	bool ok = out && writeHeader(out, newOffsets, sizes);
+	for (int i = 0; ok && i < REGION_CHUNKS; i++)
+		if (sizes[i])
+			ok = fwrite(mapping.data() + offsets[i], 1, sizes[i], out) == sizes[i];
+	if (out && fclose(out))
+		ok = false;
+	if (!ok) {
+		CRLog::error("cannot write region file %s", tmpPath);
+		remove(tmpPath);
+		free(tmpPath);
+		return false;
+	}
+	// file cannot be replaced while it's open or mapped on Windows
+	mapping.unmap();
+	fclose(f);
+#ifdef _WIN32
+	remove(path);
+#endif
+	ok = rename(tmpPath, path) == 0;
+	free(tmpPath);
+	f = fopen(path, "r+b");
+	if (!ok || !f) {
+		CRLog::error("cannot replace region file %s", path);
+		return false;
+	}
+	memcpy(offsets, newOffsets, sizeof(offsets));
+	fileSize = (int)pos;
+	CRLog::debug("region file %s compacted: %d -> %d bytes", path, oldSize, fileSize);
+	return true;
+}
+
+RegionStore::RegionStore(const char * directory) : minLevel(0), maxLevel(1) {
+	dir = copyString(directory);
+#ifdef _WIN32
+	_mkdir(dir);
+#else
+	mkdir(dir, 0755);
+#endif
+	readLevels();
+}
+
+RegionStore::~RegionStore() {
+	close();
+	free(dir);
+}
+
+/// close all region files
+void RegionStore::close() {
+	std::lock_guard<std::mutex> lock(mutex);
+	for (int i = 0; i < regions.length(); i++)
+		delete regions[i].file;
+	regions.clear();
+}
+
+/// missing file means that only level 0 was ever saved
+void RegionStore::readLevels() {
+	char filename[4096];
+	snprintf(filename, sizeof(filename), "%s/levels.txt", dir);
+	FILE * f = fopen(filename, "rt");
+	if (!f)
+		return;
+	int minY, maxY;
+	if (fscanf(f, "%d %d", &minY, &maxY) == 2 && minY < maxY) {
+		minLevel = minY;
+		maxLevel = maxY;
+	}
+	fclose(f);
+}
+
+void RegionStore::writeLevels() {
+	char filename[4096];
+	snprintf(filename, sizeof(filename), "%s/levels.txt", dir);
+	FILE * f = fopen(filename, "wt");
+	if (!f) {
+		CRLog::error("cannot write %s", filename);
+		return;
+	}
+	fprintf(f, "%d %d\n", minLevel, maxLevel);
+	fclose(f);
+}
+
+/// find or open region file, returns NULL if file cannot be opened
+RegionFile * RegionStore::getRegion(int rx, int chunky, int rz, bool create) {
+	for (int i = 0; i < regions.length(); i++)
+		if (regions[i].x == rx && regions[i].y == chunky && regions[i].z == rz)
+			return regions[i].file;
+	char filename[4096];
+	if (chunky)
+		snprintf(filename, sizeof(filename), "%s/region_%d_%d_%d.vrr", dir, rx, rz, chunky);
+	else
+		snprintf(filename, sizeof(filename), "%s/region_%d_%d.vrr", dir, rx, rz);
+	if (!create) {
+		FILE * existing = fopen(filename, "rb");
+		if (!existing)
+			return NULL;
+		fclose(existing);
+	}
+	RegionFile * file = new RegionFile();
+	if (!file->open(filename)) {
+		delete file;
+		return NULL;
+	}
+	Region region;
+	region.x = rx;
+	region.y = chunky;
+	region.z = rz;
+	region.file = file;
+	regions.append(region);
+	return file;
+}
+
+void RegionStore::saveChunk(int chunkx, int chunky, int chunkz, Chunk * chunk) {
+	RegionFile * region;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (chunky < minLevel || chunky >= maxLevel) {
+			if (chunky < minLevel)
+				minLevel = chunky;
+			if (chunky >= maxLevel)
+				maxLevel = chunky + 1;
+			writeLevels();
+		}
+		region = getRegion(chunkx >> REGION_SHIFT, chunky, chunkz >> REGION_SHIFT, true);
+	}
+	// encoded w/o any lock; region file is locked only while payload is written
+	Array<unsigned char> payload;
+	if (region)
+		ChunkCodec::encode(chunk, payload);
+	if (!region || !region->savePayload(chunkx & REGION_MASK, chunkz & REGION_MASK, payload.ptr(), payload.length()))
+		CRLog::error("cannot save chunk %d,%d,%d", chunkx, chunky, chunkz);
+}
+
+/// read chunk, returns NULL if chunk is not saved
+Chunk * RegionStore::loadChunk(int chunkx, int chunky, int chunkz) {
+	RegionFile * region;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (chunky < minLevel || chunky >= maxLevel)
+			return NULL;
+		region = getRegion(chunkx >> REGION_SHIFT, chunky, chunkz >> REGION_SHIFT, false);
+	}
+	// payload is copied under region file lock and decoded w/o any lock
+	if (!region)
+		return NULL;
+	return region->loadChunk(chunkx & REGION_MASK, chunkz & REGION_MASK);
+}
+
+/// levels of saved chunks
+void RegionStore::getLevels(int & minY, int & maxY) {
+	std::lock_guard<std::mutex> lock(mutex);
+	minY = minLevel;
+	maxY = maxLevel;
+}
+
+/// put all saved chunks of all levels from chunk rectangle [minx, maxx) x [minz, maxz) to world; returns number of loaded chunks
+/// world bottom is lowered to the lowest saved level
+int RegionStore::loadChunks(World * world, int minx, int minz, int maxx, int maxz) {
+	int minY, maxY;
+	getLevels(minY, maxY);
+	// levels below bottom were saved by world which was set deeper
+	if (world->getChunks().bottomLevel() > minY)
+		world->setBottomLevel(minY);
+	int count = 0;
+	for (int y = minY; y < maxY; y++) {
+		for (int z = minz; z < maxz; z++) {
+			for (int x = minx; x < maxx; x++) {
+				Chunk * chunk = loadChunk(x, y, z);
+				if (chunk) {
+					world->installChunk(x, y, z, chunk);
+					count++;
+				}
+			}
+		}
+	}
+	return count;
+}
@@ -0,0 +1,152 @@
+#ifndef REGIONFILE_H_INCLUDED
+#define REGIONFILE_H_INCLUDED
+
+#include <stdio.h>
+#include <mutex>
+#include "world.h"
+
+// Region is 32x32 (REGION_SHIFT x REGION_SHIFT) chunks stored in single file
+#define REGION_SHIFT 5
+#define REGION_SIZE (1<<REGION_SHIFT)
+#define REGION_MASK (REGION_SIZE - 1)
+#define REGION_CHUNKS (REGION_SIZE * REGION_SIZE)
+
+/// Chunk payload format for region files
+/// Sequence of layer records from layer 0 to CHUNK_DY - 1:
+///   0, count, cell - run of count uniform layers
+///   1, bits, paletteSize, palette[paletteSize], PackBits compressed indexes - layer with palette (bits < 8)
+///   2, PackBits compressed cells - layer with 8 bit cells
+/// Tags 1 and 2 with 0x80 flag: indexes are XORed with indexes of previous layer (which has the same bits) before compression
+/// Optional first record is per-chunk palette of global block ids (see BlockDef::id) of alias cells (see BLOCK_CELL_ALIAS):
+///   3, count, count * (cell, block id low byte, block id high byte)
+/// other cell values are block ids below BLOCK_ID_DIRECT, so chunks w/o large block ids are stored as before.
+/// Optional last record is block entities (see ChunkEntities), 16 bit little endian values:
+///   4, count, count * (cell index, type, size, data[size])
+/// The same format w/o block ids and block entities keeps cold chunks compressed in memory (ChunkCompactor); they stay in chunk.
+struct ChunkCodec {
+	/// append palette of global block ids of alias cells of chunk
+	static void encodeBlockIds(Chunk * chunk, Array<unsigned char> & buf);
+	/// replace saved cell values of decoded chunk with cell values of this session; large block ids get alias cells of chunk
+	/// ids is count entries of block ids record; returns false if record is corrupted
+	static bool mapBlockIds(Chunk * chunk, const unsigned char * ids, int count);
+	/// replace cell values of decoded chunk using map
+	static void remapCells(Chunk * chunk, const cell_t * map);
+	/// append block entities record
+	static void encodeEntities(ChunkEntities * entities, Array<unsigned char> & buf);
+	/// decode block entities record into chunk; returns pointer to data after record, or NULL if data is corrupted
+	static const unsigned char * decodeEntities(const unsigned char * data, const unsigned char * end, Chunk * chunk);
+	/// append block ids of alias cells, encoded cells and block entities of chunk to buf
+	static void encode(Chunk * chunk, Array<unsigned char> & buf);
+	/// append encoded cells of chunk to buf, w/o block ids and block entities
+	static void encodeCells(Chunk * chunk, Array<unsigned char> & buf);
+	/// decode chunk directly into layer buffers; returns NULL if data is corrupted
+	static Chunk * decode(const unsigned char * data, int size);
+	/// decode layers (and block entities, if any) into chunk which has no layers and columns; cell values are not remapped
+	/// (data of encodeCells() of this session); heightmap is not updated; returns false if data is corrupted
+	static bool decodeLayers(const unsigned char * data, int size, Chunk * chunk);
+};
+
+/// Read only memory mapping of whole file
+class MappedFile {
+	unsigned char * ptr;
+	int len;
+#ifdef _WIN32
+	void * fileHandle;
+	void * mappingHandle;
+#endif
+public:
+	MappedFile();
+	~MappedFile() { unmap(); }
+	/// map file, returns false on failure
+	bool map(const char * path);
+	void unmap();
+	bool isMapped() { return ptr != NULL; }
+	const unsigned char * data() { return ptr; }
+	int size() { return len; }
+};
+
+/// File with up to 32x32 chunks: header with table of payload offsets and sizes, then payloads
+/// Chunk payloads are read through memory mapping.
+/// Saved chunk is appended to the end of file and then table entry is updated, so interrupted write keeps old version;
+/// file is compacted when more than a half of it is occupied by stale payloads.
+/// May be used from several threads: lock is held only while payload is copied or written, chunks are encoded and decoded outside of it.
+class RegionFile {
+	std::mutex mutex;
+	char * path;
+	FILE * f;
+	MappedFile mapping;
+	unsigned int offsets[REGION_CHUNKS]; // 0 for missing chunk
+	unsigned int sizes[REGION_CHUNKS];
+	int fileSize;
+	int liveBytes; // sum of sizes of current payloads
+	bool writeHeader(FILE * file, unsigned int * offs, unsigned int * szs);
+	bool writeTableEntry(int index);
+	/// ensure that mapping covers whole file
+	bool remap();
+	/// close() under lock
+	void reset();
+	/// compact() under lock
+	bool rewrite();
+public:
+	static const int HEADER_SIZE = 16 + REGION_CHUNKS * 8;
+	/// compaction is not started while stale payloads take less than this number of bytes
+	static const int MIN_COMPACT_GARBAGE = 64 * 1024;
+	RegionFile();
+	~RegionFile() { close(); }
+	/// open existing region file or create new one
+	bool open(const char * filename);
+	void close();
+	/// local chunk coordinates are 0..REGION_SIZE-1
+	bool hasChunk(int x, int z);
+	/// append copy of saved payload of chunk to buf; returns false if chunk is not saved or file cannot be mapped
+	bool readPayload(int x, int z, Array<unsigned char> & buf);
+	/// replace payload of chunk with size bytes of data encoded by ChunkCodec::encode()
+	bool savePayload(int x, int z, const unsigned char * data, int size);
+	/// returns NULL if chunk is not saved or cannot be read
+	Chunk * loadChunk(int x, int z);
+	bool saveChunk(int x, int z, Chunk * chunk);
+	/// rewrite file with current payloads only
+	bool compact();
+	int getFileSize();
+	/// size of stale payloads
+	int garbageBytes();
+};
+
+/// Chunk persistence in region files inside directory
+/// Each chunk level (chunk y) has its own set of region files; level 0 keeps old file names.
+/// Range of saved levels is kept in small text file, so that loadChunks knows which levels to look at.
+/// May be used from several threads: store lock covers only levels and the list of open regions,
+/// so threads which load or save chunks of different regions don't wait for each other.
+class RegionStore : public ChunkPersistence, public ChunkSource {
+	struct Region {
+		int x;
+		int y;
+		int z;
+		RegionFile * file;
+	};
+	std::mutex mutex;
+	char * dir;
+	Array<Region> regions;
+	/// saved chunk levels are minLevel <= y < maxLevel
+	int minLevel;
+	int maxLevel;
+	/// find or open region file, returns NULL if file cannot be opened
+	RegionFile * getRegion(int rx, int chunky, int rz, bool create);
+	void readLevels();
+	void writeLevels();
+public:
+	RegionStore(const char * directory);
+	virtual ~RegionStore();
+	virtual void saveChunk(int chunkx, int chunky, int chunkz, Chunk * chunk);
+	/// read chunk, returns NULL if chunk is not saved
+	virtual Chunk * loadChunk(int chunkx, int chunky, int chunkz);
+	/// levels of saved chunks
+	virtual void getLevels(int & minY, int & maxY);
+	/// put all saved chunks of all levels from chunk rectangle [minx, maxx) x [minz, maxz) to world; returns number of loaded chunks
+	/// world bottom is lowered to the lowest saved level
+	int loadChunks(World * world, int minx, int minz, int maxx, int maxz);
+	/// close all region files; store must not be used by other threads at this moment
+	void close();
+};
+
+#endif// REGIONFILE_H_INCLUDED
@@ -1,70 +1,561 @@
 #include "world.h"
 #include <stdio.h>
 #include <assert.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 #include "logger.h"
 #include "blocks.h"
+#include "regionfile.h"
+#include "chunkprovider.h"
 
 bool HIGHLIGHT_GRID = true;
 
-bool World::isOpaque(Vector3d v) {
-	cell_t cell = getCell(v);
-	return BLOCK_TYPE_OPAQUE[cell] && cell != BOUND_SKY;
+int myAbs(int d);
+
+void WorldReader::init(World * world) {
+	chunks = &world->getChunks();
+	clock = world->getAccessClock();
+	linked = chunks->isLinked();
+	lastChunkX = 1000000;
+	lastChunkY = 1000000;
+	lastChunkZ = 1000000;
+	lastChunk = NULL;
 }
 
-cell_t World::getCell(int x, int y, int z) {
-	//y += CHUNK_DY / 2;
-	if (y < 0)
-		return 3;
-	int chunkx = x >> CHUNK_DX_SHIFT;
-	int chunkz = z >> CHUNK_DX_SHIFT;
-	Chunk * p;
-	if (lastChunkX == chunkx && lastChunkZ == chunkz) {
-		p = lastChunk;
+void WorldReader::init(WorldSnapshot * snapshot) {
+	chunks = &snapshot->getChunks();
+	clock = snapshot->getAccessClock();
+	linked = chunks->isLinked();
+	lastChunkX = 1000000;
+	lastChunkY = 1000000;
+	lastChunkZ = 1000000;
+	lastChunk = NULL;
+}
+
+/// property bits of 64 cells x..x+63 of row y, z: bit i is cell x + i; kind is CellMaskKind
+lUInt64 WorldReader::getRowMask(int kind, int x, int y, int z) {
+	lUInt64 mask = 0;
+	// 4 chunk rows, or 5 when x is not aligned
+	for (int rowx = x & ~CHUNK_DX_MASK; rowx < x + 64; rowx += CHUNK_DX) {
+		lUInt64 row = getChunkRowMask(kind, rowx, y, z);
+		int pos = rowx - x;
+		// lUInt64 is signed: shift as unsigned, as cells of the last row may reach bit 63
+		mask |= pos >= 0 ? (lUInt64)((unsigned long long)row << pos) : row >> -pos;
 	}
-	else {
-		p = chunks.get(chunkx, chunkz);
-		lastChunkX = chunkx;
-		lastChunkZ = chunkz;
-		lastChunk = p;
+	return mask;
+}
+
+/// cells of chunks from matrix of world or snapshot; compressed chunks are decompressed on access
+NonEmptyCellIterator::NonEmptyCellIterator(ChunkMatrix & chunkMatrix, Vector3d boxMin, Vector3d boxMax)
+	: chunks(&chunkMatrix), min(boxMin), max(boxMax), chunk(NULL), mask(0), value(NO_CELL) {
+	// only levels which have chunks
+	if (min.y < chunks->bottom())
+		min.y = chunks->bottom();
+	if (max.y > chunks->maxY() * CHUNK_DY)
+		max.y = chunks->maxY() * CHUNK_DY;
+	finished = min.x >= max.x || min.y >= max.y || min.z >= max.z;
+	chunkx = (min.x >> CHUNK_DX_SHIFT) - 1;
+	chunky = min.y >> CHUNK_DY_SHIFT;
+	chunkz = min.z >> CHUNK_DX_SHIFT;
+}
+
+/// move to next chunk which has layers in box, returns false when there are no more chunks
+bool NonEmptyCellIterator::nextChunk() {
+	for (;;) {
+		if (++chunkx > (max.x - 1) >> CHUNK_DX_SHIFT) {
+			chunkx = min.x >> CHUNK_DX_SHIFT;
+			if (++chunkz > (max.z - 1) >> CHUNK_DX_SHIFT) {
+				chunkz = min.z >> CHUNK_DX_SHIFT;
+				if (++chunky > (max.y - 1) >> CHUNK_DY_SHIFT) {
+					finished = true;
+					chunk = NULL;
+					return false;
+				}
+			}
+		}
+		chunk = chunks->get(chunkx, chunky, chunkz);
+		if (!chunk || chunk->getMinLayer() < 0)
+			continue;
+		int cx = chunkx << CHUNK_DX_SHIFT;
+		int cy = chunky << CHUNK_DY_SHIFT;
+		int cz = chunkz << CHUNK_DX_SHIFT;
+		int x0 = min.x > cx ? min.x - cx : 0;
+		int x1 = max.x < cx + CHUNK_DX ? max.x - cx : CHUNK_DX;
+		int y0 = min.y > cy ? min.y - cy : 0;
+		y1 = max.y < cy + CHUNK_DY ? max.y - cy : CHUNK_DY;
+		z0 = min.z > cz ? min.z - cz : 0;
+		z1 = max.z < cz + CHUNK_DX ? max.z - cz : CHUNK_DX;
+		// layers outside of min/max layer are empty
+		if (y0 < chunk->getMinLayer())
+			y0 = chunk->getMinLayer();
+		if (y1 > chunk->getMaxLayer() + 1)
+			y1 = chunk->getMaxLayer() + 1;
+		if (y0 >= y1)
+			continue;
+		rowBits = (unsigned short)(((1 << x1) - 1) & ~((1 << x0) - 1));
+		y = y0 - 1;
+		z = z1;
+		return true;
 	}
-	if (!p)
-		return NO_CELL;
-	return p->get(x & CHUNK_DX_MASK, y, z & CHUNK_DX_MASK);
 }
 
-bool World::canPass(Vector3d pos, Vector3d size) {
+/// move to next row of current chunk which has non-empty cells in box, returns false at the end of chunk
+bool NonEmptyCellIterator::nextRow() {
+	for (;;) {
+		if (++z >= z1) {
+			do {
+				if (++y >= y1)
+					return false;
+			} while (chunk->isEmptyLayer(y));
+			z = z0;
+		}
+		mask = chunk->getRowMask(CELL_MASK_NON_EMPTY, y, z) & rowBits;
+		if (mask)
+			return true;
+	}
+}
+
+/// move to next non-empty cell, returns false when there are no more cells
+bool NonEmptyCellIterator::next() {
+	while (!finished) {
+		if (mask) {
+			int x = 0;
+			while (!(mask & (1 << x)))
+				x++;
+			mask &= mask - 1;
+			value = chunk->get(x, y, z);
+			position = Vector3d((chunkx << CHUNK_DX_SHIFT) + x, (chunky << CHUNK_DY_SHIFT) + y, (chunkz << CHUNK_DX_SHIFT) + z);
+			return true;
+		}
+		if (!chunk || !nextRow())
+			nextChunk();
+	}
+	return false;
+}
+
+bool WorldReader::canPass(Vector3d pos, Vector3d size) {
 	for (int x = 0; x <= size.x; x++)
-		for (int z = 0; z <= size.z; z++)
+		for (int z = 0; z <= size.z; z++) {
+			WorldColumn column = getColumn(pos.x + x, pos.z + z);
 			for (int y = 0; y < size.y; y++) {
-				Vector3d p(pos.x + x, pos.y + y, pos.z + z);
-				if (isOpaque(p))
+				cell_t cell = column.get(pos.y + y);
+				if (BLOCK_TYPE_OPAQUE[cell] && cell != BOUND_SKY)
 					return false;
 			}
+		}
 	return true;
 }
 
-void World::setCell(int x, int y, int z, cell_t value) {
-	//y += CHUNK_DY / 2;
-	int chunkx = x >> CHUNK_DX_SHIFT;
-	int chunkz = z >> CHUNK_DX_SHIFT;
-	Chunk * p;
-	if (lastChunkX == chunkx && lastChunkZ == chunkz) {
-		p = lastChunk;
+bool World::isOpaque(Vector3d v) {
+	cell_t cell = getCell(v);
+	return BLOCK_TYPE_OPAQUE[cell] && cell != BOUND_SKY;
+}
+
+cell_t World::getCell(int x, int y, int z) {
+	if (y < chunks.bottom())
+		return 3; // bedrock below world bottom
+	Chunk * p = chunks.get(x >> CHUNK_DX_SHIFT, y >> CHUNK_DY_SHIFT, z >> CHUNK_DX_SHIFT);
+	if (!p)
+		return NO_CELL;
+	p->touch(accessClock);
+	return p->get(x & CHUNK_DX_MASK, y, z & CHUNK_DX_MASK);
+}
+
+/// first free y above topmost opaque cell of column x, z (ground level); world bottom if there are no opaque cells or chunks are not loaded
+int World::getHeight(int x, int z) {
+	for (int chunky = chunks.maxY() - 1; chunky >= chunks.minY(); chunky--) {
+		// heightmap is kept in compressed chunk
+		Chunk * p = chunks.find(x >> CHUNK_DX_SHIFT, chunky, z >> CHUNK_DX_SHIFT);
+		if (!p)
+			continue;
+		p->touch(accessClock);
+		int h = p->getHeight(x & CHUNK_DX_MASK, z & CHUNK_DX_MASK);
+		if (h)
+			return chunky * CHUNK_DY + h;
 	}
-	else {
-		p = chunks.get(chunkx, chunkz);
+	return chunks.bottom();
+}
+
+bool World::canPass(Vector3d pos, Vector3d size) {
+	WorldReader reader(this);
+	return reader.canPass(pos, size);
+}
+
+/// find chunk for modification, creates chunk if it does not exist
+Chunk * World::getChunkForEdit(int chunkx, int chunky, int chunkz) {
+	if (lastChunkX != chunkx || lastChunkY != chunky || lastChunkZ != chunkz) {
+		lastChunk = chunks.get(chunkx, chunky, chunkz);
 		lastChunkX = chunkx;
+		lastChunkY = chunky;
 		lastChunkZ = chunkz;
-		lastChunk = p;
+		if (!lastChunk) {
+			lastChunk = new Chunk();
+			chunks.set(chunkx, chunky, chunkz, lastChunk);
+		}
 	}
-	if (!p) {
-		p = new Chunk();
-		chunks.set(chunkx, chunkz, p);
-		lastChunkX = chunkx;
-		lastChunkZ = chunkz;
-		lastChunk = p;
+	if (lastChunk->isShared()) {
+		// copy on write: snapshot keeps old chunk
+		lastChunk = new Chunk(*lastChunk);
+		chunks.set(chunkx, chunky, chunkz, lastChunk);
 	}
+	lastChunk->touch(accessClock);
+	return lastChunk;
+}
+
+/// take immutable view of current chunks; call release() on result when done
+WorldSnapshot * World::createSnapshot() {
+	WorldSnapshot * snapshot = new WorldSnapshot();
+	snapshot->chunks.assign(chunks);
+	snapshot->clock = accessClock;
+	return snapshot;
+}
+
+void World::setCell(int x, int y, int z, cell_t value) {
+	// bedrock below world bottom stays; empty cell of missing chunk is empty already
+	if (y < chunks.bottom() || (value == NO_CELL && !chunks.find(x >> CHUNK_DX_SHIFT, y >> CHUNK_DY_SHIFT, z >> CHUNK_DX_SHIFT)))
+		return;
+	Chunk * p = getChunkForEdit(x >> CHUNK_DX_SHIFT, y >> CHUNK_DY_SHIFT, z >> CHUNK_DX_SHIFT);
 	p->set(x & CHUNK_DX_MASK, y, z & CHUNK_DX_MASK, value);
+	journal.add(Vector3d(x, y, z), Vector3d(x + 1, y + 1, z + 1));
+}
+
+/// set cells y0 <= y < y1 of column x, z
+void World::setColumn(int x, int z, int y0, int y1, cell_t value) {
+	if (y0 < chunks.bottom())
+		y0 = chunks.bottom();
+	if (y0 >= y1)
+		return;
+	journal.add(Vector3d(x, y0, z), Vector3d(x + 1, y1, z + 1));
+	for (int chunky = y0 >> CHUNK_DY_SHIFT; chunky <= (y1 - 1) >> CHUNK_DY_SHIFT; chunky++) {
+		if (value == NO_CELL && !chunks.find(x >> CHUNK_DX_SHIFT, chunky, z >> CHUNK_DX_SHIFT))
+			continue;
+		Chunk * p = getChunkForEdit(x >> CHUNK_DX_SHIFT, chunky, z >> CHUNK_DX_SHIFT);
+		int start = y0 > chunky * CHUNK_DY ? y0 : chunky * CHUNK_DY;
+		int end = y1 < (chunky + 1) * CHUNK_DY ? y1 : (chunky + 1) * CHUNK_DY;
+		for (int y = start; y < end; y++)
+			p->set(x & CHUNK_DX_MASK, y, z & CHUNK_DX_MASK, value);
+	}
+}
+
+/// set all cells of box min <= v < max
+void World::fillBox(Vector3d min, Vector3d max, cell_t value) {
+	if (min.y < chunks.bottom())
+		min.y = chunks.bottom();
+	if (min.x >= max.x || min.y >= max.y || min.z >= max.z)
+		return;
+	journal.add(min, max);
+	for (int chunky = min.y >> CHUNK_DY_SHIFT; chunky <= (max.y - 1) >> CHUNK_DY_SHIFT; chunky++) {
+		int y0 = chunky * CHUNK_DY;
+		for (int chunkz = min.z >> CHUNK_DX_SHIFT; chunkz <= (max.z - 1) >> CHUNK_DX_SHIFT; chunkz++) {
+			int z0 = chunkz * CHUNK_DX;
+			for (int chunkx = min.x >> CHUNK_DX_SHIFT; chunkx <= (max.x - 1) >> CHUNK_DX_SHIFT; chunkx++) {
+				int x0 = chunkx * CHUNK_DX;
+				if (value == NO_CELL && !chunks.find(chunkx, chunky, chunkz))
+					continue;
+				Chunk * p = getChunkForEdit(chunkx, chunky, chunkz);
+				p->fill(min.x > x0 ? min.x - x0 : 0, min.y > y0 ? min.y - y0 : 0, min.z > z0 ? min.z - z0 : 0,
+					max.x < x0 + CHUNK_DX ? max.x - x0 : CHUNK_DX, max.y < y0 + CHUNK_DY ? max.y - y0 : CHUNK_DY,
+					max.z < z0 + CHUNK_DX ? max.z - z0 : CHUNK_DX, value);
+			}
+		}
+	}
+}
+
+/// number of cells of box min <= v < max which have match[cell] set
+lUInt64 World::countMatchingCells(Vector3d min, Vector3d max, const bool * match) {
+	if (min.x >= max.x || min.y >= max.y || min.z >= max.z)
+		return 0;
+	lUInt64 area = (lUInt64)(max.x - min.x) * (max.z - min.z);
+	lUInt64 count = 0;
+	// below world bottom getCell() returns bedrock, no chunks above maxY
+	int bottom = chunks.bottom();
+	if (min.y < bottom) {
+		int y1 = max.y < bottom ? max.y : bottom;
+		if (match[3])
+			count += area * (y1 - min.y);
+		min.y = y1;
+	}
+	int top = chunks.maxY() * CHUNK_DY;
+	if (max.y > top) {
+		int y0 = min.y > top ? min.y : top;
+		if (match[NO_CELL])
+			count += area * (max.y - y0);
+		max.y = y0;
+	}
+	if (min.y >= max.y)
+		return count;
+	for (int chunky = min.y >> CHUNK_DY_SHIFT; chunky <= (max.y - 1) >> CHUNK_DY_SHIFT; chunky++) {
+		int y0 = chunky * CHUNK_DY;
+		for (int chunkz = min.z >> CHUNK_DX_SHIFT; chunkz <= (max.z - 1) >> CHUNK_DX_SHIFT; chunkz++) {
+			int z0 = chunkz * CHUNK_DX;
+			for (int chunkx = min.x >> CHUNK_DX_SHIFT; chunkx <= (max.x - 1) >> CHUNK_DX_SHIFT; chunkx++) {
+				int x0 = chunkx * CHUNK_DX;
+				int bx0 = min.x > x0 ? min.x - x0 : 0;
+				int by0 = min.y > y0 ? min.y - y0 : 0;
+				int bz0 = min.z > z0 ? min.z - z0 : 0;
+				int bx1 = max.x < x0 + CHUNK_DX ? max.x - x0 : CHUNK_DX;
+				int by1 = max.y < y0 + CHUNK_DY ? max.y - y0 : CHUNK_DY;
+				int bz1 = max.z < z0 + CHUNK_DX ? max.z - z0 : CHUNK_DX;
+				Chunk * p = chunks.find(chunkx, chunky, chunkz);
+				if (!p) {
+					if (match[NO_CELL])
+						count += (bx1 - bx0) * (by1 - by0) * (bz1 - bz0);
+					continue;
+				}
+				Array<unsigned char> data;
+				if (p->isCompressed() && p->getCompressedData(data)) {
+					// cold chunk is decoded to temporary chunk, so that it stays compressed
+					Chunk decoded;
+					if (ChunkCodec::decodeLayers(data.ptr(), data.length(), &decoded))
+						count += decoded.countCells(bx0, by0, bz0, bx1, by1, bz1, match);
+					continue;
+				}
+				count += p->countCells(bx0, by0, bz0, bx1, by1, bz1, match);
+			}
+		}
+	}
+	return count;
+}
+
+/// global block id of cell; cells of alias values are looked up through their chunk
+block_id_t World::getBlockId(Vector3d v) {
+	cell_t cell = getCell(v);
+	if (!BLOCK_CELL_ALIAS[cell])
+		return BLOCK_CELL_IDS[cell];
+	Chunk * p = chunks.get(v.x >> CHUNK_DX_SHIFT, v.y >> CHUNK_DY_SHIFT, v.z >> CHUNK_DX_SHIFT);
+	return p ? p->cellBlockId(cell) : BLOCK_CELL_IDS[cell];
+}
+
+/// put block type with global id to cell; large ids get alias cell of chunk
+bool World::setBlock(Vector3d v, block_id_t id) {
+	cell_t cell;
+	if (id < BLOCK_ID_DIRECT)
+		cell = blockCell(id);
+	else
+		cell = getChunkForEdit(v.x >> CHUNK_DX_SHIFT, v.y >> CHUNK_DY_SHIFT, v.z >> CHUNK_DX_SHIFT)->blockCell(id);
+	if (cell == NO_CELL && id != BLOCK_CELL_IDS[NO_CELL])
+		return false;
+	setCell(v.x, v.y, v.z, cell);
+	return true;
+}
+
+/// block entity of cell, NULL if there is none; valid until chunk is changed or evicted
+const ChunkEntities::Entity * World::getBlockEntity(Vector3d v) {
+	// entities are kept while chunk is compressed
+	Chunk * p = chunks.find(v.x >> CHUNK_DX_SHIFT, v.y >> CHUNK_DY_SHIFT, v.z >> CHUNK_DX_SHIFT);
+	if (!p)
+		return NULL;
+	p->touch(accessClock);
+	return p->getEntity(v.x & CHUNK_DX_MASK, v.y, v.z & CHUNK_DX_MASK);
+}
+
+/// attach state to cell, replacing old one; payload is copied, cell is not changed; chunk shared with snapshot is copied
+bool World::setBlockEntity(Vector3d v, int type, const unsigned char * data, int size) {
+	if (size < 0 || size > ChunkEntities::MAX_DATA_SIZE) {
+		CRLog::error("block entity payload is too big: %d bytes", size);
+		return false;
+	}
+	Chunk * p = getChunkForEdit(v.x >> CHUNK_DX_SHIFT, v.y >> CHUNK_DY_SHIFT, v.z >> CHUNK_DX_SHIFT);
+	p->setEntity(v.x & CHUNK_DX_MASK, v.y, v.z & CHUNK_DX_MASK, type, data, size);
+	return true;
+}
+
+/// returns false if cell has no entity
+bool World::removeBlockEntity(Vector3d v) {
+	int chunkx = v.x >> CHUNK_DX_SHIFT;
+	int chunky = v.y >> CHUNK_DY_SHIFT;
+	int chunkz = v.z >> CHUNK_DX_SHIFT;
+	// don't create or copy chunk which has nothing to remove
+	Chunk * p = chunks.find(chunkx, chunky, chunkz);
+	if (!p || !p->getEntity(v.x & CHUNK_DX_MASK, v.y, v.z & CHUNK_DX_MASK))
+		return false;
+	p = getChunkForEdit(chunkx, chunky, chunkz);
+	return p->removeEntity(v.x & CHUNK_DX_MASK, v.y, v.z & CHUNK_DX_MASK);
+}
+
+/// append positions of entities of type inside box min <= v < max to out, chunk by chunk; returns number of found entities
+int World::findBlockEntities(Vector3d min, Vector3d max, int type, Vector3dArray & out) {
+	if (min.x >= max.x || min.y >= max.y || min.z >= max.z)
+		return 0;
+	int found = 0;
+	IntArray indexes;
+	for (int chunky = min.y >> CHUNK_DY_SHIFT; chunky <= (max.y - 1) >> CHUNK_DY_SHIFT; chunky++) {
+		for (int chunkz = min.z >> CHUNK_DX_SHIFT; chunkz <= (max.z - 1) >> CHUNK_DX_SHIFT; chunkz++) {
+			for (int chunkx = min.x >> CHUNK_DX_SHIFT; chunkx <= (max.x - 1) >> CHUNK_DX_SHIFT; chunkx++) {
+				Chunk * p = chunks.find(chunkx, chunky, chunkz);
+				if (!p || !p->getEntities())
+					continue;
+				indexes.clear();
+				p->getEntities()->findByType(type, indexes);
+				Vector3d origin(chunkx * CHUNK_DX, chunky * CHUNK_DY, chunkz * CHUNK_DX);
+				for (int i = 0; i < indexes.length(); i++) {
+					Vector3d v = origin + ChunkEntities::cellPosition(indexes[i]);
+					if (v.x >= min.x && v.y >= min.y && v.z >= min.z && v.x < max.x && v.y < max.y && v.z < max.z) {
+						out.append(v);
+						found++;
+					}
+				}
+			}
+		}
+	}
+	return found;
+}
+
+/// put loaded chunk to world, replacing chunk at the same position if any
+void World::installChunk(int chunkx, int chunky, int chunkz, Chunk * chunk) {
+	if (lastChunkX == chunkx && lastChunkY == chunky && lastChunkZ == chunkz)
+		lastChunk = chunk;
+	chunk->optimizeStorage();
+	chunks.set(chunkx, chunky, chunkz, chunk);
+	chunk->touch(accessClock);
+	journal.add(Vector3d(chunkx * CHUNK_DX, chunky * CHUNK_DY, chunkz * CHUNK_DX),
+		Vector3d((chunkx + 1) * CHUNK_DX, (chunky + 1) * CHUNK_DY, (chunkz + 1) * CHUNK_DX));
+}
+
+static inline bool sameChunk(Vector3d min1, Vector3d max1, Vector3d min2, Vector3d max2) {
+	int chunkx = min1.x >> CHUNK_DX_SHIFT;
+	int chunky = min1.y >> CHUNK_DY_SHIFT;
+	int chunkz = min1.z >> CHUNK_DX_SHIFT;
+	return ((max1.x - 1) >> CHUNK_DX_SHIFT) == chunkx && ((max1.z - 1) >> CHUNK_DX_SHIFT) == chunkz
+		&& (min2.x >> CHUNK_DX_SHIFT) == chunkx && (min2.z >> CHUNK_DX_SHIFT) == chunkz
+		&& ((max2.x - 1) >> CHUNK_DX_SHIFT) == chunkx && ((max2.z - 1) >> CHUNK_DX_SHIFT) == chunkz
+		&& ((max1.y - 1) >> CHUNK_DY_SHIFT) == chunky && (min2.y >> CHUNK_DY_SHIFT) == chunky
+		&& ((max2.y - 1) >> CHUNK_DY_SHIFT) == chunky;
+}
+
+void ChangeJournal::add(Vector3d min, Vector3d max) {
+	// merge with one of the recent boxes in the same chunk
+	for (int i = boxes.length() - 1; i >= sealed && i >= boxes.length() - 4; i--) {
+		DirtyBox & box = boxes[i];
+		if (sameChunk(box.min, box.max, min, max)) {
+			if (box.min.x > min.x) box.min.x = min.x;
+			if (box.min.y > min.y) box.min.y = min.y;
+			if (box.min.z > min.z) box.min.z = min.z;
+			if (box.max.x < max.x) box.max.x = max.x;
+			if (box.max.y < max.y) box.max.y = max.y;
+			if (box.max.z < max.z) box.max.z = max.z;
+			return;
+		}
+	}
+	if (boxes.length() >= MAX_ENTRIES) {
+		firstPosition += boxes.length();
+		boxes.clear();
+		sealed = 0;
+	}
+	boxes.append(DirtyBox(min, max));
+}
+
+/// append boxes added since position to dst and move position to the end
+/// returns false if some of them are dropped on overflow
+bool ChangeJournal::drain(lUInt64 & position, Array<DirtyBox> & dst) {
+	bool complete = position >= firstPosition;
+	int start = complete ? (int)(position - firstPosition) : 0;
+	for (int i = start; i < boxes.length(); i++)
+		dst.append(boxes[i]);
+	position = endPosition();
+	sealed = boxes.length();
+	return complete;
+}
+
+/// memory used by chunk data (used items of chunk pools, columns, compressed data, block entities and block ids), in bytes
+int World::chunkMemoryUsage() {
+	int res = 0;
+	PoolStats stats = CHUNK_POOL.stats();
+	res += stats.used * stats.itemSize;
+	stats = CHUNK_LAYER_POOL.stats();
+	res += stats.used * stats.itemSize;
+	for (int i = 0; i < 4; i++) {
+		stats = CHUNK_LAYER_BUFFER_POOLS[i].stats();
+		res += stats.used * stats.itemSize;
+	}
+	res += ChunkColumns::totalMemoryUsage();
+	res += Chunk::compressedDataUsage();
+	res += ChunkEntities::totalMemoryUsage();
+	res += Chunk::blockIdsMemoryUsage();
+	return res;
+}
+
+struct EvictionCandidate {
+	Chunk * chunk;
+	int x;
+	int y;
+	int z;
+	unsigned int lastAccess;
+};
+
+static int compareEvictionCandidates(const void * p1, const void * p2) {
+	unsigned int t1 = ((const EvictionCandidate*)p1)->lastAccess;
+	unsigned int t2 = ((const EvictionCandidate*)p2)->lastAccess;
+	return t1 < t2 ? -1 : (t1 > t2 ? 1 : 0);
+}
+
+/// evict least recently used chunks out of view range until chunk memory fits into budget
+int World::evictChunks() {
+	if (!memoryBudget)
+		return 0;
+	int usage = chunkMemoryUsage();
+	if (usage <= memoryBudget)
+		return 0;
+	int camx = camPosition.pos.x >> CHUNK_DX_SHIFT;
+	int camz = camPosition.pos.z >> CHUNK_DX_SHIFT;
+	// the same chunks would be scanned again w/o result
+	if (evictionStalled && usage <= stalledUsage && camx == stalledCamX && camz == stalledCamZ)
+		return 0;
+	// free a bit more than necessary to avoid eviction on each frame
+	int target = memoryBudget - memoryBudget / 8;
+	// chunks in view range are never evicted
+	int protectDistance = (maxVisibleRange >> CHUNK_DX_SHIFT) + 1;
+	Array<EvictionCandidate> candidates;
+	for (int i = 0; i < chunks.slots(); i++) {
+		EvictionCandidate c;
+		c.chunk = chunks.getAt(i, c.x, c.y, c.z);
+		if (!c.chunk)
+			continue;
+		if (myAbs(c.x - camx) <= protectDistance && myAbs(c.z - camz) <= protectDistance)
+			continue;
+		c.lastAccess = c.chunk->getLastAccess();
+		candidates.append(c);
+	}
+	qsort(candidates.ptr(), candidates.length(), sizeof(EvictionCandidate), compareEvictionCandidates);
+	int evicted = 0;
+	for (int i = 0; i < candidates.length() && usage > target; i++) {
+		EvictionCandidate & c = candidates[i];
+		// changes would be lost: w/o persistence hook dirty chunks stay in memory over budget
+		if (c.chunk->isDirty() && !persistence)
+			continue;
+		usage -= c.chunk->memoryUsage();
+		if (c.chunk->isDirty())
+			persistence->saveChunk(c.x, c.y, c.z, c.chunk);
+		chunks.remove(c.x, c.y, c.z);
+		c.chunk->release();
+		evicted++;
+	}
+	evictionStalled = !evicted;
+	if (!evicted) {
+		// everything left is in view range, or dirty w/o persistence hook
+		stalledUsage = usage;
+		stalledCamX = camx;
+		stalledCamZ = camz;
+		return 0;
+	}
+	resetChunkCache();
+	CRLog::debug("evicted %d of %d chunks, chunk memory %d KB, budget %d KB", evicted, chunks.length() + evicted, chunkMemoryUsage() / 1024, memoryBudget / 1024);
+	return evicted;
+}
+
+/// pass all dirty chunks to persistence hook
+void World::flushDirtyChunks() {
+	if (!persistence)
+		return;
+	for (int i = 0; i < chunks.slots(); i++) {
+		int x, y, z;
+		Chunk * p = chunks.getAt(i, x, y, z);
+		if (p && p->isDirty()) {
+			persistence->saveChunk(x, y, z, p);
+			p->setDirty(false);
+		}
+	}
 }
 
 
@@ -260,7 +751,7 @@ bool VolumeVisitor::visitCell(int index, cell_t cell) {
 	if (cell == BOUND_SKY || cell >= VISITED_OCCUPIED)
 		return false;
 	// mark as visited
-	volume->put(index, BLOCK_TYPE_CAN_PASS[cell] ? VISITED_CELL : VISITED_OCCUPIED);
+	volume->mark(index, BLOCK_TYPE_CAN_PASS[cell] ? VISITED_CELL : VISITED_OCCUPIED);
 
 	Vector3d pt = volume->indexToPoint(index);
 	if (distance > 5 && pt * dirvector < distance)
@@ -315,7 +806,6 @@ void VolumeVisitor::appendNewCell(int index, int distance) {
 
 void VolumeVisitor::visitPlaneForward(int startIndex, DirEx direction) {
 	DirectionHelper & helper = helpers[direction];
-	cell_t * data = volume->ptr();
 	int * thisPlaneDirections = volume->thisPlaneDirections(direction);
 	int * nextPlaneDirections = volume->nextPlaneDirections(direction);
 	int dist = distance + 1;
@@ -323,7 +813,7 @@ void VolumeVisitor::visitPlaneForward(int startIndex, DirEx direction) {
 	// spread forward between planes oldcells->newcells
 	for (int i = 0; i < helper.oldcells.length(); i++) {
 		int forwardIndex = helper.oldcells[i] + nextPlaneDirections[0]; // index in next plane
-		cell_t cell = data[forwardIndex];
+		cell_t cell = volume->get(forwardIndex);
 		if (visitCell(forwardIndex, cell))
 			helper.newcells.append(forwardIndex);
 	}
@@ -334,7 +824,6 @@ void VolumeVisitor::visitPlaneForward(int startIndex, DirEx direction) {
 // move in forward direction
 void VolumeVisitor::visitPlaneSpread(int startIndex, DirEx direction) {
 	DirectionHelper & helper = helpers[direction];
-	cell_t * data = volume->ptr();
 	int * thisPlaneDirections = volume->thisPlaneDirections(direction);
 	int * nextPlaneDirections = volume->nextPlaneDirections(direction);
 	int dist = distance + 1;
@@ -347,19 +836,19 @@ void VolumeVisitor::visitPlaneSpread(int startIndex, DirEx direction) {
 		for (int dir = 1; dir <= 4; dir++) {
 			// forward
 			int newindex = index + thisPlaneDirections[dir];
-			cell_t cell = data[newindex];
+			cell_t cell = volume->get(newindex);
 			if (cell < VISITED_OCCUPIED) {
 				helper.spreadcells.append(newindex);
 			}
 			if (BLOCK_TYPE_CAN_PASS[cell]) {
 				// diagonal
 				int index0 = index + thisPlaneDirections[dir + 4];
-				cell = data[index0];
+				cell = volume->get(index0);
 				if (cell < VISITED_OCCUPIED)
 					helper.spreadcells.append(index0);
 				int prevdir = dir == 1 ? 8 : dir + 3;
 				index0 = index + thisPlaneDirections[prevdir];
-				cell = data[index0];
+				cell = volume->get(index0);
 				if (cell < VISITED_OCCUPIED)
 					helper.spreadcells.append(index0);
 			}
@@ -368,7 +857,7 @@ void VolumeVisitor::visitPlaneSpread(int startIndex, DirEx direction) {
 	// phase 2: visit cells
 	for (int i = helper.spreadcells.length() - 1; i >= 0; i--) {
 		int newindex = helper.spreadcells[i];
-		cell_t cell = data[newindex];
+		cell_t cell = volume->get(newindex);
 		if (cell < VISITED_OCCUPIED && visitCell(newindex, cell)) {
 			appendNewCell(newindex, dist);
 		}
@@ -380,7 +869,7 @@ void VolumeVisitor::visitAll() {
 	//CRLog::trace("VolumeVisitor2::visitAll() enter");
 	int startIndex = volume->getIndex(Vector3d());
 	cell_t cell = volume->get(startIndex);
-	volume->put(startIndex, VISITED_CELL);
+	volume->mark(startIndex, VISITED_CELL);
 	for (int i = 0; i < 6; i++)
 		helpers[i].start(startIndex, (DirEx)i);
 	for (distance = 0; distance < volume->size() - 2; distance++) {
@@ -409,7 +898,6 @@ void VolumeVisitor::visitAll() {
 
 void World::visitVisibleCellsAllDirectionsFast(Position & position, CellVisitor * visitor) {
 #if	USE_VOLUME_DATA == 1
-	volumeSnapshotInvalid = true;
 	updateVolumeSnapshot();
 #endif
 #if USE_DIAMOND_VISITOR==1
@@ -431,183 +919,3605 @@ void disposeChunkStripe(ChunkStripe * p) {
 	delete p;
 }
 
-void World::updateVolumeSnapshot() {
-#if	USE_VOLUME_DATA == 1
-	if (!volumeSnapshotInvalid && volumePos == camPosition.pos)
+ChunkMatrix::ChunkMatrix() : minx(0), maxx(0), miny(0), maxy(1), minz(0), maxz(0), bottomy(0), table(NULL), capacity(0), count(0), linked(false) {
+	resize(64);
+}
+
+ChunkMatrix::~ChunkMatrix() {
+	for (int i = 0; i < capacity; i++)
+		if (table[i].chunk)
+			Chunk::dispose(table[i].chunk);
+	free(table);
+}
+
+void ChunkMatrix::resize(int newCapacity) {
+	Entry * oldTable = table;
+	int oldCapacity = capacity;
+	table = (Entry*)malloc(sizeof(Entry) * newCapacity);
+	memset(table, 0, sizeof(Entry) * newCapacity);
+	capacity = newCapacity;
+	int mask = capacity - 1;
+	for (int i = 0; i < oldCapacity; i++) {
+		if (oldTable[i].chunk) {
+			int j = hash(oldTable[i].key) & mask;
+			while (table[j].chunk)
+				j = (j + 1) & mask;
+			table[j] = oldTable[i];
+		}
+	}
+	free(oldTable);
+}
+
+/// remove entry, shifting back following entries of the same probe sequence
+void ChunkMatrix::removeAt(int i) {
+	int mask = capacity - 1;
+	table[i].chunk = NULL;
+	count--;
+	for (int j = (i + 1) & mask; table[j].chunk; j = (j + 1) & mask) {
+		int k = hash(table[j].key) & mask;
+		// entry stays if its home slot k is cyclically in (i, j]
+		if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+			continue;
+		table[i] = table[j];
+		table[j].chunk = NULL;
+		i = j;
+	}
+}
+
+/// update neighbour links of chunks around position x, y, z after chunk there is replaced (chunk is NULL when removed)
+void ChunkMatrix::updateLinks(int x, int y, int z, Chunk * chunk) {
+	for (int dir = NORTH; dir <= EAST; dir++) {
+		Vector3d d = DIRECTION_VECTORS[dir];
+		Chunk * neighbour = find(x + d.x, y, z + d.z);
+		if (chunk)
+			chunk->neighbours[dir] = neighbour;
+		if (neighbour)
+			neighbour->neighbours[dir ^ 1] = chunk;
+	}
+}
+
+/// maintain Chunk::getNeighbour() links of chunks on set() and remove()
+void ChunkMatrix::setLinked(bool flg) {
+	linked = flg;
+	if (!linked)
 		return;
-	volumePos = camPosition.pos;
-	getCellsNear(camPosition.pos, volumeSnapshot);
-	volumeSnapshotInvalid = false;
-#endif
+	for (int i = 0; i < capacity; i++) {
+		int x, y, z;
+		Chunk * chunk = getAt(i, x, y, z);
+		if (chunk)
+			updateLinks(x, y, z, chunk);
+	}
 }
 
-void Chunk::getCells(Vector3d srcpos, Vector3d dstpos, Vector3d size, VolumeData & buf) {
-	//CRLog::trace("getCells src=%d,%d,%d  dst=%d,%d,%d  sz=%d,%d,%d", srcpos.x, srcpos.y, srcpos.z
-	//	, dstpos.x, dstpos.y, dstpos.z
-	//	, size.x, size.y, size.z
-	//	);
-	for (int y = 0; y < size.y; y++) {
-		int yy = srcpos.y + y;
-		if (yy >= 0 && yy < CHUNK_DY) {
-			ChunkLayer * layer = layers[yy];
-			if (layer) {
-				Vector3d v = dstpos;
-				v.y += y;
-				//CRLog::trace("putLayer %d  %d,%d %dx%d  to   %d,%d,%d", yy, srcpos.x, srcpos.z, size.x, size.z, v.x, v.y, v.z);
-				buf.putLayer(v, layer->ptr(srcpos.x, srcpos.z), size.x, size.z, CHUNK_DX);
+Chunk * ChunkMatrix::remove(int x, int y, int z) {
+	lUInt64 key = makeKey(x, y, z);
+	int mask = capacity - 1;
+	for (int i = hash(key) & mask; table[i].chunk; i = (i + 1) & mask) {
+		if (table[i].key == key) {
+			Chunk * chunk = table[i].chunk;
+			removeAt(i);
+			if (linked) {
+				updateLinks(x, y, z, NULL);
+				chunk->clearLinks();
 			}
+			return chunk;
 		}
 	}
+	return NULL;
 }
 
-void World::getCellsNear(Vector3d pos, VolumeData & buf) {
-	Vector3d v = pos;
-	buf.clear();
-	//setCell(pos.x, pos.y, pos.z, 15);
-	//setCell(pos.x + 1, pos.y, pos.z, 16);
-	//setCell(pos.x, pos.y, pos.z + 2, 17);
-	//setCell(pos.x, pos.y + 5, pos.z, 18);
-	int sz = buf.size();
-	int y0 = v.y;
-	v.x -= sz;
-	v.y -= sz;
-	v.z -= sz;
-	int dsty = 0;
-	int dy = sz * 2;
-	Vector3d endv = v;
-	endv.x += sz * 2;
-	endv.y += sz * 2;
-	endv.z += sz * 2;
-	if (v.y < 0) {
-		dy -= -v.y;
-		dsty += -v.y;
-		v.y = 0;
-	}
-	int minLayer = -1;
-	int maxLayer = -1;
-	for (int z = v.z; z < endv.z;) {
-		int zz = z & CHUNK_DX_MASK;
-		int nextz = z + CHUNK_DX - zz;
-		if (nextz > endv.z)
-			nextz = endv.z;
-		int dz = nextz - z;
-		int chunkz = z >> CHUNK_DX_SHIFT;
-		for (int x = v.x; x < endv.x;) {
-			int xx = x & CHUNK_DX_MASK;
-			int nextx = x + CHUNK_DX - xx;
-			if (nextx > endv.x)
-				nextx = endv.x;
-			int dx = nextx - x;
-			int chunkx = x >> CHUNK_DX_SHIFT;
-			Chunk * p = chunks.get(chunkx, chunkz);
-			if (p) {
-				p->updateMinMaxLayer(minLayer, maxLayer);
-				//CRLog::trace("chunk %d,%d  pos %d,%d next %d,%d", chunkx, chunkz, x, z, nextx, nextz);
-				p->getCells(
-					Vector3d(xx, v.y, zz),
-					Vector3d(x - v.x, dsty, z - v.z),
-					Vector3d(dx, dy, dz),
-					buf);
-			}
-			x = nextx;
-		}
-		z = nextz;
-	}
-
-	//assert(buf.get(Vector3d(0, 0, 0)) == 15);
-	//assert(buf.get(Vector3d(1, 0, 0)) == 16);
-	//assert(buf.get(Vector3d(0, 0, 2)) == 17);
-	//assert(buf.get(Vector3d(0, 5, 0)) == 18);
-
-	//for (int z = -5; z < 5; z++) {
-	//	for (int y = -1; y < 5; y++) {
-	//		for (int x = -5; x < 5; x++) {
-	//			assert(getCell(pos + Vector3d(x, y, z)) == buf.get(Vector3d(x, y, z)));
-	//		}
-	//	}
-	//}
-
-	if (minLayer != -1) {
-		if (minLayer > y0)
-			minLayer = y0;
-		if (maxLayer < y0)
-			maxLayer = y0;
-		buf.fillLayer(minLayer - y0 - 1, BOUND_BOTTOM);
-		buf.fillLayer(maxLayer - y0 + 1, BOUND_SKY);
+/// make this matrix a copy of src with the same chunks; chunks are retained
+void ChunkMatrix::assign(ChunkMatrix & src) {
+	for (int i = 0; i < capacity; i++)
+		if (table[i].chunk)
+			Chunk::dispose(table[i].chunk);
+	free(table);
+	table = (Entry*)malloc(sizeof(Entry) * src.capacity);
+	memcpy(table, src.table, sizeof(Entry) * src.capacity);
+	capacity = src.capacity;
+	count = src.count;
+	minx = src.minx;
+	maxx = src.maxx;
+	miny = src.miny;
+	maxy = src.maxy;
+	minz = src.minz;
+	maxz = src.maxz;
+	bottomy = src.bottomy;
+	for (int i = 0; i < capacity; i++)
+		if (table[i].chunk)
+			table[i].chunk->retain();
+	if (linked)
+		setLinked(true);
+}
+
+void ChunkMatrix::set(int x, int y, int z, Chunk * chunk) {
+	lUInt64 key = makeKey(x, y, z);
+	int mask = capacity - 1;
+	int i = hash(key) & mask;
+	for (; table[i].chunk; i = (i + 1) & mask) {
+		if (table[i].key == key) {
+			if (table[i].chunk != chunk) {
+				if (linked)
+					table[i].chunk->clearLinks();
+				Chunk::dispose(table[i].chunk);
+			}
+			if (chunk)
+				table[i].chunk = chunk;
+			else
+				removeAt(i);
+			if (linked)
+				updateLinks(x, y, z, chunk);
+			return;
+		}
 	}
+	if (!chunk)
+		return;
+	table[i].key = key;
+	table[i].chunk = chunk;
+	count++;
+	if (linked)
+		updateLinks(x, y, z, chunk);
+	// keep load factor below 1/2
+	if (count * 2 > capacity)
+		resize(capacity * 2);
+	if (minx > x)
+		minx = x;
+	if (maxx < x + 1)
+		maxx = x + 1;
+	if (miny > y)
+		miny = y;
+	if (maxy < y + 1)
+		maxy = y + 1;
+	if (minz > z)
+		minz = z;
+	if (maxz < z + 1)
+		maxz = z + 1;
 }
 
-#if UNIT_TESTS==1
-void testVectors();
+void World::updateVolumeSnapshot() {
+#if	USE_VOLUME_DATA == 1
+	// cells changed since the last update are copied again, then volume is scrolled to camera position
+	Array<DirtyBox> changes;
+	if (!journal.drain(volumeJournalPosition, changes) || volumeSnapshotInvalid)
+		volumeSnapshot.valid = false;
+	for (int i = 0; i < changes.length(); i++)
+		updateCells(volumeSnapshot, changes[i].min, changes[i].max);
+	getCellsNear(camPosition.pos, volumeSnapshot);
+	volumeSnapshotInvalid = false;
+#endif
+}
 
+PoolAllocator CHUNK_POOL(sizeof(Chunk));
+PoolAllocator CHUNK_LAYER_POOL(sizeof(ChunkLayer));
+PoolAllocator CHUNK_LAYER_BUFFER_POOLS[4] = {
+	{ ChunkLayer::bufSize(1) },
+	{ ChunkLayer::bufSize(2) },
+	{ ChunkLayer::bufSize(4) },
+	{ ChunkLayer::bufSize(8) },
+};
 
-void testVectors() {
-	Vector3d v1(1, 0, 0);
-	Direction d1(1, 0, 0);
-	assert(d1.dir == EAST);
-	assert(d1.forward == Vector3d(1, 0, 0));
-	assert(d1.up == Vector3d(0, 1, 0));
-	assert(d1.down == Vector3d(0, -1, 0));
-	assert(d1.left == Vector3d(0, 0, -1));
-	assert(d1.right == Vector3d(0, 0, 1));
+static void logPoolStats(const char * name, PoolAllocator & pool) {
+	PoolStats stats = pool.stats();
+	CRLog::info("pool %s: item %d bytes, %d items in %d pages (%d KB), %d partially used pages, occupancy %d%%, fragmentation %d%%",
+		name, stats.itemSize, stats.used, stats.pages, stats.memoryUsage() / 1024, stats.partialPages,
+		(int)(stats.occupancy() * 100), (int)(stats.fragmentation() * 100));
+}
 
-	Direction d3(-1, 0, 0);
-	assert(d3.dir == WEST);
-	assert(d3.forward == Vector3d(-1, 0, 0));
-	assert(d3.up == Vector3d(0, 1, 0));
-	assert(d3.down == Vector3d(0, -1, 0));
-	assert(d3.left == Vector3d(0, 0, 1));
-	assert(d3.right == Vector3d(0, 0, -1));
+/// writes pool occupancy and fragmentation to log
+void logChunkPoolStats() {
+	logPoolStats("chunks", CHUNK_POOL);
+	logPoolStats("layers", CHUNK_LAYER_POOL);
+	logPoolStats("layer buffers 1 bit", CHUNK_LAYER_BUFFER_POOLS[0]);
+	logPoolStats("layer buffers 2 bit", CHUNK_LAYER_BUFFER_POOLS[1]);
+	logPoolStats("layer buffers 4 bit", CHUNK_LAYER_BUFFER_POOLS[2]);
+	logPoolStats("layer buffers 8 bit", CHUNK_LAYER_BUFFER_POOLS[3]);
+}
 
-	Direction d2(0, 0, -1);
-	assert(d2.dir == NORTH);
-	assert(d2.forward == Vector3d(0, 0, -1));
-	assert(d2.up == Vector3d(0, 1, 0));
-	assert(d2.down == Vector3d(0, -1, 0));
-	assert(d2.left == Vector3d(-1, 0, 0));
-	assert(d2.right == Vector3d(1, 0, 0));
+ChunkLayer::ChunkLayer(cell_t fill) : bits(1), shift(0), paletteSize(1), refCount(1) {
+	int sz = bufSize(bits);
+	buf = (unsigned char *)CHUNK_LAYER_BUFFER_POOLS[shift].alloc();
+	memset(buf, 0, sz);
+	palette()[0] = fill;
+	counts()[0] = CHUNK_DX * CHUNK_DX;
+}
 
-	Direction d4(0, 0, 1);
-	assert(d4.dir == SOUTH);
-	assert(d4.forward == Vector3d(0, 0, 1));
-	assert(d4.up == Vector3d(0, 1, 0));
-	assert(d4.down == Vector3d(0, -1, 0));
-	assert(d4.left == Vector3d(1, 0, 0));
-	assert(d4.right == Vector3d(-1, 0, 0));
+ChunkLayer::ChunkLayer(int indexBits, int indexShift, int distinct) : bits((unsigned char)indexBits), shift((unsigned char)indexShift), paletteSize((unsigned short)distinct), refCount(1) {
+	buf = (unsigned char *)CHUNK_LAYER_BUFFER_POOLS[shift].alloc();
+}
 
+/// copy of layer which is not shared
+ChunkLayer::ChunkLayer(const ChunkLayer & src) : bits(src.bits), shift(src.shift), paletteSize(src.paletteSize), refCount(1) {
+	buf = (unsigned char *)CHUNK_LAYER_BUFFER_POOLS[shift].alloc();
+	memcpy(buf, src.buf, bufSize(bits));
 }
-#endif
 
-void runWorldUnitTests() {
-#if UNIT_TESTS==1
-	testVectors();
-#endif
+/// recalculate palette entry usage counters from indexes, returns false if some index is out of palette
+bool ChunkLayer::updateCounts() {
+	unsigned short * c = counts();
+	memset(c, 0, sizeof(unsigned short) << bits);
+	for (int i = 0; i < CHUNK_DX * CHUNK_DX; i++) {
+		int index = getIndex(i);
+		if (index >= paletteSize)
+			return false;
+		c[index]++;
+	}
+	return true;
 }
 
-/// ensure that data is in range [minvalue, maxvalue]
-void TerrainGen::limit(int minvalue, int maxvalue) {
-	// find actual min/max
-	int minv, maxv;
-	minv = maxv = get(0, 0);
-	for (int y = 0; y <= dy; y++) {
-		for (int x = 0; x <= dx; x++) {
-			int v = get(x, y);
-			if (minv > v)
-				minv = v;
-			if (maxv < v)
-				maxv = v;
+/// pack palette indexes of cells, (1 << SHIFT) bits per index
+template<int SHIFT> static void packIndexes(const cell_t * cells, const short * cellIndex, unsigned char * dst) {
+	for (int i = 0; i < CHUNK_DX * CHUNK_DX; i += 8 >> SHIFT) {
+		int b = 0;
+		for (int j = 0; j < (8 >> SHIFT); j++)
+			b |= cellIndex[cells[i + j]] << (j << SHIFT);
+		*dst++ = (unsigned char)b;
+	}
+}
+
+/// layer with CHUNK_DX * CHUNK_DX cells from array (row by row); cells must not be all the same
+ChunkLayer::ChunkLayer(const cell_t * cells) : refCount(1) {
+	// palette in order of first appearance, cells are counted by runs of equal values
+	short cellIndex[256];
+	memset(cellIndex, 0xFF, sizeof(cellIndex));
+	cell_t distinct[17];
+	int runCounts[17];
+	int distinctCount = 0;
+	for (int i = 0; i < CHUNK_DX * CHUNK_DX && distinctCount <= 16; ) {
+		cell_t cell = cells[i];
+		int runStart = i++;
+		// compare 8 cells at once
+		lUInt64 pattern = 0x0101010101010101ULL * cell;
+		lUInt64 next;
+		while (i + 8 <= CHUNK_DX * CHUNK_DX && (memcpy(&next, cells + i, 8), next == pattern))
+			i += 8;
+		while (i < CHUNK_DX * CHUNK_DX && cells[i] == cell)
+			i++;
+		if (cellIndex[cell] < 0) {
+			cellIndex[cell] = (short)distinctCount;
+			runCounts[distinctCount] = 0;
+			distinct[distinctCount++] = cell;
 		}
+		runCounts[cellIndex[cell]] += i - runStart;
 	}
-	int mul = (maxvalue - minvalue);
-	int div = (maxv - minv);
-	if (div > 0) {
-		for (int y = 0; y <= dy; y++) {
-			for (int x = 0; x <= dx; x++) {
-				set(x, y, minvalue + (get(x, y) - minv) * mul / div);
-			}
+	for (shift = 0; (1 << (1 << shift)) < distinctCount && shift < 3; shift++)
+		;
+	bits = (unsigned char)(1 << shift);
+	buf = (unsigned char *)CHUNK_LAYER_BUFFER_POOLS[shift].alloc();
+	cell_t * p = palette();
+	unsigned short * c = counts();
+	if (bits == 8) {
+		// identity palette, cells are indexes
+		paletteSize = 256;
+		for (int i = 0; i < 256; i++) {
+			p[i] = (cell_t)i;
+			c[i] = 0;
 		}
+		memcpy(indexes(), cells, CHUNK_DX * CHUNK_DX);
+		for (int i = 0; i < CHUNK_DX * CHUNK_DX; i++)
+			c[cells[i]]++;
+		return;
 	}
-}
+	paletteSize = (unsigned short)distinctCount;
+	for (int i = 0; i < (1 << bits); i++) {
+		p[i] = i < distinctCount ? distinct[i] : 0;
+		c[i] = i < distinctCount ? (unsigned short)runCounts[i] : 0;
+	}
+	if (shift == 0)
+		packIndexes<0>(cells, cellIndex, indexes());
+	else if (shift == 1)
+		packIndexes<1>(cells, cellIndex, indexes());
+	else
+		packIndexes<2>(cells, cellIndex, indexes());
+}
+
+/// set all cells of rectangle [x0, x1) x [z0, z1), full rows are written with memset
+/// returns true if after this change all cells of layer have the same value
+bool ChunkLayer::fill(int x0, int z0, int x1, int z1, cell_t cell) {
+	int index = paletteIndex(cell);
+	if (index < 0) {
+		widen();
+		index = paletteIndex(cell);
+	}
+	unsigned short * c = counts();
+	// index repeated in all positions of byte
+	int pattern = index;
+	for (int b = bits; b < 8; b <<= 1)
+		pattern |= pattern << b;
+	int rowBytes = (CHUNK_DX * bits) >> 3;
+	for (int z = z0; z < z1; z++) {
+		int i0 = z << CHUNK_DX_SHIFT;
+		for (int x = x0; x < x1; x++)
+			c[getIndex(i0 + x)]--;
+		if (x0 == 0 && x1 == CHUNK_DX) {
+			memset(indexes() + z * rowBytes, pattern, rowBytes);
+		} else {
+			for (int x = x0; x < x1; x++)
+				setIndex(i0 + x, index);
+		}
+	}
+	c[index] += (unsigned short)((x1 - x0) * (z1 - z0));
+	return c[index] == CHUNK_DX * CHUNK_DX;
+}
+
+/// find or allocate palette entry for cell value, returns -1 if palette is full
+int ChunkLayer::paletteIndex(cell_t cell) {
+	if (bits == 8)
+		return cell; // identity palette
+	cell_t * p = palette();
+	unsigned short * c = counts();
+	int freeIndex = -1;
+	for (int i = 0; i < paletteSize; i++) {
+		if (p[i] == cell)
+			return i;
+		if (!c[i] && freeIndex < 0)
+			freeIndex = i;
+	}
+	if (freeIndex < 0) {
+		if (paletteSize >= (1 << bits))
+			return -1;
+		freeIndex = paletteSize++;
+	}
+	p[freeIndex] = cell;
+	return freeIndex;
+}
+
+/// increase bits per cell index: 1 -> 2 -> 4 -> 8
+void ChunkLayer::widen() {
+	int newBits = bits << 1;
+	int newShift = shift + 1;
+	int sz = bufSize(newBits);
+	unsigned char * newbuf = (unsigned char *)CHUNK_LAYER_BUFFER_POOLS[newShift].alloc();
+	memset(newbuf, 0, sz);
+	cell_t * newPalette = newbuf;
+	unsigned short * newCounts = (unsigned short*)(newbuf + (1 << newBits));
+	unsigned char * newIndexes = newbuf + (3 << newBits);
+	cell_t * oldPalette = palette();
+	unsigned short * oldCounts = counts();
+	for (int i = 0; i < CHUNK_DX * CHUNK_DX; i++) {
+		int index = getIndex(i);
+		if (newBits == 8)
+			index = oldPalette[index];
+		int bitpos = i << newShift;
+		newIndexes[bitpos >> 3] |= (unsigned char)(index << (bitpos & 7));
+	}
+	if (newBits == 8) {
+		for (int i = 0; i < 256; i++)
+			newPalette[i] = (cell_t)i;
+		for (int i = 0; i < paletteSize; i++)
+			newCounts[oldPalette[i]] += oldCounts[i];
+		paletteSize = 256;
+	} else {
+		for (int i = 0; i < paletteSize; i++) {
+			newPalette[i] = oldPalette[i];
+			newCounts[i] = oldCounts[i];
+		}
+	}
+	CHUNK_LAYER_BUFFER_POOLS[shift].free(buf);
+	buf = newbuf;
+	bits = (unsigned char)newBits;
+	shift = (unsigned char)newShift;
+}
+
+/// number of cells of rectangle [x0, x1) x [z0, z1) which have match[cell] set
+int ChunkLayer::countCells(int x0, int z0, int x1, int z1, const bool * match) {
+	cell_t * p = palette();
+	unsigned short * c = counts();
+	int matched = 0;
+	int used = 0;
+	for (int i = 0; i < paletteSize; i++) {
+		if (c[i]) {
+			used += c[i];
+			if (match[p[i]])
+				matched += c[i];
+		}
+	}
+	if (!matched)
+		return 0;
+	if (matched == used)
+		return (x1 - x0) * (z1 - z0);
+	if (x1 - x0 == CHUNK_DX && z1 - z0 == CHUNK_DX)
+		return matched;
+	int count = 0;
+	for (int z = z0; z < z1; z++)
+		for (int x = x0; x < x1; x++)
+			if (match[get(x, z)])
+				count++;
+	return count;
+}
+
+/// property bits of CHUNK_DX cells of row z, bit x is cell x; kind is CellMaskKind
+unsigned short ChunkLayer::getRowMask(int kind, int z) {
+	cell_t * p = palette();
+	unsigned short mask = 0;
+	if (bits == 8) {
+		cell_t * row = indexes() + (z << CHUNK_DX_SHIFT);
+		for (int x = 0; x < CHUNK_DX; x++)
+			if (cellMaskFlag(kind, row[x]))
+				mask |= (unsigned short)(1 << x);
+		return mask;
+	}
+	// whole row of indexes fits into 64 bits for 1, 2, 4 bits per cell
+	int rowBytes = (CHUNK_DX * bits) >> 3;
+	unsigned char * src = indexes() + z * rowBytes;
+	lUInt64 row = 0;
+	for (int i = rowBytes - 1; i >= 0; i--)
+		row = (row << 8) | src[i];
+	// lowest bit of each index field
+	static const lUInt64 LOW_BITS[3] = { 0xFFFFULL, 0x55555555ULL, 0x1111111111111111ULL };
+	lUInt64 low = LOW_BITS[shift];
+	lUInt64 matches = 0;
+	for (int i = 0; i < paletteSize; i++) {
+		if (!counts()[i] || !cellMaskFlag(kind, p[i]))
+			continue;
+		// fields equal to i become zero; their bits are or-ed into the lowest bit of field
+		lUInt64 diff = row ^ (low * i);
+		for (int b = 1; b < bits; b <<= 1)
+			diff |= diff >> b;
+		matches |= ~diff & low;
+	}
+	// compress lowest bits of fields into 16 bits
+	if (shift == 1) {
+		matches = (matches | (matches >> 1)) & 0x33333333ULL;
+		matches = (matches | (matches >> 2)) & 0x0F0F0F0FULL;
+		matches = (matches | (matches >> 4)) & 0x00FF00FFULL;
+		matches = (matches | (matches >> 8)) & 0x0000FFFFULL;
+	} else if (shift == 2) {
+		matches = (matches | (matches >> 3)) & 0x0303030303030303ULL;
+		matches = (matches | (matches >> 6)) & 0x000F000F000F000FULL;
+		matches = (matches | (matches >> 12)) & 0x000000FF000000FFULL;
+		matches = (matches | (matches >> 24)) & 0x000000000000FFFFULL;
+	}
+	return (unsigned short)matches;
+}
+
+/// decode dx*dz rectangle starting from x, z to dst, dststride is dst row size
+void ChunkLayer::getCells(int x, int z, int dx, int dz, cell_t * dst, int dststride) {
+	if (bits == 8) {
+		// raw cells
+		cell_t * src = indexes() + (z << CHUNK_DX_SHIFT) + x;
+		for (int zz = 0; zz < dz; zz++) {
+			memcpy(dst, src, sizeof(cell_t) * dx);
+			src += CHUNK_DX;
+			dst += dststride;
+		}
+		return;
+	}
+	// whole row of indexes fits into 64 bits for 1, 2, 4 bits per cell
+	cell_t * p = palette();
+	int rowBytes = (CHUNK_DX * bits) >> 3;
+	int mask = (1 << bits) - 1;
+	unsigned char * src = indexes() + z * rowBytes;
+	for (int zz = 0; zz < dz; zz++) {
+		lUInt64 row = 0;
+		for (int i = rowBytes - 1; i >= 0; i--)
+			row = (row << 8) | src[i];
+		row >>= x << shift;
+		for (int xx = 0; xx < dx; xx++) {
+			dst[xx] = p[row & mask];
+			row >>= bits;
+		}
+		src += rowBytes;
+		dst += dststride;
+	}
+}
+
+/// memory used by columns of all chunks
+static std::atomic<int> CHUNK_COLUMN_BYTES(0);
+
+/// all columns are empty
+ChunkColumns::ChunkColumns() {
+	capacity = CHUNK_DX * CHUNK_DX;
+	runs = (Run*)malloc(sizeof(Run) * capacity);
+	CHUNK_COLUMN_BYTES += memoryUsage();
+	for (int i = 0; i < CHUNK_DX * CHUNK_DX; i++) {
+		runs[i].end = CHUNK_DY;
+		runs[i].cell = NO_CELL;
+		offsets[i] = (unsigned short)i;
+	}
+	offsets[CHUNK_DX * CHUNK_DX] = CHUNK_DX * CHUNK_DX;
+}
+
+/// columns from cells of layers 0..dy-1, index of cell is y * CHUNK_DX * CHUNK_DX + z * CHUNK_DX + x; layers above are empty
+ChunkColumns::ChunkColumns(const cell_t * cells, int dy) {
+	// run counts of columns, then runs are written layer by layer to their column positions
+	unsigned short ends[CHUNK_DX * CHUNK_DX];
+	capacity = countRuns(cells, dy, ends);
+	runs = (Run*)malloc(sizeof(Run) * capacity);
+	CHUNK_COLUMN_BYTES += memoryUsage();
+	offsets[0] = 0;
+	for (int i = 0; i < CHUNK_DX * CHUNK_DX; i++) {
+		offsets[i + 1] = (unsigned short)(offsets[i] + ends[i]);
+		ends[i] = offsets[i];
+	}
+	for (int y = 1; y <= dy; y++) {
+		const cell_t * below = cells + (y - 1) * CHUNK_DX * CHUNK_DX;
+		const cell_t * p = cells + y * CHUNK_DX * CHUNK_DX;
+		if (y < dy && !memcmp(p, below, CHUNK_DX * CHUNK_DX))
+			continue;
+		for (int i = 0; i < CHUNK_DX * CHUNK_DX; i++) {
+			cell_t cell = y < dy ? p[i] : NO_CELL;
+			if (cell != below[i]) {
+				Run & run = runs[ends[i]++];
+				run.end = (unsigned char)y;
+				run.cell = below[i];
+			}
+		}
+	}
+	for (int i = 0; i < CHUNK_DX * CHUNK_DX; i++) {
+		Run & run = runs[ends[i]];
+		run.end = CHUNK_DY;
+		run.cell = NO_CELL;
+	}
+}
+
+ChunkColumns::ChunkColumns(const ChunkColumns & src) {
+	capacity = src.offsets[CHUNK_DX * CHUNK_DX];
+	runs = (Run*)malloc(sizeof(Run) * capacity);
+	memcpy(runs, src.runs, sizeof(Run) * capacity);
+	memcpy(offsets, src.offsets, sizeof(offsets));
+	CHUNK_COLUMN_BYTES += memoryUsage();
+}
+
+ChunkColumns::~ChunkColumns() {
+	CHUNK_COLUMN_BYTES -= memoryUsage();
+	::free(runs);
+}
+
+/// memory used by columns of all chunks, in bytes
+int ChunkColumns::totalMemoryUsage() {
+	return CHUNK_COLUMN_BYTES.load();
+}
+
+/// number of runs in cells of layers 0..dy-1 (layout is the same as for constructor); counts of columns are put to columnRuns
+int ChunkColumns::countRuns(const cell_t * cells, int dy, unsigned short * columnRuns) {
+	for (int i = 0; i < CHUNK_DX * CHUNK_DX; i++)
+		columnRuns[i] = 1;
+	int n = CHUNK_DX * CHUNK_DX;
+	for (int y = 1; y <= dy; y++) {
+		const cell_t * below = cells + (y - 1) * CHUNK_DX * CHUNK_DX;
+		const cell_t * p = cells + y * CHUNK_DX * CHUNK_DX;
+		if (y < dy && !memcmp(p, below, CHUNK_DX * CHUNK_DX))
+			continue;
+		for (int i = 0; i < CHUNK_DX * CHUNK_DX; i++) {
+			if ((y < dy ? p[i] : NO_CELL) != below[i]) {
+				columnRuns[i]++;
+				n++;
+			}
+		}
+	}
+	return n;
+}
+
+/// replace runs of column i with count runs from src
+void ChunkColumns::replaceColumn(int i, const Run * src, int count) {
+	int total = offsets[CHUNK_DX * CHUNK_DX];
+	int delta = count - (offsets[i + 1] - offsets[i]);
+	if (total + delta > capacity) {
+		int oldUsage = memoryUsage();
+		capacity = (total + delta) + ((total + delta) >> 2);
+		runs = (Run*)realloc(runs, sizeof(Run) * capacity);
+		CHUNK_COLUMN_BYTES += memoryUsage() - oldUsage;
+	}
+	if (delta)
+		memmove(runs + offsets[i + 1] + delta, runs + offsets[i + 1], sizeof(Run) * (total - offsets[i + 1]));
+	memcpy(runs + offsets[i], src, sizeof(Run) * count);
+	for (int j = i + 1; j <= CHUNK_DX * CHUNK_DX; j++)
+		offsets[j] = (unsigned short)(offsets[j] + delta);
+}
+
+/// set cells y0 <= y < y1 of column x, z
+void ChunkColumns::fill(int x, int z, int y0, int y1, cell_t cell) {
+	int i = (z << CHUNK_DX_SHIFT) + x;
+	// column is unpacked, changed and packed again
+	cell_t cells[CHUNK_DY];
+	int y = 0;
+	for (int j = offsets[i]; j < offsets[i + 1]; j++) {
+		memset(cells + y, runs[j].cell, runs[j].end - y);
+		y = runs[j].end;
+	}
+	memset(cells + y0, cell, y1 - y0);
+	Run column[CHUNK_DY];
+	int n = 0;
+	for (y = 1; y <= CHUNK_DY; y++) {
+		if (y == CHUNK_DY || cells[y] != cells[y - 1]) {
+			column[n].end = (unsigned char)y;
+			column[n].cell = cells[y - 1];
+			n++;
+		}
+	}
+	replaceColumn(i, column, n);
+}
+
+/// decode dx*dz rectangle of layer y starting from x, z to dst, dststride is dst row size
+void ChunkColumns::getCells(int x, int y, int z, int dx, int dz, cell_t * dst, int dststride) {
+	for (int zz = 0; zz < dz; zz++) {
+		for (int xx = 0; xx < dx; xx++)
+			dst[xx] = get(x + xx, y, z + zz);
+		dst += dststride;
+	}
+}
+
+/// memory used by block entities of all chunks
+static std::atomic<int> CHUNK_ENTITY_BYTES(0);
+
+ChunkEntities::ChunkEntities() : items(NULL), byType(NULL), count(0), capacity(0), dataBytes(0) {
+	CHUNK_ENTITY_BYTES += memoryUsage();
+}
+
+ChunkEntities::ChunkEntities(const ChunkEntities & src) : count(src.count), capacity(src.count), dataBytes(src.dataBytes) {
+	items = (Entity*)malloc(sizeof(Entity) * capacity);
+	byType = (unsigned int*)malloc(sizeof(unsigned int) * capacity);
+	memcpy(byType, src.byType, sizeof(unsigned int) * count);
+	for (int i = 0; i < count; i++) {
+		items[i] = src.items[i];
+		if (items[i].size) {
+			items[i].data = (unsigned char*)malloc(items[i].size);
+			memcpy(items[i].data, src.items[i].data, items[i].size);
+		}
+	}
+	CHUNK_ENTITY_BYTES += memoryUsage();
+}
+
+ChunkEntities::~ChunkEntities() {
+	CHUNK_ENTITY_BYTES -= memoryUsage();
+	for (int i = 0; i < count; i++)
+		free(items[i].data);
+	free(items);
+	free(byType);
+}
+
+/// position of entity of cell index in items, or -(insert position) - 1
+int ChunkEntities::find(int index) {
+	int a = 0;
+	int b = count;
+	while (a < b) {
+		int m = (a + b) >> 1;
+		if (items[m].index < index)
+			a = m + 1;
+		else
+			b = m;
+	}
+	return a < count && items[a].index == index ? a : -a - 1;
+}
+
+/// position of key in byType, or -(insert position) - 1
+int ChunkEntities::findKey(unsigned int key) {
+	int a = 0;
+	int b = count;
+	while (a < b) {
+		int m = (a + b) >> 1;
+		if (byType[m] < key)
+			a = m + 1;
+		else
+			b = m;
+	}
+	return a < count && byType[a] == key ? a : -a - 1;
+}
+
+/// put entity to cell, replacing old one; data is copied
+void ChunkEntities::set(int index, int type, const unsigned char * data, int size) {
+	int oldUsage = memoryUsage();
+	int i = find(index);
+	if (i >= 0) {
+		// replace: type may change, so key is moved
+		Entity & e = items[i];
+		int k = findKey(((unsigned int)e.type << 16) | e.index);
+		memmove(byType + k, byType + k + 1, sizeof(unsigned int) * (count - k - 1));
+		free(e.data);
+		dataBytes -= e.size;
+		count--;
+	} else {
+		if (count >= capacity) {
+			capacity = capacity ? capacity * 2 : 4;
+			items = (Entity*)realloc(items, sizeof(Entity) * capacity);
+			byType = (unsigned int*)realloc(byType, sizeof(unsigned int) * capacity);
+		}
+		i = -i - 1;
+		memmove(items + i + 1, items + i, sizeof(Entity) * (count - i));
+	}
+	Entity & e = items[i];
+	e.index = (unsigned short)index;
+	e.type = (unsigned short)type;
+	e.size = size;
+	e.data = NULL;
+	if (size) {
+		e.data = (unsigned char*)malloc(size);
+		memcpy(e.data, data, size);
+	}
+	unsigned int key = ((unsigned int)e.type << 16) | e.index;
+	int k = -findKey(key) - 1;
+	memmove(byType + k + 1, byType + k, sizeof(unsigned int) * (count - k));
+	byType[k] = key;
+	count++;
+	dataBytes += size;
+	CHUNK_ENTITY_BYTES += memoryUsage() - oldUsage;
+}
+
+/// returns false if cell has no entity
+bool ChunkEntities::remove(int index) {
+	int i = find(index);
+	if (i < 0)
+		return false;
+	Entity & e = items[i];
+	int k = findKey(((unsigned int)e.type << 16) | e.index);
+	memmove(byType + k, byType + k + 1, sizeof(unsigned int) * (count - k - 1));
+	free(e.data);
+	dataBytes -= e.size;
+	CHUNK_ENTITY_BYTES -= e.size;
+	memmove(items + i, items + i + 1, sizeof(Entity) * (count - i - 1));
+	count--;
+	return true;
+}
+
+/// append cell indexes of entities of type (ascending) to out; returns number of found entities
+int ChunkEntities::findByType(int type, IntArray & out) {
+	unsigned int key = (unsigned int)type << 16;
+	int k = findKey(key);
+	if (k < 0)
+		k = -k - 1;
+	int start = k;
+	for (; k < count && (byType[k] >> 16) == (unsigned int)type; k++)
+		out.append(byType[k] & 0xFFFF);
+	return k - start;
+}
+
+/// memory used by block entities of all chunks, in bytes
+int ChunkEntities::totalMemoryUsage() {
+	return CHUNK_ENTITY_BYTES.load();
+}
+
+/// attach entity to cell, replacing old one; data is copied; cell is not changed
+void Chunk::setEntity(int x, int y, int z, int type, const unsigned char * data, int size) {
+	if (!entities)
+		entities = new ChunkEntities();
+	entities->set(ChunkEntities::cellIndex(x, y, z), type, data, size);
+	dirty = true;
+}
+
+/// returns false if cell has no entity; storage is freed with the last entity
+bool Chunk::removeEntity(int x, int y, int z) {
+	if (!entities || !entities->remove(ChunkEntities::cellIndex(x, y, z)))
+		return false;
+	if (!entities->length()) {
+		delete entities;
+		entities = NULL;
+	}
+	dirty = true;
+	return true;
+}
+
+/// cell value of this chunk for global block id; alias cell is assigned to large block id on first use
+cell_t Chunk::blockCell(block_id_t id) {
+	if (id < BLOCK_ID_DIRECT)
+		return ::blockCell(id);
+	BlockDef * def = BLOCK_DEFS_BY_ID[id];
+	if (!def)
+		return NO_CELL;
+	if (blockIds) {
+		for (int i = 0; i < BLOCK_ID_DIRECT; i++)
+			if (blockIds[i] == id)
+				return (cell_t)i;
+	} else {
+		allocBlockIds();
+	}
+	// cell values used by chunk are not available; block ids of alias cells which are not used anymore are dropped
+	bool used[256];
+	memset(used, 0, sizeof(used));
+	getUsedCells(used);
+	for (int i = 0; i < 256; i++)
+		if (!used[i])
+			blockIds[i] = 0;
+	cell_t cell = blockAliasCell(def, used);
+	if (cell == NO_CELL) {
+		CRLog::error("No free cell value for block type %d %s", def->id, def->name);
+		return NO_CELL;
+	}
+	blockIds[cell] = id;
+	return cell;
+}
+
+/// set used[cell] for each cell value which occurs in chunk
+void Chunk::getUsedCells(bool * used) {
+	decompress();
+	if (columns) {
+		for (int z = 0; z < CHUNK_DX; z++) {
+			for (int x = 0; x < CHUNK_DX; x++) {
+				int count;
+				const ChunkColumns::Run * runs = columns->getColumn(x, z, count);
+				for (int i = 0; i < count; i++)
+					used[runs[i].cell] = true;
+			}
+		}
+		return;
+	}
+	for (int y = 0; y < CHUNK_DY; y++) {
+		if (layers[y])
+			layers[y]->getUsedCells(used);
+		else
+			used[uniform[y]] = true;
+	}
+}
+
+/// guards decompression, which may happen on any thread reading compressed chunk
+static std::mutex CHUNK_DECOMPRESS_MUTEX;
+/// memory used by compressed data of all chunks
+static std::atomic<int> CHUNK_COMPRESSED_BYTES(0);
+/// memory used by block ids of alias cells of all chunks
+static std::atomic<int> CHUNK_BLOCK_ID_BYTES(0);
+
+/// allocate empty block ids of alias cells
+void Chunk::allocBlockIds() {
+	blockIds = (block_id_t *)calloc(256, sizeof(block_id_t));
+	CHUNK_BLOCK_ID_BYTES += 256 * sizeof(block_id_t);
+}
+
+/// memory used by block ids of alias cells of all chunks, in bytes
+int Chunk::blockIdsMemoryUsage() {
+	return CHUNK_BLOCK_ID_BYTES.load();
+}
+
+/// copy of chunk which shares all layers with source; layers are copied on write, columns and block entities are copied
+/// compressed source is decompressed first
+Chunk::Chunk(const Chunk & src) : columns(NULL), edits(src.edits), lastAccess(src.lastAccess.load(std::memory_order_relaxed))
+	, refCount(1), dirty(src.dirty), version(src.version), compressed(NULL), compressedSize(0), compressedColumns(false)
+	, entities(src.entities ? new ChunkEntities(*src.entities) : NULL), blockIds(NULL) {
+	const_cast<Chunk &>(src).decompress();
+	if (src.blockIds) {
+		allocBlockIds();
+		memcpy(blockIds, src.blockIds, 256 * sizeof(block_id_t));
+	}
+	for (int i = 0; i < 4; i++)
+		neighbours[i] = NULL;
+	bottomLayer = src.bottomLayer;
+	topLayer = src.topLayer;
+	if (src.columns)
+		columns = new ChunkColumns(*src.columns);
+	for (int i = 0; i < CHUNK_DY; i++) {
+		layers[i] = src.layers[i];
+		if (layers[i])
+			layers[i]->retain();
+	}
+	memcpy(uniform, src.uniform, sizeof(uniform));
+	memcpy(sectionVersions, src.sectionVersions, sizeof(sectionVersions));
+	memcpy(opaqueHeight, src.opaqueHeight, sizeof(opaqueHeight));
+	memcpy(nonEmptyHeight, src.nonEmptyHeight, sizeof(nonEmptyHeight));
+}
+
+Chunk::~Chunk() {
+	for (int i = 0; i < CHUNK_DY; i++)
+		if (layers[i])
+			layers[i]->release();
+	delete columns;
+	delete entities;
+	if (blockIds) {
+		CHUNK_BLOCK_ID_BYTES -= 256 * sizeof(block_id_t);
+		free(blockIds);
+	}
+	unsigned char * data = compressed.load(std::memory_order_relaxed);
+	if (data) {
+		free(data);
+		CHUNK_COMPRESSED_BYTES -= compressedSize;
+	}
+}
+
+/// replace layers or columns with data encoded by ChunkCodec::encodeCells(); chunk takes ownership of malloc'ed data
+void Chunk::compress(unsigned char * data, int size) {
+	if (isCompressed()) {
+		free(data);
+		return;
+	}
+	compressedColumns = columns != NULL;
+	delete columns;
+	columns = NULL;
+	for (int i = 0; i < CHUNK_DY; i++) {
+		if (layers[i]) {
+			layers[i]->release();
+			layers[i] = NULL;
+		}
+	}
+	compressedSize = size;
+	CHUNK_COMPRESSED_BYTES += size;
+	compressed.store(data, std::memory_order_release);
+}
+
+/// decode compressed cells back to layers (or columns); does nothing if chunk is not compressed; thread safe
+void Chunk::decompress() {
+	if (!isCompressed())
+		return;
+	std::lock_guard<std::mutex> lock(CHUNK_DECOMPRESS_MUTEX);
+	unsigned char * data = compressed.load(std::memory_order_relaxed);
+	if (!data)
+		return; // already decompressed by another thread
+	// version, heightmap and edit counter are kept while chunk is compressed
+	bottomLayer = topLayer = -1;
+	if (!ChunkCodec::decodeLayers(data, compressedSize, this))
+		CRLog::error("cannot decompress chunk");
+	if (compressedColumns)
+		setStorage(CHUNK_STORAGE_COLUMNS);
+	free(data);
+	CHUNK_COMPRESSED_BYTES -= compressedSize;
+	compressedSize = 0;
+	compressed.store(NULL, std::memory_order_release);
+}
+
+/// append compressed data to buf; returns false if chunk is not compressed
+bool Chunk::getCompressedData(Array<unsigned char> & buf) {
+	if (!isCompressed())
+		return false;
+	std::lock_guard<std::mutex> lock(CHUNK_DECOMPRESS_MUTEX);
+	unsigned char * data = compressed.load(std::memory_order_relaxed);
+	if (!data)
+		return false;
+	memcpy(buf.append(0, compressedSize), data, compressedSize);
+	return true;
+}
+
+/// compressed data + sizeof(Chunk) under lock, or -1 if chunk is not compressed anymore
+int Chunk::compressedMemoryUsage() {
+	std::lock_guard<std::mutex> lock(CHUNK_DECOMPRESS_MUTEX);
+	if (!compressed.load(std::memory_order_relaxed))
+		return -1;
+	return sizeof(Chunk) + compressedSize;
+}
+
+/// memory used by compressed data of all chunks, in bytes
+int Chunk::compressedDataUsage() {
+	return CHUNK_COMPRESSED_BYTES.load();
+}
+
+/// set cells of box [x0, x1) x [y0, y1) x [z0, z1), in chunk coordinates
+void Chunk::fill(int x0, int y0, int z0, int x1, int y1, int z1, cell_t cell) {
+	bool wholeLayer = x0 == 0 && z0 == 0 && x1 == CHUNK_DX && z1 == CHUNK_DX;
+	dirty = true;
+	changed(y0, y1);
+	if (edits < 0xFFFF)
+		edits++;
+	if (columns) {
+		for (int z = z0; z < z1; z++)
+			for (int x = x0; x < x1; x++)
+				columns->fill(x, z, y0, y1, cell);
+		if (cell != NO_CELL) {
+			updateLayerBounds(y0);
+			updateLayerBounds(y1 - 1);
+		}
+		for (int z = z0; z < z1; z++)
+			for (int x = x0; x < x1; x++)
+				updateHeight(x, z, y0, y1, cell);
+		columnsEdited();
+		return;
+	}
+	for (int y = y0; y < y1; y++) {
+		ChunkLayer * layer = layers[y];
+		if (wholeLayer || (!layer && uniform[y] == cell)) {
+			if (layer) {
+				layer->release();
+				layers[y] = NULL;
+			}
+			uniform[y] = cell;
+			if (cell != NO_CELL)
+				updateLayerBounds(y);
+			continue;
+		}
+		if (!layer) {
+			// split uniform layer
+			layer = new ChunkLayer(uniform[y]);
+			layers[y] = layer;
+			updateLayerBounds(y);
+		} else if (layer->isShared()) {
+			layer = unshareLayer(y);
+		}
+		if (layer->fill(x0, z0, x1, z1, cell)) {
+			// all cells are the same again: merge
+			uniform[y] = cell;
+			layers[y] = NULL;
+			layer->release();
+		}
+	}
+	for (int z = z0; z < z1; z++)
+		for (int x = x0; x < x1; x++)
+			updateHeight(x, z, y0, y1, cell);
+}
+
+/// number of cells of box [x0, x1) x [y0, y1) x [z0, z1) (chunk coordinates) which have match[cell] set
+int Chunk::countCells(int x0, int y0, int z0, int x1, int y1, int z1, const bool * match) {
+	int count = 0;
+	if (columns) {
+		for (int z = z0; z < z1; z++) {
+			for (int x = x0; x < x1; x++) {
+				int runCount;
+				const ChunkColumns::Run * runs = columns->getColumn(x, z, runCount);
+				int start = 0;
+				for (int i = 0; i < runCount && start < y1; i++) {
+					int end = runs[i].end;
+					if (end > y0 && match[runs[i].cell])
+						count += (end < y1 ? end : y1) - (start > y0 ? start : y0);
+					start = end;
+				}
+			}
+		}
+		return count;
+	}
+	int area = (x1 - x0) * (z1 - z0);
+	for (int y = y0; y < y1; y++) {
+		ChunkLayer * layer = layers[y];
+		if (layer)
+			count += layer->countCells(x0, z0, x1, z1, match);
+		else if (match[uniform[y]])
+			count += area;
+	}
+	return count;
+}
+
+/// decode all cells of layer to array of CHUNK_DX * CHUNK_DX cells
+void Chunk::getLayerCells(int y, cell_t * dst) {
+	if (columns)
+		columns->getCells(0, y, 0, CHUNK_DX, CHUNK_DX, dst, CHUNK_DX);
+	else if (layers[y])
+		layers[y]->getCells(0, 0, CHUNK_DX, CHUNK_DX, dst, CHUNK_DX);
+	else
+		memset(dst, uniform[y], CHUNK_DX * CHUNK_DX);
+}
+
+/// replace all cells of layer with array of CHUNK_DX * CHUNK_DX cells
+/// column storage is converted to layers, as whole layers are replaced usually in bulk
+void Chunk::setLayerCells(int y, const cell_t * cells, bool updateHeightmap) {
+	dirty = true;
+	changed(y, y + 1);
+	if (columns)
+		setStorage(CHUNK_STORAGE_LAYERS);
+	storeLayerCells(y, cells);
+	if (updateHeightmap) {
+		for (int i = 0; i < CHUNK_DX * CHUNK_DX; i++)
+			updateHeight(i & CHUNK_DX_MASK, i >> CHUNK_DX_SHIFT, y, y + 1, cells[i]);
+	}
+}
+
+/// replace layer cells, without version and heightmap update
+void Chunk::storeLayerCells(int y, const cell_t * cells) {
+	if (layers[y]) {
+		layers[y]->release();
+		layers[y] = NULL;
+	}
+	int i = 1;
+	while (i < CHUNK_DX * CHUNK_DX && cells[i] == cells[0])
+		i++;
+	if (i == CHUNK_DX * CHUNK_DX) {
+		uniform[y] = cells[0];
+		if (cells[0] != NO_CELL)
+			updateLayerBounds(y);
+	} else {
+		layers[y] = new ChunkLayer(cells);
+		updateLayerBounds(y);
+	}
+}
+
+/// set() for chunk with column storage
+void Chunk::setColumnCell(int x, int y, int z, cell_t cell) {
+	if (columns->get(x, y, z) == cell)
+		return;
+	columns->fill(x, z, y, y + 1, cell);
+	if (cell != NO_CELL)
+		updateLayerBounds(y);
+	updateHeight(x, z, y, y + 1, cell);
+	version++;
+	sectionVersions[y >> CHUNK_SECTION_SHIFT] = version;
+	if (edits < 0xFFFF)
+		edits++;
+	columnsEdited();
+}
+
+/// count edit of chunk with column storage; it's converted to layers when edited too often or too fragmented
+void Chunk::columnsEdited() {
+	if (edits > COLUMN_STORAGE_MAX_EDITS || columns->runCount() > COLUMN_STORAGE_MAX_RUNS)
+		setStorage(CHUNK_STORAGE_LAYERS);
+}
+
+/// getRowMask() for chunk with column storage: masks are not stored, row is decoded
+unsigned short Chunk::getColumnRowMask(int kind, int y, int z) {
+	unsigned short mask = 0;
+	bool empty = cellMaskFlag(kind, NO_CELL);
+	const unsigned char * heights = nonEmptyHeight + (z << CHUNK_DX_SHIFT);
+	for (int x = 0; x < CHUNK_DX; x++) {
+		// no search for cells above heightmap
+		if (y >= heights[x] ? empty : cellMaskFlag(kind, columns->get(x, y, z)))
+			mask |= (unsigned short)(1 << x);
+	}
+	return mask;
+}
+
+/// returns true if all cells of layer have the same value (layer is not allocated)
+bool Chunk::isUniformLayer(int y) {
+	y &= CHUNK_DY_MASK;
+	if (!columns)
+		return layers[y] == NULL;
+	cell_t cell = columns->get(0, y, 0);
+	for (int z = 0; z < CHUNK_DX; z++)
+		for (int x = 0; x < CHUNK_DX; x++)
+			if (columns->get(x, y, z) != cell)
+				return false;
+	return true;
+}
+
+/// convert cells to another storage; cells and version are not changed
+void Chunk::setStorage(ChunkStorage storage) {
+	if (storage == getStorage())
+		return;
+	if (storage == CHUNK_STORAGE_LAYERS) {
+		ChunkColumns * src = columns;
+		columns = NULL;
+		cell_t cells[CHUNK_DX * CHUNK_DX];
+		for (int y = 0; y < CHUNK_DY; y++) {
+			src->getCells(0, y, 0, CHUNK_DX, CHUNK_DX, cells, CHUNK_DX);
+			storeLayerCells(y, cells);
+		}
+		delete src;
+		return;
+	}
+	// layers above the top layer are empty
+	int dy = topLayer + 1;
+	cell_t * cells = (cell_t*)malloc(CHUNK_DX * CHUNK_DX * CHUNK_DY);
+	for (int y = 0; y < dy; y++)
+		getLayerCells(y, cells + y * CHUNK_DX * CHUNK_DX);
+	columns = new ChunkColumns(cells, dy);
+	free(cells);
+	for (int y = 0; y < CHUNK_DY; y++) {
+		if (layers[y]) {
+			layers[y]->release();
+			layers[y] = NULL;
+		}
+		uniform[y] = NO_CELL;
+	}
+}
+
+/// switch to column storage if chunk is rarely edited and columns take less memory than layers
+void Chunk::optimizeStorage() {
+	if (columns || edits > COLUMN_STORAGE_MAX_EDITS)
+		return;
+	if (!layerCount())
+		return; // uniform layers take no memory
+	int layersMemory = memoryUsage() - sizeof(Chunk);
+	if (layersMemory <= ChunkColumns::memoryUsage(CHUNK_DX * CHUNK_DX))
+		return; // columns cannot be smaller
+	int dy = topLayer + 1;
+	cell_t * cells = (cell_t*)malloc(CHUNK_DX * CHUNK_DX * CHUNK_DY);
+	for (int y = 0; y < dy; y++)
+		getLayerCells(y, cells + y * CHUNK_DX * CHUNK_DX);
+	unsigned short columnRuns[CHUNK_DX * CHUNK_DX];
+	int runCount = ChunkColumns::countRuns(cells, dy, columnRuns);
+	if (runCount <= COLUMN_STORAGE_MAX_RUNS && ChunkColumns::memoryUsage(runCount) < layersMemory) {
+		columns = new ChunkColumns(cells, dy);
+		for (int y = 0; y < CHUNK_DY; y++) {
+			if (layers[y]) {
+				layers[y]->release();
+				layers[y] = NULL;
+			}
+			uniform[y] = NO_CELL;
+		}
+	}
+	free(cells);
+}
+
+/// y + 1 of topmost opaque (or non-empty) cell of column below y, 0 if there is no such cell
+int Chunk::scanHeight(int x, int z, int y, bool opaque) {
+	if (y > topLayer + 1)
+		y = topLayer + 1;
+	for (int yy = y - 1; yy >= 0 && yy >= bottomLayer; yy--) {
+		cell_t cell = get(x, yy, z);
+		if (opaque ? isOpaqueCell(cell) : cell != NO_CELL)
+			return yy + 1;
+	}
+	return 0;
+}
+
+/// max non-empty height of columns in rectangle x..x+dx-1, z..z+dz-1
+int Chunk::getMaxNonEmptyHeight(int x, int z, int dx, int dz) {
+	int res = 0;
+	for (int zz = z; zz < z + dz; zz++) {
+		unsigned char * row = nonEmptyHeight + (zz << CHUNK_DX_SHIFT);
+		for (int xx = x; xx < x + dx; xx++)
+			if (res < row[xx])
+				res = row[xx];
+	}
+	return res;
+}
+
+/// recalculate whole heightmap from cells: layers are decoded from top down to the layer where all columns are resolved
+void Chunk::updateHeights() {
+	memset(opaqueHeight, 0, sizeof(opaqueHeight));
+	memset(nonEmptyHeight, 0, sizeof(nonEmptyHeight));
+	int unresolvedOpaque = CHUNK_DX * CHUNK_DX;
+	int unresolvedNonEmpty = CHUNK_DX * CHUNK_DX;
+	if (columns) {
+		// the topmost non-empty and opaque runs of each column
+		for (int i = 0; i < CHUNK_DX * CHUNK_DX; i++) {
+			int count;
+			const ChunkColumns::Run * runs = columns->getColumn(i & CHUNK_DX_MASK, i >> CHUNK_DX_SHIFT, count);
+			for (int j = count - 1; j >= 0 && !opaqueHeight[i]; j--) {
+				if (!nonEmptyHeight[i] && runs[j].cell != NO_CELL)
+					nonEmptyHeight[i] = runs[j].end;
+				if (isOpaqueCell(runs[j].cell))
+					opaqueHeight[i] = runs[j].end;
+			}
+		}
+		return;
+	}
+	cell_t cells[CHUNK_DX * CHUNK_DX];
+	for (int y = topLayer; y >= 0 && y >= bottomLayer && (unresolvedOpaque || unresolvedNonEmpty); y--) {
+		ChunkLayer * layer = layers[y];
+		if (layer)
+			layer->getCells(0, 0, CHUNK_DX, CHUNK_DX, cells, CHUNK_DX);
+		else if (uniform[y] != NO_CELL)
+			memset(cells, uniform[y], sizeof(cells));
+		else
+			continue;
+		for (int i = 0; i < CHUNK_DX * CHUNK_DX; i++) {
+			cell_t cell = cells[i];
+			if (cell == NO_CELL)
+				continue;
+			if (!nonEmptyHeight[i]) {
+				nonEmptyHeight[i] = y + 1;
+				unresolvedNonEmpty--;
+			}
+			if (!opaqueHeight[i] && isOpaqueCell(cell)) {
+				opaqueHeight[i] = y + 1;
+				unresolvedOpaque--;
+			}
+		}
+	}
+}
+
+WorldEditBuilder::~WorldEditBuilder() {
+	flush();
+	for (int i = 0; i < freeEdits.length(); i++)
+		free(freeEdits[i]);
+}
+
+WorldEditBuilder::ChunkEdit * WorldEditBuilder::getEdit(int chunkx, int chunky, int chunkz) {
+	if (lastEdit && lastEdit->x == chunkx && lastEdit->y == chunky && lastEdit->z == chunkz)
+		return lastEdit;
+	// keys are searched in separate compact array: edits are too big to be walked through
+	lUInt64 key = ChunkMatrix::makeKey(chunkx, chunky, chunkz);
+	for (int i = editKeys.length() - 1; i >= 0; i--) {
+		if (editKeys[i] == key) {
+			lastEdit = edits[i];
+			return lastEdit;
+		}
+	}
+	if (edits.length() >= MAX_CHUNKS)
+		flush();
+	ChunkEdit * edit = freeEdits.length() ? freeEdits.removeLast() : (ChunkEdit *)malloc(sizeof(ChunkEdit));
+	edit->x = chunkx;
+	edit->y = chunky;
+	edit->z = chunkz;
+	memset(edit->unpacked, 0, sizeof(edit->unpacked));
+	edits.append(edit);
+	editKeys.append(key);
+	lastEdit = edit;
+	return edit;
+}
+
+/// all unpacked layers of edit are NO_CELL
+bool WorldEditBuilder::isEmptyEdit(ChunkEdit * edit) {
+	for (int y = 0; y < CHUNK_DY; y++) {
+		if (!edit->unpacked[y])
+			continue;
+		for (int i = 0; i < CHUNK_DX * CHUNK_DX; i++)
+			if (edit->cells[y][i] != NO_CELL)
+				return false;
+	}
+	return true;
+}
+
+/// unpacked cells of layer
+cell_t * WorldEditBuilder::getLayer(ChunkEdit * edit, int y) {
+	cell_t * cells = edit->cells[y];
+	if (!edit->unpacked[y]) {
+		Chunk * chunk = world->getChunks().get(edit->x, edit->y, edit->z);
+		if (chunk)
+			chunk->getLayerCells(y, cells);
+		else
+			memset(cells, NO_CELL, CHUNK_DX * CHUNK_DX);
+		edit->unpacked[y] = true;
+	}
+	return cells;
+}
+
+void WorldEditBuilder::setCell(int x, int y, int z, cell_t value) {
+	if (y < world->getChunks().bottom())
+		return;
+	ChunkEdit * edit = getEdit(x >> CHUNK_DX_SHIFT, y >> CHUNK_DY_SHIFT, z >> CHUNK_DX_SHIFT);
+	getLayer(edit, y & CHUNK_DY_MASK)[((z & CHUNK_DX_MASK) << CHUNK_DX_SHIFT) + (x & CHUNK_DX_MASK)] = value;
+}
+
+/// set cells y0 <= y < y1 of column x, z
+void WorldEditBuilder::setColumn(int x, int z, int y0, int y1, cell_t value) {
+	if (y0 < world->getChunks().bottom())
+		y0 = world->getChunks().bottom();
+	int offset = ((z & CHUNK_DX_MASK) << CHUNK_DX_SHIFT) + (x & CHUNK_DX_MASK);
+	for (int y = y0; y < y1;) {
+		ChunkEdit * edit = getEdit(x >> CHUNK_DX_SHIFT, y >> CHUNK_DY_SHIFT, z >> CHUNK_DX_SHIFT);
+		// up to the end of chunk
+		int end = ((y >> CHUNK_DY_SHIFT) + 1) * CHUNK_DY;
+		if (end > y1)
+			end = y1;
+		for (; y < end; y++)
+			getLayer(edit, y & CHUNK_DY_MASK)[offset] = value;
+	}
+}
+
+/// set all cells of box min <= v < max
+void WorldEditBuilder::fillBox(Vector3d min, Vector3d max, cell_t value) {
+	if (min.y < world->getChunks().bottom())
+		min.y = world->getChunks().bottom();
+	if (min.x >= max.x || min.y >= max.y || min.z >= max.z)
+		return;
+	for (int chunky = min.y >> CHUNK_DY_SHIFT; chunky <= (max.y - 1) >> CHUNK_DY_SHIFT; chunky++) {
+		int y0 = chunky * CHUNK_DY;
+		int ystart = min.y > y0 ? min.y - y0 : 0;
+		int yend = max.y < y0 + CHUNK_DY ? max.y - y0 : CHUNK_DY;
+		for (int chunkz = min.z >> CHUNK_DX_SHIFT; chunkz <= (max.z - 1) >> CHUNK_DX_SHIFT; chunkz++) {
+			int z0 = chunkz * CHUNK_DX;
+			int zstart = min.z > z0 ? min.z - z0 : 0;
+			int zend = max.z < z0 + CHUNK_DX ? max.z - z0 : CHUNK_DX;
+			for (int chunkx = min.x >> CHUNK_DX_SHIFT; chunkx <= (max.x - 1) >> CHUNK_DX_SHIFT; chunkx++) {
+				int x0 = chunkx * CHUNK_DX;
+				int xstart = min.x > x0 ? min.x - x0 : 0;
+				int xend = max.x < x0 + CHUNK_DX ? max.x - x0 : CHUNK_DX;
+				ChunkEdit * edit = getEdit(chunkx, chunky, chunkz);
+				for (int y = ystart; y < yend; y++) {
+					cell_t * cells = getLayer(edit, y);
+					for (int z = zstart; z < zend; z++)
+						memset(cells + (z << CHUNK_DX_SHIFT) + xstart, value, xend - xstart);
+				}
+			}
+		}
+	}
+}
+
+/// write all pending changes to world
+void WorldEditBuilder::flush() {
+	for (int i = 0; i < edits.length(); i++) {
+		ChunkEdit * edit = edits[i];
+		if (isEmptyEdit(edit) && !world->getChunks().find(edit->x, edit->y, edit->z)) {
+			// only empty cells written to missing chunk
+			freeEdits.append(edit);
+			continue;
+		}
+		Chunk * chunk = world->getChunkForEdit(edit->x, edit->y, edit->z);
+		int y0 = CHUNK_DY;
+		int y1 = 0;
+		for (int y = 0; y < CHUNK_DY; y++) {
+			if (edit->unpacked[y]) {
+				chunk->setLayerCells(y, edit->cells[y], false);
+				if (y0 > y)
+					y0 = y;
+				y1 = y + 1;
+			}
+		}
+		chunk->updateHeights();
+		chunk->optimizeStorage();
+		if (y0 < y1)
+			world->getJournal().add(Vector3d(edit->x * CHUNK_DX, edit->y * CHUNK_DY + y0, edit->z * CHUNK_DX),
+				Vector3d((edit->x + 1) * CHUNK_DX, edit->y * CHUNK_DY + y1, (edit->z + 1) * CHUNK_DX));
+		freeEdits.append(edit);
+	}
+	edits.clear();
+	editKeys.clear();
+	lastEdit = NULL;
+}
+
+void Chunk::getCells(Vector3d srcpos, Vector3d dstpos, Vector3d size, VolumeData & buf) {
+	//CRLog::trace("getCells src=%d,%d,%d  dst=%d,%d,%d  sz=%d,%d,%d", srcpos.x, srcpos.y, srcpos.z
+	//	, dstpos.x, dstpos.y, dstpos.z
+	//	, size.x, size.y, size.z
+	//	);
+	// layers above heightmap are empty, and buffer is already cleared with NO_CELL
+	int top = getMaxNonEmptyHeight(srcpos.x, srcpos.z, size.x, size.z);
+#if VOLUME_DATA_MORTON == 1
+	// volume rows are not contiguous: decode layer into temporary buffer
+	cell_t cells[CHUNK_DX * CHUNK_DX];
+#endif
+	for (int y = 0; y < size.y; y++) {
+		int yy = srcpos.y + y;
+		if (yy >= top)
+			break;
+		if (yy >= 0) {
+			ChunkLayer * layer = layers[yy];
+			Vector3d v = dstpos;
+			v.y += y;
+#if VOLUME_DATA_MORTON == 1
+			if (columns || layer) {
+				if (columns)
+					columns->getCells(srcpos.x, yy, srcpos.z, size.x, size.z, cells, size.x);
+				else
+					layer->getCells(srcpos.x, srcpos.z, size.x, size.z, cells, size.x);
+				buf.putLayer(v, cells, size.x, size.z, size.x);
+			} else if (uniform[yy] != NO_CELL) {
+				buf.fillLayer(v, size.x, size.z, uniform[yy]);
+			}
+#else
+			if (columns) {
+				columns->getCells(srcpos.x, yy, srcpos.z, size.x, size.z, buf.ptr(v), buf.ROW_SIZE);
+			} else if (layer) {
+				//CRLog::trace("getCells %d  %d,%d %dx%d  to   %d,%d,%d", yy, srcpos.x, srcpos.z, size.x, size.z, v.x, v.y, v.z);
+				layer->getCells(srcpos.x, srcpos.z, size.x, size.z, buf.ptr(v), buf.ROW_SIZE);
+			} else if (uniform[yy] != NO_CELL) {
+				// buffer is already cleared with NO_CELL
+				buf.fillLayer(v, size.x, size.z, uniform[yy]);
+			}
+#endif
+		}
+	}
+}
+
+void Chunk::getCells(Vector3d srcpos, Vector3d dstpos, Vector3d size, BrickedVolumeData & buf) {
+	int top = getMaxNonEmptyHeight(srcpos.x, srcpos.z, size.x, size.z);
+	cell_t cells[CHUNK_DX * CHUNK_DX];
+	for (int y = 0; y < size.y; y++) {
+		int yy = srcpos.y + y;
+		if (yy >= top)
+			break;
+		if (yy < 0)
+			continue;
+		Vector3d v = dstpos;
+		v.y += y;
+		ChunkLayer * layer = layers[yy];
+		if (columns) {
+			columns->getCells(srcpos.x, yy, srcpos.z, size.x, size.z, cells, size.x);
+			buf.putLayer(v, cells, size.x, size.z, size.x);
+		} else if (layer) {
+			layer->getCells(srcpos.x, srcpos.z, size.x, size.z, cells, size.x);
+			buf.putLayer(v, cells, size.x, size.z, size.x);
+		} else if (uniform[yy] != NO_CELL) {
+			// run of uniform layers with the same cell is filled at once, so that covered bricks stay uniform
+			int count = 1;
+			while (y + count < size.y && yy + count < top && !layers[yy + count] && uniform[yy + count] == uniform[yy])
+				count++;
+			buf.fillBox(v, Vector3d(size.x, count, size.z), uniform[yy]);
+			y += count - 1;
+		}
+	}
+}
+
+/// copy cells of box min <= v < max (world coordinates inside volume) from chunks to volume
+void World::copyCells(VolumeData & buf, Vector3d min, Vector3d max) {
+	buf.fillBox(min - buf.origin, max - min, NO_CELL);
+	int minChunkY = min.y >> CHUNK_DY_SHIFT;
+	int maxChunkY = (max.y - 1) >> CHUNK_DY_SHIFT;
+	if (minChunkY < chunks.minY())
+		minChunkY = chunks.minY();
+	if (maxChunkY >= chunks.maxY())
+		maxChunkY = chunks.maxY() - 1;
+	for (int chunky = minChunkY; chunky <= maxChunkY; chunky++) {
+		int y0 = chunky * CHUNK_DY;
+		int ystart = min.y > y0 ? min.y : y0;
+		int yend = max.y < y0 + CHUNK_DY ? max.y : y0 + CHUNK_DY;
+		for (int z = min.z; z < max.z;) {
+			int zz = z & CHUNK_DX_MASK;
+			int nextz = z + CHUNK_DX - zz;
+			if (nextz > max.z)
+				nextz = max.z;
+			for (int x = min.x; x < max.x;) {
+				int xx = x & CHUNK_DX_MASK;
+				int nextx = x + CHUNK_DX - xx;
+				if (nextx > max.x)
+					nextx = max.x;
+				Chunk * p = chunks.get(x >> CHUNK_DX_SHIFT, chunky, z >> CHUNK_DX_SHIFT);
+				if (p) {
+					// chunk rows never cross ring buffer row end, as ROW_SIZE is multiple of CHUNK_DX
+					p->getCells(Vector3d(xx, ystart - y0, zz), Vector3d(x, ystart, z) - buf.origin, Vector3d(nextx - x, yend - ystart, nextz - z), buf);
+				}
+				x = nextx;
+			}
+			z = nextz;
+		}
+	}
+}
+
+/// copy cells of box min <= v < max again after world change; part of box outside volume is ignored
+void World::updateCells(VolumeData & buf, Vector3d min, Vector3d max) {
+	if (!buf.valid)
+		return;
+	buf.clearMarks();
+	Vector3d end = buf.origin + Vector3d(buf.ROW_SIZE, buf.ROW_SIZE, buf.ROW_SIZE);
+	if (min.x < buf.origin.x) min.x = buf.origin.x;
+	if (min.y < buf.origin.y) min.y = buf.origin.y;
+	if (min.z < buf.origin.z) min.z = buf.origin.z;
+	if (max.x > end.x) max.x = end.x;
+	if (max.y > end.y) max.y = end.y;
+	if (max.z > end.z) max.z = end.z;
+	if (min.x < max.x && min.y < max.y && min.z < max.z)
+		copyCells(buf, min, max);
+}
+
+/// bottom and sky bounds for cube of size*2 around pos: one layer below the lowest and above the highest non-empty cell in the area
+/// returns false if there are no non-empty cells (bounds are set below cube then)
+bool World::getBoundLayers(Vector3d pos, int sz, int boundLayers[2]) {
+	Vector3d origin = pos - Vector3d(sz, sz, sz);
+	Vector3d end = pos + Vector3d(sz, sz, sz);
+	int y0 = pos.y;
+	bool found = false;
+	int minLayer = 0;
+	int maxLayer = 0;
+	// whole chunk levels touched by the cube: bounds of the column are searched from the lowest to the highest loaded level
+	for (int chunky = chunks.minY(); chunky < chunks.maxY(); chunky++) {
+		for (int z = origin.z; z < end.z;) {
+			int zz = z & CHUNK_DX_MASK;
+			int nextz = z + CHUNK_DX - zz;
+			if (nextz > end.z)
+				nextz = end.z;
+			for (int x = origin.x; x < end.x;) {
+				int xx = x & CHUNK_DX_MASK;
+				int nextx = x + CHUNK_DX - xx;
+				if (nextx > end.x)
+					nextx = end.x;
+				Chunk * p = chunks.get(x >> CHUNK_DX_SHIFT, chunky, z >> CHUNK_DX_SHIFT);
+				if (p) {
+					p->touch(accessClock);
+					int top = p->getMaxNonEmptyHeight(xx, zz, nextx - x, nextz - z);
+					if (top) {
+						int bottom = chunky * CHUNK_DY + p->getMinLayer();
+						top += chunky * CHUNK_DY;
+						if (!found || minLayer > bottom)
+							minLayer = bottom;
+						if (!found || maxLayer < top - 1)
+							maxLayer = top - 1;
+						found = true;
+					}
+				}
+				x = nextx;
+			}
+			z = nextz;
+		}
+	}
+	boundLayers[0] = boundLayers[1] = origin.y - 1;
+	if (!found)
+		return false;
+	if (minLayer > y0)
+		minLayer = y0;
+	if (maxLayer < y0)
+		maxLayer = y0;
+	boundLayers[0] = minLayer - 1;
+	boundLayers[1] = maxLayer + 1;
+	return true;
+}
+
+/// fill volume with cells around pos
+/// When volume already contains cells for nearby position, it's scrolled: only slabs exposed by move are copied.
+void World::getCellsNear(Vector3d pos, VolumeData & buf) {
+	int sz = buf.size();
+	Vector3d origin = pos - Vector3d(sz, sz, sz);
+	Vector3d end = pos + Vector3d(sz, sz, sz);
+	int y0 = pos.y;
+	int boundLayers[2];
+	bool hasBounds = getBoundLayers(pos, sz, boundLayers);
+
+	Vector3d oldOrigin = buf.origin;
+	Vector3d oldEnd = oldOrigin + Vector3d(sz * 2, sz * 2, sz * 2);
+	Vector3d shift = origin - oldOrigin;
+	buf.clearMarks();
+	if (!buf.valid || myAbs(shift.x) >= sz * 2 || myAbs(shift.y) >= sz * 2 || myAbs(shift.z) >= sz * 2) {
+		buf.clear();
+		buf.setOrigin(origin);
+		copyCells(buf, origin, end);
+	} else {
+		// restore cells replaced with bounds which are moved; bounds which stay are just filled again after scrolling
+		for (int i = 0; i < 2; i++) {
+			int y = buf.boundLayers[i];
+			if (y >= oldOrigin.y && y < oldEnd.y && y != boundLayers[0] && y != boundLayers[1])
+				copyCells(buf, Vector3d(oldOrigin.x, y, oldOrigin.z), Vector3d(oldEnd.x, y + 1, oldEnd.z));
+		}
+		buf.setOrigin(origin);
+		if (shift.x > 0)
+			copyCells(buf, Vector3d(oldEnd.x, origin.y, origin.z), end);
+		else if (shift.x < 0)
+			copyCells(buf, origin, Vector3d(oldOrigin.x, end.y, end.z));
+		if (shift.z > 0)
+			copyCells(buf, Vector3d(origin.x, origin.y, oldEnd.z), end);
+		else if (shift.z < 0)
+			copyCells(buf, origin, Vector3d(end.x, end.y, oldOrigin.z));
+		if (shift.y > 0)
+			copyCells(buf, Vector3d(origin.x, oldEnd.y, origin.z), end);
+		else if (shift.y < 0)
+			copyCells(buf, origin, Vector3d(end.x, oldOrigin.y, end.z));
+	}
+	buf.valid = true;
+	buf.boundLayers[0] = boundLayers[0];
+	buf.boundLayers[1] = boundLayers[1];
+	if (hasBounds) {
+		buf.fillLayer(boundLayers[0] - y0, BOUND_BOTTOM);
+		buf.fillLayer(boundLayers[1] - y0, BOUND_SKY);
+	}
+}
+
+/// fill sparse volume with cells around pos; whole volume is filled again on each call
+void World::getCellsNear(Vector3d pos, BrickedVolumeData & buf) {
+	int sz = buf.size();
+	Vector3d origin = pos - Vector3d(sz, sz, sz);
+	Vector3d end = pos + Vector3d(sz, sz, sz);
+	int boundLayers[2];
+	bool hasBounds = getBoundLayers(pos, sz, boundLayers);
+	buf.clear();
+	int minChunkY = origin.y >> CHUNK_DY_SHIFT;
+	int maxChunkY = (end.y - 1) >> CHUNK_DY_SHIFT;
+	if (minChunkY < chunks.minY())
+		minChunkY = chunks.minY();
+	if (maxChunkY >= chunks.maxY())
+		maxChunkY = chunks.maxY() - 1;
+	for (int chunky = minChunkY; chunky <= maxChunkY; chunky++) {
+		int y0 = chunky * CHUNK_DY;
+		int ystart = origin.y > y0 ? origin.y : y0;
+		int yend = end.y < y0 + CHUNK_DY ? end.y : y0 + CHUNK_DY;
+		for (int z = origin.z; z < end.z;) {
+			int zz = z & CHUNK_DX_MASK;
+			int nextz = z + CHUNK_DX - zz;
+			if (nextz > end.z)
+				nextz = end.z;
+			for (int x = origin.x; x < end.x;) {
+				int xx = x & CHUNK_DX_MASK;
+				int nextx = x + CHUNK_DX - xx;
+				if (nextx > end.x)
+					nextx = end.x;
+				Chunk * p = chunks.get(x >> CHUNK_DX_SHIFT, chunky, z >> CHUNK_DX_SHIFT);
+				if (p)
+					p->getCells(Vector3d(xx, ystart - y0, zz), Vector3d(x, ystart, z) - origin, Vector3d(nextx - x, yend - ystart, nextz - z), buf);
+				x = nextx;
+			}
+			z = nextz;
+		}
+	}
+	if (hasBounds) {
+		buf.fillLayer(boundLayers[0] - pos.y, BOUND_BOTTOM);
+		buf.fillLayer(boundLayers[1] - pos.y, BOUND_SKY);
+	}
+	// layers with palette are written cell by cell, so solid or empty bricks may still have storage here
+	buf.compact();
+}
+
+#if UNIT_TESTS==1
+void testVectors();
+void testChunkLayer();
+void testChunkUniformLayers();
+void testChunkMatrix();
+void testWorldReader();
+void testPoolAllocator();
+void testChunkEviction();
+void testRegionFile();
+void testChunkProvider();
+void testChunkWriter();
+void testWorldEdit();
+void testHeightmap();
+void testChangeJournal();
+void testWorldSnapshot();
+void testVolumeScrolling();
+void testBrickedVolume();
+void testVolumeLayout();
+void testColumnStorage();
+void testTallWorld();
+void testCellMasks();
+void testChunkCompression();
+void testBlockIds();
+void testBlockCounts();
+void testNonEmptyCellIterator();
+void testNeighbourLinks();
+void testBlockEntities();
+void testParallelDiamondVisitor();
+
+
+void testVectors() {
+	Vector3d v1(1, 0, 0);
+	Direction d1(1, 0, 0);
+	assert(d1.dir == EAST);
+	assert(d1.forward == Vector3d(1, 0, 0));
+	assert(d1.up == Vector3d(0, 1, 0));
+	assert(d1.down == Vector3d(0, -1, 0));
+	assert(d1.left == Vector3d(0, 0, -1));
+	assert(d1.right == Vector3d(0, 0, 1));
+
+	Direction d3(-1, 0, 0);
+	assert(d3.dir == WEST);
+	assert(d3.forward == Vector3d(-1, 0, 0));
+	assert(d3.up == Vector3d(0, 1, 0));
+	assert(d3.down == Vector3d(0, -1, 0));
+	assert(d3.left == Vector3d(0, 0, 1));
+	assert(d3.right == Vector3d(0, 0, -1));
+
+	Direction d2(0, 0, -1);
+	assert(d2.dir == NORTH);
+	assert(d2.forward == Vector3d(0, 0, -1));
+	assert(d2.up == Vector3d(0, 1, 0));
+	assert(d2.down == Vector3d(0, -1, 0));
+	assert(d2.left == Vector3d(-1, 0, 0));
+	assert(d2.right == Vector3d(1, 0, 0));
+
+	Direction d4(0, 0, 1);
+	assert(d4.dir == SOUTH);
+	assert(d4.forward == Vector3d(0, 0, 1));
+	assert(d4.up == Vector3d(0, 1, 0));
+	assert(d4.down == Vector3d(0, -1, 0));
+	assert(d4.left == Vector3d(1, 0, 0));
+	assert(d4.right == Vector3d(-1, 0, 0));
+
+}
+
+void testChunkLayer() {
+	ChunkLayer layer;
+	cell_t ref[CHUNK_DX * CHUNK_DX];
+	memset(ref, 0, sizeof(ref));
+	assert(layer.indexBits() == 1);
+	unsigned int seed = 1234;
+	// number of distinct values grows: 2, 4, 16, 40
+	int limits[] = { 2, 4, 16, 40 };
+	int expectedBits[] = { 1, 2, 4, 8 };
+	for (int step = 0; step < 4; step++) {
+		for (int i = 0; i < 1000; i++) {
+			seed = seed * 1103515245 + 12345;
+			int x = (seed >> 8) & CHUNK_DX_MASK;
+			int z = (seed >> 12) & CHUNK_DX_MASK;
+			cell_t cell = (cell_t)(((seed >> 16) % limits[step]) * 3);
+			layer.set(x, z, cell);
+			ref[(z << CHUNK_DX_SHIFT) + x] = cell;
+		}
+		assert(layer.indexBits() == expectedBits[step]);
+		for (int i = 0; i < CHUNK_DX * CHUNK_DX; i++)
+			assert(layer.get(i & CHUNK_DX_MASK, i >> CHUNK_DX_SHIFT) == ref[i]);
+		cell_t rect[5 * 7];
+		layer.getCells(3, 2, 5, 7, rect, 5);
+		for (int z = 0; z < 7; z++)
+			for (int x = 0; x < 5; x++)
+				assert(rect[z * 5 + x] == ref[((z + 2) << CHUNK_DX_SHIFT) + x + 3]);
+		// usage counters match cells, also after widening to 8 bits where indexes are cell values
+		for (int value = 0; value < 256; value++) {
+			int expected = 0;
+			for (int i = 0; i < CHUNK_DX * CHUNK_DX; i++)
+				if (ref[i] == value)
+					expected++;
+			assert(layer.cellCount((cell_t)value) == expected);
+		}
+	}
+	// overwriting all cells of widened layer with one value: merge to uniform is reported on the last cell only
+	for (int i = 0; i < CHUNK_DX * CHUNK_DX; i++) {
+		bool uniform = layer.set(i & CHUNK_DX_MASK, i >> CHUNK_DX_SHIFT, 7);
+		assert(uniform == (i == CHUNK_DX * CHUNK_DX - 1));
+	}
+	assert(layer.cellCount(7) == CHUNK_DX * CHUNK_DX);
+	// unused palette entries are reused, so overwriting all cells again and again does not widen layer
+	ChunkLayer layer2(5);
+	for (int i = 0; i < 10; i++)
+		for (int z = 0; z < CHUNK_DX; z++)
+			for (int x = 0; x < CHUNK_DX; x++)
+				layer2.set(x, z, (cell_t)i);
+	assert(layer2.indexBits() == 1);
+	assert(layer2.get(1, 0) == 9 && layer2.get(15, 15) == 9);
+}
+
+void testChunkUniformLayers() {
+	Chunk chunk;
+	// fill whole layer 0 with bedrock: it ends up as uniform layer w/o allocation
+	for (int z = 0; z < CHUNK_DX; z++)
+		for (int x = 0; x < CHUNK_DX; x++)
+			chunk.set(x, 0, z, 3);
+	assert(chunk.isUniformLayer(0));
+	assert(chunk.layerCount() == 0);
+	assert(chunk.get(5, 0, 7) == 3);
+	assert(chunk.getMinLayer() == 0 && chunk.getMaxLayer() == 0);
+	// writing the same value does not split layer
+	chunk.set(5, 0, 7, 3);
+	assert(chunk.isUniformLayer(0));
+	// split on first different value, merge back when uniform again
+	chunk.set(5, 0, 7, 0);
+	assert(!chunk.isUniformLayer(0));
+	assert(chunk.get(5, 0, 7) == 0 && chunk.get(6, 0, 7) == 3);
+	chunk.set(5, 0, 7, 3);
+	assert(chunk.isUniformLayer(0));
+	chunk.set(1, 2, 1, 8);
+	assert(!chunk.isUniformLayer(2));
+	assert(chunk.getMaxLayer() == 2);
+	// uniform layers are filled directly into volume
+	VolumeData volume(4);
+	volume.clear();
+	chunk.getCells(Vector3d(2, 0, 0), Vector3d(0, 0, 0), Vector3d(4, 3, 4), volume);
+	assert(*volume.ptr(Vector3d(3, 0, 3)) == 3);
+	assert(*volume.ptr(Vector3d(4, 0, 3)) == NO_CELL);
+	assert(*volume.ptr(Vector3d(3, 1, 3)) == NO_CELL);
+	assert(*volume.ptr(Vector3d(0, 2, 1)) == NO_CELL);
+	chunk.getCells(Vector3d(0, 0, 0), Vector3d(0, 0, 0), Vector3d(4, 3, 4), volume);
+	assert(*volume.ptr(Vector3d(1, 2, 1)) == 8);
+}
+
+void testChunkMatrix() {
+	ChunkMatrix matrix;
+	// dense area + far-flung chunks
+	for (int x = -20; x < 20; x++)
+		for (int z = -20; z < 20; z++)
+			matrix.set(x, 0, z, new Chunk());
+	Chunk * far1 = new Chunk();
+	Chunk * far2 = new Chunk();
+	matrix.set(100000, 0, -3, far1);
+	matrix.set(-100000, 0, 100000, far2);
+	assert(matrix.length() == 40 * 40 + 2);
+	assert(matrix.memoryUsage() <= 64 * 1024);
+	assert(matrix.get(100000, 0, -3) == far1);
+	assert(matrix.get(-100000, 0, 100000) == far2);
+	assert(matrix.get(100000, 0, -4) == NULL);
+	assert(matrix.get(20, 0, 0) == NULL);
+	// remove every other chunk, the rest must be still reachable
+	for (int x = -20; x < 20; x++)
+		for (int z = -20; z < 20; z++)
+			if ((x + z) & 1)
+				delete matrix.remove(x, 0, z);
+	for (int x = -20; x < 20; x++)
+		for (int z = -20; z < 20; z++)
+			assert((matrix.get(x, 0, z) != NULL) == !((x + z) & 1));
+	assert(matrix.length() == 40 * 20 + 2);
+	matrix.set(100000, 0, -3, NULL);
+	assert(matrix.get(100000, 0, -3) == NULL);
+	assert(matrix.get(-100000, 0, 100000) == far2);
+	// stacked chunks: levels are separate keys, y range is tracked
+	Chunk * deep = new Chunk();
+	Chunk * high = new Chunk();
+	matrix.set(1, -40, 1, deep);
+	matrix.set(1, 7, 1, high);
+	assert(matrix.get(1, -40, 1) == deep && matrix.get(1, 7, 1) == high && matrix.get(1, -39, 1) == NULL);
+	assert(matrix.get(-20, 0, -20) != NULL && matrix.get(-20, 1, -20) == NULL && matrix.get(-20, -1, -20) == NULL);
+	assert(matrix.minY() == -40 && matrix.maxY() == 8 && matrix.bottom() == 0);
+	matrix.setBottomLevel(-40);
+	assert(matrix.bottom() == -40 * CHUNK_DY);
+	int found = 0;
+	for (int i = 0; i < matrix.slots(); i++) {
+		int x, y, z;
+		if (matrix.getAt(i, x, y, z) == deep) {
+			assert(x == 1 && y == -40 && z == 1);
+			found++;
+		}
+	}
+	assert(found == 1);
+	assert(ChunkMatrix::makeKey(-1, -1, -1) != ChunkMatrix::makeKey(-1, 0, -1));
+	assert(ChunkMatrix::makeKey(8388607, -32768, -8388608) != ChunkMatrix::makeKey(-8388608, 32767, 8388607));
+}
+
+void testPoolAllocator() {
+	PoolAllocator pool(100);
+	PoolStats stats = pool.stats();
+	assert(stats.itemSize == 104 && stats.pages == 0);
+	const int COUNT = 2000;
+	void * items[COUNT];
+	for (int i = 0; i < COUNT; i++) {
+		items[i] = pool.alloc();
+		memset(items[i], i, 100);
+	}
+	stats = pool.stats();
+	assert(stats.used == COUNT);
+	int pages = stats.pages;
+	assert(pages == (COUNT + stats.capacity / pages - 1) / (stats.capacity / pages));
+	// free every other item: pages stay allocated, but fragmented
+	for (int i = 0; i < COUNT; i += 2)
+		pool.free(items[i]);
+	stats = pool.stats();
+	assert(stats.used == COUNT / 2 && stats.pages == pages);
+	assert(stats.fragmentation() >= 0.5f);
+	for (int i = 1; i < COUNT; i += 2)
+		assert(*(unsigned char*)items[i] == (unsigned char)i);
+	// freed slots are reused
+	for (int i = 0; i < COUNT; i += 2)
+		items[i] = pool.alloc();
+	assert(pool.stats().pages == pages);
+	// when everything is freed, pages are returned to system, except one spare
+	for (int i = 0; i < COUNT; i++)
+		pool.free(items[i]);
+	stats = pool.stats();
+	assert(stats.used == 0 && stats.pages == 1 && stats.partialPages == 0);
+	pool.trim();
+	assert(pool.stats().pages == 0);
+}
+
+class RecordingPersistence : public ChunkPersistence {
+public:
+	Vector2dArray saved;
+	virtual void saveChunk(int chunkx, int chunky, int chunkz, Chunk * chunk) {
+		saved.append(Vector2d(chunkx, chunkz));
+	}
+};
+
+void testChunkEviction() {
+	RecordingPersistence persistence;
+	World * world = new World();
+	world->setPersistence(&persistence);
+	world->getCamPosition().pos = Vector3d(0, 10, 0);
+	// 3 rows of 10 chunks far from camera, each row is touched one clock tick later
+	for (int row = 0; row < 3; row++) {
+		for (int i = 0; i < 10; i++)
+			world->setCell((100 + i) * CHUNK_DX, 0, (100 + row) * CHUNK_DX, 1);
+		world->tick();
+	}
+	world->setCell(0, 0, 0, 1); // near camera
+	int usage = World::chunkMemoryUsage();
+	// nothing happens while there is enough memory
+	world->setMemoryBudget(usage);
+	assert(world->evictChunks() == 0);
+	// reading chunks of the oldest row makes them recently used
+	WorldReader reader(world);
+	for (int i = 0; i < 10; i++)
+		reader.getCell((100 + i) * CHUNK_DX, 0, 100 * CHUNK_DX);
+	// with budget for ~half of chunks only the second row goes away first
+	world->setMemoryBudget(usage - sizeof(Chunk) * 14);
+	int evicted = world->evictChunks();
+	assert(evicted >= 10 && evicted < 30);
+	assert(persistence.saved.length() == evicted);
+	assert(persistence.saved[0].y == 101);
+	assert(world->getCell(105 * CHUNK_DX, 0, 101 * CHUNK_DX) == NO_CELL);
+	assert(world->getCell(105 * CHUNK_DX, 0, 100 * CHUNK_DX) == 1);
+	// chunks in view range are kept even if budget is too small
+	world->setMemoryBudget(1);
+	world->evictChunks();
+	assert(world->getChunks().length() == 1);
+	assert(world->getCell(0, 0, 0) == 1);
+	delete world;
+	// remaining dirty chunk is flushed on world destruction
+	assert(persistence.saved.length() == 31);
+	// w/o persistence hook only clean chunks are evicted
+	world = new World();
+	world->getCamPosition().pos = Vector3d(0, 10, 0);
+	for (int i = 0; i < 4; i++)
+		world->setCell((100 + i) * CHUNK_DX, 0, 100 * CHUNK_DX, 1);
+	world->getChunks().get(100, 0, 100)->setDirty(false);
+	world->setMemoryBudget(1);
+	assert(world->evictChunks() == 1);
+	assert(world->getCell(100 * CHUNK_DX, 0, 100 * CHUNK_DX) == NO_CELL);
+	assert(world->getCell(101 * CHUNK_DX, 0, 100 * CHUNK_DX) == 1);
+	assert(world->getChunks().length() == 3);
+	// nothing to evict: not retried until chunk memory grows or camera moves to another chunk
+	assert(world->evictChunks() == 0);
+	world->getChunks().get(101, 0, 100)->setDirty(false);
+	assert(world->evictChunks() == 0 && world->getChunks().length() == 3);
+	world->getCamPosition().pos = Vector3d(CHUNK_DX, 10, 0);
+	assert(world->evictChunks() == 1 && world->getChunks().length() == 2);
+	delete world;
+}
+
+static bool sameChunkCells(Chunk * a, Chunk * b) {
+	for (int y = 0; y < CHUNK_DY; y++)
+		for (int z = 0; z < CHUNK_DX; z++)
+			for (int x = 0; x < CHUNK_DX; x++)
+				if (a->get(x, y, z) != b->get(x, y, z))
+					return false;
+	return true;
+}
+
+/// save chunks to region of thread and to region shared by all threads, and load them back
+static void saveAndLoadChunks(RegionStore * store, Chunk * chunk, int thread, std::atomic<int> * failures) {
+	for (int i = 0; i < 8; i++) {
+		store->saveChunk(thread * REGION_SIZE + i, 0, 0, chunk);
+		store->saveChunk(i, 0, 8 + thread, chunk);
+		Chunk * own = store->loadChunk(thread * REGION_SIZE + i, 0, 0);
+		Chunk * shared = store->loadChunk(i, 0, 8 + thread);
+		if (!own || !shared || !sameChunkCells(chunk, own) || !sameChunkCells(chunk, shared))
+			(*failures)++;
+		delete own;
+		delete shared;
+	}
+}
+
+void testRegionFile() {
+	// chunk with uniform layers, small palettes and 8 bit layer
+	Chunk chunk;
+	unsigned int seed = 5;
+	for (int y = 0; y < 10; y++)
+		for (int z = 0; z < CHUNK_DX; z++)
+			for (int x = 0; x < CHUNK_DX; x++)
+				chunk.set(x, y, z, (cell_t)(y < 3 ? 3 : (y < 6 ? 100 + ((x + z) & 3) : 1)));
+	for (int i = 0; i < 300; i++) {
+		seed = seed * 1103515245 + 12345;
+		chunk.set(seed & CHUNK_DX_MASK, 20, (seed >> 8) & CHUNK_DX_MASK, (cell_t)(seed >> 16));
+	}
+	Array<unsigned char> data;
+	ChunkCodec::encode(&chunk, data);
+	assert(data.length() < 2000);
+	Chunk * decoded = ChunkCodec::decode(data.ptr(), data.length());
+	assert(decoded && sameChunkCells(&chunk, decoded));
+	assert(decoded->isUniformLayer(0) && !decoded->isUniformLayer(4) && !decoded->isUniformLayer(20) && decoded->isUniformLayer(21));
+	assert(decoded->getMinLayer() == 0 && decoded->getMaxLayer() == 20);
+	// editing decoded chunk updates palette counters properly
+	for (int z = 0; z < CHUNK_DX; z++)
+		for (int x = 0; x < CHUNK_DX; x++)
+			decoded->set(x, 4, z, 7);
+	assert(decoded->isUniformLayer(4) && decoded->get(3, 4, 5) == 7);
+	delete decoded;
+	// truncated data is rejected
+	assert(ChunkCodec::decode(data.ptr(), data.length() - 1) == NULL);
+
+	const char * path = "vrpg_unittest.vrr";
+	remove(path);
+	RegionFile region;
+	assert(region.open(path));
+	assert(!region.hasChunk(1, 2) && region.loadChunk(1, 2) == NULL);
+	assert(region.saveChunk(1, 2, &chunk));
+	assert(region.saveChunk(31, 31, &chunk));
+	decoded = region.loadChunk(31, 31);
+	assert(decoded && sameChunkCells(&chunk, decoded));
+	delete decoded;
+	// rewriting the same chunk appends new payload and eventually compacts file
+	int maxSize = 0;
+	for (int i = 0; i < 200; i++) {
+		chunk.set(i & CHUNK_DX_MASK, 30 + (i & 7), 0, (cell_t)i);
+		assert(region.saveChunk(1, 2, &chunk));
+		if (maxSize < region.getFileSize())
+			maxSize = region.getFileSize();
+	}
+	assert(maxSize < RegionFile::HEADER_SIZE + 4 * RegionFile::MIN_COMPACT_GARBAGE);
+	assert(region.garbageBytes() <= RegionFile::MIN_COMPACT_GARBAGE + (int)data.length() * 2);
+	decoded = region.loadChunk(1, 2);
+	assert(decoded && sameChunkCells(&chunk, decoded));
+	delete decoded;
+	region.close();
+	// reopened file has the latest versions
+	assert(region.open(path));
+	assert(region.hasChunk(1, 2) && region.hasChunk(31, 31) && !region.hasChunk(2, 1));
+	decoded = region.loadChunk(1, 2);
+	assert(decoded && sameChunkCells(&chunk, decoded) && !decoded->isDirty());
+	delete decoded;
+	region.close();
+	remove(path);
+	// store keeps chunk levels in separate files and finds them again after reopening
+	const char * dir = "vrpg_unittest_store";
+	{
+		RegionStore store(dir);
+		store.saveChunk(1, -2, 3, &chunk);
+		store.saveChunk(1, 0, 3, &chunk);
+	}
+	{
+		RegionStore store(dir);
+		int minY, maxY;
+		store.getLevels(minY, maxY);
+		assert(minY == -2 && maxY == 1 && store.loadChunk(1, -1, 3) == NULL);
+		World world;
+		assert(store.loadChunks(&world, 0, 0, 4, 4) == 2);
+		assert(world.getChunks().get(1, -2, 3) && sameChunkCells(&chunk, world.getChunks().get(1, -2, 3)));
+		assert(world.getChunks().minY() == -2 && world.getChunks().maxY() == 1 && world.getChunks().bottomLevel() == -2);
+		// threads save and load chunks of their own regions, and of one shared region, at once
+		std::thread threads[4];
+		std::atomic<int> failures(0);
+		for (int t = 0; t < 4; t++)
+			threads[t] = std::thread(saveAndLoadChunks, &store, &chunk, t, &failures);
+		for (int t = 0; t < 4; t++)
+			threads[t].join();
+		assert(failures == 0);
+	}
+	remove("vrpg_unittest_store/region_1_0.vrr");
+	remove("vrpg_unittest_store/region_2_0.vrr");
+	remove("vrpg_unittest_store/region_3_0.vrr");
+	remove("vrpg_unittest_store/region_0_0.vrr");
+	remove("vrpg_unittest_store/region_0_0_-2.vrr");
+	remove("vrpg_unittest_store/levels.txt");
+	remove(dir);
+}
+
+/// puts chunk x coordinate to cell (0, 0, 0) of each chunk, at z < 0 only
+class TestChunkSource : public ChunkSource {
+public:
+	std::atomic<int> calls;
+	cell_t value;
+	TestChunkSource(cell_t v) : calls(0), value(v) {}
+	virtual Chunk * loadChunk(int chunkx, int chunky, int chunkz) {
+		calls++;
+		if (chunkz >= 0)
+			return NULL;
+		Chunk * chunk = new Chunk();
+		chunk->set(0, 0, 0, value);
+		return chunk;
+	}
+};
+
+void testChunkProvider() {
+	Vector3d north = Direction(NORTH).forward;
+	assert(ChunkProvider::chunkPriority(0, 0, north) == 0);
+	assert(ChunkProvider::chunkPriority(north.x * 2, north.z * 2, north) < ChunkProvider::chunkPriority(1, 1, north));
+	assert(ChunkProvider::chunkPriority(2, 0, north) < ChunkProvider::chunkPriority(-north.x * 2, -north.z * 2, north));
+	World world;
+	world.getCamPosition().pos = Vector3d(0, 10, 0);
+	world.getCamPosition().direction.set(NORTH);
+	world.setCell(0, 0, 0, 1);
+	TestChunkSource loader(5);
+	TestChunkSource generator(6);
+	int range = (world.getMaxVisibleRange() >> CHUNK_DX_SHIFT) + 1;
+	int total = (range * 2 + 1) * (range * 2 + 1);
+	{
+		// without workers nothing is loaded; existing chunk is not requested
+		ChunkProvider provider(&loader, &generator, 0);
+		assert(provider.update(&world) == 0);
+		assert(provider.pendingCount() == total - 1);
+		world.getCamPosition().pos = Vector3d(10000, 10, 0);
+		provider.update(&world);
+		assert(provider.pendingCount() == total);
+	}
+	world.getCamPosition().pos = Vector3d(0, 10, 0);
+	ChunkProvider provider(&loader, &generator, 2);
+	int installed = 0;
+	for (int i = 0; i < 10000 && world.getChunks().length() < total; i++) {
+		installed += provider.update(&world);
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	assert(installed == total - 1 && world.getChunks().length() == total);
+	assert(provider.pendingCount() == 0);
+	assert(loader.calls == total - 1);
+	// chunk which loader doesn't have is generated
+	assert(world.getCell(-CHUNK_DX, 0, -CHUNK_DX) == 5);
+	assert(world.getCell(-CHUNK_DX, 0, CHUNK_DX) == NO_CELL);
+	assert(generator.calls == total - 1 - range * (range * 2 + 1));
+	assert(world.getCell(0, 0, 0) == 1);
+}
+
+/// records cell 0,0,0 of saved chunks; saving waits while gate is locked
+class GatedPersistence : public ChunkPersistence, public ChunkSource {
+public:
+	std::mutex gate;
+	std::mutex mutex;
+	std::atomic<bool> entered;
+	Vector3dArray positions;
+	Array<int> values;
+	GatedPersistence() : entered(false) {}
+	virtual void saveChunk(int chunkx, int chunky, int chunkz, Chunk * chunk) {
+		entered = true;
+		std::lock_guard<std::mutex> wait(gate);
+		std::lock_guard<std::mutex> lock(mutex);
+		positions.append(Vector3d(chunkx, chunky, chunkz));
+		values.append(chunk->get(0, 0, 0));
+	}
+	virtual Chunk * loadChunk(int chunkx, int chunky, int chunkz) {
+		std::lock_guard<std::mutex> lock(mutex);
+		for (int i = positions.length() - 1; i >= 0; i--) {
+			if (positions[i] == Vector3d(chunkx, chunky, chunkz)) {
+				Chunk * chunk = new Chunk();
+				chunk->set(0, 0, 0, (cell_t)values[i]);
+				return chunk;
+			}
+		}
+		return NULL;
+	}
+};
+
+void testChunkWriter() {
+	GatedPersistence persistence;
+	ChunkWriter writer(&persistence, &persistence);
+	World world;
+	world.setPersistence(&writer);
+	world.getCamPosition().pos = Vector3d(0, 10, 0);
+	persistence.gate.lock();
+	// evicted chunk is queued, eviction doesn't wait for writing
+	world.setCell(100 * CHUNK_DX, 0, 0, 7);
+	world.setMemoryBudget(1);
+	assert(world.evictChunks() == 1 && !world.getChunks().find(100, 0, 0));
+	while (!persistence.entered)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	// chunk being written is loaded as a clean copy
+	Chunk * chunk = writer.loadChunk(100, 0, 0);
+	assert(chunk && chunk->get(0, 0, 0) == 7 && !chunk->isDirty());
+	delete chunk;
+	// newer save of queued position replaces older one
+	Chunk saved;
+	saved.set(0, 0, 0, 1);
+	writer.saveChunk(5, 3, 5, &saved);
+	saved.set(0, 0, 0, 2);
+	writer.saveChunk(5, 3, 5, &saved);
+	assert(writer.pendingCount() == 2);
+	int minY, maxY;
+	writer.getLevels(minY, maxY);
+	assert(minY == 0 && maxY == 4);
+	// world chunk saved by flush is retained: later edit goes to a copy
+	world.setCell(0, 0, 0, 3);
+	world.flushDirtyChunks();
+	world.setCell(0, 0, 0, 4);
+	assert(writer.pendingCount() == 3);
+	persistence.gate.unlock();
+	writer.flush();
+	assert(writer.pendingCount() == 0);
+	assert(persistence.positions.length() == 3 && persistence.values[0] == 7 && persistence.values[1] == 2 && persistence.values[2] == 3);
+	assert(persistence.positions[1] == Vector3d(5, 3, 5));
+	// written chunk is read from source
+	chunk = writer.loadChunk(5, 3, 5);
+	assert(chunk && chunk->get(0, 0, 0) == 2);
+	delete chunk;
+	assert(world.getCell(0, 0, 0) == 4);
+	// queue is written before writer stops
+	GatedPersistence target;
+	{
+		ChunkWriter shortLived(&target, NULL);
+		for (int i = 0; i < 10; i++)
+			shortLived.saveChunk(i, 0, 0, &saved);
+	}
+	assert(target.positions.length() == 10 && target.values[9] == 2);
+}
+
+static bool sameWorldCells(World & a, World & b, Vector3d min, Vector3d max) {
+	for (int y = min.y; y < max.y; y++)
+		for (int z = min.z; z < max.z; z++)
+			for (int x = min.x; x < max.x; x++)
+				if (a.getCell(x, y, z) != b.getCell(x, y, z))
+					return false;
+	return true;
+}
+
+void testWorldEdit() {
+	World expected;
+	World world;
+	Vector3d min(-40, 0, -30);
+	Vector3d max(40, 20, 30);
+	// boxes: whole layers, full rows, partial rows, single cells
+	Vector3d boxes[] = {
+		Vector3d(-32, 0, -32), Vector3d(32, 3, 32),
+		Vector3d(-20, 2, -7), Vector3d(25, 6, 9),
+		Vector3d(-3, 4, -5), Vector3d(4, 12, 3),
+		Vector3d(5, 5, 5), Vector3d(6, 6, 6),
+	};
+	cell_t values[] = { 3, 100, 7, NO_CELL };
+	for (int i = 0; i < 4; i++) {
+		for (int y = boxes[i * 2].y; y < boxes[i * 2 + 1].y; y++)
+			for (int z = boxes[i * 2].z; z < boxes[i * 2 + 1].z; z++)
+				for (int x = boxes[i * 2].x; x < boxes[i * 2 + 1].x; x++)
+					expected.setCell(x, y, z, values[i]);
+		world.fillBox(boxes[i * 2], boxes[i * 2 + 1], values[i]);
+	}
+	for (int x = -40; x < 40; x++) {
+		int h = 10 + ((x * 7) & 7);
+		for (int y = 8; y < h; y++)
+			expected.setCell(x, y, 20, 50 + (x & 3));
+		world.setColumn(x, 20, 8, h, 50 + (x & 3));
+	}
+	assert(sameWorldCells(expected, world, min, max));
+	// filled whole layers are kept uniform
+	Chunk * chunk = world.getChunks().get(0, 0, 0);
+	assert(chunk->isUniformLayer(0) && chunk->get(0, 0, 0) == 3);
+	assert(chunk->isUniformLayer(15));
+
+	// the same with builder
+	World batched;
+	{
+		WorldEditBuilder builder(&batched);
+		for (int i = 0; i < 4; i++)
+			builder.fillBox(boxes[i * 2], boxes[i * 2 + 1], values[i]);
+		for (int x = -40; x < 40; x++)
+			builder.setColumn(x, 20, 8, 10 + ((x * 7) & 7), 50 + (x & 3));
+		// nothing is written before flush
+		assert(batched.getChunks().length() == 0);
+		builder.flush();
+		assert(sameWorldCells(expected, batched, min, max));
+		// builder reads cells which are already in world
+		builder.setCell(1, 1, 1, 9);
+		expected.setCell(1, 1, 1, 9);
+		// more chunks than builder can keep
+		for (int i = 0; i < WorldEditBuilder::MAX_CHUNKS + 10; i++) {
+			builder.setCell(i * CHUNK_DX, 30, 0, 11);
+			expected.setCell(i * CHUNK_DX, 30, 0, 11);
+		}
+	}
+	assert(sameWorldCells(expected, batched, min, max));
+	for (int i = 0; i < WorldEditBuilder::MAX_CHUNKS + 10; i++)
+		assert(batched.getCell(i * CHUNK_DX, 30, 0) == 11);
+	chunk = batched.getChunks().get(0, 0, 0);
+	assert(chunk->isUniformLayer(0) && chunk->isUniformLayer(15) && !chunk->isUniformLayer(1));
+}
+
+/// compare chunk heightmap with heights found by scanning columns from top
+static bool sameHeights(Chunk * chunk) {
+	for (int z = 0; z < CHUNK_DX; z++)
+		for (int x = 0; x < CHUNK_DX; x++) {
+			int opaque = 0;
+			int nonEmpty = 0;
+			for (int y = CHUNK_DY - 1; y >= 0; y--) {
+				cell_t cell = chunk->get(x, y, z);
+				if (!nonEmpty && cell != NO_CELL)
+					nonEmpty = y + 1;
+				if (!opaque && BLOCK_TYPE_OPAQUE[cell] && cell != BOUND_SKY)
+					opaque = y + 1;
+			}
+			if (chunk->getHeight(x, z) != opaque || chunk->getNonEmptyHeight(x, z) != nonEmpty)
+				return false;
+		}
+	return true;
+}
+
+void testHeightmap() {
+	// block types may be not initialized yet; both are restored, 100 is terrain type of the game
+	bool wasOpaque = BLOCK_TYPE_OPAQUE[3];
+	bool wasOpaque100 = BLOCK_TYPE_OPAQUE[100];
+	BLOCK_TYPE_OPAQUE[3] = true;
+	BLOCK_TYPE_OPAQUE[100] = false;
+	cell_t values[] = { NO_CELL, 3, 100, BOUND_SKY };
+	Chunk chunk;
+	assert(sameHeights(&chunk) && chunk.getHeight(3, 4) == 0);
+	// single cells, removing topmost cells makes columns to be rescanned
+	unsigned int seed = 4321;
+	for (int i = 0; i < 3000; i++) {
+		seed = seed * 1103515245 + 12345;
+		int x = (seed >> 8) & 3;
+		int z = (seed >> 12) & 3;
+		int y = (seed >> 16) & 15;
+		chunk.set(x, y, z, values[(seed >> 24) & 3]);
+		if ((i & 63) == 0)
+			assert(sameHeights(&chunk));
+	}
+	assert(sameHeights(&chunk));
+	// boxes and whole layers
+	chunk.fill(0, 0, 0, CHUNK_DX, 2, CHUNK_DX, 3);
+	assert(sameHeights(&chunk) && chunk.getHeight(10, 10) == 2);
+	chunk.fill(2, 1, 2, 9, 20, 5, 100);
+	assert(sameHeights(&chunk) && chunk.getNonEmptyHeight(3, 3) == 20);
+	chunk.fill(0, 1, 0, CHUNK_DX, CHUNK_DY, CHUNK_DX, NO_CELL);
+	assert(sameHeights(&chunk) && chunk.getHeight(3, 3) == 1 && chunk.getMaxNonEmptyHeight(0, 0, CHUNK_DX, CHUNK_DX) == 1);
+	cell_t cells[CHUNK_DX * CHUNK_DX];
+	for (int i = 0; i < CHUNK_DX * CHUNK_DX; i++)
+		cells[i] = values[i & 3];
+	chunk.setLayerCells(7, cells);
+	assert(sameHeights(&chunk) && chunk.getHeight(1, 0) == 8 && chunk.getHeight(2, 0) == 1);
+	for (int i = 0; i < CHUNK_DX * CHUNK_DX; i++)
+		cells[i] = values[(i + 1) & 3];
+	chunk.setLayerCells(7, cells);
+	assert(sameHeights(&chunk) && chunk.getHeight(0, 0) == 8 && chunk.getHeight(1, 0) == 1);
+
+	// world: terrain written with builder, then dug with setCell
+	World world;
+	{
+		WorldEditBuilder builder(&world);
+		for (int z = -20; z < 20; z++)
+			for (int x = -20; x < 20; x++)
+				builder.setColumn(x, z, 0, 5 + ((x * 3 + z * 5) & 7), 3);
+	}
+	assert(world.getHeight(-20, 7) == 5 + ((-60 + 35) & 7));
+	assert(world.getHeight(100, 100) == 0);
+	int h = world.getHeight(1, 1);
+	world.setCell(1, h - 1, 1, NO_CELL);
+	assert(world.getHeight(1, 1) == h - 1);
+	world.setCell(1, h + 5, 1, 100);
+	assert(world.getHeight(1, 1) == h - 1);
+	WorldReader reader(&world);
+	assert(reader.getHeight(1, 1) == h - 1 && reader.getHeight(-5, -5) == world.getHeight(-5, -5));
+	for (int i = 0; i < world.getChunks().slots(); i++) {
+		int chunkx, chunky, chunkz;
+		Chunk * p = world.getChunks().getAt(i, chunkx, chunky, chunkz);
+		if (p) {
+			assert(sameHeights(p));
+			// heightmap is rebuilt on load
+			Array<unsigned char> buf;
+			ChunkCodec::encode(p, buf);
+			Chunk * loaded = ChunkCodec::decode(buf.ptr(), buf.length());
+			assert(loaded && sameHeights(loaded));
+			delete loaded;
+		}
+	}
+	BLOCK_TYPE_OPAQUE[3] = wasOpaque;
+	BLOCK_TYPE_OPAQUE[100] = wasOpaque100;
+}
+
+void testChangeJournal() {
+	World world;
+	ChangeJournal & journal = world.getJournal();
+	lUInt64 position = journal.endPosition();
+	Array<DirtyBox> boxes;
+	// column of cells in one chunk is merged into single box
+	for (int y = 0; y < 40; y++)
+		world.setCell(3, y, 5, 3);
+	assert(journal.drain(position, boxes) && boxes.length() == 1);
+	assert(boxes[0].min == Vector3d(3, 0, 5) && boxes[0].max == Vector3d(4, 40, 6));
+	Chunk * chunk = world.getChunks().get(0, 0, 0);
+	assert(chunk->getVersion() == 40 && chunk->getSectionVersion(0) == 16 && chunk->getSectionVersion(39) == 40);
+	assert(chunk->getSectionVersion(100) == 0);
+	// boxes which are already seen are not extended
+	world.setCell(3, 50, 5, 3);
+	world.setCell(20, 1, 1, 3);
+	world.setCell(4, 51, 5, 3);
+	boxes.clear();
+	assert(journal.drain(position, boxes) && boxes.length() == 2);
+	assert(boxes[0].min == Vector3d(3, 50, 5) && boxes[0].max == Vector3d(5, 52, 6));
+	assert(boxes[1].intersects(Vector3d(20, 0, 0), Vector3d(21, 2, 2)) && !boxes[1].intersects(Vector3d(21, 0, 0), Vector3d(22, 2, 2)));
+	assert(chunk->getSectionVersion(50) == 42 && chunk->getSectionVersion(0) == 16);
+	lUInt64 position2 = position;
+	world.fillBox(Vector3d(-10, 0, -10), Vector3d(10, 2, 10), 5);
+	chunk->fill(0, 0, 0, 1, 1, 1, 7);
+	assert(chunk->getVersion() == 44);
+	boxes.clear();
+	assert(journal.drain(position, boxes) && boxes.length() == 1 && boxes[0].max == Vector3d(10, 2, 10));
+	// other consumer is far behind: overflow
+	for (int i = 0; i <= ChangeJournal::MAX_ENTRIES; i++)
+		world.setCell(i * CHUNK_DX, 0, 0, 3);
+	boxes.clear();
+	assert(!journal.drain(position2, boxes) && position2 == journal.endPosition());
+	assert(!journal.drain(position, boxes));
+	boxes.clear();
+	world.setCell(0, 0, 0, 4);
+	assert(journal.drain(position, boxes) && boxes.length() == 1);
+}
+
+/// sum of cells in box, read from snapshot
+static void sumSnapshotCells(WorldSnapshot * snapshot, int * result) {
+	WorldReader reader(snapshot);
+	int sum = 0;
+	for (int x = -20; x < 20; x++)
+		for (int z = -20; z < 20; z++)
+			for (int y = 0; y < 10; y++)
+				sum += reader.getCell(x, y, z);
+	*result = sum;
+	snapshot->release();
+}
+
+void testWorldSnapshot() {
+	World world;
+	for (int x = -20; x < 20; x++)
+		for (int z = -20; z < 20; z++)
+			world.setColumn(x, z, 0, 3 + ((x ^ z) & 3), 3 + (x & 1));
+	int sum = 0;
+	for (int x = -20; x < 20; x++)
+		for (int z = -20; z < 20; z++)
+			for (int y = 0; y < 10; y++)
+				sum += world.getCell(x, y, z);
+	int chunksUsed = CHUNK_POOL.stats().used;
+	int layersUsed = CHUNK_LAYER_POOL.stats().used;
+	WorldSnapshot * snapshot = world.createSnapshot();
+	// nothing is copied until world is changed
+	assert(snapshot->getChunks().length() == world.getChunks().length());
+	assert(snapshot->getChunks().get(1, 0, 1) == world.getChunks().get(1, 0, 1));
+	assert(CHUNK_POOL.stats().used == chunksUsed && CHUNK_LAYER_POOL.stats().used == layersUsed);
+	// the first change of chunk copies chunk and one layer, the next change of the same layer copies nothing
+	world.setCell(17, 3, 17, 100);
+	assert(CHUNK_POOL.stats().used == chunksUsed + 1 && CHUNK_LAYER_POOL.stats().used == layersUsed + 1);
+	world.setCell(18, 3, 17, 100);
+	assert(CHUNK_POOL.stats().used == chunksUsed + 1 && CHUNK_LAYER_POOL.stats().used == layersUsed + 1);
+	assert(snapshot->getChunks().get(1, 0, 1) != world.getChunks().get(1, 0, 1));
+	assert(snapshot->getChunks().get(0, 0, 1) == world.getChunks().get(0, 0, 1));
+	assert(snapshot->getCell(17, 3, 17) != 100 && world.getCell(17, 3, 17) == 100);
+	// world is changed while snapshot is read on other threads
+	int results[2];
+	snapshot->retain();
+	snapshot->retain();
+	std::thread threads[2];
+	for (int i = 0; i < 2; i++)
+		threads[i] = std::thread(sumSnapshotCells, snapshot, &results[i]);
+	world.fillBox(Vector3d(-20, 0, -20), Vector3d(20, 5, 20), 9);
+	{
+		WorldEditBuilder builder(&world);
+		builder.fillBox(Vector3d(-20, 5, -20), Vector3d(20, 7, 20), 8);
+	}
+	for (int i = 0; i < 2; i++) {
+		threads[i].join();
+		assert(results[i] == sum);
+	}
+	assert(world.getCell(0, 0, 0) == 9 && world.getCell(0, 6, 0) == 8 && snapshot->getCell(0, 6, 0) == NO_CELL);
+	snapshot->release();
+	// old chunks and layers are freed with snapshot
+	assert(CHUNK_POOL.stats().used == chunksUsed);
+}
+
+void testVolumeScrolling() {
+	World world;
+	unsigned int seed = 777;
+	for (int i = 0; i < 20000; i++) {
+		seed = seed * 1103515245 + 12345;
+		world.setCell(((seed >> 8) & 63) - 32, (seed >> 16) & 15, ((seed >> 22) & 63) - 32, (cell_t)(1 + ((seed >> 28) & 7)));
+	}
+	VolumeData scrolled(4);
+	VolumeData fresh(4);
+	Vector3d pos(0, 5, 0);
+	lUInt64 journalPosition = world.getJournal().endPosition();
+	// small moves in all directions, a jump, world changes and visitor marks between moves
+	Vector3d moves[] = { Vector3d(1, 0, 0), Vector3d(0, 0, -1), Vector3d(-3, 1, 2), Vector3d(5, -2, -7), Vector3d(0, 0, 0),
+		Vector3d(31, 0, 0), Vector3d(-12, 3, 17), Vector3d(100, 0, -100), Vector3d(-1, -1, -1), Vector3d(0, 9, 0) };
+	for (int step = 0; step < 10; step++) {
+		pos += moves[step];
+		world.setCell(pos.x + 1, pos.y, pos.z - 2, 9);
+		world.fillBox(pos - Vector3d(20, 1, 3), pos - Vector3d(10, 0, 0), step & 1 ? 10 : NO_CELL);
+		Array<DirtyBox> changes;
+		world.getJournal().drain(journalPosition, changes);
+		for (int i = 0; i < changes.length(); i++)
+			world.updateCells(scrolled, changes[i].min, changes[i].max);
+		world.getCellsNear(pos, scrolled);
+		fresh.clear();
+		world.getCellsNear(pos, fresh);
+		for (int i = 0; i < fresh.DATA_SIZE; i++)
+			assert(scrolled.get(i) == fresh.get(i));
+		for (int i = 0; i < 100; i++) {
+			seed = seed * 1103515245 + 12345;
+			scrolled.mark((seed >> 8) & (scrolled.DATA_SIZE - 1), VISITED_CELL);
+		}
+	}
+	assert(fresh.get(Vector3d(1, 0, -2)) == 9);
+}
+
+void testVolumeLayout() {
+	VolumeData volume(3);
+	const Vector3d origins[2] = { Vector3d(0, 0, 0), Vector3d(-21, 37, 5) };
+	for (int o = 0; o < 2; o++) {
+		volume.setOrigin(origins[o]);
+		// every logical index has its own storage cell
+		Array<char> used;
+		used.append(0, volume.DATA_SIZE);
+		for (int i = 0; i < volume.DATA_SIZE; i++) {
+			int index = volume.storageIndex(i);
+			assert(index >= 0 && index < volume.DATA_SIZE && !used[index]);
+			used[index] = 1;
+		}
+		// layers and boxes written by zero based coordinates are read back by logical indexes
+		volume.clear();
+		cell_t layer[5 * 3];
+		for (int i = 0; i < 5 * 3; i++)
+			layer[i] = (cell_t)(10 + i);
+		volume.putLayer(Vector3d(0, 2, 3), layer, 5, 3, 5);
+		volume.fillBox(Vector3d(10, 7, 12), Vector3d(6, 2, 4), 7);
+		int index = volume.getIndex(Vector3d(4 - 8, 2 - 8, 5 - 8));
+		assert(volume.get(index) == 10 + 2 * 5 + 4);
+		assert(volume.get(volume.moveIndex(index, DIR_WEST)) == 10 + 2 * 5 + 3);
+		assert(volume.get(volume.moveIndex(index, DIR_NORTH)) == 10 + 5 + 4);
+		assert(volume.get(volume.moveIndex(index, DIR_UP)) == NO_CELL);
+		assert(volume.get(Vector3d(15 - 8, 8 - 8, 15 - 8)) == 7);
+		assert(volume.get(Vector3d(10 - 8, 7 - 8, 12 - 8)) == 7);
+		assert(volume.get(Vector3d(9 - 8, 7 - 8, 12 - 8)) == NO_CELL);
+		volume.fillLayer(8 - 8, 5);
+		assert(volume.get(Vector3d(3 - 8, 8 - 8, 9 - 8)) == 5);
+		assert(volume.get(Vector3d(3 - 8, 9 - 8, 9 - 8)) == NO_CELL);
+	}
+}
+
+void testBrickedVolume() {
+	// random operations give the same cells as in dense volume
+	VolumeData dense(4);
+	BrickedVolumeData bricked(4);
+	assert(bricked.BRICK_COUNT == 64 && bricked.mixedBrickCount() == 0);
+	cell_t cell;
+	assert(bricked.isUniformBrick(bricked.getIndex(Vector3d(3, -5, 7)), cell) && cell == NO_CELL);
+	cell_t layer[16 * 16];
+	unsigned int seed = 12345;
+	for (int i = 0; i < 400; i++) {
+		seed = seed * 1103515245 + 12345;
+		int op = (seed >> 8) & 7;
+		Vector3d v(((seed >> 11) & 31) - 16, ((seed >> 16) & 31) - 16, ((seed >> 21) & 31) - 16);
+		cell_t c = (cell_t)((seed >> 26) & 3);
+		if (op == 0) {
+			Vector3d size(((seed >> 4) & 15) + 1, ((seed >> 28) & 15) + 1, ((seed >> 12) & 15) + 1);
+			Vector3d zero = v + Vector3d(16, 16, 16);
+			if (zero.x + size.x > 32) size.x = 32 - zero.x;
+			if (zero.y + size.y > 32) size.y = 32 - zero.y;
+			if (zero.z + size.z > 32) size.z = 32 - zero.z;
+			dense.fillBox(zero, size, c);
+			bricked.fillBox(zero, size, c);
+		} else if (op == 1) {
+			dense.fillLayer(v.y, c);
+			bricked.fillLayer(v.y, c);
+		} else if (op == 2) {
+			for (int j = 0; j < 16 * 16; j++)
+				layer[j] = (cell_t)((j * 7 + i) & 3);
+			Vector3d zero(16, v.y + 16, 8);
+			for (int z = 0; z < 16; z++)
+				for (int x = 0; x < 16; x++)
+					dense.put(zero + Vector3d(x, 0, z) - Vector3d(16, 16, 16), layer[z * 16 + x]);
+			bricked.putLayer(zero, layer, 16, 16, 16);
+		} else if (op == 3) {
+			bricked.compact();
+		} else {
+			dense.put(v, c);
+			bricked.put(bricked.getIndex(v), c);
+		}
+	}
+	for (int i = 0; i < dense.DATA_SIZE; i++)
+		assert(bricked.get(i) == dense.get(i));
+	bricked.compact();
+	for (int i = 0; i < dense.DATA_SIZE; i++) {
+		assert(bricked.get(i) == dense.get(i));
+		if (bricked.isUniformBrick(i, cell))
+			assert(cell == dense.get(i));
+	}
+	bricked.fillBox(Vector3d(0, 0, 0), Vector3d(32, 32, 32), 5);
+	assert(bricked.mixedBrickCount() == 0 && bricked.get(bricked.getIndex(Vector3d(-16, 15, 0))) == 5);
+
+	// volume around position in world: ground and air bricks are uniform
+	World world;
+	world.fillBox(Vector3d(-40, 0, -40), Vector3d(40, 24, 40), 3);
+	seed = 99;
+	for (int i = 0; i < 2000; i++) {
+		seed = seed * 1103515245 + 12345;
+		world.setCell(((seed >> 8) & 63) - 32, 24 + ((seed >> 16) & 3), ((seed >> 22) & 63) - 32, (cell_t)(1 + ((seed >> 28) & 7)));
+	}
+	VolumeData denseNear(5);
+	BrickedVolumeData brickedNear(5);
+	Vector3d pos(3, 26, -5);
+	world.getCellsNear(pos, denseNear);
+	world.getCellsNear(pos, brickedNear);
+	for (int i = 0; i < denseNear.DATA_SIZE; i++)
+		assert(brickedNear.get(i) == denseNear.get(i));
+	assert(brickedNear.isUniformBrick(brickedNear.getIndex(Vector3d(0, -20, 0)), cell) && cell == 3);
+	assert(brickedNear.isUniformBrick(brickedNear.getIndex(Vector3d(0, 20, 0)), cell) && cell == NO_CELL);
+	assert(brickedNear.memoryUsage() < denseNear.DATA_SIZE / 2);
+}
+
+void testColumnStorage() {
+	bool wasOpaque = BLOCK_TYPE_OPAQUE[3];
+	BLOCK_TYPE_OPAQUE[3] = true;
+	// the same random edits of layered chunk and chunk with columns
+	Chunk layered;
+	Chunk columns;
+	columns.setStorage(CHUNK_STORAGE_COLUMNS);
+	assert(columns.getStorage() == CHUNK_STORAGE_COLUMNS && columns.get(3, 50, 7) == NO_CELL && columns.isUniformLayer(50));
+	unsigned int seed = 2468;
+	for (int i = 0; i < 1000; i++) {
+		seed = seed * 1103515245 + 12345;
+		int x = (seed >> 8) & 15;
+		int z = (seed >> 12) & 15;
+		int y = (seed >> 16) & 31;
+		cell_t cell = (cell_t)((seed >> 24) & 3);
+		if (i & 1) {
+			layered.set(x, y, z, cell);
+			columns.set(x, y, z, cell);
+		} else {
+			int x1 = x + 1 + ((seed >> 26) & 7);
+			int z1 = z + 1 + ((seed >> 29) & 3);
+			int y1 = y + 1 + ((seed >> 4) & 15);
+			if (x1 > CHUNK_DX) x1 = CHUNK_DX;
+			if (z1 > CHUNK_DX) z1 = CHUNK_DX;
+			layered.fill(x, y, z, x1, y1, z1, cell);
+			columns.fill(x, y, z, x1, y1, z1, cell);
+		}
+		// too many edits switch chunk back to layers
+		if (columns.getStorage() == CHUNK_STORAGE_LAYERS)
+			columns.setStorage(CHUNK_STORAGE_COLUMNS);
+	}
+	assert(sameHeights(&columns) && sameHeights(&layered));
+	for (int y = 0; y < CHUNK_DY; y++) {
+		assert(columns.isUniformLayer(y) == layered.isUniformLayer(y));
+		for (int z = 0; z < CHUNK_DX; z++)
+			for (int x = 0; x < CHUNK_DX; x++)
+				assert(columns.get(x, y, z) == layered.get(x, y, z));
+	}
+	VolumeData fromLayers(4);
+	VolumeData fromColumns(4);
+	layered.getCells(Vector3d(2, 3, 1), Vector3d(0, 0, 0), Vector3d(12, 30, 15), fromLayers);
+	columns.getCells(Vector3d(2, 3, 1), Vector3d(0, 0, 0), Vector3d(12, 30, 15), fromColumns);
+	for (int i = 0; i < fromLayers.DATA_SIZE; i++)
+		assert(fromLayers.get(i) == fromColumns.get(i));
+	Array<unsigned char> encoded;
+	ChunkCodec::encode(&columns, encoded);
+	Chunk * decoded = ChunkCodec::decode(encoded.ptr(), encoded.length());
+	for (int y = 0; y < 40; y++)
+		assert(decoded->get(y & 15, y, 5) == layered.get(y & 15, y, 5));
+	delete decoded;
+
+	// heightfield terrain is switched to columns; frequent edits switch it back
+	// layers are replaced in bulk, as by WorldEditBuilder and ChunkCodec, and it's not counted as edits
+	Chunk terrain;
+	cell_t cells[CHUNK_DX * CHUNK_DX];
+	for (int y = 0; y < CHUNK_DY; y++) {
+		for (int i = 0; i < CHUNK_DX * CHUNK_DX; i++) {
+			int h = 10 + (((i & 15) * 7 + (i >> 4) * 13) & 63);
+			cells[i] = y == 0 ? 3 : (y < h - 2 ? 1 : (y < h ? 2 : NO_CELL));
+		}
+		terrain.setLayerCells(y, cells, false);
+	}
+	terrain.updateHeights();
+	int layersMemory = terrain.memoryUsage();
+	int columnsMemory = ChunkColumns::totalMemoryUsage();
+	terrain.optimizeStorage();
+	assert(terrain.getStorage() == CHUNK_STORAGE_COLUMNS && terrain.memoryUsage() < layersMemory);
+	// columns are counted in chunk memory, as used by eviction
+	assert(ChunkColumns::totalMemoryUsage() - columnsMemory == terrain.memoryUsage() - (int)sizeof(Chunk));
+	assert(terrain.get(3, 0, 3) == 3 && terrain.get(3, 10, 3) == 1 && terrain.get(3, 100, 3) == NO_CELL);
+	terrain.updateHeights();
+	assert(sameHeights(&terrain) && terrain.getNonEmptyHeight(0, 0) == 10);
+	for (int i = 0; i <= Chunk::COLUMN_STORAGE_MAX_EDITS; i++)
+		terrain.set(i & 15, 50, i >> 4, 5);
+	assert(terrain.getStorage() == CHUNK_STORAGE_LAYERS && terrain.get(1, 50, 0) == 5 && terrain.get(3, 10, 3) == 1);
+	assert(ChunkColumns::totalMemoryUsage() == columnsMemory);
+	// edited chunk is not switched to columns again
+	terrain.optimizeStorage();
+	assert(terrain.getStorage() == CHUNK_STORAGE_LAYERS);
+	BLOCK_TYPE_OPAQUE[3] = wasOpaque;
+}
+
+class CountingCellVisitor : public CellVisitor {
+public:
+	int cells;
+	int faces;
+	CountingCellVisitor() : cells(0), faces(0) {}
+	virtual void visit(World * world, Position & camPosition, Vector3d pos, cell_t cell, int visibleFaces) {
+		cells++;
+		for (int i = 0; i < 6; i++)
+			if (visibleFaces & (1 << i))
+				faces++;
+	}
+};
+
+static void visitFromThread(World * world, CountingCellVisitor * visitor) {
+	Position position = world->getCamPosition();
+	DiamondVisitor diamond;
+	diamond.init(world, &position, NULL, visitor);
+	diamond.visitAll(24);
+}
+
+void testWorldReader() {
+	World world;
+	for (int x = -40; x < 40; x++)
+		for (int z = -40; z < 40; z++) {
+			world.setCell(x, 0, z, 3);
+			if (((x * 7) ^ (z * 13)) % 5 == 0)
+				world.setCell(x, 1, z, 1);
+		}
+	world.getCamPosition().pos = Vector3d(0, 3, 0);
+	// readers have independent caches
+	WorldReader r1(&world);
+	WorldReader r2(&world);
+	for (int x = -45; x < 45; x += 3)
+		for (int z = -45; z < 45; z += 5) {
+			assert(r1.getCell(x, 1, z) == world.getCell(x, 1, z));
+			assert(r2.getCell(-x, 0, -z) == world.getCell(-x, 0, -z));
+			WorldColumn column = r1.getColumn(x, z);
+			for (int y = -1; y < 3; y++)
+				assert(column.get(y) == world.getCell(x, y, z));
+		}
+	assert(r1.canPass(Vector3d(0, 2, 0), Vector3d(2, 2, 2)));
+	assert(!r1.canPass(Vector3d(0, 0, 0), Vector3d(2, 2, 2)));
+	// concurrent traversals produce the same result as single one
+	CountingCellVisitor single;
+	visitFromThread(&world, &single);
+	assert(single.cells > 0);
+	CountingCellVisitor visitors[4];
+	std::thread threads[4];
+	for (int i = 0; i < 4; i++)
+		threads[i] = std::thread(visitFromThread, &world, &visitors[i]);
+	for (int i = 0; i < 4; i++) {
+		threads[i].join();
+		assert(visitors[i].cells == single.cells && visitors[i].faces == single.faces);
+	}
+}
+
+void testTallWorld() {
+	World world;
+	world.setBottomLevel(-3);
+	lUInt64 journalPosition = world.getJournal().endPosition();
+	world.setCell(3, -300, 4, 5);
+	world.setCell(3, 500, 4, 6);
+	world.setCell(3, 1000, 4, 5);
+	// -300 is in chunk level -3, 1000 in level 7
+	ChunkMatrix & chunks = world.getChunks();
+	assert(chunks.length() == 3 && chunks.minY() == -3 && chunks.maxY() == 8 && chunks.bottom() == -3 * CHUNK_DY);
+	assert(world.getCell(3, -300, 4) == 5 && world.getCell(3, 500, 4) == 6 && world.getCell(3, 1000, 4) == 5);
+	assert(world.getCell(3, 999, 4) == NO_CELL && world.getCell(3, 200, 4) == NO_CELL && world.getCell(3, 500, 100) == NO_CELL);
+	// bedrock below world bottom
+	assert(world.getCell(3, chunks.bottom(), 4) == NO_CELL && world.getCell(3, chunks.bottom() - 1, 4) == 3);
+	Array<DirtyBox> changes;
+	assert(world.getJournal().drain(journalPosition, changes) && changes.length() == 3);
+	assert(changes[2].min == Vector3d(3, 1000, 4) && changes[2].max == Vector3d(4, 1001, 5));
+	int expectedHeight = BLOCK_TYPE_OPAQUE[5] ? 1001 : (BLOCK_TYPE_OPAQUE[6] ? 501 : chunks.bottom());
+	assert(world.getHeight(3, 4) == expectedHeight && world.getHeight(50, 50) == chunks.bottom());
+	WorldReader reader(&world);
+	assert(reader.getHeight(3, 4) == expectedHeight);
+	assert(reader.getCell(3, 1000, 4) == 5 && reader.getCell(3, -300, 4) == 5 && reader.getCell(3, chunks.bottom() - 10, 4) == 3);
+	WorldColumn column = reader.getColumn(3, 4);
+	assert(column.get(-300) == 5 && column.get(500) == 6 && column.get(1000) == 5 && column.get(-1000) == 3);
+	WorldSnapshot * snapshot = world.createSnapshot();
+	world.setCell(3, 1000, 4, 7);
+	assert(snapshot->getCell(3, 1000, 4) == 5 && world.getCell(3, 1000, 4) == 7 && snapshot->getCell(3, -1000, 4) == 3);
+	snapshot->release();
+
+	// edits crossing chunk levels give the same cells with World and WorldEditBuilder
+	World built;
+	built.setBottomLevel(-3);
+	WorldEditBuilder builder(&built);
+	world.fillBox(Vector3d(-2, 100, -2), Vector3d(9, 300, 2), 9);
+	builder.fillBox(Vector3d(-2, 100, -2), Vector3d(9, 300, 2), 9);
+	world.setColumn(10, 10, -10, 140, 4);
+	builder.setColumn(10, 10, -10, 140, 4);
+	world.setCell(5, 256, 7, 8);
+	builder.setCell(5, 256, 7, 8);
+	builder.flush();
+	assert(world.getCell(0, 127, 0) == 9 && world.getCell(0, 128, 0) == 9 && world.getCell(8, 299, 1) == 9 && world.getCell(8, 300, 1) == NO_CELL);
+	assert(world.getCell(10, -10, 10) == 4 && world.getCell(10, 139, 10) == 4 && world.getCell(10, -11, 10) == NO_CELL);
+	for (int y = -20; y < 310; y++)
+		for (int z = -3; z < 12; z++)
+			for (int x = -3; x < 12; x++)
+				assert(built.getCell(x, y, z) == world.getCell(x, y, z));
+
+	// volume around chunk level boundary has the same cells as world, except bound layers
+	Vector3d centers[] = { Vector3d(4, 128, 3), Vector3d(3, 1000, 4), Vector3d(9, -5, 9) };
+	for (int i = 0; i < 3; i++) {
+		VolumeData volume(4);
+		volume.clear();
+		world.getCellsNear(centers[i], volume);
+		BrickedVolumeData bricked(4);
+		world.getCellsNear(centers[i], bricked);
+		int sz = volume.size();
+		for (int y = -sz; y < sz; y++) {
+			if (centers[i].y + y == volume.boundLayers[0] || centers[i].y + y == volume.boundLayers[1])
+				continue;
+			for (int z = -sz; z < sz; z++)
+				for (int x = -sz; x < sz; x++) {
+					cell_t cell = world.getCell(centers[i] + Vector3d(x, y, z));
+					if (cell == 3 && centers[i].y + y < chunks.bottom())
+						cell = NO_CELL; // bedrock is not copied to volume
+					assert(volume.get(Vector3d(x, y, z)) == cell && bricked.get(Vector3d(x, y, z)) == cell);
+				}
+		}
+	}
+
+	// world bottom does not follow edits: digging below it changes nothing, air creates no chunks
+	World flat;
+	flat.fillBox(Vector3d(-64, 0, -64), Vector3d(64, 10, 64), 3);
+	int chunkCount = flat.getChunks().length();
+	assert(flat.getCell(40, -1, 40) == 3);
+	flat.setCell(0, -1, 0, NO_CELL);
+	flat.setColumn(1, 1, -100, 0, NO_CELL);
+	flat.fillBox(Vector3d(-5, -300, -5), Vector3d(5, 0, 5), 4);
+	flat.setCell(0, 500, 0, NO_CELL);
+	flat.fillBox(Vector3d(100, 0, 100), Vector3d(200, 300, 200), NO_CELL);
+	{
+		WorldEditBuilder builder(&flat);
+		builder.setCell(2, -1, 2, NO_CELL);
+		builder.setColumn(3, 3, 200, 300, NO_CELL);
+	}
+	assert(flat.getChunks().length() == chunkCount && flat.getChunks().bottom() == 0 && flat.getChunks().minY() == 0);
+	assert(flat.getCell(0, -1, 0) == 3 && flat.getCell(40, -1, 40) == 3 && flat.getCell(1, -50, 1) == 3);
+	flat.setCell(0, 5, 0, NO_CELL);
+	assert(flat.getCell(0, 5, 0) == NO_CELL && flat.getChunks().length() == chunkCount);
+}
+
+/// row masks of all layers of chunk match properties of its cells
+static bool sameMasks(Chunk * chunk) {
+	for (int y = 0; y < CHUNK_DY; y++)
+		for (int z = 0; z < CHUNK_DX; z++)
+			for (int kind = 0; kind < CELL_MASK_COUNT; kind++) {
+				unsigned short mask = chunk->getRowMask(kind, y, z);
+				for (int x = 0; x < CHUNK_DX; x++)
+					if (((mask >> x) & 1) != (cellMaskFlag(kind, chunk->get(x, y, z)) ? 1 : 0))
+						return false;
+			}
+	return true;
+}
+
+void testCellMasks() {
+	// cells 1..3 get distinct properties for the test
+	bool opaque[256], canPass[256], visible[256];
+	memcpy(opaque, BLOCK_TYPE_OPAQUE, sizeof(opaque));
+	memcpy(canPass, BLOCK_TYPE_CAN_PASS, sizeof(canPass));
+	memcpy(visible, BLOCK_TYPE_VISIBLE, sizeof(visible));
+	for (int i = 0; i < 4; i++) {
+		BLOCK_TYPE_OPAQUE[i] = i == 1;
+		BLOCK_TYPE_CAN_PASS[i] = i == 0 || i == 3;
+		BLOCK_TYPE_VISIBLE[i] = i != 0;
+	}
+	BLOCK_TYPE_OPAQUE[3] = BLOCK_TYPE_CAN_PASS[3] = BLOCK_TYPE_VISIBLE[3] = true;
+	// masks follow set, fill, widening and merging of layers, column storage and codec
+	Chunk chunk;
+	unsigned int seed = 1357;
+	for (int i = 0; i < 3000; i++) {
+		seed = seed * 1103515245 + 12345;
+		int x = (seed >> 8) & 15;
+		int z = (seed >> 12) & 15;
+		int y = (seed >> 16) & 7;
+		cell_t cell = (cell_t)((seed >> 24) & 3);
+		if (i == 1500)
+			cell = 200; // the fifth value widens layer to 4 bits
+		if (i % 50 == 0)
+			chunk.fill(0, y, 0, CHUNK_DX, y + 1, x + 1, cell);
+		else
+			chunk.set(x, y, z, cell);
+	}
+	// layers with 1, 2 and 8 bit indexes
+	for (int i = 0; i < 40; i++) {
+		chunk.set(i & 15, 20, i >> 4, (cell_t)(i & 1));
+		chunk.set(i & 15, 21, i >> 4, (cell_t)(i % 3));
+		chunk.set(i & 15, 22, i >> 4, (cell_t)(i + 1));
+	}
+	assert(sameMasks(&chunk));
+	Chunk copy(chunk);
+	copy.set(1, 2, 3, 1);
+	assert(sameMasks(&copy) && sameMasks(&chunk));
+	copy.setStorage(CHUNK_STORAGE_COLUMNS);
+	assert(sameMasks(&copy));
+	Array<unsigned char> buf;
+	ChunkCodec::encode(&chunk, buf);
+	Chunk * decoded = ChunkCodec::decode(buf.ptr(), buf.length());
+	assert(decoded && sameMasks(decoded));
+	delete decoded;
+
+	// 64 cell queries match cell by cell checks, across chunks and for missing chunks
+	World world;
+	for (int i = 0; i < 3000; i++) {
+		seed = seed * 1103515245 + 12345;
+		world.setCell(((seed >> 8) & 63) - 32, (seed >> 16) & 3, ((seed >> 22) & 7) - 4, (cell_t)(1 + ((seed >> 28) & 3)));
+	}
+	WorldReader reader(&world);
+	for (int z = -5; z < 5; z++)
+		for (int y = -1; y < 5; y++)
+			for (int x = -70; x < 10; x += 13) {
+				lUInt64 opaqueMask = reader.getRowMask(CELL_MASK_OPAQUE, x, y, z);
+				lUInt64 passMask = reader.getRowMask(CELL_MASK_CAN_PASS, x, y, z);
+				lUInt64 eastFaces = reader.getFaceMask(DIR_EAST, x, y, z);
+				lUInt64 upFaces = reader.getFaceMask(DIR_UP, x, y, z);
+				for (int i = 0; i < 64; i++) {
+					Vector3d v(x + i, y, z);
+					cell_t cell = reader.getCell(v);
+					assert(((opaqueMask >> i) & 1) == (reader.isOpaque(v) ? 1ULL : 0));
+					assert(((passMask >> i) & 1) == (BLOCK_TYPE_CAN_PASS[cell] ? 1ULL : 0));
+					assert(((eastFaces >> i) & 1) == (BLOCK_TYPE_VISIBLE[cell] && !reader.isOpaque(v.move(DIR_EAST)) ? 1ULL : 0));
+					assert(((upFaces >> i) & 1) == (BLOCK_TYPE_VISIBLE[cell] && !reader.isOpaque(v.move(DIR_UP)) ? 1ULL : 0));
+				}
+			}
+	memcpy(BLOCK_TYPE_OPAQUE, opaque, sizeof(opaque));
+	memcpy(BLOCK_TYPE_CAN_PASS, canPass, sizeof(canPass));
+	memcpy(BLOCK_TYPE_VISIBLE, visible, sizeof(visible));
+}
+
+static void fillCompressionTestWorld(World & world) {
+	for (int x = 0; x < CHUNK_DX * 4; x++)
+		for (int z = 0; z < CHUNK_DX * 4; z++)
+			world.setColumn(x, z, 0, 20 + ((x * 3 + z * 5) & 7), (cell_t)(1 + ((x ^ z) & 3)));
+	unsigned int seed = 777;
+	for (int i = 0; i < 300; i++) {
+		seed = seed * 1103515245 + 12345;
+		world.setCell((seed >> 8) & (CHUNK_DX * 4 - 1), (seed >> 16) & 63, (seed >> 24) & (CHUNK_DX * 4 - 1), (cell_t)((seed >> 4) & 7));
+	}
+}
+
+static int compressedChunkCount(World & world) {
+	int count = 0;
+	for (int i = 0; i < world.getChunks().slots(); i++) {
+		int x, y, z;
+		Chunk * p = world.getChunks().getAt(i, x, y, z);
+		if (p && p->isCompressed())
+			count++;
+	}
+	return count;
+}
+
+static int runCompactor(ChunkCompactor & compactor, World & world) {
+	int compressed = compactor.update(&world);
+	for (int i = 0; i < 10000 && compactor.pendingCount(); i++)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	return compressed + compactor.update(&world);
+}
+
+void testChunkCompression() {
+	World world;
+	World reference;
+	fillCompressionTestWorld(world);
+	fillCompressionTestWorld(reference);
+	world.getChunks().get(3, 0, 3)->setStorage(CHUNK_STORAGE_COLUMNS);
+	Array<unsigned char> original;
+	ChunkCodec::encode(world.getChunks().get(1, 0, 1), original);
+	int memory = World::chunkMemoryUsage();
+	{
+		// without workers chunks are only queued; budget limits number of chunks in work
+		ChunkCompactor compactor(0, 3, 4);
+		assert(compactor.update(&world) == 0 && compactor.pendingCount() == 0);
+		world.tick();
+		world.tick();
+		world.tick();
+		assert(compactor.update(&world) == 0 && compactor.pendingCount() == 4);
+		assert(compactor.update(&world) == 0 && compactor.pendingCount() == 4);
+	}
+	{
+		ChunkCompactor compactor(2, 3, 100);
+		compactor.update(&world);
+		// chunk edited while being encoded is replaced with copy, which is not compressed
+		world.setCell(CHUNK_DX * 2 + 1, 5, 1, 9);
+		reference.setCell(CHUNK_DX * 2 + 1, 5, 1, 9);
+		int compressed = runCompactor(compactor, world);
+		assert(compressed == compressedChunkCount(world) && compressed >= 14);
+		assert(!world.getChunks().find(2, 0, 0)->isCompressed());
+		// compressed chunks are not queued again
+		assert(runCompactor(compactor, world) == 0);
+	}
+	assert(World::chunkMemoryUsage() < memory);
+	// compressed chunk is saved as is, heightmap is available w/o decompression
+	Chunk * chunk = world.getChunks().find(1, 0, 1);
+	assert(chunk->isCompressed());
+	Array<unsigned char> saved;
+	ChunkCodec::encode(chunk, saved);
+	assert(saved.length() == original.length() && !memcmp(saved.ptr(), original.ptr(), saved.length()));
+	assert(world.getHeight(CHUNK_DX + 2, CHUNK_DX + 3) == reference.getHeight(CHUNK_DX + 2, CHUNK_DX + 3));
+	assert(chunk->isCompressed());
+	// snapshot decompresses shared chunk on its own thread
+	WorldSnapshot * snapshot = world.createSnapshot();
+	std::thread reader([snapshot, &reference]() {
+		for (int x = 0; x < CHUNK_DX * 4; x += 3)
+			for (int z = 0; z < CHUNK_DX * 4; z += 5)
+				assert(snapshot->getCell(x, 10, z) == reference.getCell(x, 10, z));
+	});
+	reader.join();
+	snapshot->release();
+	// cells are decompressed on access, column storage is restored
+	assert(sameWorldCells(world, reference, Vector3d(0, 0, 0), Vector3d(CHUNK_DX * 4, 64, CHUNK_DX * 4)));
+	assert(compressedChunkCount(world) == 0);
+	assert(world.getChunks().get(3, 0, 3)->getStorage() == CHUNK_STORAGE_COLUMNS);
+	assert(Chunk::compressedDataUsage() == 0);
+}
+
+void testBlockIds() {
+	assert(registerBlockType(new BlockDef(1000, "test_block_1000", OPAQUE, 0)));
+	assert(registerBlockType(new BlockDef(40000, "test_block_40000", HALF_OPAQUE, 0)));
+	// number of large block ids is not limited by cell values
+	for (int i = 0; i < 300; i++)
+		assert(registerBlockType(new BlockDef(2000 + i, "test_block_many", OPAQUE, 0)));
+	assert(blockCell(1000) == NO_CELL && blockCell(3) == 3 && BLOCK_ALIAS_CELLS == 0);
+	World world;
+	// uniform, palette and 8 bit layers with cells of large block ids in chunk 0
+	unsigned int seed = 7;
+	for (int z = 0; z < CHUNK_DX; z++) {
+		for (int x = 0; x < CHUNK_DX; x++) {
+			world.setCell(x, 0, z, 3);
+			if ((x + z) & 1)
+				assert(world.setBlock(Vector3d(x, 1, z), 1000));
+			else
+				world.setCell(x, 1, z, 3);
+			assert(world.setBlock(Vector3d(x, 2, z), 40000));
+			seed = seed * 1103515245 + 12345;
+			if (x & 3)
+				world.setCell(x, 3, z, (cell_t)((seed >> 16) % 64));
+			else
+				assert(world.setBlock(Vector3d(x, 3, z), 1000));
+		}
+	}
+	Chunk * chunk = world.getChunks().get(0, 0, 0);
+	cell_t cell1 = world.getCell(1, 1, 0);
+	cell_t cell2 = world.getCell(0, 2, 0);
+	assert(cell1 != cell2 && BLOCK_CELL_ALIAS[cell1] && BLOCK_CELL_ALIAS[cell2] && BLOCK_ALIAS_CELLS == 2);
+	// property tables are valid for alias cells, block type is looked up through chunk
+	assert(BLOCK_TYPE_OPAQUE[cell1] && !BLOCK_TYPE_OPAQUE[cell2] && BLOCK_TYPE_VISIBLE[cell2]);
+	assert(world.getBlockId(Vector3d(1, 1, 0)) == 1000 && world.getBlockId(Vector3d(5, 2, 5)) == 40000 && world.getBlockId(Vector3d(0, 0, 0)) == 3);
+	assert(world.getBlockDef(Vector3d(1, 1, 0), cell1) == BLOCK_DEFS_BY_ID[1000] && world.getBlockDef(Vector3d(0, 0, 0), 3) == BLOCK_DEFS[3]);
+	assert(chunk->blockCell(1000) == cell1 && chunk->cellBlockId(cell2) == 40000);
+	// 300 block ids of the same class in 30 other chunks share alias cells of chunk 0
+	for (int i = 0; i < 300; i++)
+		assert(world.setBlock(Vector3d(CHUNK_DX * (1 + i / 10), 0, i % 10), 2000 + i));
+	assert(BLOCK_ALIAS_CELLS <= 11 && world.getCell(CHUNK_DX, 0, 0) == cell1);
+	for (int i = 0; i < 300; i++)
+		assert(world.getBlockId(Vector3d(CHUNK_DX * (1 + i / 10), 0, i % 10)) == 2000 + i);
+	// copy of chunk keeps its block ids, they are counted in chunk memory
+	int blockIdsMemory = Chunk::blockIdsMemoryUsage();
+	Chunk copy(*chunk);
+	assert(copy.cellBlockId(cell1) == 1000 && copy.cellBlockId(cell2) == 40000);
+	assert(Chunk::blockIdsMemoryUsage() == blockIdsMemory + 256 * (int)sizeof(block_id_t));
+	// saved block ids are mapped to alias cells of loading chunk
+	Array<unsigned char> data;
+	ChunkCodec::encode(chunk, data);
+	assert(data[0] == 3);
+	Chunk * decoded = ChunkCodec::decode(data.ptr(), data.length());
+	assert(decoded && sameChunkCells(chunk, decoded) && !decoded->isDirty() && decoded->cellBlockId(cell1) == 1000);
+	delete decoded;
+	// chunk without large block ids is encoded as before
+	Chunk plain;
+	plain.set(1, 1, 1, 3);
+	Array<unsigned char> plainData;
+	ChunkCodec::encode(&plain, plainData);
+	assert(plainData[0] != 3);
+	// next session: cell value of saved alias is direct block id now, large ids get other alias cells
+	resetBlockAliases();
+	assert(BLOCK_ALIAS_CELLS == 0 && registerBlockType(new BlockDef(cell1, "test_block_direct", OPAQUE, 0)));
+	decoded = ChunkCodec::decode(data.ptr(), data.length());
+	assert(decoded);
+	for (int y = 0; y < 4; y++) {
+		for (int z = 0; z < CHUNK_DX; z++) {
+			for (int x = 0; x < CHUNK_DX; x++) {
+				cell_t cell = decoded->get(x, y, z);
+				assert(cell != cell1);
+				assert(decoded->cellBlockId(cell) == copy.cellBlockId(copy.get(x, y, z)));
+			}
+		}
+	}
+	delete decoded;
+	// unknown block ids become empty cells
+	unregisterBlockType(40000);
+	decoded = ChunkCodec::decode(data.ptr(), data.length());
+	assert(decoded && decoded->isUniformLayer(2) && decoded->get(5, 2, 5) == NO_CELL && decoded->cellBlockId(decoded->get(0, 1, 1)) == 1000);
+	delete decoded;
+	unregisterBlockType(1000);
+	for (int i = 0; i < 300; i++)
+		unregisterBlockType(2000 + i);
+	unregisterBlockType(cell1);
+	resetBlockAliases();
+	assert(BLOCK_ALIAS_CELLS == 0 && !BLOCK_CELL_ALIAS[cell1] && !BLOCK_CELL_ALIAS[cell2] && !BLOCK_DEFS_BY_ID[1000]);
+}
+
+static lUInt64 countCellsByScan(World & world, Vector3d min, Vector3d max, const bool * match) {
+	lUInt64 count = 0;
+	for (int y = min.y; y < max.y; y++)
+		for (int z = min.z; z < max.z; z++)
+			for (int x = min.x; x < max.x; x++)
+				if (match[world.getCell(x, y, z)])
+					count++;
+	return count;
+}
+
+void testBlockCounts() {
+	World world;
+	World reference;
+	fillCompressionTestWorld(world);
+	fillCompressionTestWorld(reference);
+	// stacked chunks with 8 bit layer
+	unsigned int seed = 99;
+	for (int i = 0; i < 400; i++) {
+		seed = seed * 1103515245 + 12345;
+		int x = (seed >> 8) & (CHUNK_DX * 2 - 1);
+		int z = (seed >> 12) & (CHUNK_DX * 2 - 1);
+		world.setCell(x, CHUNK_DY + 3, z, (cell_t)(seed >> 20));
+		reference.setCell(x, CHUNK_DY + 3, z, (cell_t)(seed >> 20));
+	}
+	world.getChunks().get(3, 0, 3)->setStorage(CHUNK_STORAGE_COLUMNS);
+	Chunk * cold = world.getChunks().get(1, 0, 1);
+	Array<unsigned char> data;
+	ChunkCodec::encode(cold, data);
+	unsigned char * compressed = (unsigned char *)malloc(data.length());
+	memcpy(compressed, data.ptr(), data.length());
+	cold->compress(compressed, data.length());
+	world.resetChunkCache();
+	// whole world with cells below bottom, above top and in missing chunks; chunk aligned box; partial boxes; single column
+	Vector3d boxes[] = {
+		Vector3d(-5, -5, -5), Vector3d(CHUNK_DX * 4 + 5, CHUNK_DY * 2 + 5, CHUNK_DX * 4 + 5),
+		Vector3d(CHUNK_DX, 0, CHUNK_DX), Vector3d(CHUNK_DX * 2, CHUNK_DY, CHUNK_DX * 4),
+		Vector3d(3, 5, 7), Vector3d(37, 21, 50),
+		Vector3d(20, 10, 40), Vector3d(60, CHUNK_DY + 10, 62),
+		Vector3d(5, 0, 5), Vector3d(6, CHUNK_DY + 10, 6),
+	};
+	bool nonEmpty[256];
+	bool cell2[256];
+	bool opaque[256];
+	for (int i = 0; i < 256; i++) {
+		nonEmpty[i] = i != NO_CELL;
+		cell2[i] = i == 2;
+		opaque[i] = BLOCK_TYPE_OPAQUE[i];
+	}
+	for (int i = 0; i < 5; i++) {
+		Vector3d min = boxes[i * 2];
+		Vector3d max = boxes[i * 2 + 1];
+		assert(world.countBlocks(min, max, [](cell_t cell) { return cell != NO_CELL; }) == countCellsByScan(reference, min, max, nonEmpty));
+		assert(world.countBlocks(min, max, [](cell_t cell) { return cell == 2; }) == countCellsByScan(reference, min, max, cell2));
+		assert(world.countMatchingCells(min, max, opaque) == countCellsByScan(reference, min, max, opaque));
+	}
+	// cold chunk is counted w/o decompression
+	assert(world.getChunks().find(1, 0, 1)->isCompressed());
+	// "is chunk all air above y"
+	Vector3d above(CHUNK_DX * 2, 64, CHUNK_DX * 2);
+	Vector3d chunkTop(CHUNK_DX * 3, CHUNK_DY, CHUNK_DX * 3);
+	assert(world.countBlocks(above, chunkTop, [](cell_t cell) { return cell != NO_CELL; }) == 0);
+	// counters follow edits
+	world.setCell(CHUNK_DX * 2 + 3, 100, CHUNK_DX * 2 + 4, 2);
+	world.setCell(CHUNK_DX * 2 + 5, 100, CHUNK_DX * 2 + 4, 2);
+	world.setCell(CHUNK_DX * 2 + 5, 100, CHUNK_DX * 2 + 4, NO_CELL);
+	assert(world.countBlocks(above, chunkTop, [](cell_t cell) { return cell != NO_CELL; }) == 1);
+}
+
+void testNonEmptyCellIterator() {
+	World world;
+	fillCompressionTestWorld(world);
+	world.setCell(5, CHUNK_DY + 7, 9, 4);
+	world.setCell(CHUNK_DX * 3 + 1, CHUNK_DY * 2 - 1, 2, 5);
+	world.getChunks().get(3, 0, 3)->setStorage(CHUNK_STORAGE_COLUMNS);
+	bool nonEmpty[256];
+	for (int i = 0; i < 256; i++)
+		nonEmpty[i] = i != NO_CELL;
+	// whole world with missing chunks around, partial box
+	Vector3d boxes[] = {
+		Vector3d(-20, -10, -20), Vector3d(CHUNK_DX * 5, CHUNK_DY * 3, CHUNK_DX * 5),
+		Vector3d(3, 10, 7), Vector3d(CHUNK_DX * 3 + 5, CHUNK_DY + 8, 50),
+	};
+	for (int i = 0; i < 2; i++) {
+		Vector3d min = boxes[i * 2];
+		Vector3d max = boxes[i * 2 + 1];
+		NonEmptyCellIterator it(world.getChunks(), min, max);
+		lUInt64 count = 0;
+		lUInt64 lastKey = -1;
+		while (it.next()) {
+			Vector3d v = it.pos();
+			assert(v.x >= min.x && v.y >= min.y && v.z >= min.z && v.x < max.x && v.y < max.y && v.z < max.z);
+			assert(it.cell() != NO_CELL && it.cell() == world.getCell(v));
+			// chunk order, then layer, row and cell order inside chunk
+			lUInt64 chunkKey = ((lUInt64)((v.y >> CHUNK_DY_SHIFT) - (min.y >> CHUNK_DY_SHIFT)) * 64 + (v.z >> CHUNK_DX_SHIFT) - (min.z >> CHUNK_DX_SHIFT)) * 64
+				+ (v.x >> CHUNK_DX_SHIFT) - (min.x >> CHUNK_DX_SHIFT);
+			lUInt64 key = ((chunkKey * CHUNK_DY + (v.y & CHUNK_DY_MASK)) * CHUNK_DX + (v.z & CHUNK_DX_MASK)) * CHUNK_DX + (v.x & CHUNK_DX_MASK);
+			assert(key > lastKey);
+			lastKey = key;
+			count++;
+		}
+		assert(!it.next());
+		if (min.y < 0)
+			min.y = 0;
+		assert(count == countCellsByScan(world, min, max, nonEmpty) && count > 0);
+	}
+	NonEmptyCellIterator empty(world.getChunks(), Vector3d(0, 70, 0), Vector3d(CHUNK_DX * 4, CHUNK_DY, CHUNK_DX * 4));
+	assert(!empty.next());
+}
+
+/// links of each chunk of matrix are the same as results of lookup
+static void checkNeighbourLinks(ChunkMatrix & chunks) {
+	for (int i = 0; i < chunks.slots(); i++) {
+		int x, y, z;
+		Chunk * chunk = chunks.getAt(i, x, y, z);
+		if (!chunk)
+			continue;
+		for (int dir = NORTH; dir <= EAST; dir++) {
+			Vector3d d = DIRECTION_VECTORS[dir];
+			assert(chunk->getNeighbour(dir) == chunks.find(x + d.x, y, z + d.z));
+		}
+	}
+}
+
+void testNeighbourLinks() {
+	World world;
+	assert(world.getChunks().isLinked());
+	for (int x = -40; x < 40; x += 3)
+		for (int z = -40; z < 40; z += 5)
+			world.setCell(x, (x * z) & 255, z, 3 + ((x ^ z) & 3));
+	checkNeighbourLinks(world.getChunks());
+	// table resize keeps links
+	for (int x = -100; x < 100; x += CHUNK_DX)
+		world.setCell(x, 5, 60, 4);
+	checkNeighbourLinks(world.getChunks());
+	// chunk replaced with copy on write while snapshot keeps old one
+	WorldSnapshot * snapshot = world.createSnapshot();
+	assert(!snapshot->getChunks().isLinked());
+	world.setCell(1, 2, 1, 5);
+	world.setCell(-17, 2, 1, 5);
+	checkNeighbourLinks(world.getChunks());
+	Chunk * old = snapshot->getChunks().find(0, 0, 0);
+	assert(old != world.getChunks().find(0, 0, 0) && old->getNeighbour(WEST) == NULL);
+	snapshot->release();
+	// installed and removed chunks
+	world.installChunk(0, 1, 0, new Chunk());
+	world.installChunk(1, 1, 0, new Chunk());
+	checkNeighbourLinks(world.getChunks());
+	assert(world.getChunks().find(0, 1, 0)->getNeighbour(EAST) == world.getChunks().find(1, 1, 0));
+	Chunk * removed = world.getChunks().remove(0, 0, 0);
+	assert(removed->getNeighbour(EAST) == NULL);
+	removed->release();
+	world.getChunks().set(-1, 0, 0, NULL);
+	checkNeighbourLinks(world.getChunks());
+	// reader crossing chunk borders in all directions reads the same cells as lookup
+	WorldReader reader(&world);
+	for (int z = -70; z < 70; z++)
+		for (int x = -70; x < 70; x++) {
+			int xx = (z & 1) ? -x : x;
+			assert(reader.getCell(xx, 5, z) == world.getCell(xx, 5, z));
+		}
+	for (int x = -70; x < 70; x++)
+		for (int z = -70; z < 70; z++) {
+			int zz = (x & 1) ? -z : z;
+			assert(reader.getCell(x, (x * zz) & 255, zz) == world.getCell(x, (x * zz) & 255, zz));
+		}
+}
+/// counts block entities of saved chunks, as decoded from their encoded data
+class EntityCountingPersistence : public ChunkPersistence {
+public:
+	int entities;
+	EntityCountingPersistence() : entities(0) {}
+	virtual void saveChunk(int chunkx, int chunky, int chunkz, Chunk * chunk) {
+		Array<unsigned char> data;
+		ChunkCodec::encode(chunk, data);
+		Chunk * decoded = ChunkCodec::decode(data.ptr(), data.length());
+		if (decoded->getEntities())
+			entities += decoded->getEntities()->length();
+		delete decoded;
+	}
+};
+
+void testBlockEntities() {
+	World world;
+	world.setCell(0, 0, 0, 1);
+	world.setCell(40, 130, -7, 1);
+	Chunk * plain = world.getChunks().get(0, 0, 0);
+	int usage = World::chunkMemoryUsage();
+	assert(!plain->getEntities() && !world.getBlockEntity(Vector3d(0, 0, 0)) && !world.removeBlockEntity(Vector3d(0, 0, 0)));
+	// chunk w/o entities is encoded as before
+	Array<unsigned char> cells;
+	Array<unsigned char> full;
+	ChunkCodec::encodeCells(plain, cells);
+	ChunkCodec::encode(plain, full);
+	assert(full.length() == cells.length());
+	// entities of two types in two chunks, one of them is replaced with another type
+	const unsigned char chest[] = { 1, 2, 3, 4, 5 };
+	const unsigned char sign[] = "hello";
+	assert(world.setBlockEntity(Vector3d(3, 5, 7), 10, chest, sizeof(chest)));
+	assert(world.setBlockEntity(Vector3d(1, 127, 0), 20, sign, sizeof(sign)));
+	assert(world.setBlockEntity(Vector3d(1, 5, 0), 10, NULL, 0));
+	assert(world.setBlockEntity(Vector3d(40, 130, -7), 10, chest, 3));
+	assert(world.setBlockEntity(Vector3d(2, 2, 2), 20, sign, 2));
+	assert(world.setBlockEntity(Vector3d(2, 2, 2), 10, chest, 1));
+	assert(World::chunkMemoryUsage() > usage);
+	const ChunkEntities::Entity * e = world.getBlockEntity(Vector3d(3, 5, 7));
+	assert(e && e->type == 10 && e->size == 5 && !memcmp(e->data, chest, 5));
+	e = world.getBlockEntity(Vector3d(2, 2, 2));
+	assert(e && e->type == 10 && e->size == 1 && e->data[0] == 1);
+	assert(world.getBlockEntity(Vector3d(1, 5, 0))->size == 0 && !world.getBlockEntity(Vector3d(1, 6, 0)));
+	Vector3dArray found;
+	assert(world.findBlockEntities(Vector3d(-100, 0, -100), Vector3d(100, 256, 100), 10, found) == 4);
+	// chunk by chunk, cell index order inside chunk
+	assert(found[0] == Vector3d(2, 2, 2) && found[1] == Vector3d(1, 5, 0) && found[2] == Vector3d(3, 5, 7) && found[3] == Vector3d(40, 130, -7));
+	found.clear();
+	assert(world.findBlockEntities(Vector3d(0, 0, 0), Vector3d(3, 128, 3), 20, found) == 1 && found[0] == Vector3d(1, 127, 0));
+	assert(world.findBlockEntities(Vector3d(0, 0, 0), Vector3d(3, 127, 3), 20, found) == 0);
+	// snapshot keeps entities of the moment it was taken
+	WorldSnapshot * snapshot = world.createSnapshot();
+	assert(world.setBlockEntity(Vector3d(3, 5, 7), 10, chest + 1, 2));
+	assert(world.removeBlockEntity(Vector3d(1, 127, 0)) && !world.removeBlockEntity(Vector3d(1, 127, 0)));
+	Chunk * old = snapshot->getChunks().find(0, 0, 0);
+	Chunk * current = world.getChunks().find(0, 0, 0);
+	assert(old != current && old->getEntity(3, 5, 7)->size == 5 && current->getEntity(3, 5, 7)->size == 2);
+	assert(old->getEntity(1, 127, 0) && !current->getEntity(1, 127, 0));
+	snapshot->release();
+	// storage is freed with the last entity
+	Chunk * far = world.getChunks().find(2, 1, -1);
+	assert(far->getEntities() && far->getEntities()->length() == 1);
+	assert(world.removeBlockEntity(Vector3d(40, 130, -7)) && !far->getEntities());
+	// entities survive compression and saving, loaded chunk is not dirty
+	Array<unsigned char> data;
+	ChunkCodec::encode(current, data);
+	Chunk * decoded = ChunkCodec::decode(data.ptr(), data.length());
+	assert(decoded && sameChunkCells(current, decoded) && !decoded->isDirty());
+	assert(decoded->getEntities() && decoded->getEntities()->length() == 3);
+	assert(decoded->getEntity(3, 5, 7)->size == 2 && decoded->getEntity(3, 5, 7)->data[1] == 3 && decoded->getEntity(1, 5, 0)->type == 10);
+	delete decoded;
+	assert(ChunkCodec::decode(data.ptr(), data.length() - 1) == NULL);
+	data.clear();
+	ChunkCodec::encodeCells(current, data);
+	unsigned char * compressed = (unsigned char *)malloc(data.length());
+	memcpy(compressed, data.ptr(), data.length());
+	current->compress(compressed, data.length());
+	assert(world.getBlockEntity(Vector3d(2, 2, 2))->data[0] == 1 && current->isCompressed());
+	current->decompress();
+	assert(current->getEntities()->length() == 3 && current->get(0, 0, 0) == 1);
+	// evicted chunk is saved with its entities
+	EntityCountingPersistence persistence;
+	world.setPersistence(&persistence);
+	world.getCamPosition().pos = Vector3d(100 * CHUNK_DX, 10, 0);
+	world.setMemoryBudget(1);
+	assert(world.evictChunks() == 2 && persistence.entities == 3);
+	world.setPersistence(NULL);
+	assert(ChunkEntities::totalMemoryUsage() == 0);
+}
+/// records visited cells in order
+class RecordingCellVisitor : public CellVisitor {
+public:
+	Vector3dArray cells;
+	IntArray faces;
+	virtual void visit(World * world, Position & camPosition, Vector3d pos, cell_t cell, int visibleFaces) {
+		cells.append(pos);
+		faces.append((cell << 8) | visibleFaces);
+	}
+};
+
+void testParallelDiamondVisitor() {
+	World world;
+	world.fillBox(Vector3d(-70, 0, -70), Vector3d(70, 2, 70), 3);
+	unsigned int seed = 77;
+	for (int i = 0; i < 500; i++) {
+		seed = seed * 1103515245 + 12345;
+		world.setColumn((int)((seed >> 8) % 140) - 70, (int)((seed >> 16) % 140) - 70, 2, 2 + ((seed >> 4) & 15), 1);
+	}
+	world.getCamPosition().pos = Vector3d(0, 4, 0);
+	world.getCamPosition().direction.set(NORTH);
+	RecordingCellVisitor single;
+	DiamondVisitor diamond;
+	diamond.init(&world, &world.getCamPosition(), NULL, &single);
+	diamond.visitAll(60);
+	assert(single.cells.length() > 0);
+	// shells are split between threads, but visitor gets the same cells in the same order
+	diamond.setMinParallelCells(64);
+	for (int threads = 2; threads <= 3; threads++) {
+		RecordingCellVisitor multi;
+		diamond.setThreadCount(threads);
+		assert(diamond.getThreadCount() == threads);
+		diamond.init(&world, &world.getCamPosition(), NULL, &multi);
+		diamond.visitAll(60);
+		assert(multi.cells.length() == single.cells.length());
+		for (int i = 0; i < single.cells.length(); i++)
+			assert(multi.cells[i] == single.cells[i] && multi.faces[i] == single.faces[i]);
+	}
+}
+#endif
+
+#if BENCHMARKS==1
+static Chunk * benchmarkGet(StripedChunkMatrix & matrix, int x, int z) { return matrix.get(x, z); }
+static Chunk * benchmarkGet(ChunkMatrix & matrix, int x, int z) { return matrix.get(x, 0, z); }
+static void benchmarkSet(StripedChunkMatrix & matrix, int x, int z, Chunk * chunk) { matrix.set(x, z, chunk); }
+static void benchmarkSet(ChunkMatrix & matrix, int x, int z, Chunk * chunk) { matrix.set(x, 0, z, chunk); }
+
+template<typename M> static lUInt64 benchmarkChunkMatrixGet(M & matrix, Vector2d * positions, int count, int rounds) {
+	for (int i = 0; i < count; i++)
+		benchmarkSet(matrix, positions[i].x, positions[i].y, new Chunk());
+	lUInt64 start = GetCurrentTimeMillis();
+	int found = 0;
+	for (int r = 0; r < rounds; r++) {
+		for (int i = 0; i < count; i++) {
+			// hit and miss
+			if (benchmarkGet(matrix, positions[i].x, positions[i].y))
+				found++;
+			if (benchmarkGet(matrix, positions[i].x + 1, positions[i].y + 1))
+				found++;
+		}
+	}
+	lUInt64 duration = GetCurrentTimeMillis() - start;
+	assert(found >= rounds * count);
+	return duration;
+}
+
+static void benchmarkChunkMatrix() {
+	const int DENSE = 64;
+	const int SPARSE = 256;
+	Vector2dArray dense;
+	for (int x = 0; x < DENSE; x++)
+		for (int z = 0; z < DENSE; z++)
+			dense.append(Vector2d(x - DENSE / 2, z - DENSE / 2));
+	Vector2dArray sparse;
+	unsigned int seed = 4321;
+	for (int i = 0; i < SPARSE; i++) {
+		seed = seed * 1103515245 + 12345;
+		int x = (int)((seed >> 4) % 20000) - 10000;
+		seed = seed * 1103515245 + 12345;
+		int z = (int)((seed >> 4) % 20000) - 10000;
+		sparse.append(Vector2d(x, z));
+	}
+	int lookups = 20000000;
+	{
+		StripedChunkMatrix striped;
+		ChunkMatrix hashed;
+		lUInt64 t1 = benchmarkChunkMatrixGet(striped, dense.ptr(), dense.length(), lookups / 2 / dense.length());
+		lUInt64 t2 = benchmarkChunkMatrixGet(hashed, dense.ptr(), dense.length(), lookups / 2 / dense.length());
+		CRLog::info("ChunkMatrix dense %dx%d, %d lookups: striped %lld ms, hash %lld ms (table %d bytes)", DENSE, DENSE, lookups, t1, t2, hashed.memoryUsage());
+	}
+	{
+		StripedChunkMatrix striped;
+		ChunkMatrix hashed;
+		lUInt64 t1 = benchmarkChunkMatrixGet(striped, sparse.ptr(), sparse.length(), lookups / 2 / sparse.length());
+		lUInt64 t2 = benchmarkChunkMatrixGet(hashed, sparse.ptr(), sparse.length(), lookups / 2 / sparse.length());
+		CRLog::info("ChunkMatrix sparse %d chunks in +-10000, %d lookups: striped %lld ms, hash %lld ms (table %d bytes)", SPARSE, lookups, t1, t2, hashed.memoryUsage());
+	}
+}
+
+static int benchmarkTerrainHeight(int x, int z) {
+	return 20 + ((x * 3 + z * 5) & 31) + (myAbs((x & 255) - 128) + myAbs((z & 255) - 128)) / 8;
+}
+
+/// terrain fill of 1024x1024 columns as in VRPG::initWorld
+static void benchmarkWorldFill() {
+	const int SIZE = 1024;
+	lUInt64 times[3];
+	for (int method = 0; method < 3; method++) {
+		World * world = new World();
+		lUInt64 start = GetCurrentTimeMillis();
+		WorldEditBuilder builder(world);
+		for (int x = 0; x < SIZE; x++) {
+			for (int z = 0; z < SIZE; z++) {
+				int h = benchmarkTerrainHeight(x, z);
+				cell_t cell = (cell_t)(100 + h / 20);
+				if (method == 0) {
+					for (int y = 0; y < h; y++)
+						world->setCell(x, y, z, cell);
+				} else if (method == 1) {
+					world->setColumn(x, z, 0, h, cell);
+				} else {
+					builder.setColumn(x, z, 0, h, cell);
+				}
+			}
+		}
+		builder.flush();
+		times[method] = GetCurrentTimeMillis() - start;
+		delete world;
+	}
+	CRLog::info("World fill %dx%d columns: setCell %lld ms, setColumn %lld ms, WorldEditBuilder %lld ms", SIZE, SIZE, times[0], times[1], times[2]);
+}
+
+class BenchmarkCellVisitor : public CellVisitor {
+public:
+	int cells;
+	BenchmarkCellVisitor() : cells(0) {}
+	virtual void visit(World * world, Position & camPosition, Vector3d pos, cell_t cell, int visibleFaces) {
+		cells++;
+	}
+};
+
+/// volume fill and visibility traversal over VolumeData in layout selected by VOLUME_DATA_MORTON
+static void benchmarkVolumeLayout() {
+	const int SIZE = 512;
+	const int ROUNDS = 5;
+	World * world = new World();
+	WorldEditBuilder builder(world);
+	for (int x = -SIZE / 2; x < SIZE / 2; x++)
+		for (int z = -SIZE / 2; z < SIZE / 2; z++)
+			builder.setColumn(x, z, 0, benchmarkTerrainHeight(x, z), (cell_t)(100 + ((x ^ z) & 3)));
+	builder.flush();
+	// above terrain
+	Position position(Vector3d(0, 90, 0), Vector3d(0, 0, -1));
+	VolumeData volume(MAX_VIEW_DISTANCE_BITS);
+	lUInt64 start = GetCurrentTimeMillis();
+	for (int i = 0; i < ROUNDS; i++) {
+		volume.clear();
+		world->getCellsNear(position.pos, volume);
+	}
+	lUInt64 fillTime = GetCurrentTimeMillis() - start;
+	BenchmarkCellVisitor visitor;
+	start = GetCurrentTimeMillis();
+	for (int i = 0; i < ROUNDS; i++) {
+		VolumeVisitor traversal;
+		traversal.init(world, &position, &volume, &visitor);
+		traversal.visitAll();
+		volume.clearMarks();
+	}
+	lUInt64 visitTime = GetCurrentTimeMillis() - start;
+	// 3D neighbourhood reads in random order, as in visitCell / visitPlaneSpread
+	unsigned int seed = 1234;
+	int sum = 0;
+	cell_t near[9];
+	start = GetCurrentTimeMillis();
+	for (int i = 0; i < 4000000; i++) {
+		seed = seed * 1103515245 + 12345;
+		int index = volume.getIndex(Vector3d((int)((seed >> 8) & 127) - 64, (int)((seed >> 15) & 127) - 64, (int)((seed >> 22) & 127) - 64));
+		volume.getNearCellsForDirection(index, (DirEx)(i % 6), near);
+		sum += near[0] + near[4] + near[8];
+	}
+	lUInt64 nearTime = GetCurrentTimeMillis() - start;
+	CRLog::info("VolumeData %s layout, %d rounds: getCellsNear %lld ms, VolumeVisitor %lld ms (%d cells), 4M neighbourhood reads %lld ms (%d)",
+		VOLUME_DATA_MORTON == 1 ? "Morton" : "row", ROUNDS, fillTime, visitTime, visitor.cells / ROUNDS, nearTime, sum);
+	delete world;
+}
+#endif
+
+void runWorldBenchmarks() {
+#if BENCHMARKS==1
+	benchmarkChunkMatrix();
+	benchmarkWorldFill();
+	benchmarkVolumeLayout();
+#endif
+}
+
+void runWorldUnitTests() {
+#if UNIT_TESTS==1
+	testVectors();
+	testChunkLayer();
+	testChunkUniformLayers();
+	testChunkMatrix();
+	testWorldReader();
+	testPoolAllocator();
+	testChunkEviction();
+	testRegionFile();
+	testChunkProvider();
+	testChunkWriter();
+	testWorldEdit();
+	testHeightmap();
+	testChangeJournal();
+	testWorldSnapshot();
+	testVolumeScrolling();
+	testBrickedVolume();
+	testVolumeLayout();
+	testColumnStorage();
+	testTallWorld();
+	testCellMasks();
+	testChunkCompression();
+	testBlockIds();
+	testBlockCounts();
+	testNonEmptyCellIterator();
+	testNeighbourLinks();
+	testBlockEntities();
+	testParallelDiamondVisitor();
+#endif
+}
+
+/// ensure that data is in range [minvalue, maxvalue]
+void TerrainGen::limit(int minvalue, int maxvalue) {
+	// find actual min/max
+	int minv, maxv;
+	minv = maxv = get(0, 0);
+	for (int y = 0; y <= dy; y++) {
+		for (int x = 0; x <= dx; x++) {
+			int v = get(x, y);
+			if (minv > v)
+				minv = v;
+			if (maxv < v)
+				maxv = v;
+		}
+	}
+	int mul = (maxvalue - minvalue);
+	int div = (maxv - minv);
+	if (div > 0) {
+		for (int y = 0; y <= dy; y++) {
+			for (int x = 0; x <= dx; x++) {
+				set(x, y, minvalue + (get(x, y) - minv) * mul / div);
+			}
+		}
+	}
+}
 
 void TerrainGen::generateWithScale(int seed, short * initData, int stepBits, TerrainGen & scaleMap) {
 	rnd.setSeed(seed);
@@ -760,18 +4670,159 @@ Vector3d diamondVector(int index, int distBits, int dist) {
 }
 #endif
 
-DiamondVisitor::DiamondVisitor() 
+#if	USE_VOLUME_DATA != 1
+/// claim keys of shell take 2^DIAMOND_SHELL_KEY_BITS values: (DIAMOND_MAX_SHELL - dist) << DIAMOND_SHELL_KEY_BITS | sequence number
+#define DIAMOND_SHELL_KEY_BITS 20
+#define DIAMOND_MAX_SHELL 4095
+#define DIAMOND_NO_CLAIM 0xFFFFFFFF
+
+/// Worker threads of DiamondVisitor
+/// Each large shell is expanded in two phases on all threads, part of oldcells per thread:
+/// 1) children of cells are claimed with their sequence number in single threaded order (parent index * 6 + child number),
+///    the smallest number wins, so the owner of each cell does not depend on thread timing;
+/// 2) each thread reads cells which it owns, to its own buffers; buffers are merged in order of parts.
+struct DiamondVisitorPool {
+	struct Candidate {
+		Vector3d v;
+		int index;
+		unsigned int key;
+	};
+	struct Visit {
+		Vector3d pos;
+		cell_t cell;
+		int faces;
+	};
+	/// state of one thread
+	struct Part {
+		WorldReader reader;
+		Array<Candidate> candidates;
+		Array<Visit> visits;
+		Vector3dArray newcells;
+	};
+	DiamondVisitor * owner;
+	std::mutex mutex;
+	std::condition_variable wakeup;
+	std::condition_variable finished;
+	Array<std::thread *> workers;
+	Part * parts;
+	int partCount;
+	int phase;
+	unsigned int generation;
+	int pending;
+	bool stopping;
+	/// calling thread takes part 0, threadCount - 1 workers are started for the rest
+	DiamondVisitorPool(DiamondVisitor * visitor, int threadCount)
+		: owner(visitor), partCount(threadCount), phase(0), generation(0), pending(0), stopping(false) {
+		parts = new Part[partCount];
+		for (int i = 1; i < partCount; i++)
+			workers.append(new std::thread(&DiamondVisitorPool::workerLoop, this, i));
+	}
+	~DiamondVisitorPool() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		wakeup.notify_all();
+		for (int i = 0; i < workers.length(); i++) {
+			workers[i]->join();
+			delete workers[i];
+		}
+		delete[] parts;
+	}
+	void workerLoop(int part) {
+		unsigned int seen = 0;
+		std::unique_lock<std::mutex> lock(mutex);
+		for (;;) {
+			while (!stopping && generation == seen)
+				wakeup.wait(lock);
+			if (stopping)
+				return;
+			seen = generation;
+			int currentPhase = phase;
+			lock.unlock();
+			owner->expandPart(currentPhase, part, partCount);
+			lock.lock();
+			if (--pending == 0)
+				finished.notify_one();
+		}
+	}
+	/// run phase on all threads and wait until it's done
+	void run(int newPhase) {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			phase = newPhase;
+			generation++;
+			pending = workers.length();
+		}
+		wakeup.notify_all();
+		owner->expandPart(newPhase, 0, partCount);
+		std::unique_lock<std::mutex> lock(mutex);
+		while (pending)
+			finished.wait(lock);
+	}
+};
+#endif
+
+DiamondVisitor::DiamondVisitor()
+#if	USE_VOLUME_DATA != 1
+	: claims(NULL), claimCount(0), shellKey(0), pool(NULL), threadCount(1), minParallelCells(MIN_PARALLEL_CELLS)
+#endif
 {
 }
 
+DiamondVisitor::~DiamondVisitor() {
+#if	USE_VOLUME_DATA != 1
+	delete pool;
+	delete[] claims;
+#endif
+}
+
 void DiamondVisitor::init(World * w, Position * pos, VolumeData * vol, CellVisitor * v) {
 	volume = vol;
 	world = w;
+	reader.init(w);
 	position = pos;
 	visitor = v;
 	pos0 = position->pos;
 }
 
+#if	USE_VOLUME_DATA != 1
+/// expand large shells on count threads (including calling one); 1 is single threaded
+void DiamondVisitor::setThreadCount(int count) {
+	if (count < 1)
+		count = 1;
+	if (count == threadCount)
+		return;
+	delete pool;
+	pool = count > 1 ? new DiamondVisitorPool(this, count) : NULL;
+	threadCount = count;
+}
+
+/// visible faces of non-empty cell v (relative to pos0) at world position pos
+int DiamondVisitor::visibleFaces(WorldReader & cellReader, Vector3d v, Vector3d pos) {
+	int visibleFaces = 0;
+	if (v.y <= 0 && v * DIRECTION_VECTORS[DIR_UP] <= 0 &&
+		!cellReader.isOpaque(pos.move(DIR_UP)))
+		visibleFaces |= MASK_UP;
+	if (v.y >= 0 && v * DIRECTION_VECTORS[DIR_DOWN] <= 0 &&
+		!cellReader.isOpaque(pos.move(DIR_DOWN)))
+		visibleFaces |= MASK_DOWN;
+	if (v.x <= 0 && v * DIRECTION_VECTORS[DIR_EAST] <= 0 &&
+		!cellReader.isOpaque(pos.move(DIR_EAST)))
+		visibleFaces |= MASK_EAST;
+	if (v.x >= 0 && v * DIRECTION_VECTORS[DIR_WEST] <= 0 &&
+		!cellReader.isOpaque(pos.move(DIR_WEST)))
+		visibleFaces |= MASK_WEST;
+	if (v.z <= 0 && v * DIRECTION_VECTORS[DIR_SOUTH] <= 0 &&
+		!cellReader.isOpaque(pos.move(DIR_SOUTH)))
+		visibleFaces |= MASK_SOUTH;
+	if (v.z >= 0 && v * DIRECTION_VECTORS[DIR_NORTH] <= 0 &&
+		!cellReader.isOpaque(pos.move(DIR_NORTH)))
+		visibleFaces |= MASK_NORTH;
+	return visibleFaces;
+}
+#endif
+
 void DiamondVisitor::visitCell(
 #if	USE_VOLUME_DATA != 1
 	Vector3d v
@@ -790,62 +4841,198 @@ void DiamondVisitor::visitCell(
 	if (v * position->direction.forward < dist / 3)
 		return;
 #else
-	//int occupied = visitedOccupied;
-	int index = (v.x + m0) + ((v.z + m0) << (maxDistBits + 1));
-	if (v.y < 0) {
-		// inverse index for lower half
-		index ^= m0mask;
-		//m0--;
-		//x ^= m0;
-		//y ^= m0;
-	}
-	//int index = diamondIndex(v, maxDistBits);
-	if (visited_ptr[index] == visitedOccupied)// || cell == visitedEmpty)
+	int index = cellIndex(v);
+	// claimed in this shell already
+	if (claims[index].load(std::memory_order_relaxed) < shellKey + (1 << DIAMOND_SHELL_KEY_BITS))
 		return;
 	if (v * position->direction.forward < dist / 3)
 		return;
 	Vector3d pos = pos0 + v;
-	cell_t cell = world->getCell(pos);
+	cell_t cell = reader.getCell(pos);
 #endif
 
 	// read cell from world
 	if (BLOCK_TYPE_VISIBLE[cell]) {
+#if	USE_VOLUME_DATA == 1
 		int visibleFaces = 0;
 		if (v.y <= 0 && v * DIRECTION_VECTORS[DIR_UP] <= 0 &&
-			!world->isOpaque(pos.move(DIR_UP)))
+			!reader.isOpaque(pos.move(DIR_UP)))
 			visibleFaces |= MASK_UP;
 		if (v.y >= 0 && v * DIRECTION_VECTORS[DIR_DOWN] <= 0 &&
-			!world->isOpaque(pos.move(DIR_DOWN)))
+			!reader.isOpaque(pos.move(DIR_DOWN)))
 			visibleFaces |= MASK_DOWN;
 		if (v.x <= 0 && v * DIRECTION_VECTORS[DIR_EAST] <= 0 &&
-			!world->isOpaque(pos.move(DIR_EAST)))
+			!reader.isOpaque(pos.move(DIR_EAST)))
 			visibleFaces |= MASK_EAST;
 		if (v.x >= 0 && v * DIRECTION_VECTORS[DIR_WEST] <= 0 &&
-			!world->isOpaque(pos.move(DIR_WEST)))
+			!reader.isOpaque(pos.move(DIR_WEST)))
 			visibleFaces |= MASK_WEST;
 		if (v.z <= 0 && v * DIRECTION_VECTORS[DIR_SOUTH] <= 0 &&
-			!world->isOpaque(pos.move(DIR_SOUTH)))
+			!reader.isOpaque(pos.move(DIR_SOUTH)))
 			visibleFaces |= MASK_SOUTH;
 		if (v.z >= 0 && v * DIRECTION_VECTORS[DIR_NORTH] <= 0 &&
-			!world->isOpaque(pos.move(DIR_NORTH)))
+			!reader.isOpaque(pos.move(DIR_NORTH)))
 			visibleFaces |= MASK_NORTH;
 		visitor->visit(world, *position, pos, cell, visibleFaces);
+#else
+		visitor->visit(world, *position, pos, cell, visibleFaces(reader, v, pos));
+#endif
 	}
 	// mark as visited
 #if	USE_VOLUME_DATA == 1
 	cell = BLOCK_TYPE_CAN_PASS[cell] ? VISITED_CELL : VISITED_OCCUPIED;
-	volume->put(index, cell);
+	volume->mark(index, cell);
 	if (cell == VISITED_CELL)
 		newcells.append(index);
 #else
 	if (BLOCK_TYPE_CAN_PASS[cell])
 		newcells.append(v);
-	//cell = BLOCK_TYPE_CAN_PASS[cell] ? visitedEmpty : visitedOccupied;
-	visited_ptr[index] = visitedOccupied; // cell;
+	claims[index].store(shellKey, std::memory_order_relaxed);
 #endif
 }
 
+/// cells of the next shell adjacent to cell pt of current shell, in order of visiting; returns number of cells
+static int diamondChildren(Vector3d pt, Vector3d * children) {
+	int sx = mySign(pt.x);
+	int sy = mySign(pt.y);
+	int sz = mySign(pt.z);
+	int n = 0;
+	if (sx && sy && sz) {
+		// 1, 1, 1
+		children[n++] = Vector3d(pt.x + sx, pt.y, pt.z);
+		children[n++] = Vector3d(pt.x, pt.y + sy, pt.z);
+		children[n++] = Vector3d(pt.x, pt.y, pt.z + sz);
+	} else {
+		// has 0 in one of coords
+		if (!sx) {
+			if (!sy) {
+				if (!sz) {
+					// 0, 0, 0
+					children[n++] = Vector3d(pt.x + 1, pt.y, pt.z);
+					children[n++] = Vector3d(pt.x - 1, pt.y, pt.z);
+					children[n++] = Vector3d(pt.x, pt.y + 1, pt.z);
+					children[n++] = Vector3d(pt.x, pt.y - 1, pt.z);
+					children[n++] = Vector3d(pt.x, pt.y, pt.z + 1);
+					children[n++] = Vector3d(pt.x, pt.y, pt.z - 1);
+				} else {
+					// 0, 0, 1
+					children[n++] = Vector3d(pt.x, pt.y, pt.z + sz);
+					children[n++] = Vector3d(pt.x + 1, pt.y, pt.z);
+					children[n++] = Vector3d(pt.x - 1, pt.y, pt.z);
+					children[n++] = Vector3d(pt.x, pt.y + 1, pt.z);
+					children[n++] = Vector3d(pt.x, pt.y - 1, pt.z);
+				}
+			} else {
+				if (!sz) {
+					// 0, 1, 0
+					children[n++] = Vector3d(pt.x, pt.y + sy, pt.z);
+					children[n++] = Vector3d(pt.x + 1, pt.y, pt.z);
+					children[n++] = Vector3d(pt.x - 1, pt.y, pt.z);
+					children[n++] = Vector3d(pt.x, pt.y, pt.z + 1);
+					children[n++] = Vector3d(pt.x, pt.y, pt.z - 1);
+				} else {
+					// 0, 1, 1
+					children[n++] = Vector3d(pt.x, pt.y + sy, pt.z);
+					children[n++] = Vector3d(pt.x, pt.y, pt.z + sz);
+					children[n++] = Vector3d(pt.x + 1, pt.y, pt.z);
+					children[n++] = Vector3d(pt.x - 1, pt.y, pt.z);
+				}
+			}
+		} else {
+			if (!sy) {
+				if (!sz) {
+					// 1, 0, 0
+					children[n++] = Vector3d(pt.x + sx, pt.y, pt.z);
+					children[n++] = Vector3d(pt.x, pt.y + 1, pt.z);
+					children[n++] = Vector3d(pt.x, pt.y - 1, pt.z);
+					children[n++] = Vector3d(pt.x, pt.y, pt.z + 1);
+					children[n++] = Vector3d(pt.x, pt.y, pt.z - 1);
+				} else {
+					// 1, 0, 1
+					children[n++] = Vector3d(pt.x + sx, pt.y, pt.z);
+					children[n++] = Vector3d(pt.x, pt.y, pt.z + sz);
+					children[n++] = Vector3d(pt.x, pt.y + 1, pt.z);
+					children[n++] = Vector3d(pt.x, pt.y - 1, pt.z);
+				}
+			} else {
+				// 1, 1, 0
+				children[n++] = Vector3d(pt.x + sx, pt.y, pt.z);
+				children[n++] = Vector3d(pt.x, pt.y + sy, pt.z);
+				children[n++] = Vector3d(pt.x, pt.y, pt.z + 1);
+				children[n++] = Vector3d(pt.x, pt.y, pt.z - 1);
+			}
+		}
+	}
+	return n;
+}
+
+#if	USE_VOLUME_DATA != 1
+/// expand part of oldcells on worker thread: phase 1 claims cells, phase 2 reads claimed ones
+void DiamondVisitor::expandPart(int phase, int part, int partCount) {
+	DiamondVisitorPool::Part & p = pool->parts[part];
+	if (phase == 1) {
+		int count = oldcells.length();
+		int start = (int)((lUInt64)count * part / partCount);
+		int end = (int)((lUInt64)count * (part + 1) / partCount);
+		Vector3d forward = position->direction.forward;
+		Vector3d children[6];
+		p.candidates.clear();
+		for (int i = start; i < end; i++) {
+			int n = diamondChildren(oldcells[i], children);
+			for (int k = 0; k < n; k++) {
+				Vector3d v = children[k];
+				if (v * forward < dist / 3)
+					continue;
+				DiamondVisitorPool::Candidate c;
+				c.v = v;
+				c.index = cellIndex(v);
+				c.key = shellKey + i * 6 + k;
+				// smaller key wins: the first visit in single threaded order
+				unsigned int old = claims[c.index].load(std::memory_order_relaxed);
+				while (old > c.key && !claims[c.index].compare_exchange_weak(old, c.key, std::memory_order_relaxed))
+					;
+				if (old > c.key)
+					p.candidates.append(c);
+			}
+		}
+	} else {
+		p.visits.clear();
+		p.newcells.clear();
+		for (int i = 0; i < p.candidates.length(); i++) {
+			DiamondVisitorPool::Candidate & c = p.candidates[i];
+			// lost to cell of earlier part
+			if (claims[c.index].load(std::memory_order_relaxed) != c.key)
+				continue;
+			Vector3d pos = pos0 + c.v;
+			cell_t cell = p.reader.getCell(pos);
+			if (BLOCK_TYPE_VISIBLE[cell]) {
+				DiamondVisitorPool::Visit visit;
+				visit.pos = pos;
+				visit.cell = cell;
+				visit.faces = visibleFaces(p.reader, c.v, pos);
+				p.visits.append(visit);
+			}
+			if (BLOCK_TYPE_CAN_PASS[cell])
+				p.newcells.append(c.v);
+		}
+	}
+}
 
+/// expand shell dist on all threads; results are passed to visitor in the same order as visitCell() would do
+void DiamondVisitor::expandShellParallel() {
+	pool->run(1);
+	pool->run(2);
+	for (int i = 0; i < pool->partCount; i++) {
+		DiamondVisitorPool::Part & p = pool->parts[i];
+		for (int j = 0; j < p.visits.length(); j++) {
+			DiamondVisitorPool::Visit & visit = p.visits[j];
+			visitor->visit(world, *position, visit.pos, visit.cell, visit.faces);
+		}
+		for (int j = 0; j < p.newcells.length(); j++)
+			newcells.append(p.newcells[j]);
+	}
+}
+#endif
 
 void DiamondVisitor::visitAll(int maxDistance) {
 	maxDist = maxDistance;
@@ -864,26 +5051,39 @@ void DiamondVisitor::visitAll(int maxDistance) {
 #if	USE_VOLUME_DATA == 1
 	oldcells.append(volume->getIndex(Vector3d(0, 0, 0)));
 #else
+	if (maxDistance > DIAMOND_MAX_SHELL)
+		maxDistance = DIAMOND_MAX_SHELL;
 	int sz = ((1 << maxDistBits) * (1 << maxDistBits)) << 2;
-	visited.clear();
-	visited.append(0, sz);
-	visited_ptr = visited.ptr();
-	visitedOccupied = 2;
-	visitedEmpty = 3;
+	if (claimCount < sz) {
+		delete[] claims;
+		claims = new std::atomic<unsigned int>[sz];
+		claimCount = sz;
+	}
+	for (int i = 0; i < sz; i++)
+		claims[i].store(DIAMOND_NO_CLAIM, std::memory_order_relaxed);
+	if (pool)
+		for (int i = 0; i < pool->partCount; i++)
+			pool->parts[i].reader.init(world);
 	oldcells.clear();
 	oldcells.append(Vector3d(0, 0, 0));
 #endif
 
+	Vector3d children[6];
 	for (; dist < maxDistance; dist++) {
 		// for each distance
 		if (oldcells.length() == 0) // no cells to pass through
 			break;
 		newcells.clear();
+		CRLog::trace("dist: %d cells: %d", dist, oldcells.length());
 #if	USE_VOLUME_DATA != 1
-		visitedOccupied += 2;
-		visitedEmpty += 2;
+		// keys of older shells are greater, so claims are not reset between shells
+		shellKey = (unsigned int)(DIAMOND_MAX_SHELL - dist) << DIAMOND_SHELL_KEY_BITS;
+		if (pool && oldcells.length() >= minParallelCells && oldcells.length() * 6 < (1 << DIAMOND_SHELL_KEY_BITS)) {
+			expandShellParallel();
+			newcells.swap(oldcells);
+			continue;
+		}
 #endif
-		CRLog::trace("dist: %d cells: %d", dist, oldcells.length());
 		for (int i = 0; i < oldcells.length(); i++) {
 #if	USE_VOLUME_DATA == 1
 			int oldindex = oldcells[i];
@@ -891,75 +5091,9 @@ void DiamondVisitor::visitAll(int maxDistance) {
 #else
 			Vector3d pt = oldcells[i];
 #endif
-			int sx = mySign(pt.x);
-			int sy = mySign(pt.y);
-			int sz = mySign(pt.z);
-			if (sx && sy && sz) {
-				// 1, 1, 1
-				visitCell(Vector3d(pt.x + sx, pt.y, pt.z));
-				visitCell(Vector3d(pt.x, pt.y + sy, pt.z));
-				visitCell(Vector3d(pt.x, pt.y, pt.z + sz));
-			} else {
-				// has 0 in one of coords
-				if (!sx) {
-					if (!sy) {
-						if (!sz) {
-							// 0, 0, 0
-							visitCell(Vector3d(pt.x + 1, pt.y, pt.z));
-							visitCell(Vector3d(pt.x - 1, pt.y, pt.z));
-							visitCell(Vector3d(pt.x, pt.y + 1, pt.z));
-							visitCell(Vector3d(pt.x, pt.y - 1, pt.z));
-							visitCell(Vector3d(pt.x, pt.y, pt.z + 1));
-							visitCell(Vector3d(pt.x, pt.y, pt.z - 1));
-						} else {
-							// 0, 0, 1
-							visitCell(Vector3d(pt.x, pt.y, pt.z + sz));
-							visitCell(Vector3d(pt.x + 1, pt.y, pt.z));
-							visitCell(Vector3d(pt.x - 1, pt.y, pt.z));
-							visitCell(Vector3d(pt.x, pt.y + 1, pt.z));
-							visitCell(Vector3d(pt.x, pt.y - 1, pt.z));
-						}
-					} else {
-						if (!sz) {
-							// 0, 1, 0
-							visitCell(Vector3d(pt.x, pt.y + sy, pt.z));
-							visitCell(Vector3d(pt.x + 1, pt.y, pt.z));
-							visitCell(Vector3d(pt.x - 1, pt.y, pt.z));
-							visitCell(Vector3d(pt.x, pt.y, pt.z + 1));
-							visitCell(Vector3d(pt.x, pt.y, pt.z - 1));
-						} else {
-							// 0, 1, 1
-							visitCell(Vector3d(pt.x, pt.y + sy, pt.z));
-							visitCell(Vector3d(pt.x, pt.y, pt.z + sz));
-							visitCell(Vector3d(pt.x + 1, pt.y, pt.z));
-							visitCell(Vector3d(pt.x - 1, pt.y, pt.z));
-						}
-					}
-				} else {
-					if (!sy) {
-						if (!sz) {
-							// 1, 0, 0
-							visitCell(Vector3d(pt.x + sx, pt.y, pt.z));
-							visitCell(Vector3d(pt.x, pt.y + 1, pt.z));
-							visitCell(Vector3d(pt.x, pt.y - 1, pt.z));
-							visitCell(Vector3d(pt.x, pt.y, pt.z + 1));
-							visitCell(Vector3d(pt.x, pt.y, pt.z - 1));
-						} else {
-							// 1, 0, 1
-							visitCell(Vector3d(pt.x + sx, pt.y, pt.z));
-							visitCell(Vector3d(pt.x, pt.y, pt.z + sz));
-							visitCell(Vector3d(pt.x, pt.y + 1, pt.z));
-							visitCell(Vector3d(pt.x, pt.y - 1, pt.z));
-						}
-					} else {
-						// 1, 1, 0
-						visitCell(Vector3d(pt.x + sx, pt.y, pt.z));
-						visitCell(Vector3d(pt.x, pt.y + sy, pt.z));
-						visitCell(Vector3d(pt.x, pt.y, pt.z + 1));
-						visitCell(Vector3d(pt.x, pt.y, pt.z - 1));
-					}
-				}
-			}
+			int n = diamondChildren(pt, children);
+			for (int k = 0; k < n; k++)
+				visitCell(children[k]);
 		}
 		newcells.swap(oldcells);
 	}
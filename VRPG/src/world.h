@@ -2,7 +2,9 @@
 #define WORLD_H_INCLUDED
 
 #include <stdlib.h>
+#include <atomic>
 #include "worldtypes.h"
+#include "blocks.h"
 
 const int MAX_VIEW_DISTANCE_BITS = 7;
 const int MAX_VIEW_DISTANCE = (1 << MAX_VIEW_DISTANCE_BITS);
@@ -16,48 +18,404 @@ const int MAX_VIEW_DISTANCE = (1 << MAX_VIEW_DISTANCE_BITS);
 #define CHUNK_DY (1<<CHUNK_DY_SHIFT)
 #define CHUNK_DY_MASK (CHUNK_DY - 1)
 
+// Section is 16 (CHUNK_SECTION_SHIFT) layers of chunk
+#define CHUNK_SECTION_SHIFT 4
+#define CHUNK_SECTION_COUNT (CHUNK_DY >> CHUNK_SECTION_SHIFT)
+
 extern bool HIGHLIGHT_GRID;
 
-// Layer is 256x16x16 CHUNK_DY layers = CHUNK_DY * (CHUNK_DX_SHIFT x CHUNK_DX_SHIFT) cells
+/// memory pools for chunk data
+extern PoolAllocator CHUNK_POOL;
+extern PoolAllocator CHUNK_LAYER_POOL;
+/// ChunkLayer palette + index buffers for 1, 2, 4, 8 bits per index
+extern PoolAllocator CHUNK_LAYER_BUFFER_POOLS[4];
+/// writes pool occupancy and fragmentation to log
+void logChunkPoolStats();
+
+/// Kinds of cell property bit masks of layer rows: bit x of row mask is set when cell x of row has the property
+enum CellMaskKind {
+	CELL_MASK_OPAQUE,   // BLOCK_TYPE_OPAQUE, except BOUND_SKY (as in World::isOpaque)
+	CELL_MASK_CAN_PASS, // BLOCK_TYPE_CAN_PASS
+	CELL_MASK_VISIBLE,  // BLOCK_TYPE_VISIBLE
+	CELL_MASK_NON_EMPTY, // cell != NO_CELL
+	CELL_MASK_COUNT
+};
+
+/// cell property for mask kind
+inline bool cellMaskFlag(int kind, cell_t cell) {
+	if (kind == CELL_MASK_OPAQUE)
+		return BLOCK_TYPE_OPAQUE[cell] && cell != BOUND_SKY;
+	if (kind == CELL_MASK_NON_EMPTY)
+		return cell != NO_CELL;
+	return kind == CELL_MASK_CAN_PASS ? BLOCK_TYPE_CAN_PASS[cell] : BLOCK_TYPE_VISIBLE[cell];
+}
+
+/// Layer of 16x16 cells stored as palette of distinct cell values + 1, 2, 4 or 8 bit index per cell
+/// Index width is increased on demand, when palette has no free entry for new value
+/// In 8 bit mode palette is identity mapping, so there is no limit on number of distinct values
 struct ChunkLayer {
 private:
-	cell_t cells[CHUNK_DX * CHUNK_DX];
+	unsigned char bits;  // bits per cell index: 1, 2, 4 or 8
+	unsigned char shift; // log2(bits)
+	unsigned short paletteSize; // number of used palette entries
+	/// number of chunks sharing this layer; shared layer is read only
+	std::atomic<int> refCount;
+	/// (1 << bits) palette cell values, (1 << bits) unsigned short palette entry usage counters, index bits
+	unsigned char * buf;
+	inline cell_t * palette() { return buf; }
+	inline unsigned short * counts() { return (unsigned short*)(buf + (1 << bits)); }
+	inline unsigned char * indexes() { return buf + (3 << bits); }
+	inline int getIndex(int i) {
+		int bitpos = i << shift;
+		return (indexes()[bitpos >> 3] >> (bitpos & 7)) & ((1 << bits) - 1);
+	}
+	inline void setIndex(int i, int index) {
+		int bitpos = i << shift;
+		unsigned char * p = indexes() + (bitpos >> 3);
+		int mask = ((1 << bits) - 1) << (bitpos & 7);
+		*p = (unsigned char)((*p & ~mask) | (index << (bitpos & 7)));
+	}
+	/// find or allocate palette entry for cell value, returns -1 if palette is full
+	int paletteIndex(cell_t cell);
+	/// increase bits per cell index
+	void widen();
+	/// layer with uninitialized palette and indexes, filled by ChunkCodec
+	ChunkLayer(int indexBits, int indexShift, int distinct);
+	/// recalculate palette entry usage counters from indexes, returns false if some index is out of palette
+	bool updateCounts();
+	friend struct ChunkCodec;
 public:
-	ChunkLayer() {
-		for (int x = 0; x < CHUNK_DX; x++)
-			for (int z = 0; z < CHUNK_DX; z++)
-				cells[(z << CHUNK_DX_SHIFT) + x] = NO_CELL;
+	ChunkLayer(cell_t fill = NO_CELL);
+	/// layer with CHUNK_DX * CHUNK_DX cells from array (row by row); cells must not be all the same
+	ChunkLayer(const cell_t * cells);
+	/// copy of layer which is not shared
+	ChunkLayer(const ChunkLayer & src);
+	~ChunkLayer() {
+		CHUNK_LAYER_BUFFER_POOLS[shift].free(buf);
 	}
-	inline cell_t* ptr(int x, int z) {
-		//if (!this)
-		//	return NO_CELL;
-		return cells + (z << CHUNK_DX_SHIFT) + x;
+	void retain() { refCount.fetch_add(1, std::memory_order_relaxed); }
+	/// delete layer when the last reference is released
+	void release() {
+		if (refCount.fetch_sub(1, std::memory_order_acq_rel) == 1)
+			delete this;
+	}
+	/// layer is used by several chunks (world and snapshots) and must be copied before change
+	bool isShared() { return refCount.load(std::memory_order_acquire) > 1; }
+	static void * operator new(size_t size) {
+		return CHUNK_LAYER_POOL.alloc();
 	}
+	static void operator delete(void * p) {
+		CHUNK_LAYER_POOL.free(p);
+	}
+	/// size of palette + index buffer for specified bits per index
+	static int bufSize(int bits) {
+		return (3 << bits) + ((CHUNK_DX * CHUNK_DX * bits) >> 3);
+	}
+	/// bits per cell index: 1, 2, 4 or 8
+	int indexBits() { return bits; }
+	/// number of distinct values in palette (including unused entries)
+	int distinctValues() { return paletteSize; }
+	/// number of cells with value cell, from palette entry usage counters
+	int cellCount(cell_t cell) {
+		int count = 0;
+		for (int i = 0; i < paletteSize; i++)
+			if (palette()[i] == cell)
+				count += counts()[i];
+		return count;
+	}
+	/// set used[cell] for cell values of palette entries which are in use
+	void getUsedCells(bool * used) {
+		for (int i = 0; i < paletteSize; i++)
+			if (counts()[i])
+				used[palette()[i]] = true;
+	}
+	/// approximate heap memory used by layer, in bytes
+	int memoryUsage() { return sizeof(ChunkLayer) + bufSize(bits); }
 	inline cell_t get(int x, int z) {
-		//if (!this)
-		//	return NO_CELL;
-		return cells[(z << CHUNK_DX_SHIFT) + x];
+		return buf[getIndex((z << CHUNK_DX_SHIFT) + x)];
 	}
-	inline void set(int x, int z, cell_t cell) {
-		cells[(z << CHUNK_DX_SHIFT) + x] = cell;
+	/// returns true if after this change all cells of layer have the same value
+	inline bool set(int x, int z, cell_t cell) {
+		int i = (z << CHUNK_DX_SHIFT) + x;
+		int oldIndex = getIndex(i);
+		if (buf[oldIndex] == cell)
+			return false;
+		int index = paletteIndex(cell);
+		if (index < 0) {
+			widen();
+			index = paletteIndex(cell);
+			// indexes of 8 bit layer are cell values
+			oldIndex = getIndex(i);
+		}
+		counts()[oldIndex]--;
+		setIndex(i, index);
+		return ++counts()[index] == CHUNK_DX * CHUNK_DX;
 	}
+	/// property bits of CHUNK_DX cells of row z, bit x is cell x; kind is CellMaskKind
+	/// computed from packed indexes: fields of palette entries which have the property are matched all at once
+	unsigned short getRowMask(int kind, int z);
+	/// set all cells of rectangle [x0, x1) x [z0, z1), full rows are written with memset
+	/// returns true if after this change all cells of layer have the same value
+	bool fill(int x0, int z0, int x1, int z1, cell_t cell);
+	/// number of cells of rectangle [x0, x1) x [z0, z1) which have match[cell] set
+	/// palette entry usage counters (kept up to date by set() and fill()) are summed; cells are scanned only for partial rectangle
+	int countCells(int x0, int z0, int x1, int z1, const bool * match);
+	/// decode dx*dz rectangle starting from x, z to dst, dststride is dst row size
+	void getCells(int x, int z, int dx, int dz, cell_t * dst, int dststride);
+};
+
+/// Chunk cells stored as runs of equal cells in each column, from bottom to top
+/// Heightfield terrain (bedrock, a few layers of terrain, then air) takes a few runs per column.
+/// Runs of all columns are kept in single buffer, column by column; the last run of column always ends at CHUNK_DY.
+struct ChunkColumns {
+	struct Run {
+		unsigned char end; // y of the first cell above run
+		cell_t cell;
+	};
+private:
+	Run * runs;
+	int capacity;
+	/// runs of column i are runs[offsets[i]] .. runs[offsets[i + 1] - 1]; index is z * CHUNK_DX + x
+	unsigned short offsets[CHUNK_DX * CHUNK_DX + 1];
+	/// replace runs of column i with count runs from src
+	void replaceColumn(int i, const Run * src, int count);
+public:
+	/// all columns are empty
+	ChunkColumns();
+	/// columns from cells of layers 0..dy-1, index of cell is y * CHUNK_DX * CHUNK_DX + z * CHUNK_DX + x; layers above are empty
+	ChunkColumns(const cell_t * cells, int dy);
+	ChunkColumns(const ChunkColumns & src);
+	~ChunkColumns();
+	/// number of runs in cells of layers 0..dy-1 (layout is the same as for constructor); counts of columns are put to columnRuns
+	static int countRuns(const cell_t * cells, int dy, unsigned short * columnRuns);
+	/// memory used by columns with specified number of runs, in bytes
+	static int memoryUsage(int runCount) { return sizeof(ChunkColumns) + runCount * sizeof(Run); }
+	int memoryUsage() { return sizeof(ChunkColumns) + capacity * sizeof(Run); }
+	/// memory used by columns of all chunks, in bytes
+	static int totalMemoryUsage();
+	int runCount() { return offsets[CHUNK_DX * CHUNK_DX]; }
+	/// runs of column x, z, bottom up
+	const Run * getColumn(int x, int z, int & count) {
+		int i = (z << CHUNK_DX_SHIFT) + x;
+		count = offsets[i + 1] - offsets[i];
+		return runs + offsets[i];
+	}
+	/// binary search of run containing y
+	inline cell_t get(int x, int y, int z) {
+		int i = (z << CHUNK_DX_SHIFT) + x;
+		int a = offsets[i];
+		int b = offsets[i + 1] - 1;
+		while (a < b) {
+			int m = (a + b) >> 1;
+			if (runs[m].end > y)
+				b = m;
+			else
+				a = m + 1;
+		}
+		return runs[a].cell;
+	}
+	/// set cells y0 <= y < y1 of column x, z
+	void fill(int x, int z, int y0, int y1, cell_t cell);
+	/// decode dx*dz rectangle of layer y starting from x, z to dst, dststride is dst row size
+	void getCells(int x, int y, int z, int dx, int dz, cell_t * dst, int dststride);
+};
+
+/// how cells of chunk are stored
+enum ChunkStorage {
+	/// ChunkLayer for each non-uniform layer; fast edits
+	CHUNK_STORAGE_LAYERS,
+	/// runs of equal cells in columns (ChunkColumns); small for heightfield terrain, slow edits
+	CHUNK_STORAGE_COLUMNS,
+};
+
+/// Block entities of chunk: state of cells which doesn't fit into cell_t (chest contents, orientation, growth stage, sign text)
+/// Sparse: only cells which have entities are stored, sorted by cell index; sorted (type, cell index) keys are index of positions by type.
+/// Payload is byte string interpreted by owner of entity type, world only copies and stores it.
+struct ChunkEntities {
+	struct Entity {
+		unsigned short index; // cell index, see cellIndex()
+		unsigned short type;  // e.g. block id
+		int size;
+		unsigned char * data; // malloc'ed, NULL if size is 0
+	};
+private:
+	Entity * items;
+	/// (type << 16) | index of each entity, ascending
+	unsigned int * byType;
+	int count;
+	int capacity;
+	/// sum of payload sizes
+	int dataBytes;
+	/// position of entity of cell index in items, or -(insert position) - 1
+	int find(int index);
+	/// position of key in byType, or -(insert position) - 1
+	int findKey(unsigned int key);
+public:
+	/// max size of entity payload, in bytes
+	static const int MAX_DATA_SIZE = 0xFFFF;
+	ChunkEntities();
+	ChunkEntities(const ChunkEntities & src);
+	~ChunkEntities();
+	/// index of cell x, y, z (chunk coordinates)
+	static inline int cellIndex(int x, int y, int z) {
+		return ((((y & CHUNK_DY_MASK) << CHUNK_DX_SHIFT) + z) << CHUNK_DX_SHIFT) + x;
+	}
+	/// position of cell index in chunk coordinates
+	static inline Vector3d cellPosition(int index) {
+		return Vector3d(index & CHUNK_DX_MASK, index >> (CHUNK_DX_SHIFT * 2), (index >> CHUNK_DX_SHIFT) & CHUNK_DX_MASK);
+	}
+	int length() { return count; }
+	/// entities by ascending cell index
+	const Entity & operator[](int i) { return items[i]; }
+	/// entity of cell, NULL if cell has no entity
+	const Entity * get(int index) {
+		int i = find(index);
+		return i >= 0 ? items + i : NULL;
+	}
+	/// put entity to cell, replacing old one; data is copied
+	void set(int index, int type, const unsigned char * data, int size);
+	/// returns false if cell has no entity
+	bool remove(int index);
+	/// append cell indexes of entities of type (ascending) to out; returns number of found entities
+	int findByType(int type, IntArray & out);
+	int memoryUsage() { return sizeof(ChunkEntities) + capacity * (sizeof(Entity) + sizeof(unsigned int)) + dataBytes; }
+	/// memory used by block entities of all chunks, in bytes
+	static int totalMemoryUsage();
 };
 
 struct Chunk {
 private:
+	/// layers which have different cells; NULL for uniform layers
 	ChunkLayer * layers[CHUNK_DY];
+	/// cell value of all cells for layers which are not allocated
+	cell_t uniform[CHUNK_DY];
+	/// column storage; when set, all layers are NULL and uniform values are not used
+	ChunkColumns * columns;
+	/// number of set() and fill() calls since chunk is created or loaded
+	unsigned short edits;
 	int bottomLayer;
 	int topLayer;
+	/// world access clock value at last access, for LRU eviction
+	std::atomic<unsigned int> lastAccess;
+	/// number of owners: world and snapshots; shared chunk is read only
+	std::atomic<int> refCount;
+	/// chunk has changes which are not saved
+	bool dirty;
+	/// incremented on each change of chunk cells
+	unsigned int version;
+	/// chunk version at the last change of each section
+	unsigned int sectionVersions[CHUNK_SECTION_COUNT];
+	/// cells encoded with ChunkCodec (malloc'ed) while chunk is compressed; layers and columns are freed then
+	std::atomic<unsigned char *> compressed;
+	int compressedSize;
+	/// chunk had column storage before compression
+	bool compressedColumns;
+	/// chunks next to this one in directions NORTH, SOUTH, WEST, EAST, maintained by linked ChunkMatrix
+	Chunk * neighbours[4];
+	/// block entities, NULL if chunk has none; not affected by compression
+	ChunkEntities * entities;
+	/// global block ids of alias cells (BLOCK_CELL_ALIAS) in this chunk, 0 if not assigned; NULL if chunk never had large block ids
+	/// not affected by compression
+	block_id_t * blockIds;
+	/// heightmap, index is z * CHUNK_DX + x: y + 1 of topmost opaque cell of column, 0 if column has no opaque cells
+	unsigned char opaqueHeight[CHUNK_DX * CHUNK_DX];
+	/// y + 1 of topmost non-empty cell of column, 0 if column is empty
+	unsigned char nonEmptyHeight[CHUNK_DX * CHUNK_DX];
+	static inline bool isOpaqueCell(cell_t cell) {
+		return BLOCK_TYPE_OPAQUE[cell] && cell != BOUND_SKY;
+	}
+	/// y + 1 of topmost opaque (or non-empty) cell of column below y, 0 if there is no such cell
+	int scanHeight(int x, int z, int y, bool opaque);
+	/// update heightmap after cells y0 <= y < y1 of column x, z are changed to cell
+	/// column is rescanned only when its topmost cell is removed
+	inline void updateHeight(int x, int z, int y0, int y1, cell_t cell) {
+		int i = (z << CHUNK_DX_SHIFT) + x;
+		if (cell != NO_CELL) {
+			if (nonEmptyHeight[i] < y1)
+				nonEmptyHeight[i] = y1;
+		} else if (nonEmptyHeight[i] > y0 && nonEmptyHeight[i] <= y1) {
+			nonEmptyHeight[i] = scanHeight(x, z, y0, false);
+		}
+		if (isOpaqueCell(cell)) {
+			if (opaqueHeight[i] < y1)
+				opaqueHeight[i] = y1;
+		} else if (opaqueHeight[i] > y0 && opaqueHeight[i] <= y1) {
+			opaqueHeight[i] = scanHeight(x, z, y0, true);
+		}
+	}
+	/// advance version of chunk and sections of layers y0 <= y < y1
+	inline void changed(int y0, int y1) {
+		version++;
+		for (int i = y0 >> CHUNK_SECTION_SHIFT; i <= (y1 - 1) >> CHUNK_SECTION_SHIFT; i++)
+			sectionVersions[i] = version;
+	}
+	/// replace shared layer with its copy before change
+	ChunkLayer * unshareLayer(int layerIndex) {
+		ChunkLayer * layer = new ChunkLayer(*layers[layerIndex]);
+		layers[layerIndex]->release();
+		layers[layerIndex] = layer;
+		return layer;
+	}
+	void updateLayerBounds(int layerIndex) {
+		if (topLayer == -1 || topLayer < layerIndex)
+			topLayer = layerIndex;
+		if (bottomLayer == -1 || bottomLayer > layerIndex)
+			bottomLayer = layerIndex;
+	}
+	/// replace layer cells, without version and heightmap update
+	void storeLayerCells(int y, const cell_t * cells);
+	/// set() for chunk with column storage
+	void setColumnCell(int x, int y, int z, cell_t cell);
+	/// allocate empty block ids of alias cells
+	void allocBlockIds();
+	/// count edit of chunk with column storage; it's converted to layers when edited too often or too fragmented
+	void columnsEdited();
+	/// getRowMask() for chunk with column storage: masks are not stored, row is decoded
+	unsigned short getColumnRowMask(int kind, int y, int z);
+	/// compressed data + sizeof(Chunk) under lock, or -1 if chunk is not compressed anymore
+	int compressedMemoryUsage();
+	friend struct ChunkMatrix;
+	friend struct ChunkCodec;
 public:
-	Chunk() : bottomLayer(-1), topLayer(-1) {
-		for (int i = 0; i < CHUNK_DY; i++)
+	/// column storage is dropped after this number of edits
+	static const int COLUMN_STORAGE_MAX_EDITS = 64;
+	/// column storage is not used when chunk has more runs (8 per column in average)
+	static const int COLUMN_STORAGE_MAX_RUNS = CHUNK_DX * CHUNK_DX * 8;
+	Chunk() : columns(NULL), edits(0), bottomLayer(-1), topLayer(-1), lastAccess(0), refCount(1), dirty(false), version(0)
+		, compressed(NULL), compressedSize(0), compressedColumns(false), entities(NULL), blockIds(NULL) {
+		for (int i = 0; i < CHUNK_DY; i++) {
 			layers[i] = NULL;
+			uniform[i] = NO_CELL;
+		}
+		for (int i = 0; i < CHUNK_SECTION_COUNT; i++)
+			sectionVersions[i] = 0;
+		for (int i = 0; i < 4; i++)
+			neighbours[i] = NULL;
+		memset(opaqueHeight, 0, sizeof(opaqueHeight));
+		memset(nonEmptyHeight, 0, sizeof(nonEmptyHeight));
 	}
-	~Chunk() {
-		for (int i = 0; i < CHUNK_DY; i++)
-			if (layers[i])
-				delete layers[i];
+	/// copy of chunk which shares all layers with source; layers are copied on write; block entities are copied, neighbour links are not
+	Chunk(const Chunk & src);
+	~Chunk();
+	static void * operator new(size_t size) {
+		return CHUNK_POOL.alloc();
+	}
+	static void operator delete(void * p) {
+		CHUNK_POOL.free(p);
+	}
+	void retain() { refCount.fetch_add(1, std::memory_order_relaxed); }
+	/// delete chunk when the last reference is released
+	void release() {
+		if (refCount.fetch_sub(1, std::memory_order_acq_rel) == 1)
+			delete this;
 	}
+	/// chunk is referenced by snapshot and must be copied before change
+	bool isShared() { return refCount.load(std::memory_order_acquire) > 1; }
+	/// chunk at the same chunk y next to this one in direction dir (NORTH, SOUTH, WEST or EAST), NULL if there is no chunk
+	/// links are kept by world chunk matrix only: they are not valid for chunk which is removed from world (e.g. kept by snapshot)
+	/// neighbour may be compressed
+	inline Chunk * getNeighbour(int dir) { return neighbours[dir]; }
+	void clearLinks() { neighbours[NORTH] = neighbours[SOUTH] = neighbours[WEST] = neighbours[EAST] = NULL; }
 	int getMinLayer() { return bottomLayer; }
 	int getMaxLayer() { return topLayer; }
 	void updateMinMaxLayer(int & minLayer, int & maxLayer) {
@@ -66,33 +424,165 @@ public:
 		if (maxLayer == -1 || maxLayer < topLayer)
 			maxLayer = topLayer;
 	}
+	/// mark chunk as used at specified world access clock value
+	inline void touch(unsigned int clock) {
+		if (lastAccess.load(std::memory_order_relaxed) != clock)
+			lastAccess.store(clock, std::memory_order_relaxed);
+	}
+	unsigned int getLastAccess() { return lastAccess.load(std::memory_order_relaxed); }
+	bool isDirty() { return dirty; }
+	void setDirty(bool flg) { dirty = flg; }
+	/// version of chunk cells, incremented on each change; 0 for chunk which is not changed since creation or loading
+	unsigned int getVersion() { return version; }
+	/// chunk version at the last change of section of layer y
+	unsigned int getSectionVersion(int y) { return sectionVersions[(y & CHUNK_DY_MASK) >> CHUNK_SECTION_SHIFT]; }
+	/// cells are compressed by compress(); chunk is decompressed on access through ChunkMatrix::get()
+	/// compressed chunk shared with snapshot may be decompressed by another thread at any time,
+	/// while chunk which is not compressed can only be compressed on the thread which owns world
+	bool isCompressed() { return compressed.load(std::memory_order_acquire) != NULL; }
+	/// replace layers or columns with data encoded by ChunkCodec::encodeCells(); chunk takes ownership of malloc'ed data
+	/// chunk must not be shared
+	void compress(unsigned char * data, int size);
+	/// decode compressed cells back to layers (or columns); does nothing if chunk is not compressed; thread safe
+	void decompress();
+	/// append compressed data to buf; returns false if chunk is not compressed
+	bool getCompressedData(Array<unsigned char> & buf);
+	/// memory used by compressed data of all chunks, in bytes
+	static int compressedDataUsage();
+	/// memory used by block ids of alias cells of all chunks, in bytes
+	static int blockIdsMemoryUsage();
+	/// memory used by chunk, its layers, block entities and block ids, in bytes
+	int memoryUsage() {
+		int res = entities ? entities->memoryUsage() : 0;
+		if (blockIds)
+			res += 256 * sizeof(block_id_t);
+		if (isCompressed()) {
+			int compressedUsage = compressedMemoryUsage();
+			if (compressedUsage >= 0)
+				return res + compressedUsage;
+		}
+		res += sizeof(Chunk);
+		if (columns)
+			res += columns->memoryUsage();
+		for (int i = 0; i < CHUNK_DY; i++)
+			if (layers[i])
+				res += layers[i]->memoryUsage();
+		return res;
+	}
+	/// returns true if all cells of layer have the same value (layer is not allocated)
+	bool isUniformLayer(int y);
+	/// returns true if layer is not allocated and all its cells are NO_CELL; false for column storage
+	inline bool isEmptyLayer(int y) {
+		y &= CHUNK_DY_MASK;
+		return !layers[y] && !columns && uniform[y] == NO_CELL;
+	}
+	/// global block id of cell value of this chunk
+	inline block_id_t cellBlockId(cell_t cell) {
+		return blockIds && blockIds[cell] ? blockIds[cell] : BLOCK_CELL_IDS[cell];
+	}
+	/// cell value of this chunk for global block id; alias cell is assigned to large block id on first use
+	/// NO_CELL if block type is not registered or there are no free cell values
+	cell_t blockCell(block_id_t id);
+	/// set used[cell] for each cell value which occurs in chunk
+	void getUsedCells(bool * used);
+	/// block entities of chunk, NULL if there are none
+	ChunkEntities * getEntities() { return entities; }
+	/// block entity of cell x, y, z (chunk coordinates), NULL if there is none
+	const ChunkEntities::Entity * getEntity(int x, int y, int z) {
+		return entities ? entities->get(ChunkEntities::cellIndex(x, y, z)) : NULL;
+	}
+	/// attach entity to cell, replacing old one; data is copied; cell is not changed
+	void setEntity(int x, int y, int z, int type, const unsigned char * data, int size);
+	/// returns false if cell has no entity; storage is freed with the last entity
+	bool removeEntity(int x, int y, int z);
+	ChunkStorage getStorage() { return columns ? CHUNK_STORAGE_COLUMNS : CHUNK_STORAGE_LAYERS; }
+	/// convert cells to another storage; cells and version are not changed
+	void setStorage(ChunkStorage storage);
+	/// switch to column storage if chunk is rarely edited and columns take less memory than layers
+	void optimizeStorage();
+	/// number of allocated (non-uniform) layers
+	int layerCount() {
+		int count = 0;
+		for (int i = 0; i < CHUNK_DY; i++)
+			if (layers[i])
+				count++;
+		return count;
+	}
 	inline cell_t get(int x, int y, int z) {
 		//if (!this)
 		//	return NO_CELL;
-		ChunkLayer * layer = layers[y & CHUNK_DY_MASK];
+		int layerIndex = y & CHUNK_DY_MASK;
+		ChunkLayer * layer = layers[layerIndex];
 		if (!layer)
-			return NO_CELL;
-		return layer->get(x & CHUNK_DX_MASK, z & CHUNK_DY_MASK);
+			return columns ? columns->get(x & CHUNK_DX_MASK, layerIndex, z & CHUNK_DX_MASK) : uniform[layerIndex];
+		return layer->get(x & CHUNK_DX_MASK, z & CHUNK_DX_MASK);
 	}
 	inline void set(int x, int y, int z, cell_t cell) {
 		int layerIndex = y & CHUNK_DY_MASK;
 		ChunkLayer * layer = layers[layerIndex];
+		dirty = true;
 		if (!layer) {
-			layer = new ChunkLayer();
+			if (columns) {
+				setColumnCell(x & CHUNK_DX_MASK, layerIndex, z & CHUNK_DX_MASK, cell);
+				return;
+			}
+			if (uniform[layerIndex] == cell)
+				return;
+			// split uniform layer
+			layer = new ChunkLayer(uniform[layerIndex]);
 			layers[layerIndex] = layer;
-			if (topLayer == -1 || topLayer < layerIndex)
-				topLayer = layerIndex;
-			if (bottomLayer == -1 || bottomLayer > layerIndex)
-				bottomLayer = layerIndex;
+			updateLayerBounds(layerIndex);
+		} else if (layer->isShared()) {
+			layer = unshareLayer(layerIndex);
+		}
+		if (layer->set(x & CHUNK_DX_MASK, z & CHUNK_DX_MASK, cell)) {
+			// all cells are the same again: merge
+			uniform[layerIndex] = cell;
+			layers[layerIndex] = NULL;
+			layer->release();
 		}
-		layer->set(x & CHUNK_DX_MASK, z & CHUNK_DY_MASK, cell);
+		updateHeight(x & CHUNK_DX_MASK, z & CHUNK_DX_MASK, layerIndex, layerIndex + 1, cell);
+		version++;
+		sectionVersions[layerIndex >> CHUNK_SECTION_SHIFT] = version;
+		if (edits < 0xFFFF)
+			edits++;
+	}
+	/// property bits of CHUNK_DX cells of row z of layer y (in chunk coordinates), bit x is cell x; kind is CellMaskKind
+	inline unsigned short getRowMask(int kind, int y, int z) {
+		int layerIndex = y & CHUNK_DY_MASK;
+		ChunkLayer * layer = layers[layerIndex];
+		if (layer)
+			return layer->getRowMask(kind, z);
+		if (columns)
+			return getColumnRowMask(kind, layerIndex, z);
+		return cellMaskFlag(kind, uniform[layerIndex]) ? 0xFFFF : 0;
 	}
+	/// first free y above topmost opaque cell of column x, z (in chunk coordinates); 0 if there are no opaque cells
+	inline int getHeight(int x, int z) { return opaqueHeight[(z << CHUNK_DX_SHIFT) + x]; }
+	/// first y above topmost non-empty cell of column x, z; 0 if column is empty
+	inline int getNonEmptyHeight(int x, int z) { return nonEmptyHeight[(z << CHUNK_DX_SHIFT) + x]; }
+	/// max non-empty height of columns in rectangle x..x+dx-1, z..z+dz-1
+	int getMaxNonEmptyHeight(int x, int z, int dx, int dz);
+	/// recalculate whole heightmap from cells
+	void updateHeights();
+	/// set cells of box [x0, x1) x [y0, y1) x [z0, z1), in chunk coordinates
+	void fill(int x0, int y0, int z0, int x1, int y1, int z1, cell_t cell);
+	/// number of cells of box [x0, x1) x [y0, y1) x [z0, z1) (chunk coordinates) which have match[cell] set
+	/// computed from layer palette counters and uniform layers, column storage is counted by runs
+	int countCells(int x0, int y0, int z0, int x1, int y1, int z1, const bool * match);
+	/// decode all cells of layer to array of CHUNK_DX * CHUNK_DX cells
+	void getLayerCells(int y, cell_t * dst);
+	/// replace all cells of layer with array of CHUNK_DX * CHUNK_DX cells
+	/// when replacing many layers, pass updateHeightmap = false and call updateHeights() once after the last one
+	void setLayerCells(int y, const cell_t * cells, bool updateHeightmap = true);
 	static void dispose(Chunk * p) {
-		delete p;
+		p->release();
 	}
 
 	/// srcpos coords x, z are in chunk bounds
 	void getCells(Vector3d srcpos, Vector3d dstpos, Vector3d size, VolumeData & buf);
+	/// srcpos coords x, z are in chunk bounds; dstpos is zero based volume coordinates
+	void getCells(Vector3d srcpos, Vector3d dstpos, Vector3d size, BrickedVolumeData & buf);
 };
 
 typedef InfiniteArray<Chunk*, (Chunk*)NULL, Chunk::dispose> ChunkStripe;
@@ -100,7 +590,9 @@ void disposeChunkStripe(ChunkStripe * p);
 
 typedef InfiniteArray<ChunkStripe*, (ChunkStripe*)NULL, disposeChunkStripe> ChunkStripes;
 
-struct ChunkMatrix {
+/// Dense chunk matrix based on nested InfiniteArrays
+/// Memory is proportional to coordinate range rather than number of chunks; kept for comparison in benchmarks
+struct StripedChunkMatrix {
 	int minx;
 	int maxx;
 	int minz;
@@ -108,10 +600,10 @@ struct ChunkMatrix {
 private:
 	ChunkStripes stripes;
 public:
-	ChunkMatrix() : minx(0), maxx(0), minz(0), maxz(0) {
+	StripedChunkMatrix() : minx(0), maxx(0), minz(0), maxz(0) {
 
 	}
-	~ChunkMatrix() {
+	~StripedChunkMatrix() {
 
 	}
 	int minX() { return minx; }
@@ -142,11 +634,373 @@ public:
 	}
 };
 
+/// Chunk matrix: open addressing hash table (linear probing) with chunks keyed by packed (chunkX, chunkY, chunkZ)
+/// Chunks are stacked vertically: chunk y is cell y >> CHUNK_DY_SHIFT, so world height is not limited by CHUNK_DY,
+/// and only chunks which are created or loaded take memory.
+/// Lookup is O(1), memory is proportional to number of chunks; owns chunks
+struct ChunkMatrix {
+	int minx;
+	int maxx;
+	int miny;
+	int maxy;
+	int minz;
+	int maxz;
+	/// chunk level of world bottom
+	int bottomy;
+private:
+	struct Entry {
+		lUInt64 key;
+		Chunk * chunk; // NULL for empty slot
+	};
+	Entry * table;
+	int capacity; // power of 2
+	int count;
+	/// neighbour links of chunks are maintained
+	bool linked;
+	/// update neighbour links of chunks around position x, y, z after chunk there is replaced (chunk is NULL when removed)
+	void updateLinks(int x, int y, int z, Chunk * chunk);
+	static inline int keyField(lUInt64 key, int shift, int bits) {
+		int v = (int)((key >> shift) & ((1 << bits) - 1));
+		return v >= (1 << (bits - 1)) ? v - (1 << bits) : v;
+	}
+	static inline int hash(lUInt64 key) {
+		// fibonacci hashing
+		return (int)(((unsigned long long)key * 0x9E3779B97F4A7C15ULL) >> 40);
+	}
+	void resize(int newCapacity);
+	void removeAt(int index);
+public:
+	/// chunk position packed to 64 bits: 24 bits of x and z, 16 bits of y
+	static inline lUInt64 makeKey(int x, int y, int z) {
+		return ((lUInt64)(x & 0xFFFFFF) << 40) | ((lUInt64)(y & 0xFFFF) << 24) | (lUInt64)(z & 0xFFFFFF);
+	}
+	ChunkMatrix();
+	~ChunkMatrix();
+	int minX() { return minx; }
+	int maxX() { return maxx; }
+	/// vertical bounds of chunks ever put to matrix, always including chunk y 0; max is exclusive
+	int minY() { return miny; }
+	int maxY() { return maxy; }
+	/// chunk level of world bottom, 0 by default: cells below it are bedrock, whatever chunks exist or are missing there
+	int bottomLevel() { return bottomy; }
+	/// world bottom is set explicitly, it does not follow chunks put to matrix
+	void setBottomLevel(int chunky) { bottomy = chunky; }
+	/// y of world bottom: cells below it are bedrock
+	int bottom() { return bottomy * CHUNK_DY; }
+	int minZ() { return minz; }
+	int maxZ() { return maxz; }
+	/// number of chunks
+	int length() { return count; }
+	/// maintain Chunk::getNeighbour() links of chunks on set() and remove(); used by world matrix
+	/// chunk may be linked by one matrix only, so snapshots (which share chunks with world) don't link them
+	void setLinked(bool flg);
+	bool isLinked() { return linked; }
+	/// memory used by hash table, in bytes
+	int memoryUsage() { return sizeof(Entry) * capacity; }
+	/// chunk for reading or writing cells: compressed chunk is decompressed
+	inline Chunk * get(int x, int y, int z) {
+		Chunk * chunk = find(x, y, z);
+		if (chunk && chunk->isCompressed())
+			chunk->decompress();
+		return chunk;
+	}
+	/// chunk as is, may be compressed; use to check presence of chunk
+	inline Chunk * find(int x, int y, int z) {
+		lUInt64 key = makeKey(x, y, z);
+		int mask = capacity - 1;
+		for (int i = hash(key) & mask; ; i = (i + 1) & mask) {
+			Entry & e = table[i];
+			if (!e.chunk)
+				return NULL;
+			if (e.key == key)
+				return e.chunk;
+		}
+	}
+	/// put chunk to matrix; old chunk at the same position, if any, is released
+	void set(int x, int y, int z, Chunk * chunk);
+	/// make this matrix a copy of src with the same chunks; chunks are retained
+	void assign(ChunkMatrix & src);
+	/// remove chunk from matrix w/o deleting it, returns removed chunk or NULL if not found
+	Chunk * remove(int x, int y, int z);
+	/// number of hash table slots, for iteration with getAt()
+	int slots() { return capacity; }
+	/// returns chunk at hash table slot (NULL if slot is empty), chunk coordinates are put to x, y, z; chunk may be compressed
+	Chunk * getAt(int slot, int & x, int & y, int & z) {
+		Entry & e = table[slot];
+		if (!e.chunk)
+			return NULL;
+		x = keyField(e.key, 40, 24);
+		y = keyField(e.key, 24, 16);
+		z = keyField(e.key, 0, 24);
+		return e.chunk;
+	}
+};
+
+class World;
+
+/// Cells of single world column (x, z); chunk is resolved once for each chunk y
+struct WorldColumn {
+	ChunkMatrix * chunks;
+	Chunk * chunk;
+	int chunkx;
+	int chunky; // chunk y of cached chunk
+	int chunkz;
+	int x; // in chunk coordinates
+	int z; // in chunk coordinates
+	inline cell_t get(int y) {
+		if (y < chunks->bottom())
+			return 3; // bedrock below world bottom
+		if ((y >> CHUNK_DY_SHIFT) != chunky) {
+			chunky = y >> CHUNK_DY_SHIFT;
+			chunk = chunks->get(chunkx, chunky, chunkz);
+		}
+		if (!chunk)
+			return NO_CELL;
+		return chunk->get(x, y, z);
+	}
+};
+
+/// Box of changed cells, min <= v < max
+struct DirtyBox {
+	Vector3d min;
+	Vector3d max;
+	DirtyBox() {}
+	DirtyBox(Vector3d minv, Vector3d maxv) : min(minv), max(maxv) {}
+	bool intersects(Vector3d minv, Vector3d maxv) {
+		return min.x < maxv.x && minv.x < max.x && min.y < maxv.y && minv.y < max.y && min.z < maxv.z && minv.z < max.z;
+	}
+};
+
+/// Journal of changed boxes of world
+/// Each consumer (meshing, lighting, persistence...) keeps its own journal position and drains boxes added after it.
+/// Boxes inside the same chunk column are merged while nobody has seen them, so series of setCell calls produce few entries.
+/// When journal grows over MAX_ENTRIES it's cleared; consumers which were behind get overflow and should redo all work.
+class ChangeJournal {
+	Array<DirtyBox> boxes;
+	/// journal position of boxes[0]
+	lUInt64 firstPosition;
+	/// boxes before this index are seen by some consumer and must not be changed
+	int sealed;
+public:
+	static const int MAX_ENTRIES = 4096;
+	ChangeJournal() : firstPosition(0), sealed(0) {}
+	/// position after the last box; new consumer starts from here
+	lUInt64 endPosition() { return firstPosition + boxes.length(); }
+	/// record change of box min <= v < max
+	void add(Vector3d min, Vector3d max);
+	/// append boxes added since position to dst and move position to the end
+	/// returns false if some of them are dropped on overflow
+	bool drain(lUInt64 & position, Array<DirtyBox> & dst);
+};
+
+/// Receives chunks which are going to be evicted from memory
+class ChunkPersistence {
+public:
+	virtual ~ChunkPersistence() {}
+	/// save chunk data; hook must not keep pointer to chunk - it may be deleted right after this call
+	virtual void saveChunk(int chunkx, int chunky, int chunkz, Chunk * chunk) = 0;
+};
+
+/// Source of chunk data for ChunkProvider; may be called from several worker threads at once
+class ChunkSource {
+public:
+	virtual ~ChunkSource() {}
+	/// returns new chunk or NULL if source has no data for this position
+	virtual Chunk * loadChunk(int chunkx, int chunky, int chunkz) = 0;
+	/// chunk levels minY <= chunky < maxY this source may have data for
+	virtual void getLevels(int & minY, int & maxY) { minY = 0; maxY = 1; }
+};
+
+/// Immutable view of world chunks at the moment of World::createSnapshot(), for readers on worker threads
+/// Chunks and their layers are shared with world, so taking snapshot costs O(number of chunks);
+/// world copies shared chunk on the first change after snapshot, and shared layer on the first change of this layer.
+/// Snapshot is reference counted: each thread which uses it calls retain() and then release() when done.
+/// Only cells (and heightmap and versions) of snapshot chunks may be read; dirty flag belongs to world.
+class WorldSnapshot {
+	ChunkMatrix chunks;
+	unsigned int clock;
+	std::atomic<int> refCount;
+	~WorldSnapshot() {}
+	friend class World;
+public:
+	WorldSnapshot() : clock(0), refCount(1) {}
+	void retain() { refCount.fetch_add(1, std::memory_order_relaxed); }
+	void release() {
+		if (refCount.fetch_sub(1, std::memory_order_acq_rel) == 1)
+			delete this;
+	}
+	ChunkMatrix & getChunks() { return chunks; }
+	/// world access clock value at the moment of snapshot
+	unsigned int getAccessClock() { return clock; }
+	cell_t getCell(int x, int y, int z) {
+		if (y < chunks.bottom())
+			return 3; // bedrock below world bottom
+		Chunk * p = chunks.get(x >> CHUNK_DX_SHIFT, y >> CHUNK_DY_SHIFT, z >> CHUNK_DX_SHIFT);
+		if (!p)
+			return NO_CELL;
+		return p->get(x & CHUNK_DX_MASK, y, z & CHUNK_DX_MASK);
+	}
+};
+
+/// World read cursor with its own last chunk cache
+/// World does not change on reads, so any number of readers may be used concurrently from different threads
+/// (as long as nobody modifies world at the same time)
+/// Reader must not be used after World::evictChunks() - it may keep pointer to evicted chunk
+struct WorldReader {
+private:
+	ChunkMatrix * chunks;
+	unsigned int clock;
+	int lastChunkX;
+	int lastChunkY;
+	int lastChunkZ;
+	Chunk * lastChunk;
+	/// chunks of matrix have neighbour links (world, not snapshot)
+	bool linked;
+public:
+	WorldReader() : chunks(NULL), clock(0), lastChunkX(1000000), lastChunkY(1000000), lastChunkZ(1000000), lastChunk(NULL), linked(false) {
+	}
+	WorldReader(World * world) {
+		init(world);
+	}
+	/// reader of snapshot may be used while world is being changed, as long as snapshot is not released
+	WorldReader(WorldSnapshot * snapshot) {
+		init(snapshot);
+	}
+	void init(World * world);
+	void init(WorldSnapshot * snapshot);
+	/// find chunk by chunk coordinates
+	inline Chunk * getChunk(int chunkx, int chunky, int chunkz) {
+		if (lastChunkX != chunkx || lastChunkY != chunky || lastChunkZ != chunkz) {
+			int dir = -1;
+			if (linked && lastChunk && lastChunkY == chunky) {
+				// crossing border to horizontal neighbour: follow link w/o lookup
+				if (lastChunkX == chunkx)
+					dir = chunkz == lastChunkZ - 1 ? NORTH : (chunkz == lastChunkZ + 1 ? SOUTH : -1);
+				else if (lastChunkZ == chunkz)
+					dir = chunkx == lastChunkX - 1 ? WEST : (chunkx == lastChunkX + 1 ? EAST : -1);
+			}
+			if (dir >= 0) {
+				lastChunk = lastChunk->getNeighbour(dir);
+				if (lastChunk && lastChunk->isCompressed())
+					lastChunk->decompress();
+			} else {
+				lastChunk = chunks->get(chunkx, chunky, chunkz);
+			}
+			lastChunkX = chunkx;
+			lastChunkY = chunky;
+			lastChunkZ = chunkz;
+			if (lastChunk)
+				lastChunk->touch(clock);
+		}
+		return lastChunk;
+	}
+	inline cell_t getCell(int x, int y, int z) {
+		if (y < chunks->bottom())
+			return 3; // bedrock below world bottom
+		Chunk * p = getChunk(x >> CHUNK_DX_SHIFT, y >> CHUNK_DY_SHIFT, z >> CHUNK_DX_SHIFT);
+		if (!p)
+			return NO_CELL;
+		return p->get(x & CHUNK_DX_MASK, y, z & CHUNK_DX_MASK);
+	}
+	inline cell_t getCell(Vector3d v) {
+		return getCell(v.x, v.y, v.z);
+	}
+	/// first free y above topmost opaque cell of column x, z; world bottom if there are no opaque cells or chunks are not loaded
+	/// stacked chunks are checked from the top one down
+	inline int getHeight(int x, int z) {
+		for (int chunky = chunks->maxY() - 1; chunky >= chunks->minY(); chunky--) {
+			Chunk * p = getChunk(x >> CHUNK_DX_SHIFT, chunky, z >> CHUNK_DX_SHIFT);
+			if (p && p->getHeight(x & CHUNK_DX_MASK, z & CHUNK_DX_MASK))
+				return chunky * CHUNK_DY + p->getHeight(x & CHUNK_DX_MASK, z & CHUNK_DX_MASK);
+		}
+		return chunks->bottom();
+	}
+	/// resolve column once to walk along Y
+	inline WorldColumn getColumn(int x, int z) {
+		WorldColumn column;
+		column.chunks = chunks;
+		column.chunkx = x >> CHUNK_DX_SHIFT;
+		column.chunkz = z >> CHUNK_DX_SHIFT;
+		column.chunky = 0;
+		column.chunk = getChunk(column.chunkx, 0, column.chunkz);
+		column.x = x & CHUNK_DX_MASK;
+		column.z = z & CHUNK_DX_MASK;
+		return column;
+	}
+	inline bool isOpaque(Vector3d v) {
+		cell_t cell = getCell(v);
+		return BLOCK_TYPE_OPAQUE[cell] && cell != BOUND_SKY;
+	}
+	/// property bits of CHUNK_DX cells of chunk row y, z which starts at x (multiple of CHUNK_DX); kind is CellMaskKind
+	inline unsigned short getChunkRowMask(int kind, int x, int y, int z) {
+		if (y < chunks->bottom())
+			return cellMaskFlag(kind, 3) ? 0xFFFF : 0; // bedrock below world bottom
+		Chunk * p = getChunk(x >> CHUNK_DX_SHIFT, y >> CHUNK_DY_SHIFT, z >> CHUNK_DX_SHIFT);
+		if (!p)
+			return cellMaskFlag(kind, NO_CELL) ? 0xFFFF : 0;
+		return p->getRowMask(kind, y, z & CHUNK_DX_MASK);
+	}
+	/// property bits of 64 cells x..x+63 of row y, z: bit i is cell x + i; kind is CellMaskKind
+	lUInt64 getRowMask(int kind, int x, int y, int z);
+	/// bits of visible cells among x..x+63 of row y, z which have face dir not covered by opaque neighbour
+	inline lUInt64 getFaceMask(DirEx dir, int x, int y, int z) {
+		Vector3d n = Vector3d(x, y, z).move(dir);
+		return getRowMask(CELL_MASK_VISIBLE, x, y, z) & ~getRowMask(CELL_MASK_OPAQUE, n.x, n.y, n.z);
+	}
+	bool canPass(Vector3d pos, Vector3d size);
+};
+
+/// Iterates non-empty cells of box min <= v < max without reading empty space
+/// Cells come chunk by chunk (chunk y, then z, then x), inside chunk layer by layer and row by row, in the order they are stored.
+/// Missing chunks, layers outside of chunk min/max layer and empty uniform layers are skipped,
+/// rows are skipped by CELL_MASK_NON_EMPTY row masks, and only cells which have mask bit set are read.
+/// Cells below world bottom (bedrock for getCell()) are not visited. Chunks must not be changed while iterating.
+struct NonEmptyCellIterator {
+private:
+	ChunkMatrix * chunks;
+	Vector3d min;
+	Vector3d max;
+	bool finished;
+	/// current chunk
+	int chunkx;
+	int chunky;
+	int chunkz;
+	Chunk * chunk;
+	/// box in current chunk (chunk coordinates): rows z0 <= z < z1 of layers y < y1, row bits of x0 <= x < x1
+	int z0;
+	int z1;
+	int y1;
+	unsigned short rowBits;
+	/// current row and its non-empty cells which are not visited yet
+	int y;
+	int z;
+	unsigned short mask;
+	Vector3d position;
+	cell_t value;
+	/// move to next chunk which has layers in box, returns false when there are no more chunks
+	bool nextChunk();
+	/// move to next row of current chunk which has non-empty cells in box, returns false at the end of chunk
+	bool nextRow();
+public:
+	/// cells of chunks from matrix of world or snapshot; compressed chunks are decompressed on access
+	NonEmptyCellIterator(ChunkMatrix & chunkMatrix, Vector3d boxMin, Vector3d boxMax);
+	/// move to next non-empty cell, returns false when there are no more cells
+	bool next();
+	/// world coordinates of current cell
+	Vector3d pos() { return position; }
+	/// value of current cell
+	cell_t cell() { return value; }
+};
+
+struct DiamondVisitorPool;
+
+/// Visits cells reachable from position through passable cells, shell by shell in order of Manhattan distance
 struct DiamondVisitor {
 	int maxDist;
 	int maxDistBits;
 	int dist;
 	World * world;
+	WorldReader reader;
 	Position * position;
 	Vector3d pos0;
 	VolumeData * volume;
@@ -155,21 +1009,47 @@ struct DiamondVisitor {
 	IntArray oldcells;
 	IntArray newcells;
 #else
-	CellArray visited;
-	cell_t * visited_ptr;
+	/// claim key of the first visit of cell in current shell, by cell index (x, z and sign of y), see visitAll()
+	std::atomic<unsigned int> * claims;
+	int claimCount;
+	/// claim key of current shell: keys of older shells are greater
+	unsigned int shellKey;
 	Vector3dArray oldcells;
 	Vector3dArray newcells;
-	unsigned char visitedOccupied;
-	unsigned char visitedEmpty;
 	int m0;
 	int m0mask;
+	/// worker threads for large shells, NULL if single threaded
+	DiamondVisitorPool * pool;
+	int threadCount;
+	int minParallelCells;
+	/// index of cell v in claims
+	inline int cellIndex(Vector3d v) {
+		int index = (v.x + m0) + ((v.z + m0) << (maxDistBits + 1));
+		// inverse index for lower half
+		return v.y < 0 ? index ^ m0mask : index;
+	}
+	/// visible faces of non-empty cell v (relative to pos0) at world position pos
+	int visibleFaces(WorldReader & cellReader, Vector3d v, Vector3d pos);
+	/// expand part of oldcells on worker thread: phase 1 claims cells, phase 2 reads claimed ones
+	void expandPart(int phase, int part, int partCount);
+	/// expand shell dist on all threads; results are passed to visitor in the same order as visitCell() would do
+	void expandShellParallel();
 #endif
 	DiamondVisitor();
+	~DiamondVisitor();
 	void init(World * w, Position * pos, VolumeData * data, CellVisitor * v);
 #if	USE_VOLUME_DATA == 1
 	void visitCell(int index);
 #else
 	void visitCell(Vector3d v);
+	/// expand large shells on count threads (including calling one); 1 is single threaded
+	/// visitor is always called on the thread which calls visitAll(), in the same order as with single thread
+	void setThreadCount(int count);
+	int getThreadCount() { return threadCount; }
+	/// shells with less cells are expanded on calling thread only, as splitting costs more than it saves
+	void setMinParallelCells(int cells) { minParallelCells = cells; }
+	/// default for setMinParallelCells()
+	static const int MIN_PARALLEL_CELLS = 2048;
 #endif
 	void visitAll(int maxDistance);
 };
@@ -180,12 +1060,28 @@ private:
 	ChunkMatrix chunks;
 	Position camPosition;
 	int maxVisibleRange;
+	// last chunk cache for setCell; readers use WorldReader with own cache
 	int lastChunkX;
+	int lastChunkY;
 	int lastChunkZ;
 	Chunk * lastChunk;
+	// LRU clock, advanced by tick()
+	unsigned int accessClock;
+	// chunk memory limit, 0 for unlimited
+	int memoryBudget;
+	// eviction found nothing to evict at this chunk memory and camera chunk: not retried until either changes
+	bool evictionStalled;
+	int stalledUsage;
+	int stalledCamX;
+	int stalledCamZ;
+	ChunkPersistence * persistence;
+	ChangeJournal journal;
+	void copyCells(VolumeData & buf, Vector3d min, Vector3d max);
+	/// bottom and sky bound layers for volume of size sz around pos; returns false if area has no cells
+	bool getBoundLayers(Vector3d pos, int sz, int boundLayers[2]);
 #if	USE_VOLUME_DATA == 1
 	VolumeData volumeSnapshot;
-	Vector3d volumePos;
+	lUInt64 volumeJournalPosition;
 	bool volumeSnapshotInvalid;
 #endif
 #if USE_DIAMOND_VISITOR == 1
@@ -194,28 +1090,151 @@ private:
 	VolumeVisitor visitorHelper;
 #endif
 public:
-	World() : maxVisibleRange(MAX_VIEW_DISTANCE), lastChunkX(1000000), lastChunkZ(1000000), lastChunk(NULL)
+	World() : maxVisibleRange(MAX_VIEW_DISTANCE), lastChunkX(1000000), lastChunkY(1000000), lastChunkZ(1000000), lastChunk(NULL)
+		, accessClock(1), memoryBudget(0), evictionStalled(false), stalledUsage(0), stalledCamX(0), stalledCamZ(0), persistence(NULL)
 #if	USE_VOLUME_DATA == 1
-		, volumeSnapshot(MAX_VIEW_DISTANCE_BITS), volumeSnapshotInvalid(true)
+		, volumeSnapshot(MAX_VIEW_DISTANCE_BITS), volumeJournalPosition(0), volumeSnapshotInvalid(true)
 #endif
 	{
+		chunks.setLinked(true);
 	}
 	~World() {
-
+		flushDirtyChunks();
+	}
+	/// set limit for memory used by chunk data, in bytes; 0 means unlimited
+	void setMemoryBudget(int bytes) { memoryBudget = bytes; evictionStalled = false; }
+	int getMemoryBudget() { return memoryBudget; }
+	/// memory used by chunk data (used items of chunk pools, columns, compressed chunk data, block entities and block ids), in bytes
+	static int chunkMemoryUsage();
+	/// set hook which receives dirty chunks before they are evicted; w/o hook dirty chunks are never evicted
+	void setPersistence(ChunkPersistence * p) { persistence = p; evictionStalled = false; }
+	unsigned int getAccessClock() { return accessClock; }
+	/// advance LRU clock; call once per frame
+	void tick() { accessClock++; }
+	/// evict least recently used chunks out of view range until chunk memory fits into budget
+	/// returns number of evicted chunks; readers created before this call must not be used after it
+	/// when nothing can be evicted, it's not retried until chunk memory grows or camera moves to another chunk
+	int evictChunks();
+	/// pass all dirty chunks to persistence hook
+	void flushDirtyChunks();
+	/// forget chunk cached by setCell; call when chunks are removed or compressed
+	void resetChunkCache() {
+		lastChunkX = lastChunkY = lastChunkZ = 1000000;
+		lastChunk = NULL;
 	}
 	void updateVolumeSnapshot();
+	/// fill volume with cells around v; volume which already contains cells near v is scrolled
 	void getCellsNear(Vector3d v, VolumeData & buf);
+	/// fill sparse volume with cells around v
+	void getCellsNear(Vector3d v, BrickedVolumeData & buf);
+	/// copy cells of box min <= v < max to volume again after world change
+	void updateCells(VolumeData & buf, Vector3d min, Vector3d max);
 	void visitVisibleCellsAllDirectionsFast(Position & position, CellVisitor * visitor);
+#if USE_DIAMOND_VISITOR == 1 && USE_VOLUME_DATA != 1
+	/// number of threads used by visitVisibleCellsAllDirectionsFast(); visitor is called on the calling thread
+	/// default is 1: more threads should be enabled only after measuring frame time on a multi-core machine
+	void setVisitorThreadCount(int count) { visitorHelper.setThreadCount(count); }
+#endif
 	Position & getCamPosition() { return camPosition; }
+	int getMaxVisibleRange() { return maxVisibleRange; }
+	ChunkMatrix & getChunks() { return chunks; }
+	/// boxes changed by setCell, setColumn, fillBox, WorldEditBuilder and installed chunks
+	ChangeJournal & getJournal() { return journal; }
+	/// put loaded chunk to world, replacing chunk at the same position if any
+	void installChunk(int chunkx, int chunky, int chunkz, Chunk * chunk);
+	/// find chunk for modification, creates chunk if it does not exist; chunk shared with snapshot is replaced with its copy
+	Chunk * getChunkForEdit(int chunkx, int chunky, int chunkz);
+	/// take immutable view of current chunks; call release() on result when done
+	WorldSnapshot * createSnapshot();
+	/// read cell; does not modify world, so it's safe to call from several threads; use WorldReader for faster sequential access
 	cell_t getCell(Vector3d v) {
 		return getCell(v.x, v.y, v.z);
 	}
 	cell_t getCell(int x, int y, int z);
+	/// first free y above topmost opaque cell of column x, z (ground level); world bottom if there are no opaque cells or chunks are not loaded
+	int getHeight(int x, int z);
 	bool isOpaque(Vector3d v);
+	/// set chunk level of world bottom (0 by default): cells below it are bedrock and cannot be changed
+	void setBottomLevel(int chunky) { chunks.setBottomLevel(chunky); }
+	/// cells below world bottom are not changed; NO_CELL written to missing chunk creates no chunk
 	void setCell(int x, int y, int z, cell_t value);
+	/// set cells y0 <= y < y1 of column x, z; the same rules as for setCell()
+	void setColumn(int x, int z, int y0, int y1, cell_t value);
+	/// set all cells of box min <= v < max; the same rules as for setCell()
+	void fillBox(Vector3d min, Vector3d max, cell_t value);
+	/// number of cells of box min <= v < max for which predicate(cell) returns true, as if all of them were read by getCell()
+	/// predicate is called once for each cell value; e.g. "is chunk all air above y": countBlocks(min, max, isNonEmpty) == 0
+	template<typename P> lUInt64 countBlocks(Vector3d min, Vector3d max, P predicate) {
+		bool match[256];
+		for (int i = 0; i < 256; i++)
+			match[i] = predicate((cell_t)i);
+		return countMatchingCells(min, max, match);
+	}
+	/// number of cells of box min <= v < max which have match[cell] set
+	/// chunk summaries (layer palette counters, uniform layers, column runs) are used, only partially covered layers are scanned;
+	/// compressed chunks are counted w/o decompression
+	lUInt64 countMatchingCells(Vector3d min, Vector3d max, const bool * match);
+	/// global block id of cell; cells of alias values are looked up through their chunk
+	block_id_t getBlockId(Vector3d v);
+	/// block type of cell value read at v: BLOCK_DEFS[cell], or type of chunk block id for alias cell
+	inline BlockDef * getBlockDef(Vector3d v, cell_t cell) {
+		if (!BLOCK_CELL_ALIAS[cell])
+			return BLOCK_DEFS[cell];
+		BlockDef * def = BLOCK_DEFS_BY_ID[getBlockId(v)];
+		return def ? def : BLOCK_DEFS[cell];
+	}
+	/// put block type with global id to cell; large ids get alias cell of chunk
+	/// returns false if block type is not registered or chunk has no free cell value for it
+	bool setBlock(Vector3d v, block_id_t id);
+	/// block entity of cell, NULL if there is none; valid until chunk is changed or evicted
+	const ChunkEntities::Entity * getBlockEntity(Vector3d v);
+	/// attach state to cell, replacing old one; payload is copied, cell is not changed; chunk shared with snapshot is copied
+	/// returns false if payload is larger than ChunkEntities::MAX_DATA_SIZE
+	bool setBlockEntity(Vector3d v, int type, const unsigned char * data, int size);
+	/// returns false if cell has no entity
+	bool removeBlockEntity(Vector3d v);
+	/// append positions of entities of type inside box min <= v < max to out, chunk by chunk; returns number of found entities
+	/// only chunks which have entities are looked at, using per-chunk index by type
+	int findBlockEntities(Vector3d min, Vector3d max, int type, Vector3dArray & out);
 	bool canPass(Vector3d pos, Vector3d size);
 };
 
+/// Batched world modification: each touched chunk layer is unpacked once, edited as plain cell array
+/// and packed back on flush(); works much faster than World::setCell for massive changes like terrain generation
+/// Changes become visible in world after flush(); it's called automatically when too many chunks are touched
+class WorldEditBuilder {
+	struct ChunkEdit {
+		int x;
+		int y;
+		int z;
+		bool unpacked[CHUNK_DY];
+		cell_t cells[CHUNK_DY][CHUNK_DX * CHUNK_DX];
+	};
+	World * world;
+	Array<ChunkEdit *> edits;
+	Array<lUInt64> editKeys;
+	Array<ChunkEdit *> freeEdits;
+	ChunkEdit * lastEdit;
+	ChunkEdit * getEdit(int chunkx, int chunky, int chunkz);
+	/// unpacked cells of layer
+	cell_t * getLayer(ChunkEdit * edit, int y);
+	/// all unpacked layers of edit are NO_CELL
+	static bool isEmptyEdit(ChunkEdit * edit);
+public:
+	/// max number of chunks with pending changes
+	static const int MAX_CHUNKS = 128;
+	WorldEditBuilder(World * w) : world(w), lastEdit(NULL) {}
+	~WorldEditBuilder();
+	/// the same rules as for World::setCell(): cells below world bottom are not changed, missing chunks are not created for NO_CELL
+	void setCell(int x, int y, int z, cell_t value);
+	/// set cells y0 <= y < y1 of column x, z
+	void setColumn(int x, int z, int y0, int y1, cell_t value);
+	/// set all cells of box min <= v < max
+	void fillBox(Vector3d min, Vector3d max, cell_t value);
+	/// write all pending changes to world
+	void flush();
+};
+
 class TerrainGen {
 	int dx;
 	int dy;
@@ -266,4 +1285,8 @@ public:
 #define UNIT_TESTS 1
 void runWorldUnitTests();
 
+#define BENCHMARKS 0
+/// performance measurements, results are written to log
+void runWorldBenchmarks();
+
 #endif// WORLD_H_INCLUDED
@@ -2,7 +2,15 @@
 
 /// v is zero based destination coordinates
 void VolumeData::putLayer(Vector3d v, cell_t * layer, int dx, int dz, int stripe) {
-	cell_t * dst = _data + ((v.y << (ROW_BITS * 2)) | (v.z << ROW_BITS) | v.x);
+#if VOLUME_DATA_MORTON == 1
+	for (int z = 0; z < dz; z++) {
+		int row = mortonRow(v.y, v.z + z);
+		for (int x = 0; x < dx; x++)
+			_data[row | mortonX(v.x + x)] = layer[x];
+		layer += stripe;
+	}
+#else
+	cell_t * dst = ptr(v);
 	//int nzcount = 0;
 	for (int z = 0; z < dz; z++) {
 		memcpy(dst, layer, sizeof(cell_t) * dx);
@@ -13,6 +21,7 @@ void VolumeData::putLayer(Vector3d v, cell_t * layer, int dx, int dz, int stripe
 		dst += ROW_SIZE;
 
 	}
+#endif
 	//CRLog::trace("  non-zero cells copied: %d", nzcount);
 }
 
@@ -79,14 +88,8 @@ static const char * dir_names[] = {
 	"DOWN",
 };
 
-VolumeData::VolumeData(int distBits) : MAX_DIST_BITS(distBits) {
-	ROW_BITS = MAX_DIST_BITS + 1;
-	MAX_DIST = 1 << MAX_DIST_BITS;
-	ROW_SIZE = 1 << (MAX_DIST_BITS + 1);
-	DATA_SIZE = ROW_SIZE * ROW_SIZE * ROW_SIZE;
-	ROW_MASK = ROW_SIZE - 1;
-	_data = new cell_t[DATA_SIZE];
-	clear();
+/// index deltas for direction masks and extended directions in cube with y, z, x index order
+static void initDirectionDeltas(int rowSize, int directionDelta[64], int directionExDelta[26]) {
 	for (int i = 0; i < 64; i++) {
 		int delta = 0;
 		if (i & MASK_WEST)
@@ -94,18 +97,46 @@ VolumeData::VolumeData(int distBits) : MAX_DIST_BITS(distBits) {
 		if (i & MASK_EAST)
 			delta++;
 		if (i & MASK_NORTH)
-			delta -= ROW_SIZE;
+			delta -= rowSize;
 		if (i & MASK_SOUTH)
-			delta += ROW_SIZE;
+			delta += rowSize;
 		if (i & MASK_UP)
-			delta += ROW_SIZE * ROW_SIZE;
+			delta += rowSize * rowSize;
 		if (i & MASK_DOWN)
-			delta -= ROW_SIZE * ROW_SIZE;
+			delta -= rowSize * rowSize;
 		directionDelta[i] = delta;
 	}
 	for (int d = DIR_MIN; d < DIR_MAX; d++) {
 		directionExDelta[d] = directionDelta[DIR_TO_MASK[d]];
 	}
+}
+
+VolumeData::VolumeData(int distBits) : MAX_DIST_BITS(distBits) {
+	ROW_BITS = MAX_DIST_BITS + 1;
+	MAX_DIST = 1 << MAX_DIST_BITS;
+	ROW_SIZE = 1 << (MAX_DIST_BITS + 1);
+	DATA_SIZE = ROW_SIZE * ROW_SIZE * ROW_SIZE;
+	ROW_MASK = ROW_SIZE - 1;
+	FIELD_HIGH_BITS = (ROW_SIZE >> 1) * (1 + ROW_SIZE + ROW_SIZE * ROW_SIZE);
+	originIndex = 0;
+	boundLayers[0] = boundLayers[1] = 0;
+	_data = new cell_t[DATA_SIZE];
+	clear();
+#if VOLUME_DATA_MORTON == 1
+	mortonBits[0] = new int[ROW_SIZE * 3];
+	mortonBits[1] = mortonBits[0] + ROW_SIZE;
+	mortonBits[2] = mortonBits[1] + ROW_SIZE;
+	for (int axis = 0; axis < 3; axis++) {
+		for (int i = 0; i < ROW_SIZE; i++) {
+			int bits = 0;
+			for (int b = 0; b < ROW_BITS; b++)
+				if (i & (1 << b))
+					bits |= 1 << (b * 3 + axis);
+			mortonBits[axis][i] = bits;
+		}
+	}
+#endif
+	initDirectionDeltas(ROW_SIZE, directionDelta, directionExDelta);
 	for (int d = 0; d < 6; d++) {
 		DirEx * dirs = NEAR_DIRECTIONS_FOR + 8 * d;
 		mainDirectionDeltas[d][0] = directionExDelta[d];
@@ -133,23 +164,76 @@ VolumeData::VolumeData(int distBits) : MAX_DIST_BITS(distBits) {
 void VolumeData::fillLayer(int y, cell_t cell) {
 	y += MAX_DIST;
 	if (y >= 0 && y < ROW_SIZE) {
-		int index = y << (ROW_BITS * 2);
+#if VOLUME_DATA_MORTON == 1
+		fillBox(Vector3d(0, y, 0), Vector3d(ROW_SIZE, 1, ROW_SIZE), cell);
+#else
+		// whole layer is contiguous in storage
+		int index = ((y + origin.y) & ROW_MASK) << (ROW_BITS * 2);
 		memset(_data + index, cell, ROW_SIZE * ROW_SIZE);
+#endif
 	}
 }
 
+/// fill box of given size with cell value, v is zero based destination coordinates; rows may wrap around
+void VolumeData::fillBox(Vector3d v, Vector3d size, cell_t cell) {
+#if VOLUME_DATA_MORTON == 1
+	for (int y = 0; y < size.y; y++) {
+		for (int z = 0; z < size.z; z++) {
+			int row = mortonRow(v.y + y, v.z + z);
+			for (int x = 0; x < size.x; x++)
+				_data[row | mortonX(v.x + x)] = cell;
+		}
+	}
+#else
+	// split rows at storage row end
+	int dx1 = ROW_SIZE - ((v.x + origin.x) & ROW_MASK);
+	if (dx1 > size.x)
+		dx1 = size.x;
+	for (int y = 0; y < size.y; y++) {
+		for (int z = 0; z < size.z; z++) {
+			Vector3d row(v.x, v.y + y, v.z + z);
+			memset(ptr(row), cell, dx1);
+			if (dx1 < size.x) {
+				row.x += dx1;
+				memset(ptr(row), cell, size.x - dx1);
+			}
+		}
+	}
+#endif
+}
+
+/// restore cells replaced with visitor marks
+void VolumeData::clearMarks() {
+	for (int i = marks.length() - 1; i >= 0; i--)
+		_data[marks[i].index] = marks[i].cell;
+	marks.clear();
+}
+
+/// fill dx*dz rectangle of layer with cell value, v is zero based destination coordinates
+void VolumeData::fillLayer(Vector3d v, int dx, int dz, cell_t cell) {
+#if VOLUME_DATA_MORTON == 1
+	fillBox(v, Vector3d(dx, 1, dz), cell);
+#else
+	cell_t * dst = ptr(v);
+	for (int z = 0; z < dz; z++) {
+		memset(dst, cell, sizeof(cell_t) * dx);
+		dst += ROW_SIZE;
+	}
+#endif
+}
+
 void VolumeData::getNearCellsForDirection(int index, DirEx direction, CellToVisit cells[9]) {
 	int * deltas = mainDirectionDeltas[direction];
 	CellToVisit * cell = cells + 0;
 	cell->index = index + *deltas;
-	cell->cell = _data[cell->index];
+	cell->cell = get(cell->index);
 	cell->dir = direction;
 	//if (!cell->cell || cell->cell == VISITED_CELL) {
 	for (int i = 0; i < 8; i++) {
 		cell++;
 		deltas++;
 		cell->index = index + *deltas;
-		cell->cell = _data[cell->index];
+		cell->cell = get(cell->index);
 		cell->dir = direction;
 	}
 	//}
@@ -159,14 +243,14 @@ void VolumeData::getNearCellsForDirectionNoForward(int index, DirEx direction, C
 	int * deltas = mainDirectionDeltasNoForward[direction];
 	CellToVisit * cell = cells + 0;
 	cell->index = index + *deltas;
-	cell->cell = _data[cell->index];
+	cell->cell = get(cell->index);
 	cell->dir = direction;
 	//if (!cell->cell || cell->cell == VISITED_CELL) {
 	for (int i = 0; i < 8; i++) {
 		cell++;
 		deltas++;
 		cell->index = index + *deltas;
-		cell->cell = _data[cell->index];
+		cell->cell = get(cell->index);
 		cell->dir = direction;
 	}
 	//}
@@ -175,14 +259,135 @@ void VolumeData::getNearCellsForDirectionNoForward(int index, DirEx direction, C
 void VolumeData::getNearCellsForDirection(int index, DirEx direction, cell_t cells[9]) {
 	int * deltas = mainDirectionDeltas[direction];
 	for (int i = 0; i < 9; i++)
-		cells[i] = _data[index + deltas[i]];
+		cells[i] = get(index + deltas[i]);
 }
 void VolumeData::getNearCellsForDirectionNoForward(int index, DirEx direction, cell_t cells[9]) {
 	int * deltas = mainDirectionDeltasNoForward[direction];
 	for (int i = 0; i < 9; i++)
-		cells[i] = _data[index + deltas[i]];
+		cells[i] = get(index + deltas[i]);
+}
+
+
+BrickedVolumeData::BrickedVolumeData(int distBits) : MAX_DIST_BITS(distBits), brickPool(BRICK_CELLS) {
+	ROW_BITS = MAX_DIST_BITS + 1;
+	MAX_DIST = 1 << MAX_DIST_BITS;
+	ROW_SIZE = 1 << (MAX_DIST_BITS + 1);
+	DATA_SIZE = ROW_SIZE * ROW_SIZE * ROW_SIZE;
+	ROW_MASK = ROW_SIZE - 1;
+	BRICK_ROW_BITS = ROW_BITS > BRICK_BITS ? ROW_BITS - BRICK_BITS : 0;
+	BRICK_COUNT = 1 << (BRICK_ROW_BITS * 3);
+	bricks = new cell_t*[BRICK_COUNT];
+	uniform = new cell_t[BRICK_COUNT];
+	memset(bricks, 0, sizeof(cell_t*) * BRICK_COUNT);
+	memset(uniform, NO_CELL, BRICK_COUNT);
+	initDirectionDeltas(ROW_SIZE, directionDelta, directionExDelta);
+}
+
+BrickedVolumeData::~BrickedVolumeData() {
+	clear();
+	delete[] bricks;
+	delete[] uniform;
+}
+
+void BrickedVolumeData::clear() {
+	for (int i = 0; i < BRICK_COUNT; i++)
+		setUniform(i, NO_CELL);
+}
+
+/// v is zero based destination coordinates
+void BrickedVolumeData::putLayer(Vector3d v, cell_t * layer, int dx, int dz, int stripe) {
+	for (int z = 0; z < dz; z++) {
+		cell_t * src = layer + z * stripe;
+		int y = v.y;
+		int zz = v.z + z;
+		// row is split at brick bounds; parts equal to uniform brick value do not need storage
+		for (int x = v.x; x < v.x + dx;) {
+			int end = (x | BRICK_MASK) + 1;
+			if (end > v.x + dx)
+				end = v.x + dx;
+			int brick = brickIndex(x, y, zz);
+			cell_t * part = src + (x - v.x);
+			int n = end - x;
+			bool same = !bricks[brick];
+			for (int i = 0; same && i < n; i++)
+				same = part[i] == uniform[brick];
+			if (!same)
+				memcpy(brickData(brick) + cellIndex(x, y, zz), part, n);
+			x = end;
+		}
+	}
+}
+
+/// fill layer y (relative to center) with cell value
+void BrickedVolumeData::fillLayer(int y, cell_t cell) {
+	y += MAX_DIST;
+	if (y >= 0 && y < ROW_SIZE)
+		fillBox(Vector3d(0, y, 0), Vector3d(ROW_SIZE, 1, ROW_SIZE), cell);
+}
+
+/// fill dx*dz rectangle of layer with cell value, v is zero based destination coordinates
+void BrickedVolumeData::fillLayer(Vector3d v, int dx, int dz, cell_t cell) {
+	fillBox(v, Vector3d(dx, 1, dz), cell);
+}
+
+/// fill box with cell value, v is zero based; bricks covered completely become uniform
+void BrickedVolumeData::fillBox(Vector3d v, Vector3d size, cell_t cell) {
+	if (size.x <= 0 || size.y <= 0 || size.z <= 0)
+		return;
+	Vector3d end = v + size;
+	for (int by = v.y & ~BRICK_MASK; by < end.y; by += BRICK_SIZE) {
+		int y0 = by < v.y ? v.y : by;
+		int y1 = by + BRICK_SIZE < end.y ? by + BRICK_SIZE : end.y;
+		for (int bz = v.z & ~BRICK_MASK; bz < end.z; bz += BRICK_SIZE) {
+			int z0 = bz < v.z ? v.z : bz;
+			int z1 = bz + BRICK_SIZE < end.z ? bz + BRICK_SIZE : end.z;
+			for (int bx = v.x & ~BRICK_MASK; bx < end.x; bx += BRICK_SIZE) {
+				int x0 = bx < v.x ? v.x : bx;
+				int x1 = bx + BRICK_SIZE < end.x ? bx + BRICK_SIZE : end.x;
+				int brick = brickIndex(bx, by, bz);
+				if (y1 - y0 == BRICK_SIZE && z1 - z0 == BRICK_SIZE && x1 - x0 == BRICK_SIZE) {
+					setUniform(brick, cell);
+					continue;
+				}
+				if (!bricks[brick] && uniform[brick] == cell)
+					continue;
+				cell_t * data = brickData(brick);
+				for (int y = y0; y < y1; y++)
+					for (int z = z0; z < z1; z++)
+						memset(data + cellIndex(x0, y, z), cell, x1 - x0);
+			}
+		}
+	}
 }
 
+/// free storage of mixed bricks which became uniform
+void BrickedVolumeData::compact() {
+	for (int i = 0; i < BRICK_COUNT; i++) {
+		cell_t * data = bricks[i];
+		if (!data)
+			continue;
+		cell_t cell = data[0];
+		int j = 1;
+		while (j < BRICK_CELLS && data[j] == cell)
+			j++;
+		if (j == BRICK_CELLS)
+			setUniform(i, cell);
+	}
+}
+
+/// number of bricks which have storage
+int BrickedVolumeData::mixedBrickCount() {
+	int count = 0;
+	for (int i = 0; i < BRICK_COUNT; i++)
+		if (bricks[i])
+			count++;
+	return count;
+}
+
+/// memory used by brick table and brick storage, in bytes
+int BrickedVolumeData::memoryUsage() {
+	return BRICK_COUNT * (sizeof(cell_t*) + sizeof(cell_t)) + mixedBrickCount() * BRICK_CELLS;
+}
 
 void DirectionHelper::start(int index, DirEx direction) {
 	dir = direction;
@@ -203,6 +408,153 @@ void DirectionHelper::prepareSpreading() {
 }
 
 
+static void * allocPoolPage() {
+#ifdef _WIN32
+	return _aligned_malloc(PoolStats::POOL_PAGE_SIZE, PoolStats::POOL_PAGE_SIZE);
+#else
+	void * p = NULL;
+	if (posix_memalign(&p, PoolStats::POOL_PAGE_SIZE, PoolStats::POOL_PAGE_SIZE))
+		return NULL;
+	return p;
+#endif
+}
+
+static void freePoolPage(void * p) {
+#ifdef _WIN32
+	_aligned_free(p);
+#else
+	::free(p);
+#endif
+}
+
+PoolAllocator::PoolAllocator(int size) : freePages(NULL), sparePage(NULL), pageCount(0), partialCount(0), usedCount(0) {
+	// align items by 8 bytes, item should be big enough to hold free list pointer
+	if (size < (int)sizeof(FreeItem))
+		size = sizeof(FreeItem);
+	itemSize = (size + 7) & ~7;
+	firstItemOffset = (sizeof(Page) + 7) & ~7;
+	itemsPerPage = (PoolStats::POOL_PAGE_SIZE - firstItemOffset) / itemSize;
+}
+
+PoolAllocator::~PoolAllocator() {
+	// memory of still used items is not returned here; this is called on program exit only
+	trim();
+}
+
+void PoolAllocator::linkFreePage(Page * page) {
+	page->prev = NULL;
+	page->next = freePages;
+	if (freePages)
+		freePages->prev = page;
+	freePages = page;
+}
+
+void PoolAllocator::unlinkFreePage(Page * page) {
+	if (page->prev)
+		page->prev->next = page->next;
+	else
+		freePages = page->next;
+	if (page->next)
+		page->next->prev = page->prev;
+	page->prev = page->next = NULL;
+}
+
+PoolAllocator::Page * PoolAllocator::newPage() {
+	Page * page = sparePage;
+	if (page) {
+		sparePage = NULL;
+	} else {
+		page = (Page*)allocPoolPage();
+		if (!page)
+			return NULL;
+		pageCount++;
+	}
+	page->prev = page->next = NULL;
+	page->freeItems = NULL;
+	page->used = 0;
+	page->bumpIndex = 0;
+	return page;
+}
+
+void PoolAllocator::releasePage(Page * page) {
+	if (!sparePage) {
+		sparePage = page;
+		return;
+	}
+	freePoolPage(page);
+	pageCount--;
+}
+
+void * PoolAllocator::alloc() {
+	std::lock_guard<std::mutex> guard(lock);
+	Page * page = freePages;
+	if (!page) {
+		page = newPage();
+		if (!page)
+			return NULL;
+		linkFreePage(page);
+	}
+	void * item;
+	if (page->freeItems) {
+		item = page->freeItems;
+		page->freeItems = page->freeItems->next;
+	} else {
+		item = (char*)page + firstItemOffset + page->bumpIndex * itemSize;
+		page->bumpIndex++;
+	}
+	if (page->used == 0)
+		partialCount++;
+	page->used++;
+	usedCount++;
+	if (page->used == itemsPerPage) {
+		// page is full
+		unlinkFreePage(page);
+		partialCount--;
+	}
+	return item;
+}
+
+void PoolAllocator::free(void * item) {
+	if (!item)
+		return;
+	std::lock_guard<std::mutex> guard(lock);
+	Page * page = pageOf(item);
+	FreeItem * p = (FreeItem*)item;
+	p->next = page->freeItems;
+	page->freeItems = p;
+	if (page->used == itemsPerPage) {
+		linkFreePage(page);
+		partialCount++;
+	}
+	page->used--;
+	usedCount--;
+	if (page->used == 0) {
+		partialCount--;
+		unlinkFreePage(page);
+		releasePage(page);
+	}
+}
+
+PoolStats PoolAllocator::stats() {
+	std::lock_guard<std::mutex> guard(lock);
+	PoolStats res;
+	res.itemSize = itemSize;
+	res.pages = pageCount;
+	res.partialPages = partialCount;
+	res.used = usedCount;
+	res.capacity = pageCount * itemsPerPage;
+	return res;
+}
+
+void PoolAllocator::trim() {
+	std::lock_guard<std::mutex> guard(lock);
+	if (sparePage) {
+		freePoolPage(sparePage);
+		sparePage = NULL;
+		pageCount--;
+	}
+}
+
 static lUInt64 seedUniquifier = 8682522807148012L;
 
 Random::Random() {
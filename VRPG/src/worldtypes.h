@@ -3,6 +3,7 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <mutex>
 #include "logger.h"
 
 typedef unsigned char cell_t;
@@ -344,6 +345,10 @@ public:
 	void clear() {
 		_length = 0;
 	}
+	/// remove and return last item
+	T removeLast() {
+		return _data[--_length];
+	}
 	T get(int index) {
 		return _data[index];
 	}
@@ -365,6 +370,63 @@ typedef Array<cell_t> CellArray;
 typedef Array<Vector2d> Vector2dArray;
 typedef Array<Vector3d> Vector3dArray;
 
+/// pool allocator usage counters
+struct PoolStats {
+	int itemSize;     // bytes per item
+	int pages;        // allocated pages
+	int partialPages; // pages which have both used and free items
+	int used;         // allocated items
+	int capacity;     // item slots in all pages
+	/// part of item slots in use
+	float occupancy() { return capacity ? (float)used / capacity : 1.0f; }
+	/// part of item slots which are allocated from system but not used
+	float fragmentation() { return capacity ? (float)(capacity - used) / capacity : 0.0f; }
+	/// bytes allocated from system
+	int memoryUsage() { return pages * POOL_PAGE_SIZE; }
+	static const int POOL_PAGE_SIZE = 64 * 1024;
+};
+
+/// Slab allocator for items of fixed size
+/// Items are allocated from 64K pages; page is returned to system as soon as all its items are freed
+/// (one empty page is kept as spare to avoid allocation thrashing)
+/// Thread safe
+class PoolAllocator {
+	struct FreeItem {
+		FreeItem * next;
+	};
+	struct Page {
+		Page * prev; // in list of pages with free items
+		Page * next;
+		FreeItem * freeItems;
+		int used;
+		int bumpIndex; // items starting from this index were never allocated
+	};
+	int itemSize;
+	int itemsPerPage;
+	int firstItemOffset;
+	Page * freePages; // pages with free item slots
+	Page * sparePage;
+	int pageCount;
+	int partialCount;
+	int usedCount;
+	std::mutex lock;
+	static inline Page * pageOf(void * item) {
+		return (Page*)((size_t)item & ~(size_t)(PoolStats::POOL_PAGE_SIZE - 1));
+	}
+	void linkFreePage(Page * page);
+	void unlinkFreePage(Page * page);
+	Page * newPage();
+	void releasePage(Page * page);
+public:
+	PoolAllocator(int size);
+	~PoolAllocator();
+	void * alloc();
+	void free(void * item);
+	PoolStats stats();
+	/// release spare page
+	void trim();
+};
+
 template<typename T, T initValue, void(*disposeFunction)(T value) > struct InfiniteArray {
 private:
 	T * data;
@@ -627,6 +689,17 @@ struct CellToVisit {
 };
 #pragma pack(pop)
 
+/// VolumeData storage layout: 0 - rows along x (y, z, x order), 1 - Morton order (Z-curve)
+/// Morton order keeps 3D neighbourhood of cell in a few cache lines, while in row order step in y is ROW_SIZE^2 cells;
+/// rows are not contiguous in Morton order, so layers are copied cell by cell.
+#define VOLUME_DATA_MORTON 0
+
+/// Cube of cells around center, ROW_SIZE cells along each axis
+/// Cells are addressed by logical index relative to volume corner: getIndex(), moveIndex() and direction deltas
+/// do not depend on volume position. Storage is a ring buffer addressed by world coordinates & ROW_MASK,
+/// so when volume is moved to new origin, cells which are still inside it keep their places
+/// and only newly exposed slabs have to be refreshed.
+/// With VOLUME_DATA_MORTON storage offsets are Morton (Z-order) codes of ring buffer coordinates.
 struct VolumeData {
 	int MAX_DIST_BITS;
 	int ROW_BITS;
@@ -634,25 +707,84 @@ struct VolumeData {
 	int ROW_SIZE;
 	int DATA_SIZE;
 	int ROW_MASK;
+	/// highest bit of each of x, z, y fields of index
+	int FIELD_HIGH_BITS;
 	cell_t * _data;
 	int directionDelta[64];
 	int directionExDelta[26];
 	int mainDirectionDeltas[6][9];
 	int mainDirectionDeltasNoForward[6][9];
+	/// world coordinates of logical cell 0 (corner of volume)
+	Vector3d origin;
+	/// origin packed as index: storage offset of logical cell 0
+	int originIndex;
+#if VOLUME_DATA_MORTON == 1
+	/// bits of ring buffer coordinate spread to every 3rd bit: [0] for x, [1] for z, [2] for y
+	int * mortonBits[3];
+#endif
+	/// true if cells correspond to world at origin; maintained by World::getCellsNear()
+	bool valid;
+	/// world y of layers replaced with BOUND_BOTTOM and BOUND_SKY by World::getCellsNear()
+	int boundLayers[2];
+	/// cell replaced with visitor mark: storage index + old value
+	struct Mark {
+		int index;
+		cell_t cell;
+	};
+	Array<Mark> marks;
 	VolumeData(int distBits);
 	~VolumeData() {
 		delete[] _data;
+#if VOLUME_DATA_MORTON == 1
+		delete[] mortonBits[0];
+#endif
 	}
 	int size() { return MAX_DIST; }
 	void clear() {
 		memset(_data, 0, sizeof(cell_t) * DATA_SIZE);
+		marks.clear();
+		valid = false;
+	}
+	/// move volume corner to world coordinates v; cells are not changed
+	void setOrigin(Vector3d v) {
+		origin = v;
+		originIndex = ((v.y & ROW_MASK) << (ROW_BITS * 2)) | ((v.z & ROW_MASK) << ROW_BITS) | (v.x & ROW_MASK);
+	}
+
+	/// storage index for logical index: fields are added to origin separately, wrapping around without carry
+	/// in Morton layout, fields of wrapped index are interleaved using lookup tables
+	inline int storageIndex(int index) {
+		int wrapped = ((((index & ~FIELD_HIGH_BITS) + (originIndex & ~FIELD_HIGH_BITS)) ^ ((index ^ originIndex) & FIELD_HIGH_BITS))) & (DATA_SIZE - 1);
+#if VOLUME_DATA_MORTON == 1
+		return mortonBits[0][wrapped & ROW_MASK] | mortonBits[1][(wrapped >> ROW_BITS) & ROW_MASK] | mortonBits[2][wrapped >> (ROW_BITS * 2)];
+#else
+		return wrapped;
+#endif
+	}
+
+#if VOLUME_DATA_MORTON == 1
+	/// storage bits of y and z of zero based coordinates
+	inline int mortonRow(int y, int z) {
+		return mortonBits[2][(y + origin.y) & ROW_MASK] | mortonBits[1][(z + origin.z) & ROW_MASK];
+	}
+	/// storage bits of x of zero based coordinates, to be combined with mortonRow()
+	inline int mortonX(int x) {
+		return mortonBits[0][(x + origin.x) & ROW_MASK];
 	}
+#endif
 
+	/// storage, cells are placed by world coordinates & ROW_MASK
 	cell_t * ptr() { return _data;  }
 
+	/// pointer to cell, v is zero based coordinates
+	/// in row layout, storage row continues up to the next multiple of ROW_SIZE in world x coordinate
+	inline cell_t * ptr(Vector3d v) {
+		return _data + storageIndex((v.y << (ROW_BITS * 2)) | (v.z << ROW_BITS) | v.x);
+	}
+
 	/// put cell w/o bounds checking, (0,0,0) is center of array
 	inline void put(Vector3d v, cell_t cell) {
-		_data[((v.y + MAX_DIST) << (ROW_BITS * 2)) | ((v.z + MAX_DIST) << ROW_BITS) | (v.x + MAX_DIST)] = cell;
+		_data[storageIndex(getIndex(v))] = cell;
 	}
 
 	/// v is zero based destination coordinates
@@ -660,16 +792,28 @@ struct VolumeData {
 
 	/// put cell w/o bounds checking
 	inline void put(int index, cell_t cell) {
-		_data[index] = cell;
+		_data[storageIndex(index)] = cell;
+	}
+
+	/// put visitor mark (VISITED_CELL, VISITED_OCCUPIED) to cell; old value is restored by clearMarks()
+	inline void mark(int index, cell_t cell) {
+		Mark m;
+		m.index = storageIndex(index);
+		m.cell = _data[m.index];
+		marks.append(m);
+		_data[m.index] = cell;
 	}
 
+	/// restore cells replaced with visitor marks
+	void clearMarks();
+
 	/// read w/o bounds checking, (0,0,0) is center of array
 	inline cell_t get(Vector3d v) {
-		return _data[((v.y + MAX_DIST) << (ROW_BITS * 2)) | ((v.z + MAX_DIST) << ROW_BITS) | (v.x + MAX_DIST)];
+		return _data[storageIndex(getIndex(v))];
 	}
 
 	inline cell_t get(int index) {
-		return _data[index];
+		return _data[storageIndex(index)];
 	}
 
 	/// get array index for point - (0,0,0) is center
@@ -693,7 +837,7 @@ struct VolumeData {
 
 	inline CellToVisit getNext(int index, DirEx direction, DirEx baseDir) {
 		int nextIndex = index + directionExDelta[direction];
-		return CellToVisit(nextIndex, _data[nextIndex], baseDir);
+		return CellToVisit(nextIndex, get(nextIndex), baseDir);
 	}
 
 	void getNearCellsForDirection(int index, DirEx direction, CellToVisit cells[9]);
@@ -702,12 +846,144 @@ struct VolumeData {
 	void getNearCellsForDirectionNoForward(int index, DirEx direction, cell_t cells[9]);
 
 	void fillLayer(int y, cell_t cell);
+	/// fill dx*dz rectangle of layer with cell value, v is zero based destination coordinates
+	/// rows must not cross multiple of ROW_SIZE in world x coordinate
+	void fillLayer(Vector3d v, int dx, int dz, cell_t cell);
+	/// fill box of given size with cell value, v is zero based destination coordinates; rows may wrap around
+	void fillBox(Vector3d v, Vector3d size, cell_t cell);
 
 	int * thisPlaneDirections(DirEx dir) { return mainDirectionDeltasNoForward[dir]; }
 	int * nextPlaneDirections(DirEx dir) { return mainDirectionDeltas[dir]; }
 };
 
 
+/// Sparse variant of VolumeData: cube is split into 8x8x8 (BRICK_BITS) bricks
+/// Uniform brick (all air, all solid rock) is stored as a single value in brick table, only mixed bricks have storage,
+/// so memory and clearing time depend on the amount of surface rather than on the volume size.
+/// Indexes are the same as in VolumeData: getIndex(), moveIndex() and directionExDelta can be used by traversals,
+/// and isUniformBrick() allows to skip whole 8x8x8 regions.
+struct BrickedVolumeData {
+	static const int BRICK_BITS = 3;
+	static const int BRICK_SIZE = 1 << BRICK_BITS;
+	static const int BRICK_MASK = BRICK_SIZE - 1;
+	static const int BRICK_CELLS = BRICK_SIZE * BRICK_SIZE * BRICK_SIZE;
+	int MAX_DIST_BITS;
+	int ROW_BITS;
+	int MAX_DIST;
+	int ROW_SIZE;
+	int DATA_SIZE;
+	int ROW_MASK;
+	/// number of bricks along each axis
+	int BRICK_ROW_BITS;
+	int BRICK_COUNT;
+	int directionDelta[64];
+	int directionExDelta[26];
+private:
+	/// brick storage (BRICK_CELLS cells, y, z, x order inside brick), NULL for uniform brick
+	cell_t ** bricks;
+	/// cell value for uniform bricks
+	cell_t * uniform;
+	PoolAllocator brickPool;
+	/// brick number for cell coordinates
+	inline int brickIndex(int x, int y, int z) {
+		return ((y >> BRICK_BITS) << (BRICK_ROW_BITS * 2)) | ((z >> BRICK_BITS) << BRICK_ROW_BITS) | (x >> BRICK_BITS);
+	}
+	static inline int cellIndex(int x, int y, int z) {
+		return ((y & BRICK_MASK) << (BRICK_BITS * 2)) | ((z & BRICK_MASK) << BRICK_BITS) | (x & BRICK_MASK);
+	}
+	/// storage of brick, allocated and filled with uniform value if brick is uniform
+	inline cell_t * brickData(int brick) {
+		cell_t * data = bricks[brick];
+		if (!data) {
+			data = (cell_t *)brickPool.alloc();
+			memset(data, uniform[brick], BRICK_CELLS);
+			bricks[brick] = data;
+		}
+		return data;
+	}
+	/// make brick uniform, freeing its storage
+	inline void setUniform(int brick, cell_t cell) {
+		if (bricks[brick]) {
+			brickPool.free(bricks[brick]);
+			bricks[brick] = NULL;
+		}
+		uniform[brick] = cell;
+	}
+public:
+	BrickedVolumeData(int distBits);
+	~BrickedVolumeData();
+	int size() { return MAX_DIST; }
+	/// make all bricks uniform empty
+	void clear();
+
+	/// read w/o bounds checking, v is zero based coordinates
+	inline cell_t getAt(int x, int y, int z) {
+		int brick = brickIndex(x, y, z);
+		cell_t * data = bricks[brick];
+		if (!data)
+			return uniform[brick];
+		return data[cellIndex(x, y, z)];
+	}
+	/// write w/o bounds checking, v is zero based coordinates
+	inline void putAt(int x, int y, int z, cell_t cell) {
+		int brick = brickIndex(x, y, z);
+		if (!bricks[brick] && uniform[brick] == cell)
+			return;
+		brickData(brick)[cellIndex(x, y, z)] = cell;
+	}
+
+	/// read w/o bounds checking, (0,0,0) is center of array
+	inline cell_t get(Vector3d v) {
+		return getAt(v.x + MAX_DIST, v.y + MAX_DIST, v.z + MAX_DIST);
+	}
+	/// out of range index wraps around, as in VolumeData
+	inline cell_t get(int index) {
+		return getAt(index & ROW_MASK, (index >> (ROW_BITS * 2)) & ROW_MASK, (index >> ROW_BITS) & ROW_MASK);
+	}
+	/// put cell w/o bounds checking, (0,0,0) is center of array
+	inline void put(Vector3d v, cell_t cell) {
+		putAt(v.x + MAX_DIST, v.y + MAX_DIST, v.z + MAX_DIST, cell);
+	}
+	inline void put(int index, cell_t cell) {
+		putAt(index & ROW_MASK, (index >> (ROW_BITS * 2)) & ROW_MASK, (index >> ROW_BITS) & ROW_MASK, cell);
+	}
+
+	/// get array index for point - (0,0,0) is center
+	inline int getIndex(Vector3d v) {
+		return ((v.y + MAX_DIST) << (ROW_BITS * 2)) | ((v.z + MAX_DIST) << ROW_BITS) | (v.x + MAX_DIST);
+	}
+	inline Vector3d indexToPoint(int index) {
+		return Vector3d((index & ROW_MASK) - MAX_DIST,
+			((index >> (ROW_BITS * 2)) & ROW_MASK) - MAX_DIST,
+			((index >> (ROW_BITS)) & ROW_MASK) - MAX_DIST);
+	}
+	inline int moveIndex(int oldIndex, DirEx direction) {
+		return oldIndex + directionExDelta[direction];
+	}
+
+	/// returns true if all cells of brick containing cell index are the same; their value is put to cell
+	inline bool isUniformBrick(int index, cell_t & cell) {
+		int brick = brickIndex(index & ROW_MASK, (index >> (ROW_BITS * 2)) & ROW_MASK, (index >> ROW_BITS) & ROW_MASK);
+		cell = uniform[brick];
+		return bricks[brick] == NULL;
+	}
+
+	/// v is zero based destination coordinates
+	void putLayer(Vector3d v, cell_t * layer, int dx, int dz, int stripe);
+	/// fill layer y (relative to center) with cell value
+	void fillLayer(int y, cell_t cell);
+	/// fill dx*dz rectangle of layer with cell value, v is zero based destination coordinates
+	void fillLayer(Vector3d v, int dx, int dz, cell_t cell);
+	/// fill box with cell value, v is zero based; bricks covered completely become uniform
+	void fillBox(Vector3d v, Vector3d size, cell_t cell);
+	/// free storage of mixed bricks which became uniform
+	void compact();
+	/// number of bricks which have storage
+	int mixedBrickCount();
+	/// memory used by brick table and brick storage, in bytes
+	int memoryUsage();
+};
+
 struct DirectionHelper {
 	DirEx dir;
 	IntArray oldcells;